@@ -0,0 +1,82 @@
+#include <string.h>
+#include "base64_stream.h"
+
+#define B64_CHAR(x)     ((x) < 26 ? 'A' + (x) : (x) < 52 ? 'a' + (x) - 26 : (x) < 62 ? '0' + (x) - 52 : (x) == 62 ? '+' : '/')
+
+/* 12 input bits -> 2 output characters, built at compile time so the table stays in flash */
+#define B64_PAIR(i)     { B64_CHAR((i) >> 6), B64_CHAR((i) & 0x3F) }
+#define B64_PAIR4(i)    B64_PAIR(i), B64_PAIR((i) + 1), B64_PAIR((i) + 2), B64_PAIR((i) + 3)
+#define B64_PAIR16(i)   B64_PAIR4(i), B64_PAIR4((i) + 4), B64_PAIR4((i) + 8), B64_PAIR4((i) + 12)
+#define B64_PAIR64(i)   B64_PAIR16(i), B64_PAIR16((i) + 16), B64_PAIR16((i) + 32), B64_PAIR16((i) + 48)
+#define B64_PAIR256(i)  B64_PAIR64(i), B64_PAIR64((i) + 64), B64_PAIR64((i) + 128), B64_PAIR64((i) + 192)
+#define B64_PAIR1024(i) B64_PAIR256(i), B64_PAIR256((i) + 256), B64_PAIR256((i) + 512), B64_PAIR256((i) + 768)
+
+static const char b64_pair_table[4096][2] = {
+    B64_PAIR1024(0), B64_PAIR1024(1024), B64_PAIR1024(2048), B64_PAIR1024(3072)
+};
+
+static inline void _encode_group(char *dst, uint8_t b0, uint8_t b1, uint8_t b2)
+{
+    uint32_t v = ((uint32_t)b0 << 16) | ((uint32_t)b1 << 8) | b2;
+    const char *hi = b64_pair_table[v >> 12];
+    const char *lo = b64_pair_table[v & 0xFFF];
+    dst[0] = hi[0];
+    dst[1] = hi[1];
+    dst[2] = lo[0];
+    dst[3] = lo[1];
+}
+
+void base64_stream_reset(base64_stream_t *b64)
+{
+    b64->tail_len = 0;
+}
+
+int base64_stream_encoded_len(const base64_stream_t *b64, int len)
+{
+    return (b64->tail_len + len) / 3 * 4;
+}
+
+int base64_stream_encode(base64_stream_t *b64, char *dst, const uint8_t *src, int len)
+{
+    char *out = dst;
+    // Complete the group carried from the previous block
+    if (b64->tail_len > 0) {
+        if (b64->tail_len + len < 3) {
+            memcpy(b64->tail + b64->tail_len, src, len);
+            b64->tail_len += len;
+            return 0;
+        }
+        int need = 3 - b64->tail_len;
+        uint8_t group[3];
+        memcpy(group, b64->tail, b64->tail_len);
+        memcpy(group + b64->tail_len, src, need);
+        _encode_group(out, group[0], group[1], group[2]);
+        out += 4;
+        src += need;
+        len -= need;
+        b64->tail_len = 0;
+    }
+    const uint8_t *end = src + len / 3 * 3;
+    while (src < end) {
+        _encode_group(out, src[0], src[1], src[2]);
+        src += 3;
+        out += 4;
+    }
+    b64->tail_len = len % 3;
+    memcpy(b64->tail, src, b64->tail_len);
+    return out - dst;
+}
+
+int base64_stream_finish(base64_stream_t *b64, char *dst)
+{
+    if (b64->tail_len == 0) {
+        return 0;
+    }
+    _encode_group(dst, b64->tail[0], b64->tail_len > 1 ? b64->tail[1] : 0, 0);
+    dst[3] = '=';
+    if (b64->tail_len == 1) {
+        dst[2] = '=';
+    }
+    b64->tail_len = 0;
+    return 4;
+}
@@ -0,0 +1,62 @@
+#ifndef _BASE64_STREAM_H_
+#define _BASE64_STREAM_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Streaming base64 encoder, keeps the 0-2 bytes that do not complete a 3-byte group
+ * so that consecutive blocks encode to the same text as one contiguous buffer
+ */
+typedef struct {
+    uint8_t tail[2];
+    int     tail_len;
+} base64_stream_t;
+
+/**
+ * @brief      Reset the encoder before a new stream
+ *
+ * @param      b64   The encoder
+ */
+void base64_stream_reset(base64_stream_t *b64);
+
+/**
+ * @brief      Maximum encoded length produced by `base64_stream_encode` for `len` input bytes
+ *
+ * @param      b64   The encoder
+ * @param[in]  len   The input length
+ *
+ * @return     The encoded length
+ */
+int base64_stream_encoded_len(const base64_stream_t *b64, int len);
+
+/**
+ * @brief      Encode `src` directly into `dst`, the bytes that do not complete a group are carried over
+ *
+ * @param      b64   The encoder
+ * @param      dst   The output, must hold `base64_stream_encoded_len(b64, len)` bytes
+ * @param[in]  src   The input
+ * @param[in]  len   The input length
+ *
+ * @return     The number of bytes written to `dst`
+ */
+int base64_stream_encode(base64_stream_t *b64, char *dst, const uint8_t *src, int len);
+
+/**
+ * @brief      Flush the carried bytes with padding
+ *
+ * @param      b64   The encoder
+ * @param      dst   The output, must hold 4 bytes
+ *
+ * @return     The number of bytes written to `dst` (0 or 4)
+ */
+int base64_stream_finish(base64_stream_t *b64, char *dst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
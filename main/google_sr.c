@@ -23,12 +23,15 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_system.h"
 #include "esp_wifi.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
-#include "mbedtls/base64.h"
 
 #include "esp_http_client.h"
 #include "sdkconfig.h"
@@ -42,137 +45,158 @@
 #include "mp3_decoder.h"
 #include "google_sr.h"
 #include "json_utils.h"
+#include "sr_vad.h"
+#include "sr_aec.h"
+#include "sr_preroll.h"
+#include "pcm_resample.h"
+#include "sr_ns.h"
+#include "pcm_agc.h"
+#include "sr_kws.h"
+#include "jitter_buffer.h"
+#include "latency_trace.h"
 
 #include "board.h"
 #include "baidu_access_token.h"
 
 static const char *TAG = "GOOGLE_SR";
 
-#define BAIDU_SR_ENDPOINT "https://vop.baidu.com/pro_api"
-
-#define BAIDU_SR_BEGIN "{"                        \
-                        "\"format\": \"pcm\","     \
-                        "\"rate\": 16000,"         \
-                        "\"channel\": 1,"          \
-                        "\"cuid\": \"esp32-toy\"," \
-                        "\"token\": \"%s\","       \
-                        "\"dev_pid\": 80001,"      \
-                        "\"speech\":"              \
-                        "\""
-/*  base64 audio bytes  */
-#define BAIDU_SR_END "\","        \
-                      "\"len\":%d" \
-                      "}"
+#if CONFIG_MOCK_SERVER
+//* partial hypotheses of a session are long-polled from server.py on a second connection
+#define SR_PARTIAL_URL CONFIG_MOCK_SERVER_URI "/stream_partial?sn=%08x&seq=%d&wait=%d"
+#endif
 
 #define BAIDU_SR_TASK_STACK (8 * 1024)
-
-#define TEST_WITH_PYTHON (1)
+#define SR_LOCAL_TASK_STACK (3 * 1024)
+#define SR_PARTIAL_TASK_STACK (4 * 1024)
+#define SR_PARTIAL_TASK_PRIO (4)
+#define SR_PROBE_TASK_STACK (4 * 1024)
+#define SR_PROBE_TASK_PRIO (3)
+#define SR_PARTIAL_URL_MAX (160)
+#define SR_PARTIAL_BODY_MAX (512)
+#define SR_PARTIAL_RETRY_MS (100)
+//* a poll is held by the server for the stable time, this much more covers the round trip
+#define SR_PARTIAL_MARGIN_MS (1000)
+
+#define SR_FORMAT_PCM "pcm"
 
 typedef struct google_sr
 {
     audio_pipeline_handle_t pipeline;
-    int remain_len;
-    int sr_total_write;
-    int sr_audio_total_bytes;
-    bool is_begin;
+    audio_pipeline_handle_t capture;    /*!< I2S and echo canceller, runs from init on */
+    sr_backend_ctx_t ctx;
+    const sr_backend_t *backend;
+    const sr_backend_t *backends[SR_BACKEND_MAX];
+    int backend_num;
+    int backend_index;
+    int probe_timeout_ms;
+    volatile int probed_index;          /*!< Backend the probe found, switched to at the next start, -1 if none */
+    SemaphoreHandle_t probe_idle;       /*!< Taken while the probe task runs */
     char *buffer;
-    char *b64_buffer;
     audio_element_handle_t i2s_reader;
+    audio_element_handle_t resample;    /*!< Codec rate to recording rate, NULL if they are the same */
+    audio_element_handle_t aec;
+    audio_element_handle_t ns;          /*!< Noise suppressor, NULL if off */
+    audio_element_handle_t agc;         /*!< Gain control, NULL if off */
+    audio_element_handle_t kws;         /*!< Wake word spotter, NULL if off */
+    int64_t wake_ms;                    /*!< When the last wake word was heard */
+    audio_element_handle_t preroll;
+    jitter_buffer_t jitter;             /*!< Sizes the pre-roll margin for the upload */
+    audio_element_handle_t vad;
+    audio_element_handle_t encoder;
+    const sr_codec_t *codec;
+    const char *format;
     audio_element_handle_t http_stream_writer;
+    audio_element_handle_t local_sink;  /*!< Last element for a recognizer on the device */
+    audio_element_handle_t sink;        /*!< The writer or the local sink, whichever is linked */
+    audio_event_iface_handle_t listener;
     char *api_token;
+    char *retired_token;
     int sample_rates;
     int buffer_size;
     char *response_text;
     google_sr_event_handle_t on_begin;
+    google_sr_partial_handle_t on_partial;
+    int partial_stable_ms;
+    int net_core;
+    uint32_t session;
+    volatile bool partial_stop;
+    SemaphoreHandle_t partial_idle;     /*!< Taken while a poll task runs */
 } google_sr_t;
 
-static int _http_write_chunk(esp_http_client_handle_t http, const char *buffer, int len)
+/*
+ * The utterance as the backends see it, the same for an upload and for the local sink
+ */
+static void _sr_utterance_begin(google_sr_t *sr, esp_http_client_handle_t http)
 {
-    char header_chunk_buffer[16];
-    int header_chunk_len = sprintf(header_chunk_buffer, "%x\r\n", len);
-    if (esp_http_client_write(http, header_chunk_buffer, header_chunk_len) <= 0)
-    {
-        return ESP_FAIL;
-    }
-    int write_len = esp_http_client_write(http, buffer, len);
-    if (write_len <= 0)
-    {
-        ESP_LOGE(TAG, "Error write chunked content");
-        return ESP_FAIL;
-    }
-    if (esp_http_client_write(http, "\r\n", 2) <= 0)
-    {
-        return ESP_FAIL;
-    }
-    return write_len;
+    sr->ctx.http = http;
+    sr->ctx.buffer = sr->buffer;
+    sr->ctx.buffer_size = sr->buffer_size;
+    sr->ctx.format = sr->format;
+    sr->ctx.sample_rate = sr->sample_rates;
+    sr->ctx.token = sr->api_token;
+    sr->ctx.is_begin = true;
+    sr->ctx.audio_bytes = 0;
+    sr->ctx.wire_bytes = 0;
+    sr->ctx.cpu_us = 0;
+    sr->ctx.write_us = 0;
 }
 
-//////////////////////////////////////////////////
-/// 测试程序，发送音频数据到Pyhon server运行的目录
-//////////////////////////////////////////////////
-esp_err_t _test_http_stream_writer_event_handle(http_stream_event_msg_t *msg)
+static int _sr_utterance_write(google_sr_t *sr, const char *audio, int len)
 {
-    esp_http_client_handle_t http = (esp_http_client_handle_t)msg->http_client;
-    char len_buf[16];
-    static int total_write = 0;
-
-    if (msg->event_id == HTTP_STREAM_PRE_REQUEST) {
-        // set header
-        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_PRE_REQUEST, lenght=%d", msg->buffer_len);
-        esp_http_client_set_method(http, HTTP_METHOD_POST);
-        char dat[10] = {0};
-        snprintf(dat, sizeof(dat), "%d", 16000);
-        esp_http_client_set_header(http, "x-audio-sample-rates", dat);
-        memset(dat, 0, sizeof(dat));
-        snprintf(dat, sizeof(dat), "%d", 16);
-        esp_http_client_set_header(http, "x-audio-bits", dat);
-        memset(dat, 0, sizeof(dat));
-        snprintf(dat, sizeof(dat), "%d", 1);
-        esp_http_client_set_header(http, "x-audio-channel", dat);
-        total_write = 0;
-        return ESP_OK;
+    //* the first block comes at the speech onset
+    if (sr->ctx.is_begin && sr->on_begin) {
+        sr->on_begin(sr);
     }
+    sr->ctx.audio_bytes += len;
+    int ret = sr->backend->write(&sr->ctx, (const uint8_t *)audio, len);
+    sr->ctx.is_begin = false;
+    latency_trace_first(TRACE_SR_FIRST_CHUNK, len);
+    return ret;
+}
 
-    if (msg->event_id == HTTP_STREAM_ON_REQUEST) {
-        // write data
-        int wlen = sprintf(len_buf, "%x\r\n", msg->buffer_len);
-        if (esp_http_client_write(http, len_buf, wlen) <= 0) {
-            return ESP_FAIL;
-        }
-        if (esp_http_client_write(http, msg->buffer, msg->buffer_len) <= 0) {
-            return ESP_FAIL;
-        }
-        if (esp_http_client_write(http, "\r\n", 2) <= 0) {
-            return ESP_FAIL;
-        }
-        total_write += msg->buffer_len;
-        printf("\033[A\33[2K\rTotal bytes written: %d\n", total_write);
-        return msg->buffer_len;
+static int _sr_audio_ms(google_sr_t *sr, int bytes)
+{
+    if (sr->codec) {
+        return (int64_t)bytes * sr->codec->frame_samples / sr->codec->max_frame_bytes * 1000 / sr->sample_rates;
     }
+    return (int64_t)bytes * 1000 / (sr->sample_rates * 2);
+}
 
-    if (msg->event_id == HTTP_STREAM_POST_REQUEST) {
-        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_POST_REQUEST, write end chunked marker");
-        if (esp_http_client_write(http, "0\r\n\r\n", 5) <= 0) {
-            return ESP_FAIL;
-        }
-        return ESP_OK;
+static esp_err_t _sr_utterance_finish(google_sr_t *sr)
+{
+    esp_err_t err = sr->backend->finish(&sr->ctx);
+    latency_trace_record(TRACE_SR_LAST_CHUNK, sr->ctx.audio_bytes);
+    int audio_ms = _sr_audio_ms(sr, sr->ctx.audio_bytes);
+    if (audio_ms > 0) {
+        ESP_LOGI(TAG, "%s: %d bytes sent for %d ms of audio, %d bytes and %d us CPU per second", sr->backend->name,
+                 sr->ctx.wire_bytes, audio_ms, (int)((int64_t)sr->ctx.wire_bytes * 1000 / audio_ms),
+                 (int)(sr->ctx.cpu_us * 1000 / audio_ms));
     }
+    return err;
+}
 
-    if (msg->event_id == HTTP_STREAM_FINISH_REQUEST) {
-        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_FINISH_REQUEST");
-        char *buf = calloc(1, 64);
-        assert(buf);
-        int read_len = esp_http_client_read(http, buf, 64);
-        if (read_len <= 0) {
-            free(buf);
-            return ESP_FAIL;
-        }
-        buf[read_len] = 0;
-        ESP_LOGI(TAG, "Got HTTP Response = %s", (char *)buf);
-        free(buf);
-        return ESP_OK;
+/*
+ * One upload is one round of the jitter buffer, the margin behind the pre-roll follows the upload throughput
+ */
+static void _sr_jitter_round(google_sr_t *sr)
+{
+    int audio_ms = _sr_audio_ms(sr, sr->ctx.audio_bytes);
+    if (sr->backend->uri == NULL || audio_ms <= 0) {
+        return;
     }
-    return ESP_OK;
+    jitter_buffer_measure(&sr->jitter, sr->ctx.wire_bytes, sr->ctx.write_us);
+    if (sr_preroll_get_overrun(sr->preroll) > 0) {
+        jitter_buffer_overrun(&sr->jitter);
+    }
+    int margin_ms = jitter_buffer_round_end(&sr->jitter, (int)((int64_t)sr->ctx.wire_bytes * 1000 / audio_ms));
+    sr_preroll_set_margin(sr->preroll, margin_ms);
+}
+
+static void _sr_utterance_result(google_sr_t *sr)
+{
+    free(sr->response_text);
+    sr->response_text = sr->backend->result(&sr->ctx);
+    latency_trace_record(TRACE_SR_RESULT, sr->response_text ? strlen(sr->response_text) : 0);
 }
 
 static esp_err_t _http_stream_writer_event_handle(http_stream_event_msg_t *msg)
@@ -180,142 +204,273 @@ static esp_err_t _http_stream_writer_event_handle(http_stream_event_msg_t *msg)
     esp_http_client_handle_t http = (esp_http_client_handle_t)msg->http_client;
     google_sr_t *sr = (google_sr_t *)msg->user_data;
 
-    int write_len;
-    size_t need_write = 0;
-
     //* HTTP_STREAM_PRE_REQUEST
     if (msg->event_id == HTTP_STREAM_PRE_REQUEST)
     {
-        // set header
-        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_PRE_REQUEST, lenght=%d", msg->buffer_len);
-        sr->sr_total_write = 0;
-        sr->sr_audio_total_bytes = 0;
-        sr->is_begin = true;
-        sr->remain_len = 0;
-        esp_http_client_set_method(http, HTTP_METHOD_POST);
-        //* set headers
-        esp_http_client_set_post_field(http, NULL, -1);
-        esp_http_client_set_header(http, "Content-Type", "application/json");
-        esp_http_client_set_header(http, "Connection", "keep-alive");
-        esp_http_client_delete_header(http, "Content-Length");
-        return ESP_OK;
+        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_PRE_REQUEST, backend=%s", sr->backend->name);
+        _sr_utterance_begin(sr, http);
+        return sr->backend->begin(&sr->ctx);
     }
 
     //* HTTP_STREAM_ON_REQUEST
     if (msg->event_id == HTTP_STREAM_ON_REQUEST)
     {
-        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_ON_REQUEST, lenght=%d, begin=%d", msg->buffer_len, sr->is_begin);
-        //*  Write first chunk: BAIDU_SR_BEGIN
-        if (sr->is_begin)
-        {
-            sr->is_begin = false;
-            int sr_begin_len = snprintf(sr->buffer, sr->buffer_size, BAIDU_SR_BEGIN, sr->api_token);
-            if (sr->on_begin)
-            {
-                sr->on_begin(sr);
-            }
-            ESP_LOGI(TAG, "BAIDU_SR_BEGIN: " BAIDU_SR_BEGIN, sr->api_token);
-            return _http_write_chunk(http, sr->buffer, sr_begin_len);
-        }
-        //* base64-encoded need at most 1.5 times buffer than the raw audio buffer
-        if (msg->buffer_len > sr->buffer_size * 3 / 2)
-        {
-            ESP_LOGE(TAG, "Please use SR Buffer size greeter than %d", msg->buffer_len * 3 / 2);
-            return ESP_FAIL;
-        }
-
-        //* Write b64 audio data
-        memcpy(sr->buffer + sr->remain_len, msg->buffer, msg->buffer_len);
-        sr->remain_len += msg->buffer_len;
-
-        //* base64 need to keep the datalen to encode as the multiple of 3
-        int keep_next_time = sr->remain_len % 3;
-        sr->remain_len -= keep_next_time;
-        if (mbedtls_base64_encode((unsigned char *)sr->b64_buffer, sr->buffer_size, &need_write, (unsigned char *)sr->buffer, sr->remain_len) != 0)
-        {
-            ESP_LOGE(TAG, "Error encode b64");
-            return ESP_FAIL;
-        }
-        //* calculate total raw audio len
-        sr->sr_audio_total_bytes += sr->remain_len;
-        //* keep the `keep_next_time bytes`
-        if (keep_next_time > 0)
-        {
-            memcpy(sr->buffer, sr->buffer + sr->remain_len, keep_next_time);
-        }
-        sr->remain_len = keep_next_time;
-        ESP_LOGD(TAG, "\033[A\33[2K\rTotal bytes written: %d", sr->sr_total_write);
-
-        //* write base64 data
-        write_len = _http_write_chunk(http, (const char *)sr->b64_buffer, need_write);
-        if (write_len <= 0)
-        {
-            ESP_LOGE(TAG, "_http_write_chunk error, write_len=%d", write_len);
-            return write_len;
-        }
-        sr->sr_total_write += write_len;
-        return write_len;
+        ESP_LOGD(TAG, "[ + ] HTTP client HTTP_STREAM_ON_REQUEST, lenght=%d", msg->buffer_len);
+        return _sr_utterance_write(sr, msg->buffer, msg->buffer_len);
     }
 
     //* HTTP_STREAM_POST_REQUEST
     if (msg->event_id == HTTP_STREAM_POST_REQUEST)
     {
         ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_POST_REQUEST, write end chunked marker");
-        need_write = 0;
-        //* write remained bytes
-        if (sr->remain_len)
-        {
-            if (mbedtls_base64_encode((unsigned char *)sr->b64_buffer, sr->buffer_size, &need_write, (unsigned char *)sr->buffer, sr->remain_len) != 0)
-            {
-                ESP_LOGE(TAG, "Error encode b64");
-                return ESP_FAIL;
-            }
-            sr->sr_audio_total_bytes += sr->remain_len;
-            write_len = _http_write_chunk(http, (const char *)sr->b64_buffer, need_write);
-            if (write_len <= 0)
-            {
-                return write_len;
-            }
-        }
-        //* Write End chunk: BAIDU_SR_END
-        int sr_end_len = snprintf(sr->buffer, sr->buffer_size, BAIDU_SR_END, sr->sr_audio_total_bytes);
-        write_len = _http_write_chunk(http, sr->buffer, sr_end_len);
-        ESP_LOGI(TAG, "BAIDU_SE_END: " BAIDU_SR_END, sr->sr_audio_total_bytes);
-        if (write_len <= 0)
-        {
-            return ESP_FAIL;
-        }
-        //* Finish chunked
-        if (esp_http_client_write(http, "0\r\n\r\n", 5) <= 0)
-        {
-            return ESP_FAIL;
-        }
-        return write_len;
+        return _sr_utterance_finish(sr);
     }
+
     //* HTTP_STREAM_FINISH_REQUEST
     if (msg->event_id == HTTP_STREAM_FINISH_REQUEST)
     {
-        int read_len = esp_http_client_read(http, (char *)sr->buffer, sr->buffer_size);
-        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_FINISH_REQUEST, read_len=%d", read_len);
-        if (read_len <= 0)
-        {
-            return ESP_FAIL;
+        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_FINISH_REQUEST");
+        _sr_utterance_result(sr);
+        return ESP_OK;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Sink of a recognizer on the device, stands where the HTTP writer would be
+ */
+static esp_err_t _sr_local_open(audio_element_handle_t self)
+{
+    google_sr_t *sr = (google_sr_t *)audio_element_getdata(self);
+    _sr_utterance_begin(sr, NULL);
+    return sr->backend->begin(&sr->ctx);
+}
+
+static int _sr_local_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    google_sr_t *sr = (google_sr_t *)audio_element_getdata(self);
+    int r_size = audio_element_input(self, in_buffer, in_len);
+    if (r_size <= 0) {
+        return r_size;
+    }
+    return _sr_utterance_write(sr, in_buffer, r_size);
+}
+
+static esp_err_t _sr_local_close(audio_element_handle_t self)
+{
+    google_sr_t *sr = (google_sr_t *)audio_element_getdata(self);
+    _sr_utterance_finish(sr);
+    _sr_utterance_result(sr);
+    return ESP_OK;
+}
+
+static audio_element_handle_t _sr_local_init(google_sr_t *sr, int core)
+{
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _sr_local_open;
+    cfg.close = _sr_local_close;
+    cfg.process = _sr_local_process;
+    cfg.task_stack = SR_LOCAL_TASK_STACK;
+    cfg.task_core = core;
+    cfg.out_rb_size = 0;
+    cfg.tag = "sr_local";
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, return NULL);
+    audio_element_setdata(el, sr);
+    return el;
+}
+
+static esp_err_t _sr_link(google_sr_t *sr)
+{
+    const char *link_tag[3];
+    int link_num = 0;
+    link_tag[link_num++] = "sr_vad";
+    if (sr->encoder) {
+        link_tag[link_num++] = "sr_enc";
+    }
+    link_tag[link_num++] = sr->backend->uri ? "sr_http" : "sr_local";
+    sr->sink = sr->backend->uri ? sr->http_stream_writer : sr->local_sink;
+    esp_err_t err = audio_pipeline_link(sr->pipeline, &link_tag[0], link_num);
+    //* the recording starts at the VAD, which reads from the capture pipeline's ring
+    audio_element_set_read_cb(sr->vad, sr_preroll_read, sr->preroll);
+    return err;
+}
+
+/*
+ * Switch the backend while the pipeline is stopped, a recognizer on the device needs the local sink linked
+ */
+static void _sr_use_backend(google_sr_t *sr, int index)
+{
+    const sr_backend_t *backend = sr->backends[index];
+    bool relink = (backend->uri == NULL) != (sr->backend->uri == NULL);
+    ESP_LOGW(TAG, "ASR backend %s", backend->name);
+    sr->backend_index = index;
+    sr->backend = backend;
+    if (relink) {
+        audio_pipeline_unlink(sr->pipeline);
+        _sr_link(sr);
+        if (sr->listener) {
+            audio_pipeline_set_listener(sr->pipeline, sr->listener);
         }
-        if (read_len > sr->buffer_size - 1)
-        {
-            read_len = sr->buffer_size - 1;
+    }
+}
+
+/*
+ * The reachable backend with the fastest connection, one on the device only if no server answers
+ */
+static int _sr_select_backend(google_sr_t *sr, int timeout_ms)
+{
+    int best = -1, best_ms = 0, local = -1;
+    for (int i = 0; sr->backend_num > 1 && i < sr->backend_num; i++) {
+        if (sr->backends[i]->uri == NULL) {
+            local = local < 0 ? i : local;
+            continue;
         }
-        sr->buffer[read_len] = 0;
-        ESP_LOGI(TAG, "Got HTTP Response = %s", (char *)sr->buffer);
-        if (sr->response_text)
-        {
-            free(sr->response_text);
+        int ms = sr_backend_probe(sr->backends[i], timeout_ms);
+        if (ms >= 0 && (best < 0 || ms < best_ms)) {
+            best = i;
+            best_ms = ms;
         }
-        //* parse json and get `result`
-        sr->response_text = json_get_token_value(sr->buffer, "result");
-        return ESP_OK;
     }
-    return ESP_OK;
+    if (best >= 0) {
+        return best;
+    }
+    return local >= 0 ? local : 0;
+}
+
+static void _sr_probe_task(void *pv)
+{
+    google_sr_t *sr = (google_sr_t *)pv;
+    int64_t start = esp_timer_get_time();
+    sr->probed_index = _sr_select_backend(sr, sr->probe_timeout_ms);
+    ESP_LOGI(TAG, "Backend probe picked %s in %d ms", sr->backends[sr->probed_index]->name,
+             (int)((esp_timer_get_time() - start) / 1000));
+    xSemaphoreGive(sr->probe_idle);
+    vTaskDelete(NULL);
+}
+
+/*
+ * Probe the backends in the background, the recording starts on the first one meanwhile
+ */
+static void _sr_probe_start(google_sr_t *sr)
+{
+    if (sr->backend_num < 2) {
+        return;
+    }
+    sr->probe_idle = xSemaphoreCreateBinary();
+    AUDIO_MEM_CHECK(TAG, sr->probe_idle, return);
+    if (xTaskCreatePinnedToCore(_sr_probe_task, "sr_probe", SR_PROBE_TASK_STACK, sr, SR_PROBE_TASK_PRIO, NULL,
+                                sr->net_core) != pdPASS) {
+        ESP_LOGE(TAG, "Error create probe task, staying on backend %s", sr->backend->name);
+        xSemaphoreGive(sr->probe_idle);
+    }
+}
+
+#if CONFIG_MOCK_SERVER
+/*
+ * Report one poll answer, return true once the hypothesis is final
+ */
+static bool _sr_partial_handle(google_sr_t *sr, const char *body, int *seq, bool *stable)
+{
+    char *seq_value = json_get_token_value(body, "seq");
+    char *text = json_get_token_value(body, "result");
+    char *final = json_get_token_value(body, "final");
+    int new_seq = seq_value ? atoi(seq_value) : *seq;
+    bool is_final = final && strcmp(final, "true") == 0;
+    if (text && text[0] && !is_final && !sr->partial_stop) {
+        if (new_seq != *seq) {
+            latency_trace_first(TRACE_SR_PARTIAL, strlen(text));
+            sr->on_partial(sr, text, false);
+            *stable = false;
+        } else if (!*stable) {
+            //* the server held the poll for the whole stable time without a new hypothesis
+            sr->on_partial(sr, text, true);
+            *stable = true;
+        }
+    }
+    *seq = new_seq;
+    free(seq_value);
+    free(text);
+    free(final);
+    return is_final;
+}
+
+/*
+ * Long-poll the partial hypotheses of the session, the server answers as soon as
+ * the hypothesis changes or after `partial_stable_ms` without a change
+ */
+static void _sr_partial_task(void *pv)
+{
+    google_sr_t *sr = (google_sr_t *)pv;
+    char url[SR_PARTIAL_URL_MAX];
+    char *body = malloc(SR_PARTIAL_BODY_MAX);
+    snprintf(url, sizeof(url), SR_PARTIAL_URL, sr->session, 0, sr->partial_stable_ms);
+    esp_http_client_config_t config = {
+        .url = url,
+        .timeout_ms = sr->partial_stable_ms + SR_PARTIAL_MARGIN_MS,
+        .keep_alive_enable = true,
+    };
+    esp_http_client_handle_t http = esp_http_client_init(&config);
+    int seq = 0;
+    bool stable = false;
+    while (body && http && !sr->partial_stop) {
+        snprintf(url, sizeof(url), SR_PARTIAL_URL, sr->session, seq, sr->partial_stable_ms);
+        esp_http_client_set_url(http, url);
+        int len = -1;
+        if (esp_http_client_open(http, 0) == ESP_OK && esp_http_client_fetch_headers(http) >= 0) {
+            len = esp_http_client_read_response(http, body, SR_PARTIAL_BODY_MAX - 1);
+        }
+        if (len <= 0 || !esp_http_client_is_complete_data_received(http)) {
+            esp_http_client_close(http);
+        }
+        if (len <= 0) {
+            vTaskDelay(pdMS_TO_TICKS(SR_PARTIAL_RETRY_MS));
+            continue;
+        }
+        body[len] = 0;
+        if (_sr_partial_handle(sr, body, &seq, &stable)) {
+            break;
+        }
+    }
+    if (http) {
+        esp_http_client_cleanup(http);
+    }
+    free(body);
+    xSemaphoreGive(sr->partial_idle);
+    vTaskDelete(NULL);
+}
+
+static void _sr_partial_start(google_sr_t *sr)
+{
+    char uri[SR_PARTIAL_URL_MAX];
+    sr->session = esp_random();
+    snprintf(uri, sizeof(uri), sr->backend->stream_uri, sr->session);
+    audio_element_set_uri(sr->http_stream_writer, uri);
+    if (xSemaphoreTake(sr->partial_idle, pdMS_TO_TICKS(sr->partial_stable_ms + SR_PARTIAL_MARGIN_MS)) != pdTRUE) {
+        ESP_LOGW(TAG, "Partial poll still running, no partial results this time");
+        return;
+    }
+    sr->partial_stop = false;
+    if (xTaskCreatePinnedToCore(_sr_partial_task, "sr_partial", SR_PARTIAL_TASK_STACK, sr, SR_PARTIAL_TASK_PRIO, NULL,
+                                sr->net_core) != pdPASS) {
+        ESP_LOGE(TAG, "Error create partial task");
+        xSemaphoreGive(sr->partial_idle);
+    }
+}
+#endif
+
+/*
+ * Wait for the poll task, a final hypothesis has usually ended it already
+ */
+static void _sr_partial_stop(google_sr_t *sr)
+{
+    if (sr->partial_idle == NULL) {
+        return;
+    }
+    sr->partial_stop = true;
+    if (xSemaphoreTake(sr->partial_idle, pdMS_TO_TICKS(sr->partial_stable_ms + SR_PARTIAL_MARGIN_MS)) == pdTRUE) {
+        xSemaphoreGive(sr->partial_idle);
+    }
 }
 
 google_sr_handle_t google_sr_init(google_sr_config_t *config)
@@ -324,6 +479,8 @@ google_sr_handle_t google_sr_init(google_sr_config_t *config)
     google_sr_t *sr = calloc(1, sizeof(google_sr_t));
     AUDIO_MEM_CHECK(TAG, sr, return NULL);
     sr->pipeline = audio_pipeline_init(&pipeline_cfg);
+    sr->capture = audio_pipeline_init(&pipeline_cfg);
+    AUDIO_MEM_CHECK(TAG, sr->pipeline && sr->capture, goto exit_sr_init);
 
     sr->buffer_size = config->buffer_size;
     if (sr->buffer_size <= 0)
@@ -333,17 +490,14 @@ google_sr_handle_t google_sr_init(google_sr_config_t *config)
 
     sr->buffer = malloc(sr->buffer_size);
     AUDIO_MEM_CHECK(TAG, sr->buffer, goto exit_sr_init);
-    sr->b64_buffer = malloc(sr->buffer_size);
-    AUDIO_MEM_CHECK(TAG, sr->b64_buffer, goto exit_sr_init);
     sr->api_token = strdup(config->api_token);
     AUDIO_MEM_CHECK(TAG, sr->api_token, goto exit_sr_init);
 
-    //* config I2S
-    i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT_WITH_PARA(CODEC_ADC_I2S_PORT, 44100, 16, AUDIO_STREAM_READER);
+    //* config I2S, at the codec rate shared with the playback so the clock is never reprogrammed
+    int codec_rate = config->codec_sample_rate > 0 ? config->codec_sample_rate : config->record_sample_rates;
+    i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT_WITH_PARA(CODEC_ADC_I2S_PORT, codec_rate, 16, AUDIO_STREAM_READER);
     i2s_cfg.type = AUDIO_STREAM_READER;
-    // Increase buffer to avoid missing data in bad network conditions
-    i2s_cfg.out_rb_size = 16 * 1024;
-    i2s_cfg.i2s_config.sample_rate = 16000;
+    i2s_cfg.task_core = config->audio_core;
     // i2s_cfg.i2s_config.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT;
     // //* set `use_apll` to `false` to avoid noise due to unstable clk
     // i2s_cfg.i2s_config.use_apll = false;
@@ -358,23 +512,178 @@ google_sr_handle_t google_sr_init(google_sr_config_t *config)
     //* config HTTPSTREAM
     http_stream_cfg_t http_cfg = HTTP_STREAM_CFG_DEFAULT();
     http_cfg.type = AUDIO_STREAM_WRITER;
-    if (TEST_WITH_PYTHON) {
-        http_cfg.event_handle = _test_http_stream_writer_event_handle;
-    } else {
-        http_cfg.event_handle = _http_stream_writer_event_handle;
-    }
+    http_cfg.event_handle = _http_stream_writer_event_handle;
     http_cfg.user_data = sr;
     http_cfg.task_stack = BAIDU_SR_TASK_STACK;
+    http_cfg.task_core = config->net_core;
 
     sr->http_stream_writer = http_stream_init(&http_cfg);
+    sr->local_sink = _sr_local_init(sr, config->audio_core);
+    AUDIO_MEM_CHECK(TAG, sr->local_sink, goto exit_sr_init);
     sr->sample_rates = config->record_sample_rates;
     sr->on_begin = config->on_begin;
+    sr->net_core = config->net_core;
+    sr->partial_stable_ms = config->partial_stable_ms > 0 ? config->partial_stable_ms : SR_PARTIAL_STABLE_MS;
+#if CONFIG_MOCK_SERVER
+    if (config->on_partial) {
+        sr->on_partial = config->on_partial;
+        sr->partial_idle = xSemaphoreCreateBinary();
+        AUDIO_MEM_CHECK(TAG, sr->partial_idle, goto exit_sr_init);
+        xSemaphoreGive(sr->partial_idle);
+    }
+#else
+    if (config->on_partial) {
+        ESP_LOGW(TAG, "Partial results need the streaming endpoint of the mock server");
+    }
+#endif
+
+    sr->format = SR_FORMAT_PCM;
+    //* config VAD, drop silence before it is uploaded
+    sr_vad_cfg_t vad_cfg = DEFAULT_SR_VAD_CONFIG();
+    vad_cfg.sample_rate = config->record_sample_rates;
+    vad_cfg.end_silence_ms = config->vad_end_silence_ms;
+    vad_cfg.task_core = config->audio_core;
+    sr->vad = sr_vad_init(&vad_cfg);
+    AUDIO_MEM_CHECK(TAG, sr->vad, goto exit_sr_init);
+
+    //* config AEC, the playback is removed before the VAD sees it
+    if (config->echo_reference) {
+        sr_aec_cfg_t aec_cfg = DEFAULT_SR_AEC_CONFIG();
+        aec_cfg.sample_rate = config->record_sample_rates;
+        aec_cfg.reference = config->echo_reference;
+        aec_cfg.task_core = config->audio_core;
+        if (config->echo_tail_ms > 0) {
+            aec_cfg.filter_ms = config->echo_tail_ms;
+        }
+        sr->aec = sr_aec_init(&aec_cfg);
+        AUDIO_MEM_CHECK(TAG, sr->aec, goto exit_sr_init);
+    }
+
+    //* config noise suppressor, in the capture pipeline so it learns the room between recordings
+    if (config->noise_suppression_db > 0) {
+        sr_ns_cfg_t ns_cfg = DEFAULT_SR_NS_CONFIG();
+        ns_cfg.sample_rate = config->record_sample_rates;
+        ns_cfg.max_attenuation_db = config->noise_suppression_db;
+        ns_cfg.fixed_point = config->noise_fixed_point;
+        ns_cfg.task_core = config->audio_core;
+        sr->ns = sr_ns_init(&ns_cfg);
+        AUDIO_MEM_CHECK(TAG, sr->ns, goto exit_sr_init);
+    }
+
+    //* config AGC, after the noise suppressor so the gain follows the speaker and not the room
+    if (config->agc_target_db < 0) {
+        pcm_agc_cfg_t agc_cfg = DEFAULT_PCM_AGC_CONFIG();
+        agc_cfg.sample_rate = config->record_sample_rates;
+        agc_cfg.target_db = config->agc_target_db;
+        agc_cfg.task_core = config->audio_core;
+        sr->agc = pcm_agc_init(&agc_cfg);
+        AUDIO_MEM_CHECK(TAG, sr->agc, goto exit_sr_init);
+    }
+
+    //* config wake word, it listens to what the recording would get
+    if (config->wake_model_partition) {
+        sr_kws_cfg_t kws_cfg = DEFAULT_SR_KWS_CONFIG();
+        kws_cfg.sample_rate = config->record_sample_rates;
+        kws_cfg.model_partition = config->wake_model_partition;
+        if (config->wake_threshold > 0) {
+            kws_cfg.threshold = config->wake_threshold;
+        }
+        kws_cfg.task_core = config->audio_core;
+        //* without a model the button is the only way in
+        sr->kws = sr_kws_init(&kws_cfg);
+    }
+
+    //* config encoder, raw PCM goes to the writer as it is
+    sr_encoder_cfg_t encoder_cfg = DEFAULT_SR_ENCODER_CONFIG();
+    encoder_cfg.sample_rate = config->record_sample_rates;
+    encoder_cfg.codec = NULL;
+    encoder_cfg.task_core = config->audio_core;
+    if (config->encoding == ENCODING_IMA_ADPCM) {
+        encoder_cfg.codec = &sr_codec_ima_adpcm;
+    } else if (config->encoding == ENCODING_CUSTOM) {
+        encoder_cfg.codec = config->codec;
+        AUDIO_NULL_CHECK(TAG, encoder_cfg.codec, goto exit_sr_init);
+    }
+    if (encoder_cfg.codec) {
+        sr->encoder = sr_encoder_init(&encoder_cfg);
+        AUDIO_MEM_CHECK(TAG, sr->encoder, goto exit_sr_init);
+        sr->format = encoder_cfg.codec->format;
+        sr->codec = encoder_cfg.codec;
+    }
+
+    //* config backend, Baidu if none is given
+    sr->backends[0] = &sr_backend_baidu;
+    sr->backend_num = 1;
+    if (config->backends && config->backend_num > 0) {
+        sr->backend_num = config->backend_num > SR_BACKEND_MAX ? SR_BACKEND_MAX : config->backend_num;
+        memcpy(sr->backends, config->backends, sr->backend_num * sizeof(sr->backends[0]));
+    }
+    sr->backend_index = 0;
+    sr->backend = sr->backends[0];
+    sr->probed_index = -1;
+    sr->probe_timeout_ms = config->probe_timeout_ms > 0 ? config->probe_timeout_ms : SR_BACKEND_PROBE_TIMEOUT_MS;
+    ESP_LOGI(TAG, "ASR backend %s", sr->backend->name);
+
+    //* config pre-roll, the microphone is always on and the recording starts back in time,
+    //* the margin behind it absorbs stalls of the upload and adapts to the measured throughput
+    jitter_buffer_cfg_t jitter_cfg = DEFAULT_JITTER_BUFFER_CONFIG();
+    jitter_buffer_init(&sr->jitter, "upload", &jitter_cfg);
+    sr_preroll_cfg_t preroll_cfg = DEFAULT_SR_PREROLL_CONFIG();
+    preroll_cfg.sample_rate = config->record_sample_rates;
+    preroll_cfg.pre_roll_ms = config->pre_roll_ms;
+    preroll_cfg.margin_ms = sr->jitter.target_ms;
+    preroll_cfg.task_core = config->audio_core;
+    sr->preroll = sr_preroll_init(&preroll_cfg);
+    AUDIO_MEM_CHECK(TAG, sr->preroll, goto exit_sr_init);
+
+    //* config resampler, everything after the I2S runs at the recording rate
+    if (codec_rate != config->record_sample_rates) {
+        pcm_resample_cfg_t resample_cfg = DEFAULT_PCM_RESAMPLE_CONFIG();
+        resample_cfg.src_rate = codec_rate;
+        resample_cfg.dest_rate = config->record_sample_rates;
+        resample_cfg.task_core = config->audio_core;
+        sr->resample = pcm_resample_init(&resample_cfg);
+        AUDIO_MEM_CHECK(TAG, sr->resample, goto exit_sr_init);
+    }
+
+    const char *capture_tag[7];
+    int capture_num = 0;
+    audio_pipeline_register(sr->capture, sr->i2s_reader, "sr_i2s");
+    capture_tag[capture_num++] = "sr_i2s";
+    if (sr->resample) {
+        audio_pipeline_register(sr->capture, sr->resample, "sr_resample");
+        capture_tag[capture_num++] = "sr_resample";
+    }
+    if (sr->aec) {
+        audio_pipeline_register(sr->capture, sr->aec, "sr_aec");
+        capture_tag[capture_num++] = "sr_aec";
+    }
+    if (sr->ns) {
+        audio_pipeline_register(sr->capture, sr->ns, "sr_ns");
+        capture_tag[capture_num++] = "sr_ns";
+    }
+    if (sr->agc) {
+        audio_pipeline_register(sr->capture, sr->agc, "sr_agc");
+        capture_tag[capture_num++] = "sr_agc";
+    }
+    if (sr->kws) {
+        audio_pipeline_register(sr->capture, sr->kws, "sr_kws");
+        capture_tag[capture_num++] = "sr_kws";
+    }
+    audio_pipeline_register(sr->capture, sr->preroll, "sr_preroll");
+    capture_tag[capture_num++] = "sr_preroll";
+    audio_pipeline_link(sr->capture, &capture_tag[0], capture_num);
 
     audio_pipeline_register(sr->pipeline, sr->http_stream_writer, "sr_http");
-    audio_pipeline_register(sr->pipeline, sr->i2s_reader, "sr_i2s");
-    const char *link_tag[2] = {"sr_i2s", "sr_http"};
-    audio_pipeline_link(sr->pipeline, &link_tag[0], 2);
-    i2s_stream_set_clk(sr->i2s_reader, config->record_sample_rates, 16, 1);
+    audio_pipeline_register(sr->pipeline, sr->local_sink, "sr_local");
+    audio_pipeline_register(sr->pipeline, sr->vad, "sr_vad");
+    if (sr->encoder) {
+        audio_pipeline_register(sr->pipeline, sr->encoder, "sr_enc");
+    }
+    _sr_link(sr);
+    i2s_stream_set_clk(sr->i2s_reader, codec_rate, 16, 1);
+    audio_pipeline_run(sr->capture);
+    _sr_probe_start(sr);
 
     return sr;
 exit_sr_init:
@@ -387,50 +696,137 @@ esp_err_t google_sr_destroy(google_sr_handle_t sr)
     if (sr == NULL) {
         return ESP_FAIL;
     }
-    audio_pipeline_stop(sr->pipeline);
-    audio_pipeline_wait_for_stop(sr->pipeline);
-    audio_pipeline_terminate(sr->pipeline);
-    audio_pipeline_remove_listener(sr->pipeline);
-    audio_pipeline_deinit(sr->pipeline);
+    if (sr->pipeline) {
+        audio_pipeline_stop(sr->pipeline);
+        audio_pipeline_wait_for_stop(sr->pipeline);
+        _sr_partial_stop(sr);
+        audio_pipeline_terminate(sr->pipeline);
+        audio_pipeline_remove_listener(sr->pipeline);
+        audio_pipeline_deinit(sr->pipeline);
+    }
+    if (sr->capture) {
+        audio_pipeline_stop(sr->capture);
+        audio_pipeline_wait_for_stop(sr->capture);
+        audio_pipeline_terminate(sr->capture);
+        audio_pipeline_deinit(sr->capture);
+    }
     free(sr->buffer);
-    free(sr->b64_buffer);
     free(sr->api_token);
+    free(sr->retired_token);
+    if (sr->partial_idle) {
+        vSemaphoreDelete(sr->partial_idle);
+    }
+    //* the probe gives up on every backend after its timeout
+    if (sr->probe_idle) {
+        xSemaphoreTake(sr->probe_idle, portMAX_DELAY);
+        vSemaphoreDelete(sr->probe_idle);
+    }
     free(sr);
     return ESP_OK;
 }
 
+esp_err_t baidu_sr_reset_token(google_sr_handle_t sr, const char *token)
+{
+    char *new_token = strdup(token);
+    AUDIO_MEM_CHECK(TAG, new_token, return ESP_FAIL);
+    free(sr->retired_token);
+    sr->retired_token = sr->api_token;
+    sr->api_token = new_token;
+    return ESP_OK;
+}
+
 esp_err_t google_sr_set_listener(google_sr_handle_t sr, audio_event_iface_handle_t listener)
 {
     if (listener)
     {
+        sr->listener = listener;
         audio_pipeline_set_listener(sr->pipeline, listener);
+        if (sr->kws) {
+            sr_kws_set_listener(sr->kws, listener);
+        }
     }
     return ESP_OK;
 }
 
-esp_err_t google_sr_start(google_sr_handle_t sr)
+bool google_sr_check_event_finish(google_sr_handle_t sr, audio_event_iface_msg_t *msg)
 {
+    //* the writer only finishes by itself when the VAD ended the input, google_sr_stop reports STOPPED
+    if (msg->source_type == AUDIO_ELEMENT_TYPE_ELEMENT && msg->source == (void *)sr->sink
+            && msg->cmd == AEL_MSG_CMD_REPORT_STATUS
+            && (int)msg->data == AEL_STATUS_STATE_FINISHED) {
+        return true;
+    }
+    return false;
+}
+
+bool google_sr_check_event_wake(google_sr_handle_t sr, audio_event_iface_msg_t *msg)
+{
+    if (sr->kws == NULL || !sr_kws_check_event(sr->kws, msg)) {
+        return false;
+    }
+    sr->wake_ms = sr_kws_get_detect_time(sr->kws) / 1000;
+    return true;
+}
+
+bool google_sr_speech_detected(google_sr_handle_t sr)
+{
+    return sr_vad_speech_detected(sr->vad);
+}
+
+static esp_err_t _sr_start(google_sr_handle_t sr, int back_ms)
+{
+    //* the pipeline is stopped, the backend the probe found can be linked now, once
+    int probed = sr->probed_index;
+    if (probed >= 0) {
+        sr->probed_index = -1;
+        if (probed != sr->backend_index) {
+            _sr_use_backend(sr, probed);
+        }
+    }
     audio_pipeline_reset_items_state(sr->pipeline);
     audio_pipeline_reset_ringbuffer(sr->pipeline);
-    if (TEST_WITH_PYTHON) {
-        audio_element_set_uri(sr->http_stream_writer, CONFIG_TEST_SERVER_URI);
+    if (back_ms < 0) {
+        sr_preroll_mark(sr->preroll);
     } else {
-        audio_element_set_uri(sr->http_stream_writer, BAIDU_SR_ENDPOINT);
+        sr_preroll_mark_back(sr->preroll, back_ms);
+    }
+    sr->ctx.audio_bytes = 0;
+#if CONFIG_MOCK_SERVER
+    if (sr->on_partial && sr->backend->stream_uri) {
+        _sr_partial_start(sr);
+    } else
+#endif
+    if (sr->backend->uri) {
+        audio_element_set_uri(sr->http_stream_writer, sr->backend->uri);
     }
     audio_pipeline_run(sr->pipeline);
     return ESP_OK;
 }
 
+esp_err_t google_sr_start(google_sr_handle_t sr)
+{
+    return _sr_start(sr, -1);
+}
+
+esp_err_t google_sr_start_wake(google_sr_handle_t sr)
+{
+    //* the request follows the wake word, the recording picks up where it was heard
+    int back_ms = (int)(esp_timer_get_time() / 1000 - sr->wake_ms);
+    return _sr_start(sr, back_ms > 0 ? back_ms : 0);
+}
+
 char *google_sr_stop(google_sr_handle_t sr)
 {
     audio_pipeline_stop(sr->pipeline);
     audio_pipeline_wait_for_stop(sr->pipeline);
-    AUDIO_NULL_CHECK(TAG, sr->response_text, {
-        return NULL;
-    })
-    //* get pure answer text
-    char *pure_text = strndup(sr->response_text + 2, strlen(sr->response_text) - 4);
-    free(sr->response_text);
+    _sr_partial_stop(sr);
+    char *text = sr->response_text;
     sr->response_text = NULL;
-    return pure_text;
-}
\ No newline at end of file
+    _sr_jitter_round(sr);
+    //* speech went out and nothing came back, the next utterance tries the next backend
+    if (text == NULL && sr->ctx.audio_bytes > 0 && sr->backend_num > 1) {
+        ESP_LOGE(TAG, "No result from ASR backend %s", sr->backend->name);
+        _sr_use_backend(sr, (sr->backend_index + 1) % sr->backend_num);
+    }
+    return text;
+}
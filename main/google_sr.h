@@ -27,23 +27,39 @@
 
 #include "esp_err.h"
 #include "audio_event_iface.h"
+#include "ringbuf.h"
+#include "sr_encoder.h"
+#include "sr_backend.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define DEFAULT_SR_BUFFER_SIZE (1024*8)
+#define SR_PARTIAL_STABLE_MS (300)
+#define SR_BACKEND_MAX (4)
 
 /**
  * Google Cloud Speech-to-Text audio encoding
  */
 typedef enum {
     ENCODING_LINEAR16 = 0,  /*!< Google Cloud Speech-to-Text audio encoding PCM 16-bit mono */
+    ENCODING_IMA_ADPCM,     /*!< IMA-ADPCM 4-bit mono, 4:1 smaller upload */
+    ENCODING_CUSTOM,        /*!< Codec given by `google_sr_config_t.codec` */
 } google_sr_encoding_t;
 
 typedef struct google_sr* google_sr_handle_t;
 typedef void (*google_sr_event_handle_t)(google_sr_handle_t sr);
 
+/**
+ * @brief      Partial hypothesis of the streaming recognition, called from its poll task
+ *
+ * @param      sr      The Speech-to-Text context
+ * @param      text    The hypothesis, only valid during the call
+ * @param      stable  The hypothesis did not change for `partial_stable_ms`, reported once per hypothesis
+ */
+typedef void (*google_sr_partial_handle_t)(google_sr_handle_t sr, const char *text, bool stable);
+
 /**
  * Baidu Speech-to-Text configurations
  */
@@ -52,11 +68,34 @@ typedef struct {
     int record_sample_rates;            /*!< Audio recording sample rate */
     int buffer_size;                 /*!< Processing buffer size */
     google_sr_event_handle_t on_begin;  /*!< Begin send audio data to server */
+    int vad_end_silence_ms;             /*!< Finish recording after this much silence following speech, 0 to wait for google_sr_stop */
+    google_sr_encoding_t encoding;      /*!< Upload audio encoding */
+    const sr_codec_t *codec;            /*!< Codec used with ENCODING_CUSTOM */
+    ringbuf_handle_t echo_reference;    /*!< Playback PCM removed from the recording by an echo canceller, NULL for none */
+    int echo_tail_ms;                   /*!< Echo tail covered by the echo canceller, default if 0 */
+    google_sr_partial_handle_t on_partial;  /*!< Partial hypotheses while the user speaks, only with the mock server, NULL for none */
+    int partial_stable_ms;              /*!< A hypothesis unchanged this long is stable, SR_PARTIAL_STABLE_MS if 0 */
+    const sr_backend_t *const *backends;    /*!< Recognition backends, the fastest reachable one is used and the next one
+                                                 after a failure, `sr_backend_baidu` if NULL */
+    int backend_num;                    /*!< Number of `backends`, at most SR_BACKEND_MAX */
+    int probe_timeout_ms;               /*!< Give up on probing an unreachable backend after this long, default if 0 */
+    int audio_core;                     /*!< Core of the I2S, echo canceller, VAD and encoder tasks (0 or 1) */
+    int net_core;                       /*!< Core of the upload and partial result tasks (0 or 1) */
+    int pre_roll_ms;                    /*!< Audio from before `google_sr_start` sent with the recording, 0 for none */
+    int codec_sample_rate;              /*!< Rate the I2S runs at, resampled to `record_sample_rates`, 0 for the same */
+    int noise_suppression_db;           /*!< Most the noise suppressor takes off the room noise (dB), 0 for none */
+    bool noise_fixed_point;             /*!< Q15 FFT in the noise suppressor, for chips without an FPU */
+    int agc_target_db;                  /*!< Speech level the gain control steers the recording to (dBFS), 0 for none */
+    const char *wake_model_partition;   /*!< Data partition with the wake word model, NULL for none */
+    int wake_threshold;                 /*!< Wake word score that triggers (percent), default if 0 */
 } google_sr_config_t;
 
 /**
  * @brief      initialize Google Cloud Speech-to-Text, this function will return a Speech-to-Text context
  *
+ *             With more than one backend each is probed in the background, recording starts on the first one
+ *             and switches to the fastest reachable one at the first start after the probe.
+ *
  * @param      config  The Google Cloud Speech-to-Text configuration
  *
  * @return     The Speech-to-Text context
@@ -66,6 +105,8 @@ google_sr_handle_t google_sr_init(google_sr_config_t *config);
 /**
  * @brief      Start recording and sending audio to Google Cloud Speech-to-Text
  *
+ *             The recording begins `pre_roll_ms` before the call, or where the last one ended if that is later.
+ *
  * @param[in]  sr   The Speech-to-Text context
  *
  * @return
@@ -74,9 +115,24 @@ google_sr_handle_t google_sr_init(google_sr_config_t *config);
  */
 esp_err_t google_sr_start(google_sr_handle_t sr);
 
+/**
+ * @brief      Start recording where the wake word of the last `google_sr_check_event_wake` was heard
+ *
+ *             Nothing before the wake word is sent, at most `pre_roll_ms` of what followed it is.
+ *
+ * @param[in]  sr   The Speech-to-Text context
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_FAIL
+ */
+esp_err_t google_sr_start_wake(google_sr_handle_t sr);
+
 /**
  * @brief      Stop sending audio to Google Cloud Speech-to-Text and get the result text
  *
+ *             No partial hypothesis is reported after it returns.
+ *
  * @param[in]  sr   The Speech-to-Text context
  *
  * @return     Google Cloud Speech-to-Text server response
@@ -107,15 +163,55 @@ esp_err_t google_sr_destroy(google_sr_handle_t sr);
 esp_err_t google_sr_set_listener(google_sr_handle_t sr, audio_event_iface_handle_t listener);
 
 /**
- * @brief      Reset the token of Baidu ASR
+ * @brief      Check if the voice activity detector finished the recording because the speaker stopped talking,
+ *             `google_sr_stop` should then be called to get the result text
+ *
+ * @param[in]  sr    The Speech-to-Text context
+ * @param      msg   The message
+ *
+ * @return
+ *  - true
+ *  - false
+ */
+bool google_sr_check_event_finish(google_sr_handle_t sr, audio_event_iface_msg_t *msg);
+
+/**
+ * @brief      Check if the message is a wake word heard by the recording, it arrives whether recording or not
+ *
+ * @param[in]  sr    The Speech-to-Text context
+ * @param      msg   The message
+ *
+ * @return
+ *  - true
+ *  - false
+ */
+bool google_sr_check_event_wake(google_sr_handle_t sr, audio_event_iface_msg_t *msg);
+
+/**
+ * @brief      Check if speech was detected since `google_sr_start`
+ *
+ * @param[in]  sr    The Speech-to-Text context
+ *
+ * @return
+ *  - true
+ *  - false
+ */
+bool google_sr_speech_detected(google_sr_handle_t sr);
+
+/**
+ * @brief      Reset the token of Baidu ASR, the next recording uses it
+ *
+ *             The replaced token is freed on the following reset, so an upload still starting with it
+ *             never reads freed memory.
  *
- * @param[in]  sr    The ASR context
+ * @param[in]  sr     The ASR context
+ * @param[in]  token  The new token, it is copied
  *
  * @return
  *  - ESP_OK
  *  - ESP_FAIL
  */
-esp_err_t baidu_sr_reset_token(google_sr_handle_t sr);
+esp_err_t baidu_sr_reset_token(google_sr_handle_t sr, const char *token);
 
 #ifdef __cplusplus
 }
@@ -23,9 +23,13 @@
  */
 
 #include <string.h>
+#include <ctype.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "nvs_flash.h"
 #include "mbedtls/base64.h"
@@ -37,68 +41,543 @@
 #include "audio_event_iface.h"
 #include "audio_common.h"
 #include "audio_hal.h"
-#include "http_stream.h"
+#include "audio_mem.h"
+#include "raw_stream.h"
 #include "i2s_stream.h"
 #include "mp3_decoder.h"
 #include "google_tts.h"
+#include "pcm_resample.h"
+#include "pcm_agc.h"
+#include "http_conn.h"
+#include "jitter_buffer.h"
+#include "latency_trace.h"
+#include "tts_cache.h"
 #include "json_utils.h"
 
 static const char *TAG = "GOOGLE_TTS";
 
+#if CONFIG_MOCK_SERVER
+#define GOOGLE_TTS_ENDPOINT         CONFIG_MOCK_SERVER_URI "/text2audio"
+#else
 #define GOOGLE_TTS_ENDPOINT         "https://tsn.baidu.com/text2audio"
-#define GOOGLE_TTS_TEMPLATE         "lan=zh&cuid=ESP32&ctp=1&tok=%s&tex=%s"
+#endif
+// Everything but the token and the text, the parameters that change the audio are part of the cache key
+#define GOOGLE_TTS_PARAMS           "lan=zh&cuid=ESP32&ctp=1"
+// aue=4 and aue=5 are raw 16-bit mono PCM at 16 and 8 kHz, MP3 is the default
+#define GOOGLE_TTS_PARAMS_PCM_16K   GOOGLE_TTS_PARAMS "&aue=4"
+#define GOOGLE_TTS_PARAMS_PCM_8K    GOOGLE_TTS_PARAMS "&aue=5"
+#define GOOGLE_TTS_TEMPLATE         "%s&tok=%s&tex=%s"
+
+#define GOOGLE_TTS_TASK_STACK       (4 * 1024)
+#define GOOGLE_TTS_TASK_PRIO        (5)
+#define GOOGLE_TTS_READ_SIZE        (1024)
+#define GOOGLE_TTS_SENTENCE_MAX     (512)
+// Break at a comma only once the sentence is long enough, so short clauses are not spoken one by one
+#define GOOGLE_TTS_COMMA_SPLIT_LEN  (60)
+// The LLM task feeds the answer holding its result lock, a full sentence queue must not stall it.
+// Not measured yet, TRACE_TTS_QUEUE_FULL marks every wait that ran out
+#define GOOGLE_TTS_QUEUE_WAIT_MS    (20)
+#define GOOGLE_TTS_GENERATION_QUIT  (-1)
+// The decoder and I2S stream have no hooks, their first output is polled while an answer starts
+#define GOOGLE_TTS_TRACE_POLL_US    (5000)
+#define GOOGLE_TTS_REFERENCE_RB_SIZE (8 * 1024)
+#define GOOGLE_TTS_RESAMPLE_RB_SIZE (2 * 1024)
+// TTS voices are mastered hot, the playback gain mostly comes down and only lifts a quiet voice a little
+#define GOOGLE_TTS_AGC_MAX_GAIN_DB  (6)
+// Only short sentences such as greetings and prompts come back often enough to be cached
+#define GOOGLE_TTS_CACHE_TEXT_MAX   (48)
+#define GOOGLE_TTS_CACHE_PENDING    (4)
+// Downloaded audio is written to flash once the queue has been idle this long and nothing is played
+#define GOOGLE_TTS_CACHE_IDLE_MS    (200)
+// MP3 byte rate until one answer has been played, then measured, and the range the measure is trusted in
+#define GOOGLE_TTS_MP3_RATE         (2000)
+#define GOOGLE_TTS_MP3_RATE_MIN     (1000)
+#define GOOGLE_TTS_MP3_RATE_MAX     (8000)
+// Automatic PCM needs this many times its byte rate, and falls back to MP3 below the second one
+#define GOOGLE_TTS_PCM_ENTER        (2)
+#define GOOGLE_TTS_PCM_LEAVE_PCT    (125)
+
+/*
+ * Queued sentence, `text == NULL` marks the end of an answer
+ */
+typedef struct {
+    char                    *text;
+    int                     generation;
+} google_tts_item_t;
+
+/*
+ * Downloaded audio waiting to be written to the cache
+ */
+typedef struct {
+    uint64_t                key;
+    char                    *data;
+    int                     len;
+} google_tts_cache_item_t;
 
 typedef struct google_tts {
     audio_pipeline_handle_t pipeline;
     audio_element_handle_t  i2s_writer;
-    audio_element_handle_t  http_stream_reader;
+    audio_element_handle_t  raw_writer;
     audio_element_handle_t  mp3_decoder;
+    audio_element_handle_t  resample;           /*!< Playback rate to codec rate, NULL if they are the same */
+    audio_element_handle_t  agc;                /*!< Gain control and limiter, NULL if off */
+    ringbuf_handle_t        echo_reference;
+    audio_event_iface_handle_t listener;
+    google_tts_format_t     format;
+    const char              *pcm_params;        /*!< NULL if the playback rate has no PCM format */
+    const char              *params;            /*!< Of the answer being played */
+    bool                    pcm;                /*!< The decoder is left out of the pipeline */
     char                    *api_token;
+    char                    *retired_token;
     char                    *lang_code;
     int                     buffer_size;
     char                    *buffer;
-    char                    *text;
-    bool                    is_begin;
+    char                    *read_buffer;
+    char                    pending[GOOGLE_TTS_SENTENCE_MAX + 1];
+    int                     pending_len;
+    int                     pending_ready;      /*!< Whole sentences in front of `pending` the full queue did not take */
+    QueueHandle_t           sentence_queue;
+    SemaphoreHandle_t       task_exit;
+    volatile int            generation;
     int                     tts_total_read;
     int                     sample_rate;
-    int                     remain_len;
+    tts_cache_handle_t      cache;
+    char                    *cache_capture;
+    google_tts_cache_item_t cache_pending[GOOGLE_TTS_CACHE_PENDING];
+    int                     cache_pending_num;
+    volatile bool           cache_idle;         /*!< Set by `google_tts_flush_cache`, cleared by `google_tts_stop` */
+    jitter_buffer_t         jitter;             /*!< Sizes the MP3 held back before playback starts */
+    char                    *prebuffer;
+    int                     prebuffer_size;
+    int                     prebuffer_len;
+    bool                    prebuffering;
+    int                     mp3_rate;           /*!< MP3 bytes per second of audio */
+    int                     answer_generation;  /*!< Generation of the answer the task plays */
+    int                     answer_bytes;       /*!< MP3 of that answer written so far */
+    int64_t                 answer_i2s_pos;     /*!< I2S position when it started */
+    bool                    answer_pcm;
+#if CONFIG_LATENCY_TRACE
+    esp_timer_handle_t      trace_timer;
+    int64_t                 trace_i2s_pos;
+#endif
 } google_tts_t;
 
+/*
+ * Return the length of the first complete sentence in `text`, or -1 if there is none yet
+ */
+static int _tts_sentence_end(const char *text, int len)
+{
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        bool allow_comma = i >= GOOGLE_TTS_COMMA_SPLIT_LEN;
+        if (c == '!' || c == '?' || c == ';' || c == '\n' || (c == ',' && allow_comma)) {
+            return i + 1;
+        }
+        // Do not break decimals such as "3.14", wait for the next character instead
+        if (c == '.') {
+            if (i + 1 < len && !isalnum((unsigned char)text[i + 1])) {
+                return i + 1;
+            }
+            continue;
+        }
+        if (i + 2 >= len) {
+            continue;
+        }
+        unsigned char c1 = (unsigned char)text[i + 1];
+        unsigned char c2 = (unsigned char)text[i + 2];
+        if (c == 0xE3 && c1 == 0x80 && c2 == 0x82) {
+            return i + 3;   // 。
+        }
+        if (c == 0xE2 && c1 == 0x80 && c2 == 0xA6) {
+            return i + 3;   // …
+        }
+        if (c == 0xEF && c1 == 0xBC) {
+            if (c2 == 0x81 || c2 == 0x9F || c2 == 0x9B) {
+                return i + 3;   // ！？；
+            }
+            if (c2 == 0x8C && allow_comma) {
+                return i + 3;   // ，
+            }
+        }
+    }
+    return -1;
+}
 
-static esp_err_t _http_stream_reader_event_handle(http_stream_event_msg_t *msg)
+static void _tts_drop_pending(google_tts_t *tts, int len)
 {
-    esp_http_client_handle_t http = (esp_http_client_handle_t)msg->http_client;
-    google_tts_t *tts = (google_tts_t *)msg->user_data;
+    tts->pending_len -= len;
+    tts->pending_ready = 0;
+    memmove(tts->pending, tts->pending + len, tts->pending_len);
+    tts->pending[tts->pending_len] = 0;
+}
 
-    if (msg->event_id == HTTP_STREAM_PRE_REQUEST) {
-        // Post text data
-        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_PRE_REQUEST, length=%d", msg->buffer_len);
-        tts->tts_total_read = 0;
-        tts->is_begin = true;
-        int payload_len = snprintf(tts->buffer, tts->buffer_size, GOOGLE_TTS_TEMPLATE, tts->api_token, tts->text);
-        ESP_LOGW(TAG, "[ + ] HTTP client HTTP_STREAM_PRE_REQUEST, payload_len: %d, tts->buffer: %s", payload_len, tts->buffer);
-        esp_http_client_set_post_field(http, tts->buffer, payload_len);
-        esp_http_client_set_method(http, HTTP_METHOD_POST);
-        tts->remain_len = 0;
+/*
+ * Queue the first `len` bytes of pending text, waits only shortly for a full queue.
+ * Return false if the text is still pending, the caller merges it with the next sentence or drops it.
+ */
+static bool _tts_emit_pending(google_tts_t *tts, int len)
+{
+    bool is_blank = true;
+    for (int i = 0; i < len; i++) {
+        if (!isspace((unsigned char)tts->pending[i])) {
+            is_blank = false;
+            break;
+        }
+    }
+    if (!is_blank) {
+        google_tts_item_t item = {
+            .text = strndup(tts->pending, len),
+            .generation = tts->generation,
+        };
+        AUDIO_MEM_CHECK(TAG, item.text, return false);
+        if (xQueueSend(tts->sentence_queue, &item, pdMS_TO_TICKS(GOOGLE_TTS_QUEUE_WAIT_MS)) != pdTRUE) {
+            latency_trace_record(TRACE_TTS_QUEUE_FULL, len);
+            free(item.text);
+            return false;
+        }
+    }
+    _tts_drop_pending(tts, len);
+    return true;
+}
 
-        return ESP_OK;
+/*
+ * Queue the whole pending text, dropped if the queue stays full
+ */
+static void _tts_flush_pending(google_tts_t *tts)
+{
+    if (tts->pending_len > 0 && !_tts_emit_pending(tts, tts->pending_len)) {
+        ESP_LOGW(TAG, "Sentence queue full, %d bytes of text dropped", tts->pending_len);
+        _tts_drop_pending(tts, tts->pending_len);
     }
+}
 
-    if (msg->event_id == HTTP_STREAM_ON_RESPONSE) {
-        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_ON_RESPONSE, length=%d", msg->buffer_len);
+#if CONFIG_LATENCY_TRACE
+static void _tts_trace_poll(void *arg)
+{
+    google_tts_t *tts = (google_tts_t *)arg;
+    ringbuf_handle_t rb = audio_element_get_input_ringbuf(tts->i2s_writer);
+    if (rb && rb_bytes_filled(rb) > 0) {
+        latency_trace_first(TRACE_TTS_FIRST_MP3, rb_bytes_filled(rb));
+    }
+    audio_element_info_t info = { 0 };
+    audio_element_getinfo(tts->i2s_writer, &info);
+    if (info.byte_pos > tts->trace_i2s_pos) {
+        latency_trace_first(TRACE_TTS_FIRST_MP3, 0);
+        latency_trace_first(TRACE_TTS_FIRST_I2S, info.byte_pos - tts->trace_i2s_pos);
+        esp_timer_stop(tts->trace_timer);
     }
+}
+#endif
 
-    if (msg->event_id == HTTP_STREAM_POST_REQUEST) {
-        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_POST_REQUEST, write end chunked marker");
+static void _tts_cache_queue(google_tts_t *tts, uint64_t key, int len)
+{
+    for (int i = 0; i < tts->cache_pending_num; i++) {
+        if (tts->cache_pending[i].key == key) {
+            return;
+        }
+    }
+    if (tts->cache_pending_num == GOOGLE_TTS_CACHE_PENDING) {
+        ESP_LOGD(TAG, "Cache queue full, audio not stored");
+        return;
+    }
+    char *data = audio_malloc(len);
+    if (data == NULL) {
+        return;
     }
+    memcpy(data, tts->cache_capture, len);
+    tts->cache_pending[tts->cache_pending_num++] = (google_tts_cache_item_t) {
+        .key = key,
+        .data = data,
+        .len = len,
+    };
+}
 
-    if (msg->event_id == HTTP_STREAM_FINISH_REQUEST) {
-        ESP_LOGI(TAG, "[ + ] HTTP client HTTP_STREAM_FINISH_REQUEST, write end chunked marker");
+static void _tts_cache_idle(google_tts_t *tts)
+{
+    //* erasing flash stalls the cache, so nothing is written while an answer is played or a question recorded
+    if (!tts->cache_idle || audio_element_get_state(tts->i2s_writer) == AEL_STATE_RUNNING) {
+        return;
+    }
+    if (tts->cache_pending_num == 0) {
+        tts_cache_flush(tts->cache);
+        return;
     }
+    //* one store per idle period, a new sentence waits for one slot at most
+    google_tts_cache_item_t *item = &tts->cache_pending[0];
+    tts_cache_store(tts->cache, item->key, item->data, item->len);
+    audio_free(item->data);
+    tts->cache_pending_num--;
+    memmove(item, item + 1, tts->cache_pending_num * sizeof(google_tts_cache_item_t));
+}
 
+static int _tts_byte_rate(google_tts_t *tts)
+{
+    return tts->answer_pcm ? tts->sample_rate * sizeof(int16_t) : tts->mp3_rate;
+}
+
+/*
+ * Nothing left to play in front of the I2S driver, the decoder's own frame aside
+ */
+static bool _tts_playback_dry(google_tts_t *tts)
+{
+    ringbuf_handle_t mp3_rb = tts->answer_pcm ? NULL : audio_element_get_input_ringbuf(tts->mp3_decoder);
+    ringbuf_handle_t rs_rb = tts->resample ? audio_element_get_input_ringbuf(tts->resample) : NULL;
+    ringbuf_handle_t pcm_rb = audio_element_get_input_ringbuf(tts->i2s_writer);
+    return (mp3_rb == NULL || rb_bytes_filled(mp3_rb) == 0) && (rs_rb == NULL || rb_bytes_filled(rs_rb) == 0)
+           && (pcm_rb == NULL || rb_bytes_filled(pcm_rb) == 0);
+}
+
+static esp_err_t _tts_prebuffer_flush(google_tts_t *tts)
+{
+    int len = tts->prebuffer_len;
+    tts->prebuffer_len = 0;
+    tts->prebuffering = false;
+    if (len > 0 && raw_stream_write(tts->raw_writer, tts->prebuffer, len) < 0) {
+        return ESP_FAIL;
+    }
     return ESP_OK;
 }
 
+/*
+ * Hand MP3 to the decoder, after a gap it is held back until the jitter buffer target is reached
+ */
+static esp_err_t _tts_write_audio(google_tts_t *tts, char *data, int len)
+{
+    tts->answer_bytes += len;
+    if (tts->prebuffering) {
+        if (tts->prebuffer_len + len <= tts->prebuffer_size) {
+            memcpy(tts->prebuffer + tts->prebuffer_len, data, len);
+            tts->prebuffer_len += len;
+            if (tts->prebuffer_len < jitter_buffer_target_bytes(&tts->jitter, _tts_byte_rate(tts))) {
+                return ESP_OK;
+            }
+            return _tts_prebuffer_flush(tts);
+        }
+        if (_tts_prebuffer_flush(tts) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+    return raw_stream_write(tts->raw_writer, data, len) < 0 ? ESP_FAIL : ESP_OK;
+}
+
+/*
+ * One answer is one round of the jitter buffer, ended when the task starts on the next one.
+ * Its MP3 size over the PCM it played gives the byte rate the target is converted with.
+ */
+static void _tts_answer_begin(google_tts_t *tts, int generation)
+{
+    audio_element_info_t info = { 0 };
+    audio_element_getinfo(tts->i2s_writer, &info);
+    int64_t played = info.byte_pos - tts->answer_i2s_pos;
+    if (tts->answer_bytes > 0 && played > 0) {
+        int rate = (int64_t)tts->answer_bytes * tts->sample_rate * sizeof(int16_t) / played;
+        //* an answer cut by barge-in played less than it downloaded, such a round says little about the rate
+        if (!tts->answer_pcm && rate >= GOOGLE_TTS_MP3_RATE_MIN && rate <= GOOGLE_TTS_MP3_RATE_MAX) {
+            tts->mp3_rate = rate;
+        }
+        jitter_buffer_round_end(&tts->jitter, _tts_byte_rate(tts));
+    }
+    tts->answer_pcm = tts->pcm;
+    int size = jitter_buffer_target_bytes(&tts->jitter, _tts_byte_rate(tts));
+    size = size < GOOGLE_TTS_READ_SIZE ? GOOGLE_TTS_READ_SIZE : size;
+    if (size != tts->prebuffer_size) {
+        char *prebuffer = audio_realloc(tts->prebuffer, size);
+        if (prebuffer) {
+            tts->prebuffer = prebuffer;
+            tts->prebuffer_size = size;
+        }
+    }
+    tts->answer_generation = generation;
+    tts->answer_bytes = 0;
+    tts->answer_i2s_pos = info.byte_pos;
+}
+
+static esp_err_t _tts_play_cached(google_tts_t *tts, int slot, int len, int generation, int64_t start_us)
+{
+    ESP_LOGI(TAG, "[ + ] TTS cache hit, len: %d", len);
+    latency_trace_record(TRACE_TTS_CACHE_HIT, len);
+    for (int offset = 0; offset < len; offset += GOOGLE_TTS_READ_SIZE) {
+        if (generation != tts->generation) {
+            break;
+        }
+        int read_len = len - offset < GOOGLE_TTS_READ_SIZE ? len - offset : GOOGLE_TTS_READ_SIZE;
+        if (tts_cache_read(tts->cache, slot, offset, tts->read_buffer, read_len) != ESP_OK
+                || _tts_write_audio(tts, tts->read_buffer, read_len) != ESP_OK) {
+            return ESP_FAIL;
+        }
+        if (offset == 0) {
+            tts_cache_record(tts->cache, true, esp_timer_get_time() - start_us);
+        }
+        tts->tts_total_read += read_len;
+    }
+    //* flash keeps up with any playback, the sentence goes out whole even under the target
+    if (generation != tts->generation) {
+        tts->prebuffer_len = 0;
+        return ESP_OK;
+    }
+    return _tts_prebuffer_flush(tts);
+}
+
+static esp_err_t _tts_fetch_sentence(google_tts_t *tts, const char *text, int generation)
+{
+    int64_t start_us = esp_timer_get_time();
+    //* a sentence that starts on an empty decoder is a gap, the next one is held back up to the target
+    tts->prebuffering = _tts_playback_dry(tts);
+    tts->prebuffer_len = 0;
+    uint64_t cache_key = 0;
+    bool cacheable = tts->cache && strlen(text) <= GOOGLE_TTS_CACHE_TEXT_MAX;
+    if (cacheable) {
+        int len;
+        cache_key = tts_cache_key(tts->params, text);
+        int slot = tts_cache_lookup(tts->cache, cache_key, &len);
+        if (slot >= 0) {
+            return _tts_play_cached(tts, slot, len, generation, start_us);
+        }
+    }
+    int payload_len = snprintf(tts->buffer, tts->buffer_size, GOOGLE_TTS_TEMPLATE, tts->params, tts->api_token,
+                               text);
+    if (payload_len >= tts->buffer_size) {
+        ESP_LOGE(TAG, "Sentence too long for TTS buffer, payload_len=%d", payload_len);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "[ + ] TTS request, payload_len: %d, text: %s", payload_len, text);
+    latency_trace_record(TRACE_TTS_REQUEST, payload_len);
+
+    //* every sentence of an answer goes over the same kept connection
+    esp_http_client_handle_t http = http_conn_acquire(GOOGLE_TTS_ENDPOINT, portMAX_DELAY);
+    if (http == NULL) {
+        return ESP_FAIL;
+    }
+    esp_http_client_set_method(http, HTTP_METHOD_POST);
+    if (http_conn_request(http, tts->buffer, payload_len) != ESP_OK) {
+        http_conn_release(http, false);
+        return ESP_FAIL;
+    }
+    esp_err_t err = ESP_OK;
+    if (esp_http_client_get_status_code(http) != 200) {
+        ESP_LOGE(TAG, "TTS server status=%d", esp_http_client_get_status_code(http));
+        http_conn_release(http, false);
+        return ESP_FAIL;
+    }
+    int read_len;
+    // Bytes copied for the cache, -1 once the audio outgrew a slot
+    int captured = 0;
+    int sentence_bytes = 0;
+    int64_t read_us = esp_timer_get_time();
+    while ((read_len = esp_http_client_read(http, tts->read_buffer, GOOGLE_TTS_READ_SIZE)) > 0) {
+        // Only the read is timed, a write blocked on a full decoder says nothing about the network
+        jitter_buffer_measure(&tts->jitter, read_len, esp_timer_get_time() - read_us);
+        // Drop the rest of this sentence as soon as a new answer begins
+        if (generation != tts->generation) {
+            break;
+        }
+        if (cacheable && captured == 0) {
+            tts_cache_record(tts->cache, false, esp_timer_get_time() - start_us);
+        }
+        //* the server answers errors with status 200 and a JSON body, as PCM it would be played as noise
+        if (sentence_bytes == 0 && tts->read_buffer[0] == '{') {
+            ESP_LOGE(TAG, "TTS server error: %.*s", read_len, tts->read_buffer);
+            err = ESP_FAIL;
+            break;
+        }
+        if (sentence_bytes > 0 && !tts->prebuffering && _tts_playback_dry(tts)) {
+            ESP_LOGW(TAG, "Playback underrun after %d bytes of the sentence", sentence_bytes);
+            latency_trace_record(TRACE_TTS_UNDERRUN, sentence_bytes);
+            jitter_buffer_underrun(&tts->jitter);
+            tts->prebuffering = true;
+        }
+        if (_tts_write_audio(tts, tts->read_buffer, read_len) != ESP_OK) {
+            err = ESP_FAIL;
+            break;
+        }
+        sentence_bytes += read_len;
+        tts->tts_total_read += read_len;
+        if (cacheable && captured >= 0) {
+            if (captured + read_len > TTS_CACHE_SLOT_SIZE) {
+                captured = -1;
+            } else {
+                memcpy(tts->cache_capture + captured, tts->read_buffer, read_len);
+                captured += read_len;
+            }
+        }
+        read_us = esp_timer_get_time();
+    }
+    //* the end of a sentence is played even under the target, a stopped answer is dropped
+    if (generation != tts->generation) {
+        tts->prebuffer_len = 0;
+    } else if (_tts_prebuffer_flush(tts) != ESP_OK) {
+        err = ESP_FAIL;
+    }
+    bool complete = esp_http_client_is_complete_data_received(http);
+    //* the server answers errors with status 200 and a JSON body, only MP3 is kept
+    if (err == ESP_OK && complete && captured > 0 && tts->cache_capture[0] != '{' && generation == tts->generation) {
+        _tts_cache_queue(tts, cache_key, captured);
+    }
+    http_conn_release(http, complete);
+    return err;
+}
+
+static void _tts_task(void *pv)
+{
+    google_tts_t *tts = (google_tts_t *)pv;
+    google_tts_item_t item;
+    TickType_t wait = tts->cache ? pdMS_TO_TICKS(GOOGLE_TTS_CACHE_IDLE_MS) : portMAX_DELAY;
+    while (1) {
+        if (xQueueReceive(tts->sentence_queue, &item, wait) != pdTRUE) {
+            _tts_cache_idle(tts);
+            continue;
+        }
+        if (item.generation == GOOGLE_TTS_GENERATION_QUIT) {
+            break;
+        }
+        if (item.generation != tts->generation) {
+            free(item.text);
+            continue;
+        }
+        if (item.text == NULL) {
+            ESP_LOGI(TAG, "[ + ] TTS answer finished, total read=%d", tts->tts_total_read);
+            audio_element_set_ringbuf_done(tts->raw_writer);
+            if (tts->cache) {
+                tts_cache_log_stats(tts->cache);
+            }
+            continue;
+        }
+        if (item.generation != tts->answer_generation) {
+            _tts_answer_begin(tts, item.generation);
+        }
+        _tts_fetch_sentence(tts, item.text, item.generation);
+        free(item.text);
+    }
+    xSemaphoreGive(tts->task_exit);
+    vTaskDelete(NULL);
+}
+
+/*
+ * raw -> [mp3] -> [resample] -> i2s, PCM leaves the decoder out and the echo reference is not affected
+ */
+static void _tts_link(google_tts_t *tts, bool pcm, bool relink)
+{
+    const char *link_tag[5];
+    int link_num = 0;
+    link_tag[link_num++] = "tts_raw";
+    if (!pcm) {
+        link_tag[link_num++] = "tts_mp3";
+    }
+    if (tts->agc) {
+        link_tag[link_num++] = "tts_agc";
+    }
+    if (tts->resample) {
+        link_tag[link_num++] = "tts_resample";
+    }
+    link_tag[link_num++] = "tts_i2s";
+    if (relink) {
+        audio_pipeline_breakup_elements(tts->pipeline, NULL);
+        audio_pipeline_relink(tts->pipeline, &link_tag[0], link_num);
+    } else {
+        audio_pipeline_link(tts->pipeline, &link_tag[0], link_num);
+    }
+}
+
 google_tts_handle_t google_tts_init(google_tts_config_t *config)
 {
     audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
@@ -114,37 +593,126 @@ google_tts_handle_t google_tts_init(google_tts_config_t *config)
 
     tts->buffer = malloc(tts->buffer_size);
     AUDIO_MEM_CHECK(TAG, tts->buffer, goto exit_tts_init);
+    tts->read_buffer = malloc(GOOGLE_TTS_READ_SIZE);
+    AUDIO_MEM_CHECK(TAG, tts->read_buffer, goto exit_tts_init);
 
     tts->api_token = strdup(config->api_token);
     AUDIO_MEM_CHECK(TAG, tts->api_token, goto exit_tts_init);
 
     tts->sample_rate = config->playback_sample_rate;
+    tts->format = config->format;
+    if (tts->sample_rate == 16000) {
+        tts->pcm_params = GOOGLE_TTS_PARAMS_PCM_16K;
+    } else if (tts->sample_rate == 8000) {
+        tts->pcm_params = GOOGLE_TTS_PARAMS_PCM_8K;
+    } else if (tts->format != TTS_FORMAT_MP3) {
+        ESP_LOGW(TAG, "No PCM format at %d Hz, TTS uses MP3", tts->sample_rate);
+        tts->format = TTS_FORMAT_MP3;
+    }
+    tts->params = GOOGLE_TTS_PARAMS;
+    tts->mp3_rate = GOOGLE_TTS_MP3_RATE;
+    jitter_buffer_cfg_t jitter_cfg = DEFAULT_JITTER_BUFFER_CONFIG();
+    jitter_buffer_init(&tts->jitter, "playback", &jitter_cfg);
+
+    if (config->cache_partition) {
+        tts->cache = tts_cache_init(config->cache_partition);
+        if (tts->cache) {
+            tts->cache_capture = audio_malloc(TTS_CACHE_SLOT_SIZE);
+            AUDIO_MEM_CHECK(TAG, tts->cache_capture, goto exit_tts_init);
+        }
+    }
+
+    if (http_conn_init() != ESP_OK) {
+        goto exit_tts_init;
+    }
+#if CONFIG_LATENCY_TRACE
+    esp_timer_create_args_t timer_args = {
+        .callback = _tts_trace_poll,
+        .arg = tts,
+        .name = "tts_trace",
+    };
+    if (esp_timer_create(&timer_args, &tts->trace_timer) != ESP_OK) {
+        goto exit_tts_init;
+    }
+#endif
+
+    int queue_size = config->queue_size > 0 ? config->queue_size : DEFAULT_TTS_QUEUE_SIZE;
+    tts->sentence_queue = xQueueCreate(queue_size, sizeof(google_tts_item_t));
+    AUDIO_MEM_CHECK(TAG, tts->sentence_queue, goto exit_tts_init);
+    tts->task_exit = xSemaphoreCreateBinary();
+    AUDIO_MEM_CHECK(TAG, tts->task_exit, goto exit_tts_init);
 
     i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
     i2s_cfg.type = AUDIO_STREAM_WRITER;
+    i2s_cfg.task_core = config->audio_core;
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
     i2s_cfg.std_cfg.slot_cfg.slot_mode = I2S_SLOT_MODE_MONO;
     i2s_cfg.std_cfg.slot_cfg.slot_mask = I2S_STD_SLOT_LEFT;
 #else
     i2s_cfg.i2s_config.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT;
 #endif
+    //* the echo reference is taken at the playback rate, the rate of the recording
+    int codec_rate = config->codec_sample_rate > 0 ? config->codec_sample_rate : config->playback_sample_rate;
+    bool resample = codec_rate != config->playback_sample_rate;
+    if (config->echo_reference && !resample) {
+        i2s_cfg.multi_out_num = 1;
+    }
     tts->i2s_writer = i2s_stream_init(&i2s_cfg);
+    if (resample) {
+        pcm_resample_cfg_t resample_cfg = DEFAULT_PCM_RESAMPLE_CONFIG();
+        resample_cfg.src_rate = config->playback_sample_rate;
+        resample_cfg.dest_rate = codec_rate;
+        resample_cfg.multi_out_num = config->echo_reference ? 1 : 0;
+        resample_cfg.tap_input = true;
+        //* the reference leads the speaker by the ring in front of the I2S, keep it within the echo tail
+        resample_cfg.out_rb_size = GOOGLE_TTS_RESAMPLE_RB_SIZE;
+        resample_cfg.task_core = config->audio_core;
+        tts->resample = pcm_resample_init(&resample_cfg);
+        AUDIO_MEM_CHECK(TAG, tts->resample, goto exit_tts_init);
+    }
+    //* in front of the resampler, so the echo reference carries the gain too
+    if (config->agc_target_db < 0) {
+        pcm_agc_cfg_t agc_cfg = DEFAULT_PCM_AGC_CONFIG();
+        agc_cfg.sample_rate = config->playback_sample_rate;
+        agc_cfg.target_db = config->agc_target_db;
+        agc_cfg.max_gain_db = GOOGLE_TTS_AGC_MAX_GAIN_DB;
+        agc_cfg.task_core = config->audio_core;
+        tts->agc = pcm_agc_init(&agc_cfg);
+        AUDIO_MEM_CHECK(TAG, tts->agc, goto exit_tts_init);
+    }
+    if (config->echo_reference) {
+        tts->echo_reference = rb_create(GOOGLE_TTS_REFERENCE_RB_SIZE, 1);
+        AUDIO_MEM_CHECK(TAG, tts->echo_reference, goto exit_tts_init);
+        audio_element_set_multi_output_ringbuf(resample ? tts->resample : tts->i2s_writer, tts->echo_reference, 0);
+    }
 
-    http_stream_cfg_t http_cfg = HTTP_STREAM_CFG_DEFAULT();
-    http_cfg.type = AUDIO_STREAM_READER;
-    http_cfg.event_handle = _http_stream_reader_event_handle;
-    http_cfg.user_data = tts;
-    tts->http_stream_reader = http_stream_init(&http_cfg);
+    // The TTS task writes every sentence's MP3 into this stream in order
+    raw_stream_cfg_t raw_cfg = RAW_STREAM_CFG_DEFAULT();
+    raw_cfg.type = AUDIO_STREAM_WRITER;
+    tts->raw_writer = raw_stream_init(&raw_cfg);
 
     mp3_decoder_cfg_t mp3_cfg = DEFAULT_MP3_DECODER_CONFIG();
+    mp3_cfg.task_core = config->audio_core;
     tts->mp3_decoder = mp3_decoder_init(&mp3_cfg);
 
-    audio_pipeline_register(tts->pipeline, tts->http_stream_reader, "tts_http");
+    audio_pipeline_register(tts->pipeline, tts->raw_writer,         "tts_raw");
     audio_pipeline_register(tts->pipeline, tts->mp3_decoder,        "tts_mp3");
     audio_pipeline_register(tts->pipeline, tts->i2s_writer,         "tts_i2s");
-    const char *link_tag[3] = {"tts_http", "tts_mp3", "tts_i2s"};
-    audio_pipeline_link(tts->pipeline, &link_tag[0], 3);
-    i2s_stream_set_clk(tts->i2s_writer, config->playback_sample_rate, 16, 1);
+    if (tts->resample) {
+        audio_pipeline_register(tts->pipeline, tts->resample,       "tts_resample");
+    }
+    if (tts->agc) {
+        audio_pipeline_register(tts->pipeline, tts->agc,            "tts_agc");
+    }
+    _tts_link(tts, false, false);
+    i2s_stream_set_clk(tts->i2s_writer, codec_rate, 16, 1);
+    _tts_answer_begin(tts, tts->generation);
+
+    if (xTaskCreatePinnedToCore(_tts_task, "tts_task", GOOGLE_TTS_TASK_STACK, tts, GOOGLE_TTS_TASK_PRIO, NULL,
+                                config->net_core) != pdPASS) {
+        ESP_LOGE(TAG, "Error create TTS task");
+        goto exit_tts_init;
+    }
     return tts;
 exit_tts_init:
     google_tts_destroy(tts);
@@ -158,11 +726,46 @@ esp_err_t google_tts_destroy(google_tts_handle_t tts)
     }
     audio_pipeline_stop(tts->pipeline);
     audio_pipeline_wait_for_stop(tts->pipeline);
+    if (tts->task_exit) {
+        tts->generation++;
+        google_tts_item_t quit = {
+            .text = NULL,
+            .generation = GOOGLE_TTS_GENERATION_QUIT,
+        };
+        if (xQueueSend(tts->sentence_queue, &quit, portMAX_DELAY) == pdTRUE) {
+            xSemaphoreTake(tts->task_exit, portMAX_DELAY);
+        }
+        vSemaphoreDelete(tts->task_exit);
+    }
+    if (tts->sentence_queue) {
+        google_tts_item_t item;
+        while (xQueueReceive(tts->sentence_queue, &item, 0) == pdTRUE) {
+            free(item.text);
+        }
+        vQueueDelete(tts->sentence_queue);
+    }
+#if CONFIG_LATENCY_TRACE
+    if (tts->trace_timer) {
+        esp_timer_stop(tts->trace_timer);
+        esp_timer_delete(tts->trace_timer);
+    }
+#endif
     audio_pipeline_terminate(tts->pipeline);
     audio_pipeline_remove_listener(tts->pipeline);
     audio_pipeline_deinit(tts->pipeline);
+    if (tts->echo_reference) {
+        rb_destroy(tts->echo_reference);
+    }
+    for (int i = 0; i < tts->cache_pending_num; i++) {
+        audio_free(tts->cache_pending[i].data);
+    }
+    audio_free(tts->cache_capture);
+    audio_free(tts->prebuffer);
+    tts_cache_deinit(tts->cache);
     free(tts->buffer);
+    free(tts->read_buffer);
     free(tts->api_token);
+    free(tts->retired_token);
     free(tts);
     return ESP_OK;
 }
@@ -170,6 +773,7 @@ esp_err_t google_tts_destroy(google_tts_handle_t tts)
 esp_err_t google_tts_set_listener(google_tts_handle_t tts, audio_event_iface_handle_t listener)
 {
     if (listener) {
+        tts->listener = listener;
         audio_pipeline_set_listener(tts->pipeline, listener);
     }
     return ESP_OK;
@@ -185,23 +789,148 @@ bool google_tts_check_event_finish(google_tts_handle_t tts, audio_event_iface_ms
     return false;
 }
 
-esp_err_t google_tts_start(google_tts_handle_t tts, const char *text)
+/*
+ * Pick the format of the next answer, the pipeline is stopped
+ */
+static void _tts_select_format(google_tts_t *tts)
 {
-    free(tts->text);
-    tts->text = strdup(text);
-    if (tts->text == NULL) {
-        ESP_LOGE(TAG, "Error no mem");
-        return ESP_ERR_NO_MEM;
+    bool pcm = tts->format == TTS_FORMAT_PCM;
+    if (tts->format == TTS_FORMAT_AUTO) {
+        //* no measure yet means no evidence the link carries PCM
+        int64_t pcm_rate = tts->sample_rate * sizeof(int16_t);
+        int64_t throughput = tts->jitter.throughput;
+        pcm = tts->pcm ? throughput * 100 >= pcm_rate * GOOGLE_TTS_PCM_LEAVE_PCT
+                       : throughput >= pcm_rate * GOOGLE_TTS_PCM_ENTER;
+    }
+    tts->params = pcm ? tts->pcm_params : GOOGLE_TTS_PARAMS;
+    if (pcm == tts->pcm) {
+        return;
     }
+    ESP_LOGI(TAG, "TTS format %s, throughput %d B/s", pcm ? "PCM" : "MP3", tts->jitter.throughput);
+    _tts_link(tts, pcm, true);
+    if (tts->listener) {
+        audio_pipeline_set_listener(tts->pipeline, tts->listener);
+    }
+    tts->pcm = pcm;
+}
+
+esp_err_t google_tts_stream_begin(google_tts_handle_t tts)
+{
+    google_tts_stop(tts);
+    _tts_select_format(tts);
+    tts->pending_len = 0;
+    tts->pending_ready = 0;
+    tts->pending[0] = 0;
+    tts->tts_total_read = 0;
     audio_pipeline_reset_items_state(tts->pipeline);
     audio_pipeline_reset_ringbuffer(tts->pipeline);
-    audio_element_set_uri(tts->http_stream_reader, GOOGLE_TTS_ENDPOINT);
     audio_pipeline_run(tts->pipeline);
+#if CONFIG_LATENCY_TRACE
+    audio_element_info_t info = { 0 };
+    audio_element_getinfo(tts->i2s_writer, &info);
+    tts->trace_i2s_pos = info.byte_pos;
+    esp_timer_start_periodic(tts->trace_timer, GOOGLE_TTS_TRACE_POLL_US);
+#endif
+    return ESP_OK;
+}
+
+esp_err_t google_tts_stream_feed(google_tts_handle_t tts, const char *text)
+{
+    AUDIO_NULL_CHECK(TAG, text, return ESP_FAIL);
+    int remain = strlen(text);
+    while (remain > 0) {
+        int copy_len = GOOGLE_TTS_SENTENCE_MAX - tts->pending_len;
+        if (copy_len > remain) {
+            copy_len = remain;
+        } else {
+            // Keep whole UTF-8 characters in the pending buffer
+            while (copy_len > 0 && ((unsigned char)text[copy_len] & 0xC0) == 0x80) {
+                copy_len--;
+            }
+            if (copy_len == 0 && tts->pending_len == 0) {
+                copy_len = GOOGLE_TTS_SENTENCE_MAX;
+            }
+        }
+        memcpy(tts->pending + tts->pending_len, text, copy_len);
+        tts->pending_len += copy_len;
+        tts->pending[tts->pending_len] = 0;
+        text += copy_len;
+        remain -= copy_len;
+
+        int sentence_len;
+        while ((sentence_len = _tts_sentence_end(tts->pending + tts->pending_ready,
+                                                 tts->pending_len - tts->pending_ready)) > 0) {
+            int len = tts->pending_ready + sentence_len;
+            //* the queue is full, the sentence goes out together with the next one
+            if (!_tts_emit_pending(tts, len)) {
+                tts->pending_ready = len;
+            }
+        }
+        // No punctuation in a full buffer, speak it as it is
+        if (copy_len == 0 || tts->pending_len == GOOGLE_TTS_SENTENCE_MAX) {
+            _tts_flush_pending(tts);
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t google_tts_stream_end(google_tts_handle_t tts)
+{
+    _tts_flush_pending(tts);
+    google_tts_item_t item = {
+        .text = NULL,
+        .generation = tts->generation,
+    };
+    //* without the end the answer is stopped by the caller's TTS timeout
+    if (xQueueSend(tts->sentence_queue, &item, pdMS_TO_TICKS(GOOGLE_TTS_QUEUE_WAIT_MS)) != pdTRUE) {
+        ESP_LOGW(TAG, "Sentence queue full, end of the answer not queued");
+        return ESP_FAIL;
+    }
     return ESP_OK;
 }
 
+esp_err_t google_tts_start(google_tts_handle_t tts, const char *text)
+{
+    google_tts_stream_begin(tts);
+    if (google_tts_stream_feed(tts, text) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    return google_tts_stream_end(tts);
+}
+
+esp_err_t google_tts_prewarm(google_tts_handle_t tts)
+{
+    return http_conn_prewarm(GOOGLE_TTS_ENDPOINT);
+}
+
+esp_err_t google_tts_set_token(google_tts_handle_t tts, const char *token)
+{
+    char *new_token = strdup(token);
+    AUDIO_MEM_CHECK(TAG, new_token, return ESP_FAIL);
+    free(tts->retired_token);
+    tts->retired_token = tts->api_token;
+    tts->api_token = new_token;
+    return ESP_OK;
+}
+
+void google_tts_flush_cache(google_tts_handle_t tts)
+{
+    tts->cache_idle = true;
+}
+
+ringbuf_handle_t google_tts_get_echo_reference(google_tts_handle_t tts)
+{
+    return tts->echo_reference;
+}
+
 esp_err_t google_tts_stop(google_tts_handle_t tts)
 {
+    // Invalidate queued sentences and the one being downloaded
+    tts->generation++;
+    tts->cache_idle = false;
+#if CONFIG_LATENCY_TRACE
+    esp_timer_stop(tts->trace_timer);
+#endif
     audio_pipeline_stop(tts->pipeline);
     audio_pipeline_wait_for_stop(tts->pipeline);
     ESP_LOGD(TAG, "TTS Stopped");
@@ -27,20 +27,39 @@
 
 #include "esp_err.h"
 #include "audio_event_iface.h"
+#include "ringbuf.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define DEFAULT_TTS_BUFFER_SIZE (2048)
+#define DEFAULT_TTS_QUEUE_SIZE  (16)
 
 typedef struct google_tts* google_tts_handle_t;
 
+/**
+ * Audio format asked from the TTS server
+ */
+typedef enum {
+    TTS_FORMAT_AUTO = 0,        /*!< PCM while the measured throughput is well above its byte rate, else MP3 */
+    TTS_FORMAT_MP3,
+    TTS_FORMAT_PCM,             /*!< 16-bit mono at the playback rate, 16 or 8 kHz only */
+} google_tts_format_t;
+
 typedef struct {
     const char *api_token;
     const char *lang_code;
     int playback_sample_rate;
     int buffer_size;
+    int queue_size;             /*!< Max number of sentences waiting to be synthesized */
+    bool echo_reference;        /*!< Copy the played PCM into a ringbuffer, see `google_tts_get_echo_reference` */
+    const char *cache_partition; /*!< Label of a data partition keeping the audio of short sentences, NULL to disable */
+    int audio_core;             /*!< Core of the MP3 decoder and I2S tasks (0 or 1) */
+    int net_core;               /*!< Core of the task requesting the sentences (0 or 1) */
+    google_tts_format_t format; /*!< Audio format, chosen again for every answer with TTS_FORMAT_AUTO */
+    int codec_sample_rate;      /*!< Rate the I2S runs at, resampled from `playback_sample_rate`, 0 for the same */
+    int agc_target_db;          /*!< Level the gain control steers the answers to (dBFS), 0 for none */
 } google_tts_config_t;
 
 /**
@@ -65,6 +84,82 @@ google_tts_handle_t google_tts_init(google_tts_config_t *config);
  */
 esp_err_t google_tts_start(google_tts_handle_t tts, const char *text);
 
+/**
+ * @brief      Begin a streamed answer, stop current playback, drop queued sentences and restart the pipeline
+ *
+ * @param[in]  tts   The Text-to-Speech context
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t google_tts_stream_begin(google_tts_handle_t tts);
+
+/**
+ * @brief      Feed partial text of a streamed answer, every complete sentence is queued for synthesis
+ *             and played in order while the following sentences are still being requested
+ *
+ *             Never blocks for long: a sentence the full queue does not take is merged with the next one,
+ *             text that no longer fits is dropped
+ *
+ * @param[in]  tts   The Text-to-Speech context
+ * @param[in]  text  The partial text
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t google_tts_stream_feed(google_tts_handle_t tts, const char *text);
+
+/**
+ * @brief      End a streamed answer, queue the remaining text and finish the pipeline after the last sentence
+ *
+ * @param[in]  tts   The Text-to-Speech context
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL  The queue stayed full, the answer does not finish by itself
+ */
+esp_err_t google_tts_stream_end(google_tts_handle_t tts);
+
+/**
+ * @brief      Open the connection to the TTS server in the background,
+ *             so the first sentence of the next answer skips the TLS handshake
+ *
+ * @param[in]  tts   The Text-to-Speech context
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t google_tts_prewarm(google_tts_handle_t tts);
+
+/**
+ * @brief      Get the ringbuffer with a copy of the PCM handed to I2S, the reference of an echo canceller
+ *
+ *             The copy is written without waiting, it is dropped while nobody reads the ringbuffer.
+ *
+ * @param[in]  tts   The Text-to-Speech context
+ *
+ * @return     The ringbuffer, NULL if `echo_reference` was not set
+ */
+ringbuf_handle_t google_tts_get_echo_reference(google_tts_handle_t tts);
+
+/**
+ * @brief      Replace the access token, the next sentence is requested with it
+ *
+ *             The replaced token is freed on the following call, so a request still being
+ *             formatted with it never reads freed memory.
+ *
+ * @param[in]  tts    The Text-to-Speech context
+ * @param[in]  token  The new token, it is copied
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t google_tts_set_token(google_tts_handle_t tts, const char *token);
+
 /**
  * @brief      Stop playing audio from Google Cloud Text-to-Speech
  *
@@ -76,6 +171,15 @@ esp_err_t google_tts_start(google_tts_handle_t tts, const char *text);
  */
 esp_err_t google_tts_stop(google_tts_handle_t tts);
 
+/**
+ * @brief      Write the downloaded audio to the cache, call it while no audio is played or recorded
+ *
+ *             The audio is written in the background, one sentence at a time, until the next `google_tts_stop`.
+ *
+ * @param[in]  tts   The Text-to-Speech context
+ */
+void google_tts_flush_cache(google_tts_handle_t tts);
+
 /**
  * @brief      Register listener for the Text-to-Speech context
  *
@@ -0,0 +1,283 @@
+#include <string.h>
+#include <stdlib.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_error.h"
+#include "http_conn.h"
+
+static const char *TAG = "HTTP_CONN";
+
+#define HTTP_CONN_HOST_MAX          (64)
+#define HTTP_CONN_BUFFER_SIZE       (4 * 1024)
+#define HTTP_CONN_PREWARM_STACK     (6 * 1024)
+#define HTTP_CONN_PREWARM_PRIO      (3)
+#define HTTP_CONN_DRAIN_SIZE        (256)
+
+typedef struct {
+    char                        host[HTTP_CONN_HOST_MAX];
+    char                        *prewarm_url;
+    esp_http_client_handle_t    client;
+    SemaphoreHandle_t           lock;
+    bool                        connected;
+    bool                        reused;
+    int64_t                     idle_since;     /*!< esp_timer time the kept connection was last given back */
+} http_conn_t;
+
+static http_conn_t http_conns[HTTP_CONN_MAX_HOSTS];
+static SemaphoreHandle_t table_lock;
+static QueueHandle_t prewarm_queue;
+
+/*
+ * "https://host:port/path?query" -> "https://host:port"
+ */
+static int _http_conn_origin(const char *url, char *origin, int size)
+{
+    const char *p = strstr(url, "://");
+    p = p ? p + 3 : url;
+    int len = strcspn(p, "/?#") + (p - url);
+    if (len >= size) {
+        return -1;
+    }
+    memcpy(origin, url, len);
+    origin[len] = 0;
+    return len;
+}
+
+static http_conn_t *_http_conn_get(const char *url)
+{
+    char origin[HTTP_CONN_HOST_MAX];
+    if (_http_conn_origin(url, origin, sizeof(origin)) < 0) {
+        ESP_LOGE(TAG, "Host too long in url %s", url);
+        return NULL;
+    }
+    http_conn_t *conn = NULL;
+    xSemaphoreTake(table_lock, portMAX_DELAY);
+    for (int i = 0; i < HTTP_CONN_MAX_HOSTS; i++) {
+        if (http_conns[i].client && strcmp(http_conns[i].host, origin) == 0) {
+            conn = &http_conns[i];
+            break;
+        }
+    }
+    for (int i = 0; conn == NULL && i < HTTP_CONN_MAX_HOSTS; i++) {
+        if (http_conns[i].client) {
+            continue;
+        }
+        esp_http_client_config_t config = {
+            .url = url,
+            .buffer_size = HTTP_CONN_BUFFER_SIZE,
+            .timeout_ms = HTTP_CONN_TIMEOUT_MS,
+            .keep_alive_enable = true,
+        };
+        http_conns[i].lock = xSemaphoreCreateMutex();
+        AUDIO_MEM_CHECK(TAG, http_conns[i].lock, break);
+        http_conns[i].client = esp_http_client_init(&config);
+        if (http_conns[i].client == NULL) {
+            ESP_LOGE(TAG, "Error init client for %s", origin);
+            vSemaphoreDelete(http_conns[i].lock);
+            http_conns[i].lock = NULL;
+            break;
+        }
+        strcpy(http_conns[i].host, origin);
+        conn = &http_conns[i];
+        ESP_LOGI(TAG, "New shared client for %s", origin);
+    }
+    xSemaphoreGive(table_lock);
+    if (conn == NULL) {
+        ESP_LOGE(TAG, "No free connection slot for %s", origin);
+    }
+    return conn;
+}
+
+static http_conn_t *_http_conn_find_client(esp_http_client_handle_t client)
+{
+    for (int i = 0; i < HTTP_CONN_MAX_HOSTS; i++) {
+        if (http_conns[i].client == client) {
+            return &http_conns[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * A kept connection idle past CONFIG_HTTP_CONN_IDLE_MS, the server may have closed it
+ */
+static bool _http_conn_stale(http_conn_t *conn)
+{
+    return conn->connected && esp_timer_get_time() - conn->idle_since > CONFIG_HTTP_CONN_IDLE_MS * 1000LL;
+}
+
+/*
+ * Close a stale connection before it is used, called with the connection's lock held
+ */
+static void _http_conn_expire(http_conn_t *conn)
+{
+    if (_http_conn_stale(conn)) {
+        ESP_LOGI(TAG, "Kept connection to %s idle for %d ms, reconnecting", conn->host,
+                 (int)((esp_timer_get_time() - conn->idle_since) / 1000));
+        esp_http_client_close(conn->client);
+        conn->connected = false;
+    }
+}
+
+static void _http_conn_prewarm_task(void *pv)
+{
+    http_conn_t *conn;
+    char *drain = malloc(HTTP_CONN_DRAIN_SIZE);
+    AUDIO_MEM_CHECK(TAG, drain, vTaskDelete(NULL));
+    while (xQueueReceive(prewarm_queue, &conn, portMAX_DELAY) == pdTRUE) {
+        //* busy means somebody is already using the connection
+        if (xSemaphoreTake(conn->lock, 0) != pdTRUE) {
+            continue;
+        }
+        _http_conn_expire(conn);
+        if (conn->connected) {
+            xSemaphoreGive(conn->lock);
+            continue;
+        }
+        esp_http_client_handle_t client = conn->client;
+        int64_t start = esp_timer_get_time();
+        esp_http_client_set_url(client, conn->prewarm_url);
+        esp_http_client_set_method(client, HTTP_METHOD_GET);
+        bool keep_alive = false;
+        if (esp_http_client_open(client, 0) == ESP_OK && esp_http_client_fetch_headers(client) >= 0) {
+            //* the answer does not matter, read it off so the connection can carry the next request
+            while (esp_http_client_read(client, drain, HTTP_CONN_DRAIN_SIZE) > 0);
+            keep_alive = esp_http_client_is_complete_data_received(client);
+        }
+        ESP_LOGI(TAG, "Prewarm %s %s in %d ms", conn->host, keep_alive ? "done" : "failed",
+                 (int)((esp_timer_get_time() - start) / 1000));
+        http_conn_release(client, keep_alive);
+    }
+    free(drain);
+    vTaskDelete(NULL);
+}
+
+esp_err_t http_conn_init(void)
+{
+    if (table_lock) {
+        return ESP_OK;
+    }
+    table_lock = xSemaphoreCreateMutex();
+    AUDIO_MEM_CHECK(TAG, table_lock, return ESP_FAIL);
+    prewarm_queue = xQueueCreate(HTTP_CONN_MAX_HOSTS, sizeof(http_conn_t *));
+    AUDIO_MEM_CHECK(TAG, prewarm_queue, return ESP_FAIL);
+    if (xTaskCreatePinnedToCore(_http_conn_prewarm_task, "http_prewarm", HTTP_CONN_PREWARM_STACK, NULL,
+                                HTTP_CONN_PREWARM_PRIO, NULL, CONFIG_NET_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Error create prewarm task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_http_client_handle_t http_conn_acquire(const char *url, TickType_t ticks_to_wait)
+{
+    AUDIO_NULL_CHECK(TAG, table_lock, return NULL);
+    http_conn_t *conn = _http_conn_get(url);
+    if (conn == NULL) {
+        return NULL;
+    }
+    if (xSemaphoreTake(conn->lock, ticks_to_wait) != pdTRUE) {
+        ESP_LOGW(TAG, "Timeout waiting for %s", conn->host);
+        return NULL;
+    }
+    _http_conn_expire(conn);
+    //* same origin, esp_http_client keeps the socket open across set_url
+    esp_http_client_set_url(conn->client, url);
+    conn->reused = conn->connected;
+    return conn->client;
+}
+
+void http_conn_release(esp_http_client_handle_t client, bool keep_alive)
+{
+    http_conn_t *conn = _http_conn_find_client(client);
+    AUDIO_NULL_CHECK(TAG, conn, return);
+    if (!keep_alive) {
+        esp_http_client_close(client);
+    }
+    conn->connected = keep_alive;
+    conn->idle_since = esp_timer_get_time();
+    xSemaphoreGive(conn->lock);
+}
+
+typedef struct {
+    const char  *data;
+    int         len;
+} http_conn_body_t;
+
+static esp_err_t _http_conn_write_body(esp_http_client_handle_t client, void *user_data)
+{
+    http_conn_body_t *body = (http_conn_body_t *)user_data;
+    return esp_http_client_write(client, body->data, body->len) == body->len ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t http_conn_request(esp_http_client_handle_t client, const char *body, int len)
+{
+    http_conn_body_t data = {
+        .data = body,
+        .len = len,
+    };
+    return http_conn_request_stream(client, len, _http_conn_write_body, &data);
+}
+
+esp_err_t http_conn_request_stream(esp_http_client_handle_t client, int len, http_conn_body_cb_t write_body, void *user_data)
+{
+    http_conn_t *conn = _http_conn_find_client(client);
+    AUDIO_NULL_CHECK(TAG, conn, return ESP_FAIL);
+    while (1) {
+        //* the server only acts on a request it got in full
+        bool sent = false;
+        bool answered = false;
+        int64_t fetch_start = 0;
+        esp_err_t err = esp_http_client_open(client, len);
+        if (err == ESP_OK && len > 0 && write_body(client, user_data) != ESP_OK) {
+            err = ESP_FAIL;
+        }
+        if (err == ESP_OK) {
+            sent = true;
+            fetch_start = esp_timer_get_time();
+            if (esp_http_client_fetch_headers(client) < 0) {
+                err = ESP_FAIL;
+            }
+            //* the status code is cleared by the fetch and set by the status line
+            answered = esp_http_client_get_status_code(client) > 0;
+        }
+        if (err == ESP_OK && answered) {
+            return ESP_OK;
+        }
+        esp_http_client_close(client);
+        conn->connected = false;
+        //* writes to a socket the server closed while idle go through, the close only shows as an EOF or a reset
+        //* right at the header fetch. That is retried once on a fresh connection. Anything else that may have
+        //* reached the server, an answer cut off or a server that timed out, is not sent again, a POST is not idempotent.
+        bool stale = sent && !answered && esp_timer_get_time() - fetch_start < HTTP_CONN_TIMEOUT_MS * 1000LL / 2;
+        if (!conn->reused || (sent && !stale)) {
+            ESP_LOGE(TAG, "Request to %s failed: %s", conn->host, esp_err_to_name(err));
+            return ESP_FAIL;
+        }
+        ESP_LOGW(TAG, "Kept connection to %s is gone, reconnecting", conn->host);
+        conn->reused = false;
+    }
+}
+
+esp_err_t http_conn_prewarm(const char *url)
+{
+    AUDIO_NULL_CHECK(TAG, table_lock, return ESP_FAIL);
+    http_conn_t *conn = _http_conn_get(url);
+    if (conn == NULL) {
+        return ESP_FAIL;
+    }
+    if (conn->prewarm_url == NULL) {
+        conn->prewarm_url = strdup(url);
+        AUDIO_MEM_CHECK(TAG, conn->prewarm_url, return ESP_FAIL);
+    }
+    //* a stale connection is opened again, the next request would close it anyway
+    if (conn->connected && !_http_conn_stale(conn)) {
+        return ESP_OK;
+    }
+    return xQueueSend(prewarm_queue, &conn, 0) == pdTRUE ? ESP_OK : ESP_FAIL;
+}
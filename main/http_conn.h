@@ -0,0 +1,97 @@
+#ifndef _HTTP_CONN_H_
+#define _HTTP_CONN_H_
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_client.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HTTP_CONN_MAX_HOSTS     (4)
+#define HTTP_CONN_TIMEOUT_MS    (10000)
+
+/**
+ * @brief      Writes the request body with esp_http_client_write, may be called twice when a kept connection is retried
+ */
+typedef esp_err_t (*http_conn_body_cb_t)(esp_http_client_handle_t client, void *user_data);
+
+/**
+ * @brief      Initialize the shared connection manager, keeps one keep-alive client per host
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t http_conn_init(void);
+
+/**
+ * @brief      Take the shared client of the url's host and point it to `url`,
+ *             an open connection to the same host is reused without a new TLS handshake
+ *             unless it has been idle for longer than CONFIG_HTTP_CONN_IDLE_MS
+ *
+ * @param[in]  url            The request url
+ * @param[in]  ticks_to_wait  Time to wait while another task uses the client
+ *
+ * @return     The client, NULL on timeout or error
+ */
+esp_http_client_handle_t http_conn_acquire(const char *url, TickType_t ticks_to_wait);
+
+/**
+ * @brief      Give the client back, the connection is kept for the next request when
+ *             `keep_alive` is true, i.e. the whole response has been read
+ *
+ * @param[in]  client      The client
+ * @param[in]  keep_alive  Keep the connection open
+ */
+void http_conn_release(esp_http_client_handle_t client, bool keep_alive);
+
+/**
+ * @brief      Send the request with `body` and fetch the response headers,
+ *             a kept connection the server has closed meanwhile is retried once on a fresh one
+ *             when it broke before the whole body went out or ended right away without a status line,
+ *             a request the server may have answered is never sent twice
+ *
+ * @param[in]  client  The client from `http_conn_acquire`
+ * @param[in]  body    The request body, NULL if `len` is 0
+ * @param[in]  len     The body length
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t http_conn_request(esp_http_client_handle_t client, const char *body, int len);
+
+/**
+ * @brief      Same as `http_conn_request`, the body is produced by `write_body` in pieces
+ *
+ * @param[in]  client      The client from `http_conn_acquire`
+ * @param[in]  len         The exact body length
+ * @param[in]  write_body  Writes `len` bytes
+ * @param      user_data   The user data passed to `write_body`
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t http_conn_request_stream(esp_http_client_handle_t client, int len, http_conn_body_cb_t write_body, void *user_data);
+
+/**
+ * @brief      Open the connection to the url's host in the background so the next request skips the handshake,
+ *             a connection idle for longer than CONFIG_HTTP_CONN_IDLE_MS is opened again
+ *
+ * @param[in]  url   Any url on the host
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t http_conn_prewarm(const char *url);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
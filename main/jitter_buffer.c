@@ -0,0 +1,76 @@
+#include <string.h>
+#include "esp_log.h"
+#include "jitter_buffer.h"
+
+static const char *TAG = "JITTER_BUFFER";
+
+// Transfers shorter than this say more about the scheduler than about the network
+#define JITTER_BUFFER_MEASURE_MIN_US    (1000)
+
+void jitter_buffer_init(jitter_buffer_t *jb, const char *name, const jitter_buffer_cfg_t *config)
+{
+    memset(jb, 0, sizeof(jitter_buffer_t));
+    jb->cfg = *config;
+    jb->name = name;
+    jb->target_ms = config->min_ms;
+}
+
+void jitter_buffer_measure(jitter_buffer_t *jb, int bytes, int64_t us)
+{
+    if (bytes <= 0 || us < JITTER_BUFFER_MEASURE_MIN_US) {
+        return;
+    }
+    int rate = (int)((int64_t)bytes * 1000000 / us);
+    //* moving average over the last few transfers, follows a Wi-Fi drop within a second
+    jb->throughput = jb->throughput ? (jb->throughput * 7 + rate) / 8 : rate;
+}
+
+void jitter_buffer_underrun(jitter_buffer_t *jb)
+{
+    jb->underruns++;
+    jb->glitched = true;
+}
+
+void jitter_buffer_overrun(jitter_buffer_t *jb)
+{
+    jb->overruns++;
+    jb->glitched = true;
+}
+
+int jitter_buffer_round_end(jitter_buffer_t *jb, int bytes_per_s)
+{
+    //* a network slower than the audio falls behind all round long, buffer the deficit of a whole round
+    int need_ms = jb->cfg.min_ms;
+    if (jb->throughput > 0 && jb->throughput < bytes_per_s) {
+        need_ms = (int)((int64_t)jb->cfg.horizon_ms * (bytes_per_s - jb->throughput) / bytes_per_s);
+    }
+    int target_ms = jb->target_ms;
+    if (jb->glitched) {
+        target_ms += jb->cfg.step_ms;
+        jb->clean_rounds = 0;
+    } else if (++jb->clean_rounds >= jb->cfg.shrink_after) {
+        target_ms -= jb->cfg.step_ms / 2;
+        jb->clean_rounds = 0;
+    }
+    if (target_ms < need_ms) {
+        target_ms = need_ms;
+    }
+    if (target_ms < jb->cfg.min_ms) {
+        target_ms = jb->cfg.min_ms;
+    }
+    if (target_ms > jb->cfg.max_ms) {
+        target_ms = jb->cfg.max_ms;
+    }
+    if (target_ms != jb->target_ms) {
+        ESP_LOGI(TAG, "%s: %d -> %d ms, throughput %d B/s for %d B/s of audio, %d underruns, %d overruns",
+                 jb->name, jb->target_ms, target_ms, jb->throughput, bytes_per_s, jb->underruns, jb->overruns);
+    }
+    jb->target_ms = target_ms;
+    jb->glitched = false;
+    return target_ms;
+}
+
+int jitter_buffer_target_bytes(const jitter_buffer_t *jb, int bytes_per_s)
+{
+    return (int)((int64_t)jb->target_ms * bytes_per_s / 1000);
+}
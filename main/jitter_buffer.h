@@ -0,0 +1,99 @@
+#ifndef _JITTER_BUFFER_H_
+#define _JITTER_BUFFER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JITTER_BUFFER_MIN_MS        (200)
+#define JITTER_BUFFER_MAX_MS        (2000)
+#define JITTER_BUFFER_STEP_MS       (200)
+// Rounds without a glitch before the buffer shrinks by half a step
+#define JITTER_BUFFER_SHRINK_AFTER  (3)
+// Length of a round the throughput deficit is covered for, about one spoken sentence or question
+#define JITTER_BUFFER_HORIZON_MS    (4000)
+
+typedef struct {
+    int min_ms;
+    int max_ms;
+    int step_ms;                /*!< Growth after a round with a glitch */
+    int shrink_after;           /*!< Clean rounds before shrinking */
+    int horizon_ms;             /*!< Round length the throughput deficit is buffered for */
+} jitter_buffer_cfg_t;
+
+#define DEFAULT_JITTER_BUFFER_CONFIG() {                \
+    .min_ms             = JITTER_BUFFER_MIN_MS,         \
+    .max_ms             = JITTER_BUFFER_MAX_MS,         \
+    .step_ms            = JITTER_BUFFER_STEP_MS,        \
+    .shrink_after       = JITTER_BUFFER_SHRINK_AFTER,   \
+    .horizon_ms         = JITTER_BUFFER_HORIZON_MS,     \
+}
+
+/**
+ * Sizing of a buffer between the network and the audio, in ms of audio
+ *
+ * The network throughput is measured on every transfer. After each round the target grows if audio was
+ * lost or the network fell behind the audio rate, and shrinks slowly while rounds go clean.
+ */
+typedef struct {
+    jitter_buffer_cfg_t cfg;
+    const char      *name;
+    int             target_ms;
+    int             throughput;     /*!< Recent network throughput in bytes per second, 0 before the first measure */
+    int             underruns;      /*!< Since init */
+    int             overruns;
+    bool            glitched;       /*!< Underrun or overrun in this round */
+    int             clean_rounds;
+} jitter_buffer_t;
+
+/**
+ * @brief      Initialize the sizing, the target starts at `min_ms`
+ *
+ * @param      jb      The jitter buffer
+ * @param[in]  name    Name in the logs
+ * @param[in]  config  The configuration
+ */
+void jitter_buffer_init(jitter_buffer_t *jb, const char *name, const jitter_buffer_cfg_t *config);
+
+/**
+ * @brief      Add a transfer to the throughput measure
+ *
+ * @param      jb     The jitter buffer
+ * @param[in]  bytes  Bytes written or read
+ * @param[in]  us     Time the transfer took
+ */
+void jitter_buffer_measure(jitter_buffer_t *jb, int bytes, int64_t us);
+
+/**
+ * @brief      Count a playback that ran dry
+ */
+void jitter_buffer_underrun(jitter_buffer_t *jb);
+
+/**
+ * @brief      Count audio dropped because the buffer was full
+ */
+void jitter_buffer_overrun(jitter_buffer_t *jb);
+
+/**
+ * @brief      Adapt the target at the end of a round
+ *
+ * @param      jb            The jitter buffer
+ * @param[in]  bytes_per_s   Byte rate of the audio on the network side
+ *
+ * @return     The new target in ms
+ */
+int jitter_buffer_round_end(jitter_buffer_t *jb, int bytes_per_s);
+
+/**
+ * @brief      The target in bytes of a stream at `bytes_per_s`
+ */
+int jitter_buffer_target_bytes(const jitter_buffer_t *jb, int bytes_per_s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "latency_trace.h"
+
+#if CONFIG_LATENCY_TRACE
+
+static const char *TAG = "LATENCY_TRACE";
+
+#define TRACE_RING_SIZE     (CONFIG_LATENCY_TRACE_RING_SIZE)
+
+/*
+ * `seq` is written last, a reader that sees `seq` change while copying drops the record
+ */
+typedef struct {
+    uint32_t    seq;
+    uint16_t    round;
+    uint8_t     event;
+    int32_t     bytes;
+    int64_t     time_us;
+} latency_trace_record_t;
+
+typedef struct {
+    uint8_t     stage;
+    const char  *name;
+} latency_trace_point_t;
+
+static const char *trace_stage_names[TRACE_STAGE_MAX] = {
+    [TRACE_STAGE_MAIN] = "main",
+    [TRACE_STAGE_SR]   = "sr",
+    [TRACE_STAGE_LLM]  = "llm",
+    [TRACE_STAGE_TTS]  = "tts",
+};
+
+static const latency_trace_point_t trace_points[TRACE_EVENT_MAX] = {
+    [TRACE_BUTTON_PRESS]     = { TRACE_STAGE_MAIN, "button_press" },
+    [TRACE_BUTTON_RELEASE]   = { TRACE_STAGE_MAIN, "button_release" },
+    [TRACE_SR_FIRST_FRAME]   = { TRACE_STAGE_SR,   "first_i2s_frame" },
+    [TRACE_SR_SPEECH_END]    = { TRACE_STAGE_SR,   "speech_end" },
+    [TRACE_SR_FIRST_CHUNK]   = { TRACE_STAGE_SR,   "first_upload_chunk" },
+    [TRACE_SR_LAST_CHUNK]    = { TRACE_STAGE_SR,   "last_upload_chunk" },
+    [TRACE_SR_RESULT]        = { TRACE_STAGE_SR,   "asr_response" },
+    [TRACE_SR_PARTIAL]       = { TRACE_STAGE_SR,   "asr_first_partial" },
+    [TRACE_LLM_SPECULATE]    = { TRACE_STAGE_LLM,  "llm_speculate" },
+    [TRACE_LLM_REQUEST]      = { TRACE_STAGE_LLM,  "llm_request" },
+    [TRACE_LLM_FIRST_BYTE]   = { TRACE_STAGE_LLM,  "llm_first_byte" },
+    [TRACE_LLM_FIRST_RESULT] = { TRACE_STAGE_LLM,  "llm_first_result" },
+    [TRACE_LLM_LAST_RESULT]  = { TRACE_STAGE_LLM,  "llm_last_result" },
+    [TRACE_LLM_CACHE_HIT]    = { TRACE_STAGE_LLM,  "llm_cache_hit" },
+    [TRACE_TTS_REQUEST]      = { TRACE_STAGE_TTS,  "tts_request" },
+    [TRACE_TTS_CACHE_HIT]    = { TRACE_STAGE_TTS,  "tts_cache_hit" },
+    [TRACE_TTS_FIRST_MP3]    = { TRACE_STAGE_TTS,  "first_mp3_decoded" },
+    [TRACE_TTS_FIRST_I2S]    = { TRACE_STAGE_TTS,  "first_i2s_write" },
+    [TRACE_BARGE_IN]         = { TRACE_STAGE_MAIN, "barge_in" },
+    [TRACE_SR_OVERRUN]       = { TRACE_STAGE_SR,   "upload_overrun" },
+    [TRACE_TTS_UNDERRUN]     = { TRACE_STAGE_TTS,  "playback_underrun" },
+    [TRACE_WAKE_WORD]        = { TRACE_STAGE_MAIN, "wake_word" },
+    [TRACE_STAGE_TIMEOUT]    = { TRACE_STAGE_MAIN, "stage_timeout" },
+    [TRACE_TTS_QUEUE_FULL]   = { TRACE_STAGE_TTS,  "tts_queue_full" },
+};
+
+static latency_trace_record_t trace_ring[TRACE_RING_SIZE];
+static uint32_t trace_head;
+static uint32_t trace_round;
+static uint32_t trace_first_mask;
+
+void latency_trace_round_begin(void)
+{
+    __atomic_fetch_add(&trace_round, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace_first_mask, 0, __ATOMIC_RELEASE);
+}
+
+void latency_trace_record(latency_trace_event_t event, int bytes)
+{
+    if (event >= TRACE_EVENT_MAX) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    uint32_t seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    latency_trace_record_t *rec = &trace_ring[seq % TRACE_RING_SIZE];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    rec->round = __atomic_load_n(&trace_round, __ATOMIC_RELAXED);
+    rec->event = event;
+    rec->bytes = bytes;
+    rec->time_us = now;
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void latency_trace_first(latency_trace_event_t event, int bytes)
+{
+    uint32_t bit = 1u << event;
+    if (__atomic_fetch_or(&trace_first_mask, bit, __ATOMIC_ACQ_REL) & bit) {
+        return;
+    }
+    latency_trace_record(event, bytes);
+}
+
+/*
+ * Copy the record with sequence `seq`, false if it has been overwritten or is being written
+ */
+static bool _trace_read(uint32_t seq, latency_trace_record_t *out)
+{
+    latency_trace_record_t *rec = &trace_ring[seq % TRACE_RING_SIZE];
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != seq + 1) {
+        return false;
+    }
+    memcpy(out, rec, sizeof(*out));
+    return __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) == seq + 1;
+}
+
+static uint32_t _trace_oldest(uint32_t head)
+{
+    return head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+}
+
+void latency_trace_dump(void)
+{
+    uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    latency_trace_record_t rec;
+    int round = -1;
+    int64_t round_start = 0, last = 0;
+    ESP_LOGI(TAG, "%-5s %-5s %-20s %10s %10s %8s", "round", "stage", "event", "t(ms)", "delta(ms)", "bytes");
+    for (uint32_t seq = _trace_oldest(head); seq < head; seq++) {
+        if (!_trace_read(seq, &rec)) {
+            continue;
+        }
+        if (rec.round != round) {
+            round = rec.round;
+            round_start = rec.time_us;
+            last = rec.time_us;
+        }
+        const latency_trace_point_t *point = &trace_points[rec.event];
+        ESP_LOGI(TAG, "%-5d %-5s %-20s %10.1f %10.1f %8d", round, trace_stage_names[point->stage], point->name,
+                 (rec.time_us - round_start) / 1000.0f, (rec.time_us - last) / 1000.0f, rec.bytes);
+        last = rec.time_us;
+    }
+}
+
+static void _trace_chrome_round(FILE *out, bool *first, int round, int64_t start, int64_t end)
+{
+    fprintf(out, "%s\n{\"name\":\"round %d\",\"cat\":\"main\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}",
+            *first ? "" : ",", round, TRACE_STAGE_MAIN, (long long)start, (long long)(end - start));
+    *first = false;
+}
+
+void latency_trace_export_chrome(FILE *out)
+{
+    uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    latency_trace_record_t rec;
+    bool first = true;
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (int stage = 0; stage < TRACE_STAGE_MAX; stage++) {
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",", stage, trace_stage_names[stage]);
+        first = false;
+    }
+    //* one span per round trip on the main row, instant events for every trace point
+    int round = -1;
+    int64_t round_start = 0, round_end = 0;
+    for (uint32_t seq = _trace_oldest(head); seq < head; seq++) {
+        if (!_trace_read(seq, &rec)) {
+            continue;
+        }
+        if (rec.round != round) {
+            if (round >= 0) {
+                _trace_chrome_round(out, &first, round, round_start, round_end);
+            }
+            round = rec.round;
+            round_start = rec.time_us;
+        }
+        round_end = rec.time_us;
+        const latency_trace_point_t *point = &trace_points[rec.event];
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%lld,"
+                "\"args\":{\"round\":%d,\"bytes\":%d}}",
+                point->name, trace_stage_names[point->stage], point->stage, (long long)rec.time_us, round, rec.bytes);
+    }
+    if (round >= 0) {
+        _trace_chrome_round(out, &first, round, round_start, round_end);
+    }
+    fprintf(out, "\n]}\n");
+    fflush(out);
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef _LATENCY_TRACE_H_
+#define _LATENCY_TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Stages of a voice round trip, a Chrome trace shows one row per stage
+ */
+typedef enum {
+    TRACE_STAGE_MAIN = 0,
+    TRACE_STAGE_SR,
+    TRACE_STAGE_LLM,
+    TRACE_STAGE_TTS,
+    TRACE_STAGE_MAX,
+} latency_trace_stage_t;
+
+/**
+ * Trace points, see `latency_trace.c` for the stage each one belongs to
+ */
+typedef enum {
+    TRACE_BUTTON_PRESS = 0,
+    TRACE_BUTTON_RELEASE,
+    TRACE_SR_FIRST_FRAME,           /*!< First captured frame reached the VAD */
+    TRACE_SR_SPEECH_END,            /*!< Recording stopped by the end of speech detection */
+    TRACE_SR_FIRST_CHUNK,           /*!< First upload chunk written */
+    TRACE_SR_LAST_CHUNK,            /*!< Upload finished, bytes is the audio size */
+    TRACE_SR_RESULT,                /*!< ASR response read */
+    TRACE_SR_PARTIAL,               /*!< First partial hypothesis of the streaming recognition */
+    TRACE_LLM_SPECULATE,            /*!< Question asked from a stable partial hypothesis, bytes is its size */
+    TRACE_LLM_REQUEST,              /*!< Question sent, response headers received */
+    TRACE_LLM_FIRST_BYTE,
+    TRACE_LLM_FIRST_RESULT,
+    TRACE_LLM_LAST_RESULT,
+    TRACE_LLM_CACHE_HIT,            /*!< Answer taken from the answer cache instead, bytes is the answer size */
+    TRACE_TTS_REQUEST,              /*!< One per sentence, bytes is the request size */
+    TRACE_TTS_CACHE_HIT,            /*!< Sentence played from the flash cache instead, bytes is the audio size */
+    TRACE_TTS_FIRST_MP3,            /*!< First decoded PCM handed to I2S */
+    TRACE_TTS_FIRST_I2S,            /*!< First bytes written to the I2S driver */
+    TRACE_BARGE_IN,                 /*!< Speech onset while an answer was playing, starts a round trip */
+    TRACE_SR_OVERRUN,               /*!< Upload fell a whole capture ring behind, bytes is the audio lost */
+    TRACE_TTS_UNDERRUN,             /*!< Playback ran dry in the middle of a sentence */
+    TRACE_WAKE_WORD,                /*!< Wake word heard, starts a round trip like the button */
+    TRACE_STAGE_TIMEOUT,            /*!< A stage ran past its deadline and was given up, bytes is the stage */
+    TRACE_TTS_QUEUE_FULL,           /*!< The sentence queue stayed full for the feed's wait, bytes is the pending text */
+    TRACE_EVENT_MAX,
+} latency_trace_event_t;
+
+#if CONFIG_LATENCY_TRACE
+
+/**
+ * @brief      Start a new round trip, the `latency_trace_first` points are armed again
+ */
+void latency_trace_round_begin(void);
+
+/**
+ * @brief      Record a trace point, safe to call from any task
+ *
+ * @param[in]  event  The trace point
+ * @param[in]  bytes  Bytes related to the event, 0 if none
+ */
+void latency_trace_record(latency_trace_event_t event, int bytes);
+
+/**
+ * @brief      Record a trace point only the first time it is hit in the current round trip
+ *
+ * @param[in]  event  The trace point
+ * @param[in]  bytes  Bytes related to the event, 0 if none
+ */
+void latency_trace_first(latency_trace_event_t event, int bytes);
+
+/**
+ * @brief      Log the records in the ring, times are relative to the start of each round trip
+ */
+void latency_trace_dump(void);
+
+/**
+ * @brief      Write the records in the ring as Chrome trace JSON (chrome://tracing, Perfetto)
+ *
+ * @param      out   The output stream, e.g. stdout
+ */
+void latency_trace_export_chrome(FILE *out);
+
+#else
+
+static inline void latency_trace_round_begin(void) {}
+static inline void latency_trace_record(latency_trace_event_t event, int bytes) {}
+static inline void latency_trace_first(latency_trace_event_t event, int bytes) {}
+static inline void latency_trace_dump(void) {}
+static inline void latency_trace_export_chrome(FILE *out) {}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
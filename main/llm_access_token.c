@@ -25,66 +25,89 @@
 #include <string.h>
 #include <stdlib.h>
 #include "esp_http_client.h"
+#include "sdkconfig.h"
 #include "json_utils.h"
 #include "esp_log.h"
 #include "audio_error.h"
+#include "audio_mem.h"
+#include "http_conn.h"
 
 #define BAIDU_URI_LENGTH (200)
+#define BAIDU_AUTH_RESPONSE_MAX (2 * 1024)
 // "https://openapi.baidu.com/oauth/2.0/token?grant_type=client_credentials"
+#if CONFIG_MOCK_SERVER
+#define BAIDU_AUTH_ENDPOINT CONFIG_MOCK_SERVER_URI "/oauth/2.0/token?grant_type=client_credentials"
+#else
 #define BAIDU_AUTH_ENDPOINT "https://aip.baidubce.com/oauth/2.0/token?grant_type=client_credentials"
+#endif
 
 static const char *TAG = "BAIDU_AUTH";
 
-char *llm_get_access_token(const char *access_key, const char *access_secret)
+esp_err_t llm_fetch_access_token(const char *access_key, const char *access_secret, char **token, int *expires_in)
 {
-    char *token = NULL;
+    esp_err_t err = ESP_FAIL;
+    bool keep_alive = false;
+    char *data = NULL;
     char *url = calloc(1, BAIDU_URI_LENGTH);
 
-    AUDIO_MEM_CHECK(TAG, url, return NULL);
+    AUDIO_MEM_CHECK(TAG, url, return ESP_ERR_NO_MEM);
 
     snprintf(url, BAIDU_URI_LENGTH, BAIDU_AUTH_ENDPOINT"&client_id=%s&client_secret=%s", access_key, access_secret);
 
-    esp_http_client_config_t config = {
-        .url = url,
-    };
-    esp_http_client_handle_t http_client = esp_http_client_init(&config);
-    AUDIO_MEM_CHECK(TAG, http_client, return NULL);
+    //* same host as the LLM, the connection is kept for the first question
+    http_conn_init();
+    esp_http_client_handle_t http_client = http_conn_acquire(url, portMAX_DELAY);
+    AUDIO_NULL_CHECK(TAG, http_client, goto _exit);
+    esp_http_client_set_method(http_client, HTTP_METHOD_GET);
 
-    if (esp_http_client_open(http_client, 0) != ESP_OK) {
+    if (http_conn_request(http_client, NULL, 0) != ESP_OK) {
         ESP_LOGE(TAG, "Error open http request to baidu auth server");
         goto _exit;
     }
-    esp_http_client_fetch_headers(http_client);
-    int max_len = 5 * 1024;
-    char *data = malloc(max_len);
-
+    //* the scope list makes the response about 1K, it is only parsed once, so it goes to PSRAM
+    data = audio_malloc(BAIDU_AUTH_RESPONSE_MAX);
     AUDIO_MEM_CHECK(TAG, data, goto _exit);
 
-    int read_index = 0, total_len = 0;
-    while (1) {
-        int read_len = esp_http_client_read(http_client, data + read_index, max_len - read_index);
+    int read_index = 0;
+    while (read_index < BAIDU_AUTH_RESPONSE_MAX - 1) {
+        int read_len = esp_http_client_read(http_client, data + read_index, BAIDU_AUTH_RESPONSE_MAX - 1 - read_index);
         if (read_len <= 0) {
             break;
         }
         read_index += read_len;
-        total_len += read_len;
-        data[read_index] = 0;
     }
-    if (total_len <= 0) {
+    data[read_index] = 0;
+    keep_alive = esp_http_client_is_complete_data_received(http_client);
+    if (read_index <= 0) {
         ESP_LOGE(TAG, "Invalid length of the response");
-        free(data);
         goto _exit;
     }
     // Remove unexpect characters
     ESP_LOGD(TAG, "Data=%s", data);
-    token = json_get_token_value(data, "access_token");
-    free(data);
-    if (token) {
-        ESP_LOGI(TAG, "Access token=%s", token);
+    *token = json_get_token_value(data, "access_token");
+    if (*token == NULL) {
+        ESP_LOGE(TAG, "No access token in the response");
+        goto _exit;
+    }
+    ESP_LOGI(TAG, "Access token=%s", *token);
+    if (expires_in) {
+        char *expires = json_get_token_value(data, "expires_in");
+        *expires_in = expires ? atoi(expires) : 0;
+        free(expires);
     }
+    err = ESP_OK;
 _exit:
+    audio_free(data);
     free(url);
-    esp_http_client_close(http_client);
-    esp_http_client_cleanup(http_client);
+    if (http_client) {
+        http_conn_release(http_client, keep_alive);
+    }
+    return err;
+}
+
+char *llm_get_access_token(const char *access_key, const char *access_secret)
+{
+    char *token = NULL;
+    llm_fetch_access_token(access_key, access_secret, &token, NULL);
     return token;
-}
\ No newline at end of file
+}
@@ -25,6 +25,8 @@
 #ifndef _LLM_ACCESS_TOKEN
 #define _LLM_ACCESS_TOKEN
 
+#include "esp_err.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -39,6 +41,20 @@ extern "C" {
  */
 char *llm_get_access_token(const char *access_key, const char *access_secret);
 
+/**
+ * @brief      Get baidu access token and its lifetime
+ *
+ * @param[in]  access_key     The access key
+ * @param[in]  access_secret  The access secret
+ * @param[out] token          Access token response from baidu, need to freed after used
+ * @param[out] expires_in     Seconds the token is valid, 0 if unknown, may be NULL
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t llm_fetch_access_token(const char *access_key, const char *access_secret, char **token, int *expires_in);
+
 
 #ifdef __cplusplus
 }
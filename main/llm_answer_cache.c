@@ -0,0 +1,327 @@
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <time.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "audio_mem.h"
+#include "llm_answer_cache.h"
+
+static const char *TAG = "LLM_ANSWER_CACHE";
+
+#define LLM_ANSWER_CACHE_MAGIC  (0x4C4C4D41)    // "LLMA"
+#define LLM_FNV_OFFSET          (0xcbf29ce484222325ULL)
+#define LLM_FNV_PRIME           (0x100000001b3ULL)
+// Before SNTP has set the clock time() counts from 1970, stamps of that time mean nothing after a reboot
+#define LLM_CLOCK_VALID_AFTER   (1704067200)    // 2024-01-01
+
+/*
+ * Written after the question and answer, a slot cut by a power loss has none
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t stored_at;     /*!< Wall clock in seconds */
+    uint64_t key;
+    uint16_t question_len;
+    uint16_t answer_len;
+    uint32_t reserved;
+} llm_answer_header_t;
+
+#define LLM_ANSWER_HEADER   ((int)sizeof(llm_answer_header_t))
+
+typedef struct llm_answer_cache
+{
+    const esp_partition_t *partition;
+    int slots;
+    int ttl_s;
+    llm_answer_header_t index[LLM_ANSWER_CACHE_MAX_SLOTS];  /*!< `magic == 0` marks a free slot */
+    llm_answer_cache_stats_t stats;
+} llm_answer_cache_t;
+
+static uint64_t llm_answer_key(const char *question)
+{
+    uint64_t hash = LLM_FNV_OFFSET;
+    for (const char *p = question; *p; p++)
+    {
+        hash = (hash ^ (uint8_t)*p) * LLM_FNV_PRIME;
+    }
+    return hash;
+}
+
+static bool llm_answer_clock(uint32_t *now)
+{
+    time_t t = time(NULL);
+    *now = (uint32_t)t;
+    return t > LLM_CLOCK_VALID_AFTER;
+}
+
+static bool llm_answer_expired(llm_answer_cache_t *cache, const llm_answer_header_t *entry, uint32_t now)
+{
+    //* a stamp from the future means the clock was wrong when it was stored
+    return now < entry->stored_at || now - entry->stored_at > cache->ttl_s;
+}
+
+llm_answer_cache_handle_t llm_answer_cache_init(const char *partition_label, int ttl_s)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if (partition == NULL)
+    {
+        ESP_LOGW(TAG, "No partition %s, answer cache disabled", partition_label);
+        return NULL;
+    }
+    llm_answer_cache_t *cache = audio_calloc(1, sizeof(llm_answer_cache_t));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->partition = partition;
+    cache->ttl_s = ttl_s;
+    cache->slots = partition->size / LLM_ANSWER_CACHE_SLOT_SIZE;
+    if (cache->slots > LLM_ANSWER_CACHE_MAX_SLOTS)
+    {
+        cache->slots = LLM_ANSWER_CACHE_MAX_SLOTS;
+    }
+    int used = 0;
+    for (int i = 0; i < cache->slots; i++)
+    {
+        llm_answer_header_t *entry = &cache->index[i];
+        if (esp_partition_read(partition, i * LLM_ANSWER_CACHE_SLOT_SIZE, entry, LLM_ANSWER_HEADER) != ESP_OK
+            || entry->magic != LLM_ANSWER_CACHE_MAGIC
+            || LLM_ANSWER_HEADER + entry->question_len + entry->answer_len > LLM_ANSWER_CACHE_SLOT_SIZE)
+        {
+            memset(entry, 0, LLM_ANSWER_HEADER);
+            continue;
+        }
+        used++;
+    }
+    ESP_LOGI(TAG, "Answer cache %s, %d of %d slots used, TTL %d s", partition_label, used, cache->slots, ttl_s);
+    return cache;
+}
+
+void llm_answer_cache_deinit(llm_answer_cache_handle_t cache)
+{
+    audio_free(cache);
+}
+
+/*
+ * Decode one UTF-8 character, a broken sequence is taken byte by byte
+ */
+static int llm_utf8_decode(const unsigned char *s, uint32_t *cp)
+{
+    if (s[0] < 0x80)
+    {
+        *cp = s[0];
+        return 1;
+    }
+    if ((s[0] & 0xE0) == 0xC0 && (s[1] & 0xC0) == 0x80)
+    {
+        *cp = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+        return 2;
+    }
+    if ((s[0] & 0xF0) == 0xE0 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80)
+    {
+        *cp = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        return 3;
+    }
+    *cp = 0;
+    return 1;
+}
+
+static bool llm_is_cjk_punct(uint32_t cp)
+{
+    return (cp >= 0x3000 && cp <= 0x303F)      // CJK symbols and punctuation, 、。「」《》 and the ideographic space
+           || (cp >= 0x2010 && cp <= 0x2027)   // dashes, quotes, …
+           || cp == 0x00B7 || cp == 0xFF5E;    // · ～
+}
+
+int llm_answer_cache_normalize(const char *text, char *out, int size)
+{
+    const unsigned char *s = (const unsigned char *)text;
+    int len = 0;
+    bool space = false;
+    while (*s)
+    {
+        uint32_t cp;
+        int n = llm_utf8_decode(s, &cp);
+        //* full-width ASCII, ＡＢＣ１２３ and ！？，
+        if (cp >= 0xFF01 && cp <= 0xFF5D)
+        {
+            cp -= 0xFEE0;
+        }
+        if (cp != 0 && cp < 0x80 && !isalnum(cp))
+        {
+            //* punctuation is dropped, a space only separates words
+            space = space || cp == ' ' || cp == '\t' || cp == '\n' || cp == '\r';
+            s += n;
+            continue;
+        }
+        if (llm_is_cjk_punct(cp))
+        {
+            space = space || cp == 0x3000;
+            s += n;
+            continue;
+        }
+        bool ascii = cp != 0 && cp < 0x80;
+        //* a space only matters between two words of Latin letters or digits, "今天 天气" is "今天天气"
+        bool separate = space && ascii && len > 0 && ((unsigned char)out[len - 1] < 0x80);
+        if (len + (ascii ? 1 : n) + separate >= size)
+        {
+            return -1;
+        }
+        if (separate)
+        {
+            out[len++] = ' ';
+        }
+        space = false;
+        if (ascii)
+        {
+            out[len++] = tolower(cp);
+        }
+        else
+        {
+            memcpy(out + len, s, n);
+            len += n;
+        }
+        s += n;
+    }
+    out[len] = 0;
+    return len;
+}
+
+int llm_answer_cache_lookup(llm_answer_cache_handle_t cache, const char *question, int *answer_len)
+{
+    uint32_t now;
+    if (!llm_answer_clock(&now))
+    {
+        ESP_LOGD(TAG, "Clock not set, answer cache skipped");
+        return -1;
+    }
+    cache->stats.lookups++;
+    uint64_t key = llm_answer_key(question);
+    int question_len = strlen(question);
+    bool expired = false;
+    for (int i = 0; i < cache->slots; i++)
+    {
+        llm_answer_header_t *entry = &cache->index[i];
+        if (entry->magic == 0 || entry->key != key || entry->question_len != question_len)
+        {
+            continue;
+        }
+        if (llm_answer_expired(cache, entry, now))
+        {
+            expired = true;
+            continue;
+        }
+        //* the hash only picks the slot, the stored question decides
+        char stored[LLM_ANSWER_CACHE_QUESTION_MAX];
+        if (question_len >= sizeof(stored)
+            || esp_partition_read(cache->partition, i * LLM_ANSWER_CACHE_SLOT_SIZE + LLM_ANSWER_HEADER,
+                                  stored, question_len) != ESP_OK
+            || memcmp(stored, question, question_len) != 0)
+        {
+            continue;
+        }
+        cache->stats.hits++;
+        *answer_len = entry->answer_len;
+        return i;
+    }
+    cache->stats.expired += expired ? 1 : 0;
+    return -1;
+}
+
+esp_err_t llm_answer_cache_read(llm_answer_cache_handle_t cache, int slot, char *answer)
+{
+    if (slot < 0 || slot >= cache->slots || cache->index[slot].magic == 0)
+    {
+        return ESP_FAIL;
+    }
+    llm_answer_header_t *entry = &cache->index[slot];
+    return esp_partition_read(cache->partition,
+                              slot * LLM_ANSWER_CACHE_SLOT_SIZE + LLM_ANSWER_HEADER + entry->question_len,
+                              answer, entry->answer_len);
+}
+
+esp_err_t llm_answer_cache_store(llm_answer_cache_handle_t cache, const char *question, const char *answer, int len)
+{
+    int question_len = strlen(question);
+    if (question_len == 0 || question_len >= LLM_ANSWER_CACHE_QUESTION_MAX || len <= 0
+        || LLM_ANSWER_HEADER + question_len + len > LLM_ANSWER_CACHE_SLOT_SIZE)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint32_t now;
+    if (!llm_answer_clock(&now))
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    uint64_t key = llm_answer_key(question);
+    //* the slot of the same question, else a free or expired slot, else the oldest answer
+    int slot = -1, spare = -1, oldest = 0;
+    for (int i = 0; i < cache->slots; i++)
+    {
+        llm_answer_header_t *entry = &cache->index[i];
+        if (entry->magic && entry->key == key && entry->question_len == question_len)
+        {
+            slot = i;
+            break;
+        }
+        if (entry->magic == 0 || llm_answer_expired(cache, entry, now))
+        {
+            spare = spare < 0 ? i : spare;
+        }
+        else if (entry->stored_at < cache->index[oldest].stored_at)
+        {
+            oldest = i;
+        }
+    }
+    if (slot < 0)
+    {
+        slot = spare >= 0 ? spare : oldest;
+    }
+    llm_answer_header_t header = {
+        .magic = LLM_ANSWER_CACHE_MAGIC,
+        .stored_at = now,
+        .key = key,
+        .question_len = question_len,
+        .answer_len = len,
+    };
+    size_t address = slot * LLM_ANSWER_CACHE_SLOT_SIZE;
+    memset(&cache->index[slot], 0, LLM_ANSWER_HEADER);
+    if (esp_partition_erase_range(cache->partition, address, LLM_ANSWER_CACHE_SLOT_SIZE) != ESP_OK
+        || esp_partition_write(cache->partition, address + LLM_ANSWER_HEADER, question, question_len) != ESP_OK
+        || esp_partition_write(cache->partition, address + LLM_ANSWER_HEADER + question_len, answer, len) != ESP_OK
+        || esp_partition_write(cache->partition, address, &header, LLM_ANSWER_HEADER) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to write slot %d", slot);
+        return ESP_FAIL;
+    }
+    cache->index[slot] = header;
+    cache->stats.stores++;
+    ESP_LOGI(TAG, "Stored answer of \"%s\" in slot %d, %d bytes", question, slot, len);
+    return ESP_OK;
+}
+
+void llm_answer_cache_record_miss(llm_answer_cache_handle_t cache, int64_t answer_us)
+{
+    cache->stats.misses_timed++;
+    cache->stats.miss_us += answer_us;
+}
+
+void llm_answer_cache_get_stats(llm_answer_cache_handle_t cache, llm_answer_cache_stats_t *stats)
+{
+    *stats = cache->stats;
+}
+
+void llm_answer_cache_log_stats(llm_answer_cache_handle_t cache)
+{
+    llm_answer_cache_stats_t *s = &cache->stats;
+    if (s->lookups == 0)
+    {
+        return;
+    }
+    int64_t avg_ms = s->misses_timed ? s->miss_us / s->misses_timed / 1000 : 0;
+    ESP_LOGI(TAG, "hits %d/%d (%d%%), expired %d, stores %d, saved %d round trips, about %lld ms",
+             s->hits, s->lookups, s->hits * 100 / s->lookups, s->expired, s->stores, s->hits, (long long)(s->hits * avg_ms));
+}
@@ -0,0 +1,108 @@
+#ifndef _LLM_ANSWER_CACHE_H_
+#define _LLM_ANSWER_CACHE_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#define LLM_ANSWER_CACHE_SLOT_SIZE      (4 * 1024)
+#define LLM_ANSWER_CACHE_MAX_SLOTS      (64)
+// Long questions hardly ever come back word for word
+#define LLM_ANSWER_CACHE_QUESTION_MAX   (128)
+
+typedef struct llm_answer_cache *llm_answer_cache_handle_t;
+
+/*
+ * @brief      Counters since boot
+ */
+typedef struct
+{
+    int lookups;
+    int hits;
+    int expired;        /*!< Lookups that found the question past its TTL */
+    int stores;
+    int misses_timed;   /*!< Answers from the server counted in `miss_us` */
+    int64_t miss_us;    /*!< Time of those answers from the request to the last result */
+} llm_answer_cache_stats_t;
+
+/*
+ * @brief      Open the cache in a data partition, the slot headers are read into an index in RAM
+ *
+ *             Every slot is one flash sector with a normalized question and its answer,
+ *             stamped with the wall clock, so the TTL also holds across reboots.
+ *
+ * @param[in]  partition_label  The label of the partition
+ * @param[in]  ttl_s            Seconds an answer stays valid
+ *
+ * @return     The cache, NULL if the partition is missing
+ */
+llm_answer_cache_handle_t llm_answer_cache_init(const char *partition_label, int ttl_s);
+
+/*
+ * @brief      Release the cache
+ */
+void llm_answer_cache_deinit(llm_answer_cache_handle_t cache);
+
+/*
+ * @brief      Normalize recognized text into a cache key, so "今天天气？" and " 今天 天气" are the same question
+ *
+ *             ASCII and CJK punctuation are removed, full-width letters and digits are folded to ASCII,
+ *             ASCII is lowercased and whitespace is kept only between two Latin words.
+ *
+ * @param[in]  text  The recognized text
+ * @param[out] out   The normalized text, NUL terminated
+ * @param[in]  size  Size of `out`
+ *
+ * @return     Length of the normalized text, -1 if it does not fit
+ */
+int llm_answer_cache_normalize(const char *text, char *out, int size);
+
+/*
+ * @brief      Find the answer of a normalized question
+ *
+ * @param      cache       The cache
+ * @param[in]  question    The normalized question
+ * @param[out] answer_len  Length of the answer
+ *
+ * @return     The slot to read the answer from, -1 on a miss, on an expired answer
+ *             or while the wall clock is not set yet
+ */
+int llm_answer_cache_lookup(llm_answer_cache_handle_t cache, const char *question, int *answer_len);
+
+/*
+ * @brief      Read the answer of a slot found by `llm_answer_cache_lookup`, `answer` takes `answer_len` bytes
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_FAIL
+ */
+esp_err_t llm_answer_cache_read(llm_answer_cache_handle_t cache, int slot, char *answer);
+
+/*
+ * @brief      Store the answer of a normalized question, an expired or else the oldest answer is replaced
+ *
+ *             Erasing a flash sector stalls the caller, call it while no audio is played.
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_ERR_INVALID_SIZE  Question and answer do not fit in a slot
+ *     - ESP_ERR_INVALID_STATE The wall clock is not set yet
+ *     - ESP_FAIL
+ */
+esp_err_t llm_answer_cache_store(llm_answer_cache_handle_t cache, const char *question, const char *answer, int len);
+
+/*
+ * @brief      Count an answer that came from the server, its time is what a hit saves
+ */
+void llm_answer_cache_record_miss(llm_answer_cache_handle_t cache, int64_t answer_us);
+
+/*
+ * @brief      Get the counters
+ */
+void llm_answer_cache_get_stats(llm_answer_cache_handle_t cache, llm_answer_cache_stats_t *stats);
+
+/*
+ * @brief      Log the hit rate and the round trips saved
+ */
+void llm_answer_cache_log_stats(llm_answer_cache_handle_t cache);
+
+#endif
@@ -0,0 +1,105 @@
+#include <string.h>
+#include "esp_log.h"
+#include "audio_mem.h"
+#include "llm_arena.h"
+
+static const char *TAG = "LLM_ARENA";
+
+struct llm_arena_block
+{
+    llm_arena_block_t *next;
+    int size;
+    int used;
+    char data[];
+};
+
+static llm_arena_block_t *llm_arena_block_new(llm_arena_t *arena, int size)
+{
+    if (arena->total_size + size > arena->max_size)
+    {
+        return NULL;
+    }
+    llm_arena_block_t *block = audio_malloc(sizeof(llm_arena_block_t) + size);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    arena->total_size += size;
+    return block;
+}
+
+esp_err_t llm_arena_init(llm_arena_t *arena, int block_size, int max_size)
+{
+    memset(arena, 0, sizeof(llm_arena_t));
+    arena->block_size = block_size;
+    arena->max_size = max_size < block_size ? block_size : max_size;
+    arena->first = llm_arena_block_new(arena, block_size);
+    if (arena->first == NULL)
+    {
+        ESP_LOGE(TAG, "No memory for the first block");
+        return ESP_ERR_NO_MEM;
+    }
+    arena->current = arena->first;
+    return ESP_OK;
+}
+
+void llm_arena_deinit(llm_arena_t *arena)
+{
+    llm_arena_block_t *block = arena->first;
+    while (block)
+    {
+        llm_arena_block_t *next = block->next;
+        audio_free(block);
+        block = next;
+    }
+    memset(arena, 0, sizeof(llm_arena_t));
+}
+
+void llm_arena_reset(llm_arena_t *arena)
+{
+    if (arena->first == NULL)
+    {
+        return;
+    }
+    llm_arena_block_t *block = arena->first->next;
+    while (block)
+    {
+        llm_arena_block_t *next = block->next;
+        audio_free(block);
+        block = next;
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+    arena->total_size = arena->first->size;
+}
+
+char *llm_arena_strndup(llm_arena_t *arena, const char *str, int len)
+{
+    if (arena->current == NULL)
+    {
+        return NULL;
+    }
+    llm_arena_block_t *block = arena->current;
+    if (block->size - block->used < len + 1)
+    {
+        //* the rest of the current block is given up, appends stay O(1)
+        int size = len + 1 > arena->block_size ? len + 1 : arena->block_size;
+        block = llm_arena_block_new(arena, size);
+        if (block == NULL)
+        {
+            ESP_LOGW(TAG, "Arena full, %d of %d bytes used", arena->total_size, arena->max_size);
+            return NULL;
+        }
+        arena->current->next = block;
+        arena->current = block;
+    }
+    char *copy = block->data + block->used;
+    memcpy(copy, str, len);
+    copy[len] = 0;
+    block->used += len + 1;
+    return copy;
+}
@@ -0,0 +1,55 @@
+#ifndef _LLM_ARENA_H_
+#define _LLM_ARENA_H_
+
+#include "esp_err.h"
+
+#define LLM_ARENA_BLOCK_SIZE    (2 * 1024)
+
+typedef struct llm_arena_block llm_arena_block_t;
+
+/*
+ * @brief      Append-only string storage of one request, grows by blocks up to `max_size`
+ *
+ *             Blocks come from audio_malloc, i.e. PSRAM when it is enabled. Strings never move,
+ *             so pointers stay valid until `llm_arena_reset`.
+ */
+typedef struct
+{
+    llm_arena_block_t *first;
+    llm_arena_block_t *current;
+    int block_size;
+    int max_size;
+    int total_size;
+} llm_arena_t;
+
+/*
+ * @brief      Initialize the arena and allocate its first block
+ *
+ * @param      arena       The arena
+ * @param[in]  block_size  Size of a block, longer strings get a block of their own
+ * @param[in]  max_size    Upper bound of all blocks together
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_ERR_NO_MEM
+ */
+esp_err_t llm_arena_init(llm_arena_t *arena, int block_size, int max_size);
+
+/*
+ * @brief      Free all blocks
+ */
+void llm_arena_deinit(llm_arena_t *arena);
+
+/*
+ * @brief      Drop all strings, the first block is kept for the next request
+ */
+void llm_arena_reset(llm_arena_t *arena);
+
+/*
+ * @brief      Copy `len` bytes and a terminating NUL into the arena
+ *
+ * @return     The stable copy, NULL when `max_size` would be exceeded
+ */
+char *llm_arena_strndup(llm_arena_t *arena, const char *str, int len);
+
+#endif
@@ -1,247 +1,802 @@
 #include "llm_ask.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "esp_timer.h"
+#include "latency_trace.h"
 
 static const char *TAG = "LLM_ASK";
 
-#define POST_DATA "{"                     \
-                  "\"temperature\": 0.7," \
-                  "\"stream\": true,"     \
-                  "\"messages\": ["       \
-                  "{"                     \
-                  "\"role\": \"user\","   \
-                  "\"content\": \"%s\""   \
-                  "}"                     \
-                  "]"                     \
-                  "}"
+//* the messages array is written between these two from the history
+#define POST_DATA_HEAD "{\"temperature\":0.7,\"stream\":true,\"messages\":"
+#define POST_DATA_TAIL "}"
+#define POST_CHUNK_SIZE 256
 
+#if CONFIG_MOCK_SERVER
+#define GPT_HOST_URL CONFIG_MOCK_SERVER_URI "/"
+#define GPT_URL CONFIG_MOCK_SERVER_URI "/rpc/2.0/ai_custom/v1/wenxinworkshop/chat/yi_34b_chat?access_token=%s"
+#else
+#define GPT_HOST_URL "https://aip.baidubce.com/"
 #define GPT_URL "https://aip.baidubce.com/rpc/2.0/ai_custom/v1/wenxinworkshop/chat/yi_34b_chat?access_token=%s"
+#endif
 
-GPT_resTxtState state = START;
-esp_http_client_handle_t client = NULL;
-char raw_response_buffer[RAW_RESPONSE_BUFFER_MAX + 512];
-AnsBuffer ans_buffer = {0, {0}};
+#define RESPONSE_BUFFER_SIZE (RAW_RESPONSE_BUFFER_MAX + 512)
+// The answer is read in slices this long, an abort is noticed between two of them
+#define LLM_READ_SLICE_MS 100
+// Qianfan error codes of a bad access token
+#define LLM_ERROR_TOKEN_INVALID 110
+#define LLM_ERROR_TOKEN_EXPIRED 111
 
-llm_ask_handle_t llm_ask_init(llm_ask_config_t *initConfig)
+typedef struct
 {
-    llm_ask_t *ask = calloc(1, sizeof(llm_ask_t));
-    ask->on_respone = initConfig->on_respone;
+    char *question;
+    uint32_t num;
+    uint32_t generation;    /*!< `generation` of the LLM context when it was posted */
+} llm_post_item_t;
 
-    esp_http_client_config_t config = {
-        .buffer_size = 2048 * 4,
-    };
-    char *baidu_url_with_token = calloc(1, strlen(GPT_URL) + strlen(initConfig->api_token) + 1);
-    sprintf(baidu_url_with_token, GPT_URL, initConfig->api_token);
-    config.url = (const char *)baidu_url_with_token;
-    client = esp_http_client_init(&config);
-    free(baidu_url_with_token);
+/*
+ * Collects small JSON pieces into one esp_http_client_write
+ */
+typedef struct
+{
+    esp_http_client_handle_t client;
+    int len;
+    char buffer[POST_CHUNK_SIZE];
+} llm_post_writer_t;
 
-    return ask;
+static int llm_post_flush(llm_post_writer_t *writer)
+{
+    if (writer->len > 0 && esp_http_client_write(writer->client, writer->buffer, writer->len) != writer->len)
+    {
+        return -1;
+    }
+    writer->len = 0;
+    return 0;
 }
 
-void llm_ask_uninit(llm_ask_handle_t ask)
+static int llm_post_write(void *user_data, const char *data, int len)
 {
-    esp_http_client_cleanup(client);
-    free(ask->question);
-    free(ask->answer);
-    free(ask);
+    llm_post_writer_t *writer = (llm_post_writer_t *)user_data;
+    while (len > 0)
+    {
+        int n = POST_CHUNK_SIZE - writer->len;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(writer->buffer + writer->len, data, n);
+        writer->len += n;
+        data += n;
+        len -= n;
+        if (writer->len == POST_CHUNK_SIZE && llm_post_flush(writer) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
 }
 
-esp_err_t llm_post_response(llm_ask_handle_t ask)
+static esp_err_t llm_post_body(esp_http_client_handle_t client, void *user_data)
 {
-    if (ask->question == NULL)
+    llm_ask_handle_t ask = (llm_ask_handle_t)user_data;
+    llm_post_writer_t writer = {
+        .client = client,
+    };
+    if (llm_post_write(&writer, POST_DATA_HEAD, strlen(POST_DATA_HEAD)) < 0
+        || llm_context_write_messages(&ask->context, llm_post_write, &writer) < 0
+        || llm_post_write(&writer, POST_DATA_TAIL, strlen(POST_DATA_TAIL)) < 0
+        || llm_post_flush(&writer) < 0)
     {
-        ESP_LOGE(TAG, "question is NULL");
         return ESP_FAIL;
     }
-    // POST
-    char post_data[2048];
-    snprintf(post_data, 2048, POST_DATA, ask->question);
+    return ESP_OK;
+}
 
-    int post_data_len = strlen(post_data);
-    esp_http_client_set_method(client, HTTP_METHOD_POST);
-    esp_http_client_set_header(client, "Content-Type", "application/json");
+static void llm_deliver(llm_ask_handle_t ask)
+{
+    if (ask->answer_generation != ask->generation)
+    {
+        return;
+    }
+    latency_trace_first(TRACE_LLM_FIRST_RESULT, ask->answer_len);
+    ask->on_respone(ask);
+}
+
+/*
+ * Keep a result of a speculation back, it lives in the arena until the next question
+ */
+static void llm_hold(llm_ask_handle_t ask)
+{
+    if (ask->spec_lost || ask->held_num == LLM_ASK_SPECULATE_HELD_MAX)
+    {
+        ask->spec_lost = true;
+        return;
+    }
+    ask->held[ask->held_num++] = (llm_held_result_t) {
+        .text = ask->answer,
+        .len = ask->answer_len,
+        .sentence_id = ask->sentence_id,
+    };
+}
+
+static void llm_on_sse_event(const llm_sse_event_t *event, void *user_data)
+{
+    llm_ask_handle_t ask = (llm_ask_handle_t)user_data;
+    if (event->error_code)
+    {
+        ESP_LOGE(TAG, "LLM error %d: %s", event->error_code, event->error_msg ? event->error_msg : "");
+        ask->token_rejected = event->error_code == LLM_ERROR_TOKEN_INVALID
+                              || event->error_code == LLM_ERROR_TOKEN_EXPIRED;
+        return;
+    }
+    ask->is_end = event->is_end;
+    if (event->is_end)
+    {
+        latency_trace_record(TRACE_LLM_LAST_RESULT, event->result_len);
+        ask->usage = event->usage;
+        ESP_LOGI(TAG, "usage: prompt=%d, completion=%d, total=%d",
+                 event->usage.prompt_tokens, event->usage.completion_tokens, event->usage.total_tokens);
+    }
+    //* the lock keeps `answer` for the adoption of a speculation, which replays the held results
+    xSemaphoreTake(ask->spec_lock, portMAX_DELAY);
+    ask->sentence_id = event->sentence_id;
+    if (event->result_len > 0)
+    {
+        ESP_LOGW(TAG, "ans[%d]: %s", event->sentence_id, event->result);
+        //* keep the result, the receive buffer is reused by the next read
+        ask->answer = llm_arena_strndup(&ask->arena, event->result, event->result_len);
+        if (ask->answer == NULL)
+        {
+            ESP_LOGW(TAG, "Answer storage full, result only valid in this callback");
+            ask->answer = event->result;
+            ask->spec_lost = ask->spec_lost || ask->spec_hold;
+        }
+        ask->answer_len = event->result_len;
+        llm_context_append_answer(&ask->context, event->result, event->result_len);
+        if (ask->spec_hold)
+        {
+            llm_hold(ask);
+        }
+        else
+        {
+            llm_deliver(ask);
+        }
+    }
+    xSemaphoreGive(ask->spec_lock);
+}
+
+/*
+ * The cache is keyed by the question alone, an answer that follows earlier turns depends on them
+ */
+static bool llm_cache_usable(llm_ask_handle_t ask)
+{
+    return ask->cache && ask->context.committed == 0;
+}
+
+/*
+ * Answer from the cache, the turn goes into the history as if the server had answered
+ */
+static bool llm_answer_from_cache(llm_ask_handle_t ask)
+{
+    if (!llm_cache_usable(ask)
+        || llm_answer_cache_normalize(ask->question, ask->cache_question, sizeof(ask->cache_question)) <= 0)
+    {
+        ask->cache_question[0] = 0;
+        return false;
+    }
+    int len;
+    int slot = llm_answer_cache_lookup(ask->cache, ask->cache_question, &len);
+    if (slot < 0)
+    {
+        return false;
+    }
+    char *answer = audio_malloc(len);
+    if (answer == NULL || llm_answer_cache_read(ask->cache, slot, answer) != ESP_OK)
+    {
+        audio_free(answer);
+        return false;
+    }
+    ask->answer = llm_arena_strndup(&ask->arena, answer, len);
+    audio_free(answer);
+    if (ask->answer == NULL)
+    {
+        return false;
+    }
+    ESP_LOGI(TAG, "Answer of \"%s\" from the cache", ask->cache_question);
+    latency_trace_record(TRACE_LLM_CACHE_HIT, len);
+    ask->answer_len = len;
+    ask->sentence_id = 0;
+    ask->is_end = true;
+    memset(&ask->usage, 0, sizeof(ask->usage));
+    if (llm_context_begin_turn(&ask->context, ask->question, strlen(ask->question)) == ESP_OK)
+    {
+        llm_context_append_answer(&ask->context, ask->answer, len);
+        llm_context_end_turn(&ask->context, true);
+    }
+    //* aborted meanwhile, the hit is not played either
+    llm_deliver(ask);
+    llm_answer_cache_log_stats(ask->cache);
+    return true;
+}
 
-    esp_err_t err;
-    if ((err = esp_http_client_open(client, post_data_len)) != ESP_OK)
+/*
+ * Copy a complete answer from the server, flash is only written once the answer has been played
+ */
+static void llm_answer_keep(llm_ask_handle_t ask, int64_t answer_us)
+{
+    int len;
+    const char *answer = llm_context_get_answer(&ask->context, &len);
+    llm_answer_cache_record_miss(ask->cache, answer_us);
+    llm_answer_cache_log_stats(ask->cache);
+    if (ask->cache_question[0] == 0 || answer == NULL)
+    {
+        return;
+    }
+    int question_len = strlen(ask->cache_question);
+    char *pending = audio_malloc(question_len + 1 + len);
+    if (pending == NULL)
+    {
+        return;
+    }
+    memcpy(pending, ask->cache_question, question_len + 1);
+    memcpy(pending + question_len + 1, answer, len);
+    audio_free(ask->cache_pending);
+    ask->cache_pending = pending;
+    ask->cache_pending_len = len;
+}
+
+/*
+ * Post the question and read the answer, the turn stays open for `llm_request_end` if it returns ESP_OK
+ */
+static esp_err_t llm_request(llm_ask_handle_t ask, uint32_t generation)
+{
+    ask->token_rejected = false;
+    // POST
+    if (llm_context_begin_turn(&ask->context, ask->question, strlen(ask->question)) != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    //* the body is never built in RAM, a counting pass gives the Content-Length
+    int post_data_len = strlen(POST_DATA_HEAD) + llm_context_write_messages(&ask->context, NULL, NULL)
+                        + strlen(POST_DATA_TAIL);
+    esp_http_client_handle_t client = http_conn_acquire(ask->url, portMAX_DELAY);
+    if (client == NULL)
     {
-        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        llm_context_end_turn(&ask->context, false);
         return ESP_FAIL;
     }
-    if (esp_http_client_write(client, post_data, post_data_len) <= 0)
+    esp_http_client_set_method(client, HTTP_METHOD_POST);
+    esp_http_client_set_header(client, "Content-Type", "application/json");
+
+    if (http_conn_request_stream(client, post_data_len, llm_post_body, ask) != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to write data");
+        ESP_LOGE(TAG, "Failed to post question");
+        http_conn_release(client, false);
+        llm_context_end_turn(&ask->context, false);
         return ESP_FAIL;
     }
-    int content_length = esp_http_client_fetch_headers(client);
-    if (content_length < 0)
+    latency_trace_record(TRACE_LLM_REQUEST, post_data_len);
+    if (esp_http_client_is_chunked_response(client))
     {
-        ESP_LOGE(TAG, "HTTP client fetch headers failed");
+        ESP_LOGI(TAG, "esp_http_client_is_chunked_response");
     }
     else
     {
-        if (esp_http_client_is_chunked_response(client))
+        ESP_LOGI(TAG, "esp_http_client_is_not_chunked_response");
+    }
+    llm_sse_parser_t parser;
+    llm_sse_parser_init(&parser, ask->response_buffer, RESPONSE_BUFFER_SIZE, llm_on_sse_event, ask);
+    ask->is_end = false;
+    //* a read blocked on a silent server would hold the task past an abort, the server gets
+    //* HTTP_CONN_TIMEOUT_MS of silence in slices
+    esp_http_client_set_timeout_ms(client, LLM_READ_SLICE_MS);
+    int64_t quiet_since = esp_timer_get_time();
+
+    while (!esp_http_client_is_complete_data_received(client))
+    {
+        //* a cancelled speculation or an aborted answer drops the connection, the answer is not read to the end
+        if (ask->spec_cancel || generation != ask->generation)
         {
-            ESP_LOGI(TAG, "esp_http_client_is_chunked_response");
+            ESP_LOGI(TAG, "%s", ask->spec_cancel ? "Speculation cancelled" : "Answer aborted");
+            break;
         }
-        else
+        int available;
+        char *read_ptr = llm_sse_parser_get_write_ptr(&parser, &available);
+        if (available > RAW_RESPONSE_BUFFER_MAX)
         {
-            ESP_LOGI(TAG, "esp_http_client_is_not_chunked_response");
+            available = RAW_RESPONSE_BUFFER_MAX;
         }
-        resTxtState_reset();
-        ansBuffer_reset();
+        int64_t read_start = esp_timer_get_time();
+        int data_read = esp_http_client_read_response(client, read_ptr, available);
+        ESP_LOGD(TAG, "raw_response len: %d", data_read);
+        if (data_read < 0)
+        {
+            ESP_LOGE(TAG, "Failed to read response");
+            break;
+        }
+        if (data_read == 0)
+        {
+            int64_t now = esp_timer_get_time();
+            //* nothing in a whole slice is a quiet server, nothing right away is a closed connection
+            if (now - read_start < LLM_READ_SLICE_MS * 1000 / 2)
+            {
+                break;
+            }
+            if (now - quiet_since > HTTP_CONN_TIMEOUT_MS * 1000LL)
+            {
+                ESP_LOGE(TAG, "No answer for %d ms", HTTP_CONN_TIMEOUT_MS);
+                break;
+            }
+            continue;
+        }
+        quiet_since = esp_timer_get_time();
+        latency_trace_first(TRACE_LLM_FIRST_BYTE, data_read);
+        //* after the last result only the end of the chunked body is left, read it off to keep the connection
+        if (!ask->is_end)
+        {
+            llm_sse_parser_feed(&parser, data_read);
+        }
+    }
+    llm_sse_parser_finish(&parser);
+    ESP_LOGI(TAG, "esp_http_client finish");
+    esp_http_client_set_timeout_ms(client, HTTP_CONN_TIMEOUT_MS);
+    http_conn_release(client, esp_http_client_is_complete_data_received(client));
+    return ESP_OK;
+}
 
-        GPT_resTxtState last_state = START;
-        bool isAns = false;
+static void llm_request_end(llm_ask_handle_t ask, int64_t answer_us)
+{
+    if (ask->cache && ask->is_end)
+    {
+        llm_answer_keep(ask, answer_us);
+    }
+    //* a broken answer is not kept, the question can be asked again
+    llm_context_end_turn(&ask->context, ask->is_end);
+}
 
-        while (!esp_http_client_is_complete_data_received(client))
+static esp_err_t llm_question_copy(llm_ask_handle_t ask, const char *question)
+{
+    llm_arena_reset(&ask->arena);
+    ask->answer = NULL;
+    ask->answer_len = 0;
+    ask->question = llm_arena_strndup(&ask->arena, question, strlen(question));
+    if (ask->question == NULL)
+    {
+        ESP_LOGE(TAG, "question too long");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static void llm_speculate_task(void *pv)
+{
+    llm_ask_handle_t ask = (llm_ask_handle_t)pv;
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        xSemaphoreTake(ask->spec_run, portMAX_DELAY);
+        xSemaphoreTake(ask->spec_lock, portMAX_DELAY);
+        bool start = ask->spec_queued;
+        if (start)
         {
-            int data_read = esp_http_client_read_response(client, raw_response_buffer, RAW_RESPONSE_BUFFER_MAX);
-            ESP_LOGW(TAG, "raw_response len: %d", data_read);
-            // ESP_LOGE(TAG, "raw_response len->%d: %s", data_read, raw_response_buffer);
-            for (int i = 0; i < data_read; i++)
+            ask->spec_queued = false;
+            //* a done speculation nobody adopted leaves its turn out of the history
+            if (ask->spec_state == LLM_SPECULATION_DONE)
             {
-                last_state = state;
-                state = get_gptResTxtState(state, raw_response_buffer[i]);
-                if (state == ACCEPT && last_state == FOUND_quotation3)
-                {
-                    isAns = true;
-                }
-
-                if (state == START && last_state == ACCEPT)
+                llm_context_end_turn(&ask->context, false);
+            }
+            start = llm_question_copy(ask, ask->spec_next) == ESP_OK;
+            strcpy(ask->spec_run_key, ask->spec_key);
+            ask->spec_state = start ? LLM_SPECULATION_RUNNING : LLM_SPECULATION_IDLE;
+            ask->spec_hold = true;
+            ask->spec_cancel = false;
+            ask->spec_lost = false;
+            ask->held_num = 0;
+        }
+        //* an abort after this point drops the speculation too
+        uint32_t generation = ask->generation;
+        ask->spec_generation = generation;
+        xSemaphoreGive(ask->spec_lock);
+        if (start)
+        {
+            ESP_LOGI(TAG, "Speculate on \"%s\"", ask->question);
+            latency_trace_record(TRACE_LLM_SPECULATE, strlen(ask->question));
+            int64_t start_us = esp_timer_get_time();
+            esp_err_t err = llm_request(ask, generation);
+            xSemaphoreTake(ask->spec_lock, portMAX_DELAY);
+            ask->spec_err = err;
+            ask->spec_answer_us = esp_timer_get_time() - start_us;
+            ask->spec_state = LLM_SPECULATION_DONE;
+            //* still held means not adopted, a cancelled, aborted or failed one is gone
+            bool aborted = generation != ask->generation;
+            if (ask->spec_hold && (ask->spec_cancel || aborted || err != ESP_OK))
+            {
+                if (err == ESP_OK)
                 {
-                    isAns = false;
-                    ESP_LOGW(TAG, "ans: %s", ans_buffer.ans);
-                    ask->answer = ans_buffer.ans;
-                    ask->on_respone(ask);
-
-                    ansBuffer_reset();
+                    llm_context_end_turn(&ask->context, false);
                 }
-                if (isAns)
+                ask->spec_state = LLM_SPECULATION_IDLE;
+                //* the next round may speculate on the same text
+                if (aborted && strcmp(ask->spec_key, ask->spec_run_key) == 0)
                 {
-                    if (raw_response_buffer[i] == 'n' && ansBuffer_top() == '\\')
-                    {
-                        ansBuffer_rewind();
-                    }
-                    else
-                    {
-                        ansBuffer_append(raw_response_buffer[i]);
-                    }
+                    ask->spec_key[0] = 0;
                 }
             }
+            ask->spec_hold = false;
+            ask->spec_cancel = false;
+            xSemaphoreGive(ask->spec_lock);
         }
-        // esp_tts_task_destory();
-        ESP_LOGE(TAG, "esp_http_client finish");
+        xSemaphoreGive(ask->spec_run);
     }
-    esp_http_client_close(client);
+}
+
+/*
+ * Answer posted questions one by one, the event loop hears of the end through `evt`
+ */
+static void llm_ask_task(void *pv)
+{
+    llm_ask_handle_t ask = (llm_ask_handle_t)pv;
+    llm_post_item_t item;
+    while (1)
+    {
+        if (xQueueReceive(ask->post_queue, &item, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+        //* asked before an abort, nobody waits for the answer any more
+        esp_err_t err = ESP_FAIL;
+        if (item.generation != ask->generation)
+        {
+            ESP_LOGI(TAG, "Question %u dropped", (unsigned)item.num);
+        }
+        else if ((err = llm_ask_set_question(ask, item.question)) == ESP_OK)
+        {
+            ask->answer_generation = item.generation;
+            err = llm_post_response(ask);
+        }
+        free(item.question);
+        ask->post_err = err;
+        audio_event_iface_msg_t msg = {
+            .cmd = LLM_ASK_EVENT_FINISH,
+            .data = (void *)(uintptr_t)item.num,
+            .source = ask,
+        };
+        audio_event_iface_sendout(ask->evt, &msg);
+    }
+}
+
+/*
+ * Decide about the speculation once the final question is known, true if it is adopted
+ */
+static bool llm_speculation_match(llm_ask_handle_t ask, const char *question)
+{
+    if (ask->spec_task == NULL)
+    {
+        return false;
+    }
+    char key[LLM_ANSWER_CACHE_QUESTION_MAX];
+    bool normalized = llm_answer_cache_normalize(question, key, sizeof(key)) > 0;
+    xSemaphoreTake(ask->spec_lock, portMAX_DELAY);
+    ask->spec_closed = true;
+    ask->spec_queued = false;
+    bool match = false;
+    if (ask->spec_state != LLM_SPECULATION_IDLE)
+    {
+        //* one asked before an abort stops with part of the answer
+        match = normalized && !ask->spec_lost && !ask->spec_cancel && strcmp(key, ask->spec_run_key) == 0
+                && ask->spec_generation == ask->generation
+                && (ask->spec_state == LLM_SPECULATION_RUNNING || ask->spec_err == ESP_OK);
+        ask->spec_cancel = !match && ask->spec_state == LLM_SPECULATION_RUNNING;
+    }
+    bool speculated = ask->spec_state != LLM_SPECULATION_IDLE;
+    ask->spec_adopt = match;
+    xSemaphoreGive(ask->spec_lock);
+    if (speculated)
+    {
+        ESP_LOGI(TAG, "Speculation on \"%s\" %s", ask->spec_run_key, match ? "adopted" : "dropped");
+    }
+    return match;
+}
+
+/*
+ * Hand the held results over and wait for the rest, returns with `spec_run` taken
+ */
+static esp_err_t llm_speculation_adopt(llm_ask_handle_t ask, bool *ask_again)
+{
+    xSemaphoreTake(ask->spec_lock, portMAX_DELAY);
+    for (int i = 0; i < ask->held_num; i++)
+    {
+        ask->answer = ask->held[i].text;
+        ask->answer_len = ask->held[i].len;
+        ask->sentence_id = ask->held[i].sentence_id;
+        llm_deliver(ask);
+    }
+    int delivered = ask->held_num;
+    ask->held_num = 0;
+    ask->spec_hold = false;
+    xSemaphoreGive(ask->spec_lock);
+
+    xSemaphoreTake(ask->spec_run, portMAX_DELAY);
+    ask->run_held = true;
+    ask->spec_adopt = false;
+    ask->spec_state = LLM_SPECULATION_IDLE;
+    //* a speculation that failed before any result is asked again
+    *ask_again = ask->spec_err != ESP_OK && delivered == 0;
+    if (ask->spec_err != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    if (llm_cache_usable(ask))
+    {
+        strcpy(ask->cache_question, ask->spec_run_key);
+    }
+    else
+    {
+        ask->cache_question[0] = 0;
+    }
+    llm_request_end(ask, ask->spec_answer_us);
     return ESP_OK;
 }
 
-void resTxtState_reset()
+llm_ask_handle_t llm_ask_init(llm_ask_config_t *initConfig)
 {
-    state = START;
+    llm_ask_t *ask = calloc(1, sizeof(llm_ask_t));
+    AUDIO_MEM_CHECK(TAG, ask, return NULL);
+    ask->on_respone = initConfig->on_respone;
+
+    int arena_size = initConfig->arena_size > 0 ? initConfig->arena_size : LLM_ASK_ARENA_MAX;
+    if (llm_arena_init(&ask->arena, LLM_ARENA_BLOCK_SIZE, arena_size) != ESP_OK)
+    {
+        goto _init_exit;
+    }
+    int history_size = initConfig->history_size > 0 ? initConfig->history_size : LLM_ASK_HISTORY_SIZE;
+    int history_tokens = initConfig->history_tokens > 0 ? initConfig->history_tokens : LLM_ASK_HISTORY_TOKENS;
+    if (llm_context_init(&ask->context, history_size, history_tokens) != ESP_OK)
+    {
+        goto _init_exit;
+    }
+    ask->response_buffer = audio_malloc(RESPONSE_BUFFER_SIZE);
+    AUDIO_MEM_CHECK(TAG, ask->response_buffer, goto _init_exit);
+    if (llm_ask_set_token(ask, initConfig->api_token) != ESP_OK)
+    {
+        goto _init_exit;
+    }
+    ask->spec_lock = xSemaphoreCreateMutex();
+    AUDIO_MEM_CHECK(TAG, ask->spec_lock, goto _init_exit);
+    ask->spec_run = xSemaphoreCreateMutex();
+    AUDIO_MEM_CHECK(TAG, ask->spec_run, goto _init_exit);
+    http_conn_init();
+    if (initConfig->cache_partition)
+    {
+        ask->cache = llm_answer_cache_init(initConfig->cache_partition, initConfig->cache_ttl_s);
+    }
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    ask->evt = audio_event_iface_init(&evt_cfg);
+    AUDIO_MEM_CHECK(TAG, ask->evt, goto _init_exit);
+    ask->post_queue = xQueueCreate(LLM_ASK_QUEUE_SIZE, sizeof(llm_post_item_t));
+    AUDIO_MEM_CHECK(TAG, ask->post_queue, goto _init_exit);
+    int task_prio = initConfig->task_prio > 0 ? initConfig->task_prio : LLM_ASK_TASK_PRIO;
+    if (xTaskCreatePinnedToCore(llm_ask_task, "llm_ask", LLM_ASK_TASK_STACK, ask, task_prio, &ask->task,
+                                initConfig->task_core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Error create LLM task");
+        goto _init_exit;
+    }
+    if (initConfig->speculate
+        && xTaskCreatePinnedToCore(llm_speculate_task, "llm_speculate", LLM_ASK_SPECULATE_TASK_STACK, ask,
+                                   initConfig->task_prio > 0 ? initConfig->task_prio : LLM_ASK_SPECULATE_TASK_PRIO,
+                                   &ask->spec_task, initConfig->task_core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Error create speculation task");
+        goto _init_exit;
+    }
+
+    return ask;
+_init_exit:
+    llm_ask_uninit(ask);
+    return NULL;
 }
 
-void ansBuffer_reset()
+void llm_ask_uninit(llm_ask_handle_t ask)
 {
-    ans_buffer.ans_len = 0;
-    ans_buffer.ans[0] = '\0';
+    if (ask->task)
+    {
+        vTaskDelete(ask->task);
+    }
+    if (ask->post_queue)
+    {
+        llm_post_item_t item;
+        while (xQueueReceive(ask->post_queue, &item, 0) == pdTRUE)
+        {
+            free(item.question);
+        }
+        vQueueDelete(ask->post_queue);
+    }
+    if (ask->evt)
+    {
+        audio_event_iface_destroy(ask->evt);
+    }
+    if (ask->spec_task)
+    {
+        vTaskDelete(ask->spec_task);
+    }
+    if (ask->spec_lock)
+    {
+        vSemaphoreDelete(ask->spec_lock);
+    }
+    if (ask->spec_run)
+    {
+        vSemaphoreDelete(ask->spec_run);
+    }
+    free(ask->url);
+    free(ask->retired_url);
+    audio_free(ask->response_buffer);
+    llm_arena_deinit(&ask->arena);
+    llm_context_deinit(&ask->context);
+    audio_free(ask->cache_pending);
+    if (ask->cache)
+    {
+        llm_answer_cache_deinit(ask->cache);
+    }
+    free(ask);
 }
 
-void ansBuffer_append(char c)
+esp_err_t llm_ask_set_question(llm_ask_handle_t ask, const char *question)
 {
-    ans_buffer.ans[ans_buffer.ans_len++] = c;
-    ans_buffer.ans[ans_buffer.ans_len] = '\0';
+    ask->answer_generation = ask->generation;
+    if (llm_speculation_match(ask, question))
+    {
+        return ESP_OK;
+    }
+    //* a dropped speculation ends first, it shares the arena and the history
+    if (!ask->run_held)
+    {
+        xSemaphoreTake(ask->spec_run, portMAX_DELAY);
+        ask->run_held = true;
+    }
+    if (ask->spec_state == LLM_SPECULATION_DONE)
+    {
+        llm_context_end_turn(&ask->context, false);
+        ask->spec_state = LLM_SPECULATION_IDLE;
+    }
+    esp_err_t err = llm_question_copy(ask, question);
+    if (err != ESP_OK)
+    {
+        ask->spec_closed = false;
+        ask->run_held = false;
+        xSemaphoreGive(ask->spec_run);
+    }
+    return err;
 }
 
-char ansBuffer_top()
+void llm_ask_speculate(llm_ask_handle_t ask, const char *text)
 {
-    if (ans_buffer.ans_len == 0)
-        return '\0';
-    return ans_buffer.ans[ans_buffer.ans_len - 1];
+    char key[LLM_ANSWER_CACHE_QUESTION_MAX];
+    if (ask->spec_task == NULL || strlen(text) >= sizeof(ask->spec_next)
+        || llm_answer_cache_normalize(text, key, sizeof(key)) <= 0)
+    {
+        return;
+    }
+    xSemaphoreTake(ask->spec_lock, portMAX_DELAY);
+    if (!ask->spec_closed && strcmp(key, ask->spec_key) != 0)
+    {
+        strcpy(ask->spec_next, text);
+        strcpy(ask->spec_key, key);
+        ask->spec_queued = true;
+        //* the running one asks the wrong question now
+        ask->spec_cancel = ask->spec_state == LLM_SPECULATION_RUNNING;
+        xTaskNotifyGive(ask->spec_task);
+    }
+    xSemaphoreGive(ask->spec_lock);
+}
+esp_err_t llm_ask_set_token(llm_ask_handle_t ask, const char *token)
+{
+    char *url = calloc(1, strlen(GPT_URL) + strlen(token) + 1);
+    AUDIO_MEM_CHECK(TAG, url, return ESP_FAIL);
+    sprintf(url, GPT_URL, token);
+    //* a question may still be posted with the current URL, it is freed on the next replacement
+    free(ask->retired_url);
+    ask->retired_url = ask->url;
+    ask->url = url;
+    return ESP_OK;
+}
+
+void llm_ask_clear_history(llm_ask_handle_t ask)
+{
+    llm_context_clear(&ask->context);
 }
 
-void ansBuffer_rewind()
+void llm_ask_flush_cache(llm_ask_handle_t ask)
 {
-    if (ans_buffer.ans_len == 0)
+    if (ask->cache_pending == NULL)
+    {
         return;
-    ans_buffer.ans[ans_buffer.ans_len - 1] = '\0';
-    ans_buffer.ans_len--;
+    }
+    const char *question = ask->cache_pending;
+    llm_answer_cache_store(ask->cache, question, question + strlen(question) + 1, ask->cache_pending_len);
+    audio_free(ask->cache_pending);
+    ask->cache_pending = NULL;
 }
 
-GPT_resTxtState get_gptResTxtState(GPT_resTxtState state, char c)
+uint32_t llm_ask_post(llm_ask_handle_t ask, const char *question)
 {
-    switch (state)
+    llm_post_item_t item = {
+        .question = strdup(question),
+        .num = ++ask->post_num,
+        .generation = ask->generation,
+    };
+    //* 0 is the failure
+    if (item.num == 0)
     {
-    case START:
-        if (c == '\"')
-            return FOUND_quotation;
-        else
-            return START;
-    case FOUND_quotation:
-        if (c == 'r')
-            return FOUND_r;
-        else if (c == '\"')
-            return FOUND_quotation;
-        else
-            return START;
-    case FOUND_r:
-        if (c == 'e')
-            return FOUND_e;
-        else if (c == '\"')
-            return FOUND_quotation;
-        else
-            return START;
-    case FOUND_e:
-        if (c == 's')
-            return FOUND_s;
-        else if (c == '\"')
-            return FOUND_quotation;
-        else
-            return START;
-    case FOUND_s:
-        if (c == 'u')
-            return FOUND_u;
-        else if (c == '\"')
-            return FOUND_quotation;
-        else
-            return START;
-    case FOUND_u:
-        if (c == 'l')
-            return FOUND_l;
-        else if (c == '\"')
-            return FOUND_quotation;
-        else
-            return START;
-    case FOUND_l:
-        if (c == 't')
-            return FOUND_t;
-        else if (c == '\"')
-            return FOUND_quotation;
-        else
-            return START;
-    case FOUND_t:
-        if (c == '\"')
-            return FOUND_quotation2;
-        else
-            return START;
-    case FOUND_quotation2:
-        if (c == ':')
-            return FOUND_colon;
-        else if (c == '\"')
-            return FOUND_quotation;
-        else
-            return START;
-    case FOUND_colon:
-        if (c == '\"')
-            return FOUND_quotation3;
-        else
-            return START;
-    case FOUND_quotation3:
-    case ACCEPT:
-        if (c == '\"')
-            return START;
-        else
-            return ACCEPT;
-    default:
-        return state;
+        item.num = ++ask->post_num;
+    }
+    AUDIO_MEM_CHECK(TAG, item.question, return 0);
+    if (xQueueSend(ask->post_queue, &item, 0) != pdTRUE)
+    {
+        ESP_LOGE(TAG, "LLM task busy, question dropped");
+        free(item.question);
+        return 0;
+    }
+    return item.num;
+}
+
+void llm_ask_abort(llm_ask_handle_t ask)
+{
+    ask->generation++;
+}
+
+esp_err_t llm_ask_set_listener(llm_ask_handle_t ask, audio_event_iface_handle_t listener)
+{
+    if (listener)
+    {
+        audio_event_iface_set_listener(ask->evt, listener);
     }
-}
\ No newline at end of file
+    return ESP_OK;
+}
+
+bool llm_ask_check_event_finish(llm_ask_handle_t ask, audio_event_iface_msg_t *msg, uint32_t post_num)
+{
+    return msg->source == (void *)ask && msg->cmd == LLM_ASK_EVENT_FINISH && (uint32_t)(uintptr_t)msg->data == post_num;
+}
+
+void llm_ask_prewarm(llm_ask_handle_t ask)
+{
+    http_conn_prewarm(GPT_HOST_URL);
+}
+
+esp_err_t llm_post_response(llm_ask_handle_t ask)
+{
+    if (ask->question == NULL)
+    {
+        ESP_LOGE(TAG, "question is NULL");
+        return ESP_FAIL;
+    }
+    esp_err_t err = ESP_OK;
+    bool ask_again = true;
+    if (ask->spec_adopt)
+    {
+        err = llm_speculation_adopt(ask, &ask_again);
+    }
+    if (ask_again && !llm_answer_from_cache(ask))
+    {
+        int64_t start_us = esp_timer_get_time();
+        err = llm_request(ask, ask->answer_generation);
+        if (err == ESP_OK)
+        {
+            llm_request_end(ask, esp_timer_get_time() - start_us);
+        }
+    }
+    else if (ask_again)
+    {
+        err = ESP_OK;
+    }
+    xSemaphoreTake(ask->spec_lock, portMAX_DELAY);
+    ask->spec_closed = false;
+    ask->spec_key[0] = 0;
+    xSemaphoreGive(ask->spec_lock);
+    if (ask->run_held)
+    {
+        ask->run_held = false;
+        xSemaphoreGive(ask->spec_run);
+    }
+    return err;
+}
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
 #include "esp_system.h"
 #include "nvs_flash.h"
@@ -12,40 +14,29 @@
 #include "esp_netif.h"
 #include "esp_tls.h"
 #include "esp_http_client.h"
+#include "audio_event_iface.h"
 
-#define RAW_RESPONSE_BUFFER_MAX 2048
-#define ANS_BUFFER_MAX 1024
+#include "llm_sse_parser.h"
+#include "llm_arena.h"
+#include "llm_context.h"
+#include "llm_answer_cache.h"
+#include "http_conn.h"
 
-/*
- * @brief      GPT answer buffer
- */
-typedef struct
-{
-    int ans_len;
-    char ans[ANS_BUFFER_MAX + 5];
-} AnsBuffer;
+#define RAW_RESPONSE_BUFFER_MAX 2048
+#define LLM_ASK_ARENA_MAX (16 * 1024)
+#define LLM_ASK_HISTORY_SIZE (4 * 1024)
+#define LLM_ASK_HISTORY_TOKENS 1024
+#define LLM_ASK_TASK_STACK (8 * 1024)
+#define LLM_ASK_TASK_PRIO (4)
+#define LLM_ASK_TASK_CORE (0)
+#define LLM_ASK_QUEUE_SIZE 2
+#define LLM_ASK_SPECULATE_TASK_STACK (8 * 1024)
+#define LLM_ASK_SPECULATE_TASK_PRIO (4)
+// Results of a speculation kept back until the final text confirms it
+#define LLM_ASK_SPECULATE_HELD_MAX 32
 
 #define USE_BAIDU
 
-/*
- * @brief      GPT response text state
- */
-typedef enum
-{
-    START,
-    FOUND_quotation,  // "
-    FOUND_r,          // "r
-    FOUND_e,          // "re
-    FOUND_s,          // "res
-    FOUND_u,          // "resu
-    FOUND_l,          // "resul
-    FOUND_t,          // "result
-    FOUND_quotation2, // "result"
-    FOUND_colon,      // "result":
-    FOUND_quotation3, // "result":"
-    ACCEPT
-} GPT_resTxtState;
-
 typedef struct llm_ask *llm_ask_handle_t;
 typedef void (*llm_ask_event_handle_t)(llm_ask_handle_t ask);
 
@@ -53,13 +44,80 @@ typedef struct
 {
     const char *api_token;
     llm_ask_event_handle_t on_respone;
+    int arena_size;     /*!< Storage of the question and answers of one request, LLM_ASK_ARENA_MAX if 0 */
+    int history_size;   /*!< Bytes of earlier turns sent with a question, LLM_ASK_HISTORY_SIZE if 0 */
+    int history_tokens; /*!< Estimated tokens sent with a question, LLM_ASK_HISTORY_TOKENS if 0 */
+    const char *cache_partition;    /*!< Label of a data partition for answers of repeated questions, NULL to disable */
+    int cache_ttl_s;    /*!< Seconds a cached answer stays valid */
+    bool speculate;     /*!< Start a task for `llm_ask_speculate` */
+    int task_core;      /*!< Core of the request and speculation tasks (0 or 1) */
+    int task_prio;      /*!< Priority of both, LLM_ASK_TASK_PRIO if 0 */
 } llm_ask_config_t;
 
+typedef enum
+{
+    LLM_ASK_EVENT_FINISH = 1,   /*!< A posted question is answered, `data` is its number from `llm_ask_post` */
+} llm_ask_event_t;
+
+typedef enum
+{
+    LLM_SPECULATION_IDLE = 0,
+    LLM_SPECULATION_RUNNING,
+    LLM_SPECULATION_DONE,   /*!< Answered, its turn stays open until it is adopted or dropped */
+} llm_speculation_state_t;
+
+typedef struct
+{
+    char *text;
+    int len;
+    int sentence_id;
+} llm_held_result_t;
+
 typedef struct llm_ask
 {
-    char *question;    
-    char *answer;
+    char *url;
+    char *retired_url;  /*!< URL with the replaced token, freed on the next `llm_ask_set_token` */
+    char *question;
+    char *answer;       /*!< The latest result, stable until the next question */
+    int answer_len;
+    llm_arena_t arena;
+    llm_context_t context;
+    char *response_buffer;
+    int sentence_id;
+    bool is_end;
+    bool token_rejected;    /*!< The server answered the last question with an invalid or expired token error */
+    llm_sse_usage_t usage;
     llm_ask_event_handle_t on_respone;
+    llm_answer_cache_handle_t cache;
+    char cache_question[LLM_ANSWER_CACHE_QUESTION_MAX]; /*!< Normalized question, empty if it is not cached */
+    char *cache_pending;    /*!< Normalized question and answer waiting for `llm_ask_flush_cache` */
+    int cache_pending_len;
+    TaskHandle_t spec_task;
+    SemaphoreHandle_t spec_lock;    /*!< Guards the speculation state and the results handed to `on_respone` */
+    SemaphoreHandle_t spec_run;     /*!< Held by the request using the arena and the open turn */
+    bool run_held;                  /*!< `spec_run` taken by `llm_ask_set_question`, given by `llm_post_response` */
+    llm_speculation_state_t spec_state;
+    bool spec_queued;               /*!< `spec_next` waits for the speculation task */
+    bool spec_hold;                 /*!< Results are kept back instead of going to `on_respone` */
+    bool spec_cancel;
+    bool spec_lost;                 /*!< A result could not be kept, the speculation cannot be adopted */
+    bool spec_closed;               /*!< The final question is set, no speculation until it is answered */
+    bool spec_adopt;                /*!< The final question is the speculated one */
+    esp_err_t spec_err;
+    uint32_t spec_generation;       /*!< `generation` the running or done speculation was asked in */
+    int64_t spec_answer_us;
+    char spec_next[LLM_ANSWER_CACHE_QUESTION_MAX];
+    char spec_key[LLM_ANSWER_CACHE_QUESTION_MAX];       /*!< Normalized text of the latest speculation asked for */
+    char spec_run_key[LLM_ANSWER_CACHE_QUESTION_MAX];   /*!< Normalized text of the running or done speculation */
+    int held_num;
+    llm_held_result_t held[LLM_ASK_SPECULATE_HELD_MAX];
+    TaskHandle_t task;
+    QueueHandle_t post_queue;       /*!< Questions for the request task */
+    audio_event_iface_handle_t evt; /*!< Sends LLM_ASK_EVENT_FINISH to the listener */
+    uint32_t post_num;              /*!< Number of the latest posted question */
+    volatile uint32_t generation;   /*!< Bumped by `llm_ask_abort`, requests of an older one stop */
+    uint32_t answer_generation;     /*!< Generation of the question being answered */
+    esp_err_t post_err;             /*!< Result of the latest answered question */
 } llm_ask_t;
 
 /*
@@ -73,53 +131,101 @@ llm_ask_handle_t llm_ask_init(llm_ask_config_t *initConfig);
 void llm_ask_uninit(llm_ask_handle_t ask);
 
 /*
- * @brief      Post a question to LLM
+ * @brief      Set the question of the next request, the text is copied
  *
- * @param      question  The question
+ *             Answers of the previous request are released. A speculation of the same normalized text
+ *             is adopted by the following `llm_post_response`, any other one is cancelled.
+ *             Every successful call must be followed by `llm_post_response`.
  *
  * @return
  *     - ESP_OK
  *     - ESP_FAIL
  */
-esp_err_t llm_post_response(llm_ask_handle_t ask);
+esp_err_t llm_ask_set_question(llm_ask_handle_t ask, const char *question);
 
 /*
- * @brief      Reset the GPT response text state
+ * @brief      Replace the access token, the next question is posted with it
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_FAIL
+ */
+esp_err_t llm_ask_set_token(llm_ask_handle_t ask, const char *token);
+
+/*
+ * @brief      Forget the earlier turns, the next question starts a new conversation
  */
-void resTxtState_reset();
+void llm_ask_clear_history(llm_ask_handle_t ask);
 
 /*
- * @brief      Reset the GPT answer buffer
+ * @brief      Open the connection to the LLM server in the background, call it while the user is still speaking
  */
-void ansBuffer_reset();
+void llm_ask_prewarm(llm_ask_handle_t ask);
 
 /*
- * @brief      Append a character to the GPT answer buffer
+ * @brief      Ask a likely question before the final text is known, e.g. a stable partial ASR hypothesis
  *
- * @param[in]  c     The character (1 Byte)
+ *             The request runs in the speculation task with its results kept back. A later text replaces
+ *             a running speculation, which is then cancelled. Ignored without `speculate` in the config
+ *             and between `llm_ask_set_question` and the end of `llm_post_response`.
+ *
+ * @param      text  The question, it is copied
  */
-void ansBuffer_append(char c);
+void llm_ask_speculate(llm_ask_handle_t ask, const char *text);
 
 /*
- * @brief      Get the top character of the GPT answer buffer
+ * @brief      Ask in the request task, the caller goes on right away
+ *
+ *             Results come to `on_respone` from that task, LLM_ASK_EVENT_FINISH goes to the listener
+ *             after the last one. Questions are answered in order, call `llm_ask_abort` first to drop
+ *             the running answer.
+ *
+ * @param      question  The question, it is copied
  *
- * @return     The top character
+ * @return     Number of the question, found in `data` of its LLM_ASK_EVENT_FINISH, 0 on failure
  */
-char ansBuffer_top();
+uint32_t llm_ask_post(llm_ask_handle_t ask, const char *question);
 
 /*
- * @brief      Pop the top character of the GPT answer buffer
+ * @brief      Stop reading the running answer, no more results of it come to `on_respone`
+ *
+ *             Questions posted before are dropped unasked, their LLM_ASK_EVENT_FINISH still comes.
+ *             A speculation asked before stops too and is never adopted.
+ *             A running request drops its connection within 100 ms, the answer is read in slices that
+ *             long so a silent server does not hold it.
+ */
+void llm_ask_abort(llm_ask_handle_t ask);
+
+/*
+ * @brief      Register listener for LLM_ASK_EVENT_FINISH
  */
-void ansBuffer_rewind();
+esp_err_t llm_ask_set_listener(llm_ask_handle_t ask, audio_event_iface_handle_t listener);
 
 /*
- * @brief      renew the GPT response text state
+ * @brief      Check if the message is the LLM_ASK_EVENT_FINISH of the question numbered `post_num`
  *
- * @param[in]  state  The current state
- * @param[in]  c      The new character
+ *             The result of that question is in `post_err` and `token_rejected` then.
+ */
+bool llm_ask_check_event_finish(llm_ask_handle_t ask, audio_event_iface_msg_t *msg, uint32_t post_num);
+
+/*
+ * @brief      Write the last answer to the answer cache, call it while no audio is played or recorded
+ */
+void llm_ask_flush_cache(llm_ask_handle_t ask);
+
+/*
+ * @brief      Post a question to LLM
+ *
+ *             An answer of the same question from the cache is handed to `on_respone` right away,
+ *             there is no request then. An adopted speculation hands over the results it kept back,
+ *             the later ones come to `on_respone` from the speculation task.
  *
- * @return     The next state
+ * @param      question  The question
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_FAIL
  */
-GPT_resTxtState get_gptResTxtState(GPT_resTxtState state, char c);
+esp_err_t llm_post_response(llm_ask_handle_t ask);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,308 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_log.h"
+#include "audio_mem.h"
+#include "llm_context.h"
+
+static const char *TAG = "LLM_CONTEXT";
+
+#define LLM_ROLE_USER       (0)
+#define LLM_ROLE_ASSISTANT  (1)
+#define LLM_TURN_LEN_MAX    (0xFFFF)
+// Every message costs a few tokens for the role and separators
+#define LLM_TURN_TOKENS     (4)
+
+typedef struct
+{
+    uint8_t role;
+    uint8_t reserved;
+    uint16_t len;
+} llm_turn_t;
+
+#define LLM_TURN_HEADER     ((int)sizeof(llm_turn_t))
+
+static const char *llm_role_names[] = {
+    [LLM_ROLE_USER] = "user",
+    [LLM_ROLE_ASSISTANT] = "assistant",
+};
+
+/*
+ * No tokenizer on the device, a CJK character is about one token and English about four bytes per token
+ */
+static int llm_estimate_tokens(const char *text, int len)
+{
+    int multibyte = 0, ascii = 0;
+    for (int i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)text[i];
+        if (c < 0x80)
+        {
+            ascii++;
+        }
+        else if (c >= 0xC0)
+        {
+            multibyte++;
+        }
+    }
+    return multibyte + (ascii + 3) / 4 + LLM_TURN_TOKENS;
+}
+
+static void llm_turn_read(llm_context_t *ctx, int offset, llm_turn_t *turn)
+{
+    memcpy(turn, ctx->buffer + offset, LLM_TURN_HEADER);
+}
+
+static void llm_turn_append(llm_context_t *ctx, int role, const char *text, int len)
+{
+    llm_turn_t turn = {
+        .role = role,
+        .len = len,
+    };
+    memcpy(ctx->buffer + ctx->used, &turn, LLM_TURN_HEADER);
+    memcpy(ctx->buffer + ctx->used + LLM_TURN_HEADER, text, len);
+    ctx->used += LLM_TURN_HEADER + len;
+}
+
+static int llm_turn_tokens(llm_context_t *ctx, int from, int to)
+{
+    int tokens = 0;
+    llm_turn_t turn;
+    for (int offset = from; offset < to; offset += LLM_TURN_HEADER + turn.len)
+    {
+        llm_turn_read(ctx, offset, &turn);
+        tokens += llm_estimate_tokens(ctx->buffer + offset + LLM_TURN_HEADER, turn.len);
+    }
+    return tokens;
+}
+
+/*
+ * Drop the oldest finished question and its answer
+ */
+static bool llm_context_drop_oldest(llm_context_t *ctx)
+{
+    if (ctx->committed == 0)
+    {
+        return false;
+    }
+    llm_turn_t question, answer;
+    llm_turn_read(ctx, 0, &question);
+    llm_turn_read(ctx, LLM_TURN_HEADER + question.len, &answer);
+    int drop = 2 * LLM_TURN_HEADER + question.len + answer.len;
+    ctx->tokens -= llm_turn_tokens(ctx, 0, drop);
+    memmove(ctx->buffer, ctx->buffer + drop, ctx->used - drop);
+    ctx->used -= drop;
+    ctx->committed -= drop;
+    if (ctx->answer_offset > 0)
+    {
+        ctx->answer_offset -= drop;
+    }
+    return true;
+}
+
+esp_err_t llm_context_init(llm_context_t *ctx, int size, int token_budget)
+{
+    memset(ctx, 0, sizeof(llm_context_t));
+    ctx->buffer = audio_malloc(size);
+    if (ctx->buffer == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    ctx->size = size;
+    ctx->token_budget = token_budget;
+    return ESP_OK;
+}
+
+void llm_context_deinit(llm_context_t *ctx)
+{
+    audio_free(ctx->buffer);
+    memset(ctx, 0, sizeof(llm_context_t));
+}
+
+void llm_context_clear(llm_context_t *ctx)
+{
+    ctx->used = 0;
+    ctx->committed = 0;
+    ctx->answer_offset = 0;
+    ctx->tokens = 0;
+    ctx->truncated = false;
+}
+
+esp_err_t llm_context_begin_turn(llm_context_t *ctx, const char *question, int len)
+{
+    //* an unfinished turn is dropped
+    ctx->used = ctx->committed;
+    ctx->answer_offset = 0;
+    ctx->truncated = false;
+
+    int tokens = llm_estimate_tokens(question, len);
+    if (len > LLM_TURN_LEN_MAX || LLM_TURN_HEADER + len > ctx->size || tokens > ctx->token_budget)
+    {
+        ESP_LOGE(TAG, "Question too long, %d bytes, about %d tokens", len, tokens);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    while ((ctx->used + LLM_TURN_HEADER + len > ctx->size || ctx->tokens + tokens > ctx->token_budget)
+           && llm_context_drop_oldest(ctx));
+    llm_turn_append(ctx, LLM_ROLE_USER, question, len);
+    ESP_LOGD(TAG, "History %d bytes, about %d tokens", ctx->used, ctx->tokens + tokens);
+    return ESP_OK;
+}
+
+void llm_context_append_answer(llm_context_t *ctx, const char *text, int len)
+{
+    if (ctx->used == ctx->committed || ctx->truncated)
+    {
+        return;
+    }
+    int need = len + (ctx->answer_offset ? 0 : LLM_TURN_HEADER);
+    while (ctx->used + need > ctx->size && llm_context_drop_oldest(ctx));
+
+    int room = ctx->size - ctx->used - (ctx->answer_offset ? 0 : LLM_TURN_HEADER);
+    if (ctx->answer_offset)
+    {
+        llm_turn_t answer;
+        llm_turn_read(ctx, ctx->answer_offset, &answer);
+        if (room > LLM_TURN_LEN_MAX - answer.len)
+        {
+            room = LLM_TURN_LEN_MAX - answer.len;
+        }
+    }
+    if (len > room)
+    {
+        //* keep whole UTF-8 characters
+        len = room > 0 ? room : 0;
+        while (len > 0 && ((unsigned char)text[len] & 0xC0) == 0x80)
+        {
+            len--;
+        }
+        ctx->truncated = true;
+        ESP_LOGW(TAG, "Answer truncated in the history");
+    }
+    if (ctx->answer_offset == 0)
+    {
+        if (room < 0)
+        {
+            return;
+        }
+        ctx->answer_offset = ctx->used;
+        llm_turn_append(ctx, LLM_ROLE_ASSISTANT, text, len);
+        return;
+    }
+    llm_turn_t answer;
+    llm_turn_read(ctx, ctx->answer_offset, &answer);
+    memcpy(ctx->buffer + ctx->used, text, len);
+    ctx->used += len;
+    answer.len += len;
+    memcpy(ctx->buffer + ctx->answer_offset, &answer, LLM_TURN_HEADER);
+}
+
+const char *llm_context_get_answer(llm_context_t *ctx, int *len)
+{
+    if (ctx->answer_offset == 0 || ctx->truncated)
+    {
+        return NULL;
+    }
+    llm_turn_t answer;
+    llm_turn_read(ctx, ctx->answer_offset, &answer);
+    *len = answer.len;
+    return ctx->buffer + ctx->answer_offset + LLM_TURN_HEADER;
+}
+
+void llm_context_end_turn(llm_context_t *ctx, bool keep)
+{
+    if (keep && ctx->answer_offset)
+    {
+        ctx->tokens += llm_turn_tokens(ctx, ctx->committed, ctx->used);
+        ctx->committed = ctx->used;
+    }
+    else
+    {
+        ctx->used = ctx->committed;
+    }
+    ctx->answer_offset = 0;
+}
+
+static int llm_emit(llm_context_write_t write, void *user_data, const char *data, int len, int *total)
+{
+    if (len <= 0)
+    {
+        return 0;
+    }
+    if (write && write(user_data, data, len) < 0)
+    {
+        return -1;
+    }
+    *total += len;
+    return 0;
+}
+
+static int llm_emit_escaped(llm_context_write_t write, void *user_data, const char *text, int len, int *total)
+{
+    int start = 0;
+    for (int i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)text[i];
+        char escape[8];
+        if (c == '"' || c == '\\')
+        {
+            snprintf(escape, sizeof(escape), "\\%c", c);
+        }
+        else if (c == '\n')
+        {
+            strcpy(escape, "\\n");
+        }
+        else if (c == '\r')
+        {
+            strcpy(escape, "\\r");
+        }
+        else if (c == '\t')
+        {
+            strcpy(escape, "\\t");
+        }
+        else if (c < 0x20)
+        {
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+        }
+        else
+        {
+            continue;
+        }
+        //* plain runs go out in one piece
+        if (llm_emit(write, user_data, text + start, i - start, total) < 0
+            || llm_emit(write, user_data, escape, strlen(escape), total) < 0)
+        {
+            return -1;
+        }
+        start = i + 1;
+    }
+    return llm_emit(write, user_data, text + start, len - start, total);
+}
+
+int llm_context_write_messages(llm_context_t *ctx, llm_context_write_t write, void *user_data)
+{
+    int total = 0;
+    int end = ctx->answer_offset ? ctx->answer_offset : ctx->used;
+    if (llm_emit(write, user_data, "[", 1, &total) < 0)
+    {
+        return -1;
+    }
+    llm_turn_t turn;
+    for (int offset = 0; offset < end; offset += LLM_TURN_HEADER + turn.len)
+    {
+        llm_turn_read(ctx, offset, &turn);
+        char head[48];
+        int head_len = snprintf(head, sizeof(head), "%s{\"role\":\"%s\",\"content\":\"",
+                                offset ? "," : "", llm_role_names[turn.role]);
+        if (llm_emit(write, user_data, head, head_len, &total) < 0
+            || llm_emit_escaped(write, user_data, ctx->buffer + offset + LLM_TURN_HEADER, turn.len, &total) < 0
+            || llm_emit(write, user_data, "\"}", 2, &total) < 0)
+        {
+            return -1;
+        }
+    }
+    if (llm_emit(write, user_data, "]", 1, &total) < 0)
+    {
+        return -1;
+    }
+    return total;
+}
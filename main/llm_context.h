@@ -0,0 +1,97 @@
+#ifndef _LLM_CONTEXT_H_
+#define _LLM_CONTEXT_H_
+
+#include <stdbool.h>
+#include "esp_err.h"
+
+/*
+ * @brief      Write callback of `llm_context_write_messages`, returns < 0 on error
+ */
+typedef int (*llm_context_write_t)(void *user_data, const char *data, int len);
+
+/*
+ * @brief      Conversation history, the turns are packed back to back in one buffer
+ *
+ *             Every turn is a small header followed by its text. The oldest question and answer
+ *             are dropped together when the buffer or the token budget is exceeded, so the
+ *             messages always alternate user/assistant and end with the pending question.
+ */
+typedef struct
+{
+    char *buffer;
+    int size;
+    int used;
+    int committed;      /*!< Bytes of finished turns, the pending question and answer follow */
+    int answer_offset;  /*!< Where the pending answer starts, 0 if none yet */
+    int tokens;         /*!< Estimated tokens of all turns */
+    int token_budget;
+    bool truncated;     /*!< The pending answer did not fit */
+} llm_context_t;
+
+/*
+ * @brief      Initialize the context
+ *
+ * @param      ctx           The context
+ * @param[in]  size          Bytes kept for the history, allocated with audio_malloc
+ * @param[in]  token_budget  Estimated tokens sent with a question at most
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_ERR_NO_MEM
+ */
+esp_err_t llm_context_init(llm_context_t *ctx, int size, int token_budget);
+
+/*
+ * @brief      Free the context buffer
+ */
+void llm_context_deinit(llm_context_t *ctx);
+
+/*
+ * @brief      Drop all turns
+ */
+void llm_context_clear(llm_context_t *ctx);
+
+/*
+ * @brief      Add a question, older turns are dropped to make room for it
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_ERR_INVALID_SIZE  The question alone is over the size or the budget
+ */
+esp_err_t llm_context_begin_turn(llm_context_t *ctx, const char *question, int len);
+
+/*
+ * @brief      Append a piece of the answer of the pending question
+ */
+void llm_context_append_answer(llm_context_t *ctx, const char *text, int len);
+
+/*
+ * @brief      Get the answer of the pending turn, stable until the next call that changes the context
+ *
+ * @param      ctx   The context
+ * @param[out] len   Length of the answer
+ *
+ * @return     The answer, not NUL terminated, NULL if there is none or it was truncated
+ */
+const char *llm_context_get_answer(llm_context_t *ctx, int *len);
+
+/*
+ * @brief      Finish the pending turn
+ *
+ * @param      ctx   The context
+ * @param[in]  keep  Keep the question and answer in the history, false drops both, e.g. on error
+ */
+void llm_context_end_turn(llm_context_t *ctx, bool keep);
+
+/*
+ * @brief      Write the turns as a JSON `messages` array, the text is escaped on the fly
+ *
+ * @param      ctx        The context
+ * @param[in]  write      The write callback, NULL to only count the bytes
+ * @param      user_data  The user data passed to `write`
+ *
+ * @return     The length of the array, < 0 if `write` failed
+ */
+int llm_context_write_messages(llm_context_t *ctx, llm_context_write_t write, void *user_data);
+
+#endif
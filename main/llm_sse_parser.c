@@ -0,0 +1,364 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "esp_log.h"
+#include "llm_sse_parser.h"
+
+static const char *TAG = "LLM_SSE";
+
+#define SSE_DATA_PREFIX "data:"
+
+static char *_skip_ws(char *p, char *end)
+{
+    while (p < end && isspace((unsigned char)*p))
+    {
+        p++;
+    }
+    return p;
+}
+
+static bool _hex4(const char *p, const char *end, uint32_t *out)
+{
+    if (end - p < 4)
+    {
+        return false;
+    }
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')
+            v |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            v |= c - 'A' + 10;
+        else
+            return false;
+    }
+    *out = v;
+    return true;
+}
+
+static int _utf8_encode(uint32_t cp, char *dst)
+{
+    if (cp < 0x80)
+    {
+        dst[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800)
+    {
+        dst[0] = 0xC0 | (cp >> 6);
+        dst[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000)
+    {
+        dst[0] = 0xE0 | (cp >> 12);
+        dst[1] = 0x80 | ((cp >> 6) & 0x3F);
+        dst[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    dst[0] = 0xF0 | (cp >> 18);
+    dst[1] = 0x80 | ((cp >> 12) & 0x3F);
+    dst[2] = 0x80 | ((cp >> 6) & 0x3F);
+    dst[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+/*
+ * Decode a JSON string in place, `p` points after the opening quote.
+ * The decoded text is never longer than the encoded one, so it is written over the
+ * source and NUL-terminated where the closing quote was.
+ * Return the position after the closing quote, or NULL if the string is malformed.
+ */
+static char *_decode_string(char *p, char *end, char **out, int *out_len)
+{
+    char *dst = p;
+    *out = p;
+    while (p < end)
+    {
+        char c = *p++;
+        if (c == '\"')
+        {
+            *dst = '\0';
+            *out_len = dst - *out;
+            return p;
+        }
+        if (c != '\\')
+        {
+            *dst++ = c;
+            continue;
+        }
+        if (p >= end)
+        {
+            return NULL;
+        }
+        c = *p++;
+        switch (c)
+        {
+        case 'n':
+            *dst++ = '\n';
+            break;
+        case 'r':
+            *dst++ = '\r';
+            break;
+        case 't':
+            *dst++ = '\t';
+            break;
+        case 'b':
+            *dst++ = '\b';
+            break;
+        case 'f':
+            *dst++ = '\f';
+            break;
+        case 'u':
+        {
+            uint32_t cp;
+            if (!_hex4(p, end, &cp))
+            {
+                return NULL;
+            }
+            p += 4;
+            // UTF-16 surrogate pair
+            if (cp >= 0xD800 && cp <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+            {
+                uint32_t low;
+                if (_hex4(p + 2, end, &low) && low >= 0xDC00 && low <= 0xDFFF)
+                {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+            }
+            // A lone surrogate is not a character, UTF-8 has no bytes for it
+            if (cp >= 0xD800 && cp <= 0xDFFF)
+            {
+                cp = 0xFFFD;
+            }
+            dst += _utf8_encode(cp, dst);
+            break;
+        }
+        default:
+            // \" \\ \/
+            *dst++ = c;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Skip a nested object or array we are not interested in
+ */
+static char *_skip_container(char *p, char *end)
+{
+    int depth = 0;
+    bool in_string = false;
+    for (; p < end; p++)
+    {
+        if (in_string)
+        {
+            if (*p == '\\')
+                p++;
+            else if (*p == '\"')
+                in_string = false;
+            continue;
+        }
+        if (*p == '\"')
+            in_string = true;
+        else if (*p == '{' || *p == '[')
+            depth++;
+        else if ((*p == '}' || *p == ']') && --depth == 0)
+            return p + 1;
+    }
+    return NULL;
+}
+
+static void _set_string_field(llm_sse_event_t *event, const char *key, char *val, int val_len)
+{
+    if (strcmp(key, "result") == 0)
+    {
+        event->result = val;
+        event->result_len = val_len;
+    }
+    else if (strcmp(key, "error_msg") == 0)
+    {
+        event->error_msg = val;
+    }
+}
+
+static void _set_literal_field(llm_sse_event_t *event, bool is_usage, const char *key, const char *tok, int tok_len)
+{
+    if (is_usage)
+    {
+        int value = strtol(tok, NULL, 10);
+        if (strcmp(key, "prompt_tokens") == 0)
+            event->usage.prompt_tokens = value;
+        else if (strcmp(key, "completion_tokens") == 0)
+            event->usage.completion_tokens = value;
+        else if (strcmp(key, "total_tokens") == 0)
+            event->usage.total_tokens = value;
+        return;
+    }
+    if (strcmp(key, "is_end") == 0)
+        event->is_end = (tok_len == 4 && strncmp(tok, "true", 4) == 0);
+    else if (strcmp(key, "sentence_id") == 0)
+        event->sentence_id = strtol(tok, NULL, 10);
+    else if (strcmp(key, "error_code") == 0)
+        event->error_code = strtol(tok, NULL, 10);
+}
+
+/*
+ * Parse a flat JSON object, the `usage` member is parsed one level down
+ */
+static char *_parse_object(char *p, char *end, llm_sse_event_t *event, bool is_usage)
+{
+    p = _skip_ws(p, end);
+    if (p >= end || *p != '{')
+    {
+        return NULL;
+    }
+    p++;
+    while (1)
+    {
+        p = _skip_ws(p, end);
+        if (p >= end)
+            return NULL;
+        if (*p == '}')
+            return p + 1;
+        if (*p != '\"')
+            return NULL;
+
+        char *key;
+        int key_len;
+        if ((p = _decode_string(p + 1, end, &key, &key_len)) == NULL)
+            return NULL;
+        p = _skip_ws(p, end);
+        if (p >= end || *p != ':')
+            return NULL;
+        p = _skip_ws(p + 1, end);
+        if (p >= end)
+            return NULL;
+
+        if (*p == '\"')
+        {
+            char *val;
+            int val_len;
+            if ((p = _decode_string(p + 1, end, &val, &val_len)) == NULL)
+                return NULL;
+            if (!is_usage)
+                _set_string_field(event, key, val, val_len);
+        }
+        else if (*p == '{' && !is_usage && strcmp(key, "usage") == 0)
+        {
+            p = _parse_object(p, end, event, true);
+        }
+        else if (*p == '{' || *p == '[')
+        {
+            p = _skip_container(p, end);
+        }
+        else
+        {
+            // number, true, false or null
+            char *tok = p;
+            while (p < end && *p != ',' && *p != '}' && !isspace((unsigned char)*p))
+                p++;
+            _set_literal_field(event, is_usage, key, tok, p - tok);
+        }
+        if (p == NULL)
+            return NULL;
+        p = _skip_ws(p, end);
+        if (p < end && *p == ',')
+            p++;
+    }
+}
+
+static void _parse_line(llm_sse_parser_t *parser, char *line, char *line_end)
+{
+    if (line_end > line && line_end[-1] == '\r')
+    {
+        line_end--;
+    }
+    *line_end = '\0';
+
+    char *json = line;
+    if (line_end - line >= (int)sizeof(SSE_DATA_PREFIX) - 1 && memcmp(line, SSE_DATA_PREFIX, sizeof(SSE_DATA_PREFIX) - 1) == 0)
+    {
+        json += sizeof(SSE_DATA_PREFIX) - 1;
+        if (*json == ' ')
+            json++;
+    }
+    else if (*line != '{')
+    {
+        // blank line, comment, `event:` or `id:` field, nothing to decode
+        return;
+    }
+
+    llm_sse_event_t event = {0};
+    if (_parse_object(json, line_end, &event, false) == NULL)
+    {
+        ESP_LOGW(TAG, "Malformed event: %s", line);
+        return;
+    }
+    if (parser->on_event)
+    {
+        parser->on_event(&event, parser->user_data);
+    }
+}
+
+void llm_sse_parser_init(llm_sse_parser_t *parser, char *buffer, int buffer_size, llm_sse_event_cb_t on_event, void *user_data)
+{
+    parser->buffer = buffer;
+    parser->buffer_size = buffer_size;
+    parser->len = 0;
+    parser->on_event = on_event;
+    parser->user_data = user_data;
+}
+
+char *llm_sse_parser_get_write_ptr(llm_sse_parser_t *parser, int *available)
+{
+    // keep one byte to NUL-terminate the last line in llm_sse_parser_finish
+    *available = parser->buffer_size - parser->len - 1;
+    return parser->buffer + parser->len;
+}
+
+esp_err_t llm_sse_parser_feed(llm_sse_parser_t *parser, int len)
+{
+    char *line = parser->buffer;
+    char *scan = parser->buffer + parser->len;
+    char *end = scan + len;
+    char *newline;
+
+    // Only the new bytes are scanned, the carried tail is known to have no newline
+    while (scan < end && (newline = memchr(scan, '\n', end - scan)) != NULL)
+    {
+        _parse_line(parser, line, newline);
+        line = scan = newline + 1;
+    }
+
+    int remain = end - line;
+    if (remain >= parser->buffer_size - 1)
+    {
+        ESP_LOGE(TAG, "Event line longer than %d bytes, dropped", parser->buffer_size - 1);
+        parser->len = 0;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (line != parser->buffer && remain > 0)
+    {
+        memmove(parser->buffer, line, remain);
+    }
+    parser->len = remain;
+    return ESP_OK;
+}
+
+void llm_sse_parser_finish(llm_sse_parser_t *parser)
+{
+    if (parser->len > 0)
+    {
+        _parse_line(parser, parser->buffer, parser->buffer + parser->len);
+    }
+    parser->len = 0;
+}
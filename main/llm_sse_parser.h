@@ -0,0 +1,89 @@
+#ifndef _LLM_SSE_PARSER_H_
+#define _LLM_SSE_PARSER_H_
+
+#include <stdbool.h>
+#include "esp_err.h"
+
+/*
+ * @brief      Token usage reported by the LLM server
+ */
+typedef struct
+{
+    int prompt_tokens;
+    int completion_tokens;
+    int total_tokens;
+} llm_sse_usage_t;
+
+/*
+ * @brief      One decoded server-sent event
+ *
+ *             `result` and `error_msg` point into the parser buffer, escapes are decoded in place
+ *             and the strings are NUL-terminated. They are only valid during the callback.
+ */
+typedef struct
+{
+    int sentence_id;
+    bool is_end;
+    char *result;
+    int result_len;
+    llm_sse_usage_t usage;
+    int error_code;
+    char *error_msg;
+} llm_sse_event_t;
+
+typedef void (*llm_sse_event_cb_t)(const llm_sse_event_t *event, void *user_data);
+
+/*
+ * @brief      Incremental SSE/JSON stream parser
+ */
+typedef struct
+{
+    char *buffer;
+    int buffer_size;
+    int len;
+    llm_sse_event_cb_t on_event;
+    void *user_data;
+} llm_sse_parser_t;
+
+/*
+ * @brief      Initialize the parser on a caller owned buffer
+ *
+ * @param      parser       The parser
+ * @param      buffer       The receive buffer, also used to decode events in place
+ * @param[in]  buffer_size  The buffer size, must hold the longest event line
+ * @param[in]  on_event     Called for every `data:` line (or plain JSON body)
+ * @param      user_data    The user data passed to `on_event`
+ */
+void llm_sse_parser_init(llm_sse_parser_t *parser, char *buffer, int buffer_size, llm_sse_event_cb_t on_event, void *user_data);
+
+/*
+ * @brief      Get where the next received bytes must be written
+ *
+ * @param      parser     The parser
+ * @param[out] available  The free space at the returned address
+ *
+ * @return     The write position inside the parser buffer
+ */
+char *llm_sse_parser_get_write_ptr(llm_sse_parser_t *parser, int *available);
+
+/*
+ * @brief      Parse `len` bytes just written at the write position, an incomplete
+ *             trailing line is kept for the next call
+ *
+ * @param      parser  The parser
+ * @param[in]  len     The number of bytes received
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_ERR_INVALID_SIZE  A line did not fit into the buffer and was dropped
+ */
+esp_err_t llm_sse_parser_feed(llm_sse_parser_t *parser, int len);
+
+/*
+ * @brief      Parse the last line if the stream ended without a newline
+ *
+ * @param      parser  The parser
+ */
+void llm_sse_parser_finish(llm_sse_parser_t *parser);
+
+#endif
@@ -11,6 +11,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "nvs_flash.h"
 
@@ -26,11 +27,12 @@
 #include "google_tts.h"
 #include "google_sr.h"
 #include "llm_ask.h"
+#include "latency_trace.h"
+#include "esp_sntp.h"
 
 #include "audio_idf_version.h"
 
-#include "baidu_access_token.h"
-#include "llm_access_token.h"
+#include "token_manager.h"
 
 #if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 1, 0))
 #include "esp_netif.h"
@@ -41,10 +43,33 @@
 static const char *TAG = "LLM_TOY_DEMO";
 
 #define RECORD_PLAYBACK_SAMPLE_RATE (16000)
+#define MAIN_TASK_STACK (8 * 1024)
+#define MAIN_TASK_PRIO (5)
+#define MAIN_STATS_TASK_STACK (3 * 1024)
+#define MAIN_STATS_TASK_PRIO (1)
+#define MAIN_STATS_BUFFER_SIZE (2048)
+#define MAIN_EVENT_BARGE_IN (1)
+
+#if CONFIG_BARGE_IN
+#define BARGE_IN_ENABLED (true)
+#else
+#define BARGE_IN_ENABLED (false)
+#endif
 
 esp_periph_handle_t led_handle = NULL;
 
 google_tts_handle_t tts;
+llm_ask_handle_t ask;
+
+//* set by speech over a playing answer, the rest of that answer is dropped
+static volatile bool barge_in = false;
+static volatile bool answer_playing = false;
+//* events main_task sends itself from the callbacks of other tasks
+static audio_event_iface_handle_t main_evt;
+//* number of the question the LLM task is answering, 0 if none
+static uint32_t llm_answer = 0;
+//* when each stage of the round trip is given up, esp_timer us, 0 while it does not run
+static int64_t stage_deadline[TRACE_STAGE_MAX];
 
 void google_sr_begin(google_sr_handle_t sr)
 {
@@ -52,13 +77,216 @@ void google_sr_begin(google_sr_handle_t sr)
         periph_led_blink(led_handle, get_green_led_gpio(), 500, 500, true, -1, 0);
     }
     ESP_LOGW(TAG, "Start speaking now");
+    //* the first upload happens at the speech onset, called from the ASR upload task,
+    //* the answer is stopped in main_task where everything else about it is decided
+    if (answer_playing) {
+        audio_event_iface_msg_t msg = {
+            .cmd = MAIN_EVENT_BARGE_IN,
+            .source = main_evt,
+        };
+        audio_event_iface_sendout(main_evt, &msg);
+    }
+}
+
+#if CONFIG_SR_STREAMING
+void google_sr_partial(google_sr_handle_t sr, const char *text, bool stable)
+{
+    ESP_LOGI(TAG, "Partial%s: %s", stable ? " (stable)" : "", text);
+    //* the user paused, ask now and keep the answer back until the final text agrees
+    if (stable) {
+        llm_ask_speculate(ask, text);
+    }
 }
+#endif
 
 void llm_ask_respone(llm_ask_handle_t ask)
 {
-    google_tts_start(tts, ask->answer);
+    if (!barge_in) {
+        google_tts_stream_feed(tts, ask->answer);
+    }
+}
+
+static void main_asr_token(const char *token, void *user_data)
+{
+    baidu_sr_reset_token((google_sr_handle_t)user_data, token);
+    google_tts_set_token(tts, token);
+}
+
+static void main_llm_token(const char *token, void *user_data)
+{
+    llm_ask_set_token((llm_ask_handle_t)user_data, token);
 }
 
+static void main_stage_arm(latency_trace_stage_t stage, int timeout_ms)
+{
+    stage_deadline[stage] = timeout_ms > 0 ? esp_timer_get_time() + timeout_ms * 1000LL : 0;
+}
+
+/*
+ * Ticks until the nearest deadline, the event loop wakes up for it without an event
+ */
+static TickType_t main_stage_wait(void)
+{
+    int64_t next = 0;
+    for (int i = 0; i < TRACE_STAGE_MAX; i++) {
+        if (stage_deadline[i] && (next == 0 || stage_deadline[i] < next)) {
+            next = stage_deadline[i];
+        }
+    }
+    if (next == 0) {
+        return portMAX_DELAY;
+    }
+    int64_t left_ms = (next - esp_timer_get_time()) / 1000;
+    return left_ms > 0 ? pdMS_TO_TICKS(left_ms) + 1 : 0;
+}
+
+/*
+ * Drop whatever is asked, played or recorded and record a new question, from the button or the wake word
+ */
+static void main_start_recording(google_sr_handle_t sr, bool wake)
+{
+    answer_playing = false;
+    //* the answer still streaming in is dropped, its finish event with it
+    llm_ask_abort(ask);
+    llm_answer = 0;
+    google_tts_stop(tts);
+    main_stage_arm(TRACE_STAGE_LLM, 0);
+    main_stage_arm(TRACE_STAGE_TTS, 0);
+    main_stage_arm(TRACE_STAGE_SR, CONFIG_SR_RECORD_TIMEOUT_MS);
+    ESP_LOGI(TAG, "[ * ] Resuming pipeline");
+    if (wake) {
+        google_sr_start_wake(sr);
+    } else {
+        google_sr_start(sr);
+    }
+    //* the ASR upload connects right away, open the LLM and TTS connections while the user speaks
+    llm_ask_prewarm(ask);
+    google_tts_prewarm(tts);
+}
+
+/*
+ * Speech over the playing answer, drop the rest of it and keep recording the new question
+ */
+static void main_barge_in(void)
+{
+    //* the answer ended between the speech onset and this event
+    if (!answer_playing) {
+        return;
+    }
+    latency_trace_round_begin();
+    latency_trace_record(TRACE_BARGE_IN, 0);
+    ESP_LOGW(TAG, "Barge-in, stop the answer");
+    barge_in = true;
+    answer_playing = false;
+    llm_ask_abort(ask);
+    llm_answer = 0;
+    google_tts_stop(tts);
+    main_stage_arm(TRACE_STAGE_LLM, 0);
+    main_stage_arm(TRACE_STAGE_TTS, 0);
+}
+
+/*
+ * Return true if the recording goes on while the answer is played
+ */
+static bool main_ask_llm(google_sr_handle_t sr, llm_ask_handle_t ask)
+{
+    periph_led_stop(led_handle, get_green_led_gpio());
+    main_stage_arm(TRACE_STAGE_SR, 0);
+
+    char *original_text = google_sr_stop(sr);
+    if (original_text == NULL) {
+        return false;
+    }
+    if (strlen(original_text) == 0) {
+        ESP_LOGE(TAG, "Original is Empty");
+        free(original_text);
+        return false;
+    }
+    ESP_LOGI(TAG, "Original text = %s", original_text);
+    //* answered in the LLM task, the loop goes on with button and TTS events meanwhile
+    llm_answer = llm_ask_post(ask, original_text);
+    free(original_text);
+    if (llm_answer == 0) {
+        return false;
+    }
+    main_stage_arm(TRACE_STAGE_LLM, CONFIG_LLM_ANSWER_TIMEOUT_MS);
+    barge_in = false;
+    google_tts_stream_begin(tts);
+#if CONFIG_BARGE_IN
+    //* listen through the answer, the echo canceller removes it from the recording
+    answer_playing = true;
+    google_sr_start(sr);
+#endif
+    return BARGE_IN_ENABLED;
+}
+
+/*
+ * Give up the stages past their deadline as if the user had moved on, return true if the recording goes on
+ */
+static bool main_stage_timeout(google_sr_handle_t sr, bool is_recording)
+{
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < TRACE_STAGE_MAX; i++) {
+        if (stage_deadline[i] == 0 || stage_deadline[i] > now) {
+            continue;
+        }
+        stage_deadline[i] = 0;
+        latency_trace_record(TRACE_STAGE_TIMEOUT, i);
+        if (i == TRACE_STAGE_SR && is_recording && !answer_playing) {
+            ESP_LOGW(TAG, "[ * ] Recording timed out");
+            //* what was said so far is asked, a recording nobody spoke into is dropped
+            if (google_sr_speech_detected(sr)) {
+                is_recording = main_ask_llm(sr, ask);
+            } else {
+                periph_led_stop(led_handle, get_green_led_gpio());
+                free(google_sr_stop(sr));
+                is_recording = false;
+            }
+        } else if (i == TRACE_STAGE_LLM && llm_answer) {
+            ESP_LOGW(TAG, "[ * ] LLM answer timed out");
+            //* the sentences already here are still played
+            llm_ask_abort(ask);
+            llm_answer = 0;
+            if (!barge_in) {
+                google_tts_stream_end(tts);
+                main_stage_arm(TRACE_STAGE_TTS, CONFIG_TTS_ANSWER_TIMEOUT_MS);
+            }
+        } else if (i == TRACE_STAGE_TTS) {
+            ESP_LOGW(TAG, "[ * ] TTS answer timed out");
+            google_tts_stop(tts);
+            //* like the end of the answer, the recording that listened through it stops
+            if (answer_playing && is_recording && !google_sr_speech_detected(sr)) {
+                free(google_sr_stop(sr));
+                is_recording = false;
+            }
+            answer_playing = false;
+        }
+    }
+    return is_recording;
+}
+
+#if CONFIG_TASK_STATS
+static void main_log_task_stats(void)
+{
+    char *stats = malloc(MAIN_STATS_BUFFER_SIZE);
+    if (stats == NULL) {
+        return;
+    }
+    //* CPU time since boot, compare two logs for the load in between
+    vTaskGetRunTimeStats(stats);
+    ESP_LOGI(TAG, "Task stats:\n%s", stats);
+    free(stats);
+}
+
+static void main_stats_task(void *pv)
+{
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_TASK_STATS_INTERVAL_S * 1000));
+        main_log_task_stats();
+    }
+}
+#endif
+
 void main_task(void *pv)
 {
     esp_err_t err = nvs_flash_init();
@@ -109,43 +337,120 @@ void main_task(void *pv)
     esp_periph_start(set, led_handle);
 
     periph_wifi_wait_for_connected(wifi_handle, portMAX_DELAY);
+    //* tokens and cached answers are stamped with the wall clock, so they expire across reboots
+    sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    sntp_setservername(0, "pool.ntp.org");
+    sntp_init();
 
     ESP_LOGI(TAG, "[ 2 ] Start codec chip");
     audio_board_handle_t board_handle = audio_board_init();
     audio_hal_ctrl_codec(board_handle->audio_hal, AUDIO_HAL_CODEC_MODE_BOTH, AUDIO_HAL_CTRL_START);
     audio_hal_set_volume(board_handle->audio_hal, 70);
 
-    // get baidu access token
-    char *baidu_access_token = baidu_get_access_token(CONFIG_BAIDU_ASR_ACCESS_KEY, CONFIG_BAIDU_ASR_ACCESS_SECERT);
+    //* tokens kept in NVS are used right away, only missing ones are fetched before going on
+    token_manager_config_t token_config = TOKEN_MANAGER_DEFAULT_CONFIG();
+    token_config.access_key[TOKEN_ASR] = CONFIG_BAIDU_ASR_ACCESS_KEY;
+    token_config.access_secret[TOKEN_ASR] = CONFIG_BAIDU_ASR_ACCESS_SECERT;
+    token_config.access_key[TOKEN_LLM] = CONFIG_BAIDU_GPT_ACCESS_KEY;
+    token_config.access_secret[TOKEN_LLM] = CONFIG_BAIDU_GPT_ACCESS_SECERT;
+    token_manager_init(&token_config);
+    char *baidu_access_token = token_manager_get(TOKEN_ASR);
+    char *llm_access_token = token_manager_get(TOKEN_LLM);
+
+    google_tts_config_t tts_config = {
+        .api_token = baidu_access_token ? baidu_access_token : "",
+        .playback_sample_rate = RECORD_PLAYBACK_SAMPLE_RATE,
+        .codec_sample_rate = CONFIG_CODEC_SAMPLE_RATE,
+        .agc_target_db = CONFIG_TTS_AGC_TARGET_DB,
+        .echo_reference = BARGE_IN_ENABLED,
+#if CONFIG_TTS_CACHE
+        .cache_partition = "tts_cache",
+#endif
+        .audio_core = CONFIG_AUDIO_TASK_CORE,
+        .net_core = CONFIG_NET_TASK_CORE,
+#if CONFIG_TTS_FORMAT_PCM
+        .format = TTS_FORMAT_PCM,
+#elif CONFIG_TTS_FORMAT_MP3
+        .format = TTS_FORMAT_MP3,
+#else
+        .format = TTS_FORMAT_AUTO,
+#endif
+    };
+    tts = google_tts_init(&tts_config);
 
+    //* in order of preference when no probe tells them apart, the offline stub keeps the toy answering without a network
+    static const sr_backend_t *const sr_backends[] = {
+        &sr_backend_baidu,
+#if CONFIG_MOCK_SERVER
+        &sr_backend_raw_pcm,
+#endif
+        &sr_backend_offline,
+    };
     google_sr_config_t sr_config = {
-        .api_token = baidu_access_token,
+        .api_token = baidu_access_token ? baidu_access_token : "",
         .record_sample_rates = RECORD_PLAYBACK_SAMPLE_RATE,
+        .codec_sample_rate = CONFIG_CODEC_SAMPLE_RATE,
         .on_begin = google_sr_begin,
         .buffer_size = DEFAULT_SR_BUFFER_SIZE,
+        .vad_end_silence_ms = 1000,
+        // Baidu ASR only takes pcm/wav/amr/m4a, use ENCODING_IMA_ADPCM with the test server
+        .encoding = ENCODING_LINEAR16,
+        // Same rate as the playback, the echo canceller needs both in step
+        .echo_reference = google_tts_get_echo_reference(tts),
+#if CONFIG_BARGE_IN
+        .echo_tail_ms = CONFIG_BARGE_IN_ECHO_TAIL_MS,
+#endif
+#if CONFIG_SR_STREAMING
+        .on_partial = google_sr_partial,
+        .partial_stable_ms = CONFIG_SR_PARTIAL_STABLE_MS,
+#endif
+        .backends = sr_backends,
+        .backend_num = sizeof(sr_backends) / sizeof(sr_backends[0]),
+        .audio_core = CONFIG_AUDIO_TASK_CORE,
+        .net_core = CONFIG_NET_TASK_CORE,
+        .pre_roll_ms = CONFIG_SR_PRE_ROLL_MS,
+        .noise_suppression_db = CONFIG_SR_NOISE_SUPPRESSION_DB,
+#if CONFIG_SR_NOISE_FIXED_POINT
+        .noise_fixed_point = true,
+#endif
+        .agc_target_db = CONFIG_SR_AGC_TARGET_DB,
+#if CONFIG_WAKE_WORD
+        .wake_model_partition = "kws_model",
+        .wake_threshold = CONFIG_WAKE_WORD_THRESHOLD,
+#endif
     };
     google_sr_handle_t sr = google_sr_init(&sr_config);
 
-    google_tts_config_t tts_config = {
-        .api_token = baidu_access_token,
-        .playback_sample_rate = RECORD_PLAYBACK_SAMPLE_RATE,
-    };
-    tts = google_tts_init(&tts_config);
-
-    char *llm_access_token = llm_get_access_token(CONFIG_BAIDU_GPT_ACCESS_KEY, CONFIG_BAIDU_GPT_ACCESS_SECERT);
     llm_ask_config_t llm_config = {
-        .api_token = llm_access_token,
+        .api_token = llm_access_token ? llm_access_token : "",
         .on_respone = llm_ask_respone,
+#if CONFIG_LLM_ANSWER_CACHE
+        .cache_partition = "llm_cache",
+        .cache_ttl_s = CONFIG_LLM_ANSWER_CACHE_TTL,
+#endif
+#if CONFIG_SR_STREAMING
+        .speculate = true,
+#endif
+        .task_core = CONFIG_NET_TASK_CORE,
+        .task_prio = CONFIG_LLM_TASK_PRIO,
     };
-    llm_ask_handle_t ask = llm_ask_init(&llm_config);
+    ask = llm_ask_init(&llm_config);
+    free(baidu_access_token);
+    free(llm_access_token);
+    //* refreshed tokens are swapped into the contexts from the token task
+    token_manager_add_listener(TOKEN_ASR, main_asr_token, sr);
+    token_manager_add_listener(TOKEN_LLM, main_llm_token, ask);
 
     ESP_LOGI(TAG, "[ 4 ] Set up  event listener");
     audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
     audio_event_iface_handle_t evt = audio_event_iface_init(&evt_cfg);
+    main_evt = audio_event_iface_init(&evt_cfg);
+    audio_event_iface_set_listener(main_evt, evt);
 
     ESP_LOGI(TAG, "[4.1] Listening event from the pipeline");
     google_sr_set_listener(sr, evt);
     google_tts_set_listener(tts, evt);
+    llm_ask_set_listener(ask, evt);
 
     ESP_LOGI(TAG, "[4.2] Listening event from peripherals");
     audio_event_iface_set_listener(esp_periph_set_get_event_iface(set), evt);
@@ -153,10 +458,17 @@ void main_task(void *pv)
     google_tts_start(tts, "设备已启动");
 
     ESP_LOGI(TAG, "[ 5 ] Listen for all pipeline events");
+    bool is_recording = false;
     while (1) {
         ESP_LOGI(TAG, "[ * ] pipeline loop");
+        //* checked every round, a steady stream of events would keep the listen below from ever timing out
+        is_recording = main_stage_timeout(sr, is_recording);
         audio_event_iface_msg_t msg;
-        if (audio_event_iface_listen(evt, &msg, portMAX_DELAY) != ESP_OK) {
+        TickType_t wait = main_stage_wait();
+        if (audio_event_iface_listen(evt, &msg, wait) != ESP_OK) {
+            if (wait != portMAX_DELAY) {
+                continue;
+            }
             ESP_LOGW(TAG, "[ * ] Event process failed: src_type:%d, source:%p cmd:%d, data:%p, data_len:%d",
                      msg.source_type, msg.source, msg.cmd, msg.data, msg.data_len);
             continue;
@@ -165,8 +477,63 @@ void main_task(void *pv)
         ESP_LOGI(TAG, "[ * ] Event received: src_type:%d, source:%p cmd:%d, data:%p, data_len:%d",
                  msg.source_type, msg.source, msg.cmd, msg.data, msg.data_len);
 
+        if (msg.source == (void *)main_evt && msg.cmd == MAIN_EVENT_BARGE_IN) {
+            main_barge_in();
+            continue;
+        }
+
+        if (llm_answer && llm_ask_check_event_finish(ask, &msg, llm_answer)) {
+            ESP_LOGI(TAG, "[ * ] LLM Finish");
+            llm_answer = 0;
+            main_stage_arm(TRACE_STAGE_LLM, 0);
+            if (ask->token_rejected) {
+                token_manager_invalidate(TOKEN_LLM);
+            }
+            if (!barge_in) {
+                google_tts_stream_end(tts);
+                main_stage_arm(TRACE_STAGE_TTS, CONFIG_TTS_ANSWER_TIMEOUT_MS);
+            }
+            continue;
+        }
+
         if (google_tts_check_event_finish(tts, &msg)) {
             ESP_LOGI(TAG, "[ * ] TTS Finish");
+            //* played to the end and nobody spoke over it, stop listening,
+            //* STOPPED comes from a barge-in or from the start of the next answer
+            if ((int)msg.data == AEL_STATUS_STATE_FINISHED) {
+                main_stage_arm(TRACE_STAGE_TTS, 0);
+            }
+            if ((int)msg.data == AEL_STATUS_STATE_FINISHED && answer_playing) {
+                answer_playing = false;
+                if (is_recording && !google_sr_speech_detected(sr)) {
+                    free(google_sr_stop(sr));
+                    is_recording = false;
+                }
+            }
+            //* nothing is played, recorded or asked, a flash erase stalls nobody now
+            if (!is_recording && llm_answer == 0) {
+                llm_ask_flush_cache(ask);
+                google_tts_flush_cache(tts);
+            }
+            continue;
+        }
+
+        if (is_recording && google_sr_check_event_finish(sr, &msg)) {
+            ESP_LOGI(TAG, "[ * ] End of speech detected");
+            latency_trace_record(TRACE_SR_SPEECH_END, 0);
+            is_recording = main_ask_llm(sr, ask);
+            continue;
+        }
+
+        if (google_sr_check_event_wake(sr, &msg)) {
+            //* a recording is already listening, the wake word is part of what it hears
+            if (!is_recording) {
+                ESP_LOGI(TAG, "[ * ] Wake word");
+                latency_trace_round_begin();
+                latency_trace_record(TRACE_WAKE_WORD, 0);
+                main_start_recording(sr, true);
+                is_recording = true;
+            }
             continue;
         }
 
@@ -178,6 +545,13 @@ void main_task(void *pv)
         // It's MODE button
         if ((int)msg.data == get_input_mode_id()) {
             ESP_LOGI(TAG, "[ * ] MODE button pressed");
+            if (msg.cmd == PERIPH_BUTTON_PRESSED) {
+                latency_trace_dump();
+                latency_trace_export_chrome(stdout);
+#if CONFIG_TASK_STATS
+                main_log_task_stats();
+#endif
+            }
             continue;
         }
 
@@ -187,25 +561,22 @@ void main_task(void *pv)
         }
 
         if (msg.cmd == PERIPH_BUTTON_PRESSED) {
-            google_tts_stop(tts);
-            ESP_LOGI(TAG, "[ * ] Resuming pipeline");
-            google_sr_start(sr);
-        } else if (msg.cmd == PERIPH_BUTTON_RELEASE || msg.cmd == PERIPH_BUTTON_LONG_RELEASE) {
-            ESP_LOGI(TAG, "[ * ] Stop pipeline");
-
-            periph_led_stop(led_handle, get_green_led_gpio());
-
-            char *original_text = google_sr_stop(sr);
-            if (original_text == NULL) {
-                continue;
+            latency_trace_round_begin();
+            latency_trace_record(TRACE_BUTTON_PRESS, 0);
+            //* drop the recording that listened through the answer
+            if (is_recording) {
+                free(google_sr_stop(sr));
             }
-            if (strlen(original_text) == 0) {
-                ESP_LOGE(TAG, "Original is Empty");
+            main_start_recording(sr, false);
+            is_recording = true;
+        } else if (msg.cmd == PERIPH_BUTTON_RELEASE || msg.cmd == PERIPH_BUTTON_LONG_RELEASE) {
+            //* already finished by the end of speech detection
+            if (!is_recording) {
                 continue;
             }
-            ESP_LOGI(TAG, "Original text = %s", original_text);
-            ask->question = original_text;
-            llm_post_response(ask);
+            ESP_LOGI(TAG, "[ * ] Stop pipeline");
+            latency_trace_record(TRACE_BUTTON_RELEASE, 0);
+            is_recording = main_ask_llm(sr, ask);
         }
 
     }
@@ -216,6 +587,8 @@ void main_task(void *pv)
     /* Stop all periph before removing the listener */
     esp_periph_set_stop_all(set);
     audio_event_iface_remove_listener(esp_periph_set_get_event_iface(set), evt);
+    audio_event_iface_remove_listener(main_evt, evt);
+    audio_event_iface_destroy(main_evt);
 
     /* Make sure audio_pipeline_remove_listener & audio_event_iface_remove_listener are called before destroying event_iface */
     audio_event_iface_destroy(evt);
@@ -227,5 +600,8 @@ void app_main(void)
 {
     esp_log_level_set("*", ESP_LOG_INFO);
     esp_log_level_set(TAG, ESP_LOG_INFO);
-    xTaskCreate(main_task, "main_task", 8 * 1024, NULL, 5, NULL);
+    xTaskCreatePinnedToCore(main_task, "main_task", MAIN_TASK_STACK, NULL, MAIN_TASK_PRIO, NULL, CONFIG_NET_TASK_CORE);
+#if CONFIG_TASK_STATS
+    xTaskCreate(main_stats_task, "stats_task", MAIN_STATS_TASK_STACK, NULL, MAIN_STATS_TASK_PRIO, NULL);
+#endif
 }
\ No newline at end of file
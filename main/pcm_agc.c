@@ -0,0 +1,236 @@
+#include <string.h>
+#include <math.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_dsp.h"
+#include "audio_element.h"
+#include "audio_common.h"
+#include "audio_mem.h"
+#include "pcm_agc.h"
+
+static const char *TAG = "PCM_AGC";
+
+// Share of a block taken into the level, about 100 ms of speech
+#define PCM_AGC_LEVEL_MS        (100)
+#define PCM_AGC_EPS             (1e-10f)
+
+typedef struct {
+    pcm_agc_cfg_t   cfg;
+    int             block;      /*!< Samples per gain step, also the look-ahead */
+    int             in_max;
+    int16_t         *buf;       /*!< `block` delayed samples, then the new input */
+    int             fill;       /*!< New samples in `buf` */
+    float           *x_f32;
+    float           *ramp_f32;
+    int16_t         *ramp_s16;
+    float           level;      /*!< Mean square of the signal above the gate */
+    float           level_rate;
+    float           gain_db;    /*!< AGC gain */
+    float           attack;
+    float           release;
+    float           limit;      /*!< Ceiling as a sample value */
+    float           limiter;    /*!< Limiter gain on top of the AGC gain, 1 when no peak is near */
+    float           gain;       /*!< Gain at the end of the last block */
+    float           max_gain;
+    int64_t         cpu_us;
+    int64_t         samples;
+} pcm_agc_t;
+
+static float _agc_rate(int block, int sample_rate, int ms)
+{
+    return ms > 0 ? 1.0f - expf(-(float)block * 1000.0f / ((float)sample_rate * ms)) : 1.0f;
+}
+
+/*
+ * Gain at the end of the block at `x`, `x + block` is the look-ahead
+ */
+static float _agc_gain(pcm_agc_t *agc, const int16_t *x)
+{
+    const int n = agc->block;
+    int32_t peak = 0;
+    int64_t sum = 0;
+    for (int i = 0; i < 2 * n; i++) {
+        int32_t v = x[i] < 0 ? -x[i] : x[i];
+        peak = v > peak ? v : peak;
+    }
+    for (int i = n; i < 2 * n; i++) {
+        sum += (int32_t)x[i] * x[i];
+    }
+    //* the level of the newest block, held below the gate
+    float power = (float)sum / n;
+    if (10.0f * log10f(power / (32768.0f * 32768.0f) + PCM_AGC_EPS) > agc->cfg.gate_db) {
+        agc->level += agc->level_rate * (power - agc->level);
+        float want_db = agc->cfg.target_db - 10.0f * log10f(agc->level / (32768.0f * 32768.0f) + PCM_AGC_EPS);
+        if (want_db > agc->cfg.max_gain_db) {
+            want_db = agc->cfg.max_gain_db;
+        }
+        if (want_db < agc->cfg.min_gain_db) {
+            want_db = agc->cfg.min_gain_db;
+        }
+        agc->gain_db += (want_db < agc->gain_db ? agc->attack : agc->release) * (want_db - agc->gain_db);
+    }
+    float gain = powf(10.0f, agc->gain_db / 20.0f);
+
+    //* the limiter comes down at once for a peak in the look-ahead and recovers at the release rate
+    float bound = peak > 0 ? agc->limit / (peak * gain) : 1.0f;
+    agc->limiter += agc->release * (1.0f - agc->limiter);
+    if (agc->limiter > bound) {
+        agc->limiter = bound;
+    }
+    gain *= agc->limiter;
+    return gain > agc->max_gain ? agc->max_gain : gain;
+}
+
+/*
+ * Ramp from the last gain to `gain` over the block at `x`, in place. Both ends are below the ceiling
+ * over the block, the last one saw it as its look-ahead, so no sample clips.
+ */
+static void _agc_apply(pcm_agc_t *agc, int16_t *x, float gain)
+{
+    const int n = agc->block;
+    float from = agc->gain;
+    agc->gain = gain;
+    if (from == gain && fabsf(gain - 1.0f) < 1e-4f) {
+        return;
+    }
+    if (agc->cfg.fixed_point) {
+        if (from == gain && gain <= 1.0f) {
+            dsps_mulc_s16(x, x, n, (int16_t)(gain * 32767.0f), 1, 1);
+            return;
+        }
+        //* Q12, up to 8 times
+        float step = (gain - from) / n;
+        for (int i = 0; i < n; i++) {
+            agc->ramp_s16[i] = (int16_t)((from + step * (i + 1)) * 4096.0f);
+        }
+        dsps_mul_s16(x, agc->ramp_s16, x, n, 1, 1, 1, 12);
+        return;
+    }
+    float step = (gain - from) / n;
+    for (int i = 0; i < n; i++) {
+        agc->x_f32[i] = x[i];
+        agc->ramp_f32[i] = from + step * (i + 1);
+    }
+    dsps_mul_f32(agc->x_f32, agc->ramp_f32, agc->x_f32, n, 1, 1, 1);
+    for (int i = 0; i < n; i++) {
+        float v = agc->x_f32[i];
+        x[i] = v > 32767.0f ? 32767 : (v < -32768.0f ? -32768 : (int16_t)lrintf(v));
+    }
+}
+
+static esp_err_t _agc_open(audio_element_handle_t self)
+{
+    pcm_agc_t *agc = (pcm_agc_t *)audio_element_getdata(self);
+    agc->fill = 0;
+    memset(agc->buf, 0, agc->block * sizeof(int16_t));
+    return ESP_OK;
+}
+
+static esp_err_t _agc_close(audio_element_handle_t self)
+{
+    pcm_agc_t *agc = (pcm_agc_t *)audio_element_getdata(self);
+    if (agc->samples > 0) {
+        ESP_LOGI(TAG, "Gain %.1f dB, limiter %.1f dB, %d ns per sample", agc->gain_db,
+                 20.0f * log10f(agc->limiter + PCM_AGC_EPS), (int)(agc->cpu_us * 1000 / agc->samples));
+    }
+    agc->cpu_us = 0;
+    agc->samples = 0;
+    return ESP_OK;
+}
+
+static audio_element_err_t _agc_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    pcm_agc_t *agc = (pcm_agc_t *)audio_element_getdata(self);
+    int r_size = audio_element_input(self, (char *)(agc->buf + agc->block + agc->fill),
+                                     (agc->in_max - agc->fill) * sizeof(int16_t));
+    if (r_size <= 0) {
+        return r_size;
+    }
+    agc->fill += r_size / sizeof(int16_t);
+    int blocks = agc->fill / agc->block;
+    if (blocks == 0) {
+        return r_size;
+    }
+    int64_t start = esp_timer_get_time();
+    for (int b = 0; b < blocks; b++) {
+        int16_t *x = agc->buf + b * agc->block;
+        _agc_apply(agc, x, _agc_gain(agc, x));
+    }
+    agc->cpu_us += esp_timer_get_time() - start;
+    int out_n = blocks * agc->block;
+    agc->samples += out_n;
+    int ret = audio_element_output(self, (char *)agc->buf, out_n * sizeof(int16_t));
+    //* the newest block and any rest become the delay of the next process
+    agc->fill -= out_n;
+    memmove(agc->buf, agc->buf + out_n, (agc->block + agc->fill) * sizeof(int16_t));
+    return ret < 0 ? ret : r_size;
+}
+
+static void _agc_free(pcm_agc_t *agc)
+{
+    audio_free(agc->buf);
+    audio_free(agc->x_f32);
+    audio_free(agc->ramp_f32);
+    audio_free(agc->ramp_s16);
+    audio_free(agc);
+}
+
+static esp_err_t _agc_destroy(audio_element_handle_t self)
+{
+    _agc_free((pcm_agc_t *)audio_element_getdata(self));
+    return ESP_OK;
+}
+
+audio_element_handle_t pcm_agc_init(pcm_agc_cfg_t *config)
+{
+    pcm_agc_t *agc = audio_calloc(1, sizeof(pcm_agc_t));
+    AUDIO_MEM_CHECK(TAG, agc, return NULL);
+    agc->cfg = *config;
+    if (config->fixed_point && agc->cfg.max_gain_db > PCM_AGC_FIXED_MAX_GAIN_DB) {
+        agc->cfg.max_gain_db = PCM_AGC_FIXED_MAX_GAIN_DB;
+    }
+    agc->in_max = PCM_AGC_BUFFER_LEN / sizeof(int16_t);
+    agc->block = config->lookahead_ms * config->sample_rate / 1000;
+    if (agc->block < 1 || agc->block > agc->in_max) {
+        agc->block = agc->in_max;
+    }
+    agc->buf = audio_calloc(agc->block + agc->in_max, sizeof(int16_t));
+    AUDIO_MEM_CHECK(TAG, agc->buf, goto _agc_init_exit);
+    if (config->fixed_point) {
+        agc->ramp_s16 = audio_calloc(agc->block, sizeof(int16_t));
+        AUDIO_MEM_CHECK(TAG, agc->ramp_s16, goto _agc_init_exit);
+    } else {
+        agc->x_f32 = audio_calloc(agc->block, sizeof(float));
+        agc->ramp_f32 = audio_calloc(agc->block, sizeof(float));
+        AUDIO_MEM_CHECK(TAG, agc->x_f32 && agc->ramp_f32, goto _agc_init_exit);
+    }
+    agc->level_rate = _agc_rate(agc->block, config->sample_rate, PCM_AGC_LEVEL_MS);
+    agc->attack = _agc_rate(agc->block, config->sample_rate, config->attack_ms);
+    agc->release = _agc_rate(agc->block, config->sample_rate, config->release_ms);
+    agc->limit = 32767.0f * powf(10.0f, config->limit_db / 20.0f);
+    agc->max_gain = config->fixed_point ? 32767.0f / 4096.0f : powf(10.0f, agc->cfg.max_gain_db / 20.0f);
+    agc->limiter = 1.0f;
+    agc->gain = 1.0f;
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _agc_open;
+    cfg.close = _agc_close;
+    cfg.process = _agc_process;
+    cfg.destroy = _agc_destroy;
+    cfg.buffer_len = PCM_AGC_BUFFER_LEN;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.tag = "agc";
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto _agc_init_exit);
+    audio_element_setdata(el, agc);
+    ESP_LOGI(TAG, "Target %d dBFS, %d to %d dB, ceiling %d dBFS, %d samples look-ahead, %s", config->target_db,
+             agc->cfg.min_gain_db, agc->cfg.max_gain_db, config->limit_db, agc->block,
+             config->fixed_point ? "Q15" : "float");
+    return el;
+_agc_init_exit:
+    _agc_free(agc);
+    return NULL;
+}
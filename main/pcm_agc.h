@@ -0,0 +1,73 @@
+#ifndef _PCM_AGC_H_
+#define _PCM_AGC_H_
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PCM_AGC_TASK_STACK          (3 * 1024)
+#define PCM_AGC_TASK_CORE           (1)
+#define PCM_AGC_TASK_PRIO           (5)
+#define PCM_AGC_BUFFER_LEN          (512)
+#define PCM_AGC_RINGBUFFER_SIZE     (4 * 1024)
+// The Q12 gain of the fixed point path stays below 8
+#define PCM_AGC_FIXED_MAX_GAIN_DB   (18)
+
+/**
+ * Automatic gain control element configurations, 16 bit mono PCM
+ */
+typedef struct {
+    int sample_rate;            /*!< Input sample rate */
+    int target_db;              /*!< Level the gain steers the signal to (dBFS RMS) */
+    int max_gain_db;            /*!< Most the gain raises a quiet signal */
+    int min_gain_db;            /*!< Most the gain lowers a loud signal */
+    int gate_db;                /*!< Below this level the gain holds, so silence and noise are not raised */
+    int limit_db;               /*!< Peak ceiling of the output (dBFS) */
+    int lookahead_ms;           /*!< Delay of the output, the limiter sees a peak this long before it */
+    int attack_ms;              /*!< Time constant of the gain coming down */
+    int release_ms;             /*!< Time constant of the gain going up */
+    bool fixed_point;           /*!< Q15/Q12 gains, else float */
+    int out_rb_size;            /*!< Size of output ringbuffer */
+    int task_stack;             /*!< Task stack size */
+    int task_core;              /*!< Task running in core (0 or 1) */
+    int task_prio;              /*!< Task priority (based on freeRTOS priority) */
+} pcm_agc_cfg_t;
+
+#define DEFAULT_PCM_AGC_CONFIG() {                  \
+    .sample_rate        = 16000,                    \
+    .target_db          = -20,                      \
+    .max_gain_db        = 18,                       \
+    .min_gain_db        = -12,                      \
+    .gate_db            = -50,                      \
+    .limit_db           = -1,                       \
+    .lookahead_ms       = 4,                        \
+    .attack_ms          = 50,                       \
+    .release_ms         = 500,                      \
+    .fixed_point        = true,                     \
+    .out_rb_size        = PCM_AGC_RINGBUFFER_SIZE,  \
+    .task_stack         = PCM_AGC_TASK_STACK,       \
+    .task_core          = PCM_AGC_TASK_CORE,        \
+    .task_prio          = PCM_AGC_TASK_PRIO,        \
+}
+
+/**
+ * @brief      Create the AGC element, a slow gain towards `target_db` and a look-ahead peak limiter
+ *
+ *             The gain is worked out once per block of `lookahead_ms` and ramped over the block, so a peak
+ *             is limited before it arrives and the output never clips. The gain outlives a restart.
+ *
+ * @param      config  The configuration
+ *
+ * @return     The audio element handle
+ */
+audio_element_handle_t pcm_agc_init(pcm_agc_cfg_t *config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,296 @@
+#include <string.h>
+#include <math.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_dsp.h"
+#include "audio_element.h"
+#include "audio_common.h"
+#include "audio_mem.h"
+#include "pcm_resample.h"
+
+static const char *TAG = "PCM_RESAMPLE";
+
+// Lowpass cutoff as a share of the lower Nyquist frequency, the rest is the transition band
+#define PCM_RESAMPLE_CUTOFF         (0.9f)
+
+typedef struct {
+    pcm_resample_cfg_t  cfg;
+    int                 up;         /*!< The rate ratio reduced, dest_rate / src_rate = up / down */
+    int                 down;
+    int                 taps;       /*!< Input samples under one output sample */
+    int                 in_max;     /*!< Input samples per process */
+    int                 out_max;
+    int16_t             *in;        /*!< `carry` samples kept from the last process, then the new input */
+    int                 carry;
+    int16_t             *out;
+    float               *in_f32;
+    float               *out_f32;
+    /* polyphase, one bank of `taps` coefficients per phase, time reversed for a dot product over the input */
+    int16_t             *bank_s16;
+    float               *bank_f32;
+    int                 phase;
+    int                 pos;        /*!< Newest input sample of the next output, index into `in` */
+    /* integer decimation */
+    fir_s16_t           fir_s16;
+    fir_f32_t           fir_f32;
+    int16_t             *delay_s16;
+    float               *delay_f32;
+    int64_t             cpu_us;
+    int64_t             out_samples;
+} pcm_resample_t;
+
+static int _resample_gcd(int a, int b)
+{
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static inline int16_t _resample_clip(float x)
+{
+    return x > 32767.0f ? 32767 : (x < -32768.0f ? -32768 : (int16_t)lrintf(x));
+}
+
+/*
+ * Blackman windowed sinc at the rate `up` times the input rate, unity gain in every phase
+ */
+static float *_resample_design(pcm_resample_t *rs)
+{
+    int len = rs->taps * rs->up;
+    float *h = audio_calloc(len, sizeof(float));
+    AUDIO_MEM_CHECK(TAG, h, return NULL);
+    float fc = PCM_RESAMPLE_CUTOFF * 0.5f / (rs->up > rs->down ? rs->up : rs->down);
+    for (int i = 0; i < len; i++) {
+        float m = i - (len - 1) / 2.0f;
+        float x = (float)M_PI * 2 * fc * m;
+        float sinc = m == 0 ? 1.0f : sinf(x) / x;
+        float w = 0.42f - 0.5f * cosf(2 * (float)M_PI * i / (len - 1)) + 0.08f * cosf(4 * (float)M_PI * i / (len - 1));
+        h[i] = 2 * fc * sinc * w * rs->up;
+    }
+    return h;
+}
+
+static esp_err_t _resample_setup(pcm_resample_t *rs)
+{
+    float *h = _resample_design(rs);
+    if (h == NULL) {
+        return ESP_FAIL;
+    }
+    int len = rs->taps * rs->up;
+    esp_err_t ret = ESP_FAIL;
+    if (rs->up == 1) {
+        //* the decimator only computes the outputs it keeps, the delay line has to be aligned for the S3
+        if (rs->cfg.fixed_point) {
+            rs->bank_s16 = audio_calloc(len, sizeof(int16_t));
+            rs->delay_s16 = heap_caps_aligned_calloc(16, len, sizeof(int16_t), MALLOC_CAP_8BIT);
+            AUDIO_MEM_CHECK(TAG, rs->bank_s16 && rs->delay_s16, goto _setup_exit);
+            for (int i = 0; i < len; i++) {
+                rs->bank_s16[i] = _resample_clip(h[i] * 32767.0f);
+            }
+            if (dsps_fird_init_s16(&rs->fir_s16, rs->bank_s16, rs->delay_s16, len, rs->down, 0, 0) != ESP_OK) {
+                goto _setup_exit;
+            }
+        } else {
+            rs->delay_f32 = audio_calloc(len, sizeof(float));
+            AUDIO_MEM_CHECK(TAG, rs->delay_f32, goto _setup_exit);
+            rs->bank_f32 = h;
+            h = NULL;
+            if (dsps_fird_init_f32(&rs->fir_f32, rs->bank_f32, rs->delay_f32, len, rs->down) != ESP_OK) {
+                goto _setup_exit;
+            }
+        }
+        rs->carry = 0;
+    } else {
+        if (rs->cfg.fixed_point) {
+            rs->bank_s16 = audio_calloc(len, sizeof(int16_t));
+            AUDIO_MEM_CHECK(TAG, rs->bank_s16, goto _setup_exit);
+        } else {
+            rs->bank_f32 = audio_calloc(len, sizeof(float));
+            AUDIO_MEM_CHECK(TAG, rs->bank_f32, goto _setup_exit);
+        }
+        for (int p = 0; p < rs->up; p++) {
+            for (int j = 0; j < rs->taps; j++) {
+                float c = h[p + (rs->taps - 1 - j) * rs->up];
+                if (rs->cfg.fixed_point) {
+                    rs->bank_s16[p * rs->taps + j] = _resample_clip(c * 32767.0f);
+                } else {
+                    rs->bank_f32[p * rs->taps + j] = c;
+                }
+            }
+        }
+        rs->carry = rs->taps - 1;
+        rs->pos = rs->carry;
+    }
+    ret = ESP_OK;
+_setup_exit:
+    audio_free(h);
+    return ret;
+}
+
+static int _resample_decimate(pcm_resample_t *rs, int n)
+{
+    int total = rs->carry + n;
+    int out_n = total / rs->down;
+    if (rs->cfg.fixed_point) {
+        dsps_fird_s16(&rs->fir_s16, rs->in, rs->out, out_n);
+    } else {
+        for (int i = 0; i < out_n * rs->down; i++) {
+            rs->in_f32[i] = rs->in[i];
+        }
+        dsps_fird_f32(&rs->fir_f32, rs->in_f32, rs->out_f32, out_n);
+        for (int i = 0; i < out_n; i++) {
+            rs->out[i] = _resample_clip(rs->out_f32[i]);
+        }
+    }
+    //* the samples short of a whole decimation step wait for the next input
+    rs->carry = total - out_n * rs->down;
+    memmove(rs->in, rs->in + out_n * rs->down, rs->carry * sizeof(int16_t));
+    return out_n;
+}
+
+static int _resample_polyphase(pcm_resample_t *rs, int n)
+{
+    int avail = rs->carry + n;
+    int out_n = 0;
+    if (!rs->cfg.fixed_point) {
+        for (int i = 0; i < avail; i++) {
+            rs->in_f32[i] = rs->in[i];
+        }
+    }
+    while (rs->pos < avail && out_n < rs->out_max) {
+        int base = rs->pos - rs->taps + 1;
+        if (rs->cfg.fixed_point) {
+            dsps_dotprod_s16(rs->bank_s16 + rs->phase * rs->taps, rs->in + base, &rs->out[out_n], rs->taps, 0);
+        } else {
+            float acc = 0;
+            dsps_dotprod_f32(rs->bank_f32 + rs->phase * rs->taps, rs->in_f32 + base, &acc, rs->taps);
+            rs->out[out_n] = _resample_clip(acc);
+        }
+        out_n++;
+        rs->phase += rs->down;
+        rs->pos += rs->phase / rs->up;
+        rs->phase %= rs->up;
+    }
+    rs->pos -= n;
+    memmove(rs->in, rs->in + n, rs->carry * sizeof(int16_t));
+    return out_n;
+}
+
+static esp_err_t _resample_close(audio_element_handle_t self)
+{
+    pcm_resample_t *rs = (pcm_resample_t *)audio_element_getdata(self);
+    if (rs->out_samples > 0) {
+        //* what the filter costs, next to the naive FIR which runs `taps * up` MACs per output
+        ESP_LOGI(TAG, "%d -> %d Hz, %d MACs and %d ns per output sample", rs->cfg.src_rate, rs->cfg.dest_rate,
+                 rs->taps, (int)(rs->cpu_us * 1000 / rs->out_samples));
+    }
+    rs->cpu_us = 0;
+    rs->out_samples = 0;
+    return ESP_OK;
+}
+
+static audio_element_err_t _resample_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    pcm_resample_t *rs = (pcm_resample_t *)audio_element_getdata(self);
+    char *in = (char *)(rs->in + rs->carry);
+    int r_size = audio_element_input(self, in, rs->in_max * sizeof(int16_t));
+    if (r_size <= 0) {
+        return r_size;
+    }
+    if (rs->cfg.multi_out_num > 0 && rs->cfg.tap_input) {
+        audio_element_multi_output(self, in, r_size, 0);
+    }
+    int64_t start = esp_timer_get_time();
+    int n = r_size / sizeof(int16_t);
+    int out_n = rs->up == 1 ? _resample_decimate(rs, n) : _resample_polyphase(rs, n);
+    rs->cpu_us += esp_timer_get_time() - start;
+    rs->out_samples += out_n;
+    if (out_n > 0) {
+        int ret = audio_element_output(self, (char *)rs->out, out_n * sizeof(int16_t));
+        if (ret < 0) {
+            return ret;
+        }
+        if (rs->cfg.multi_out_num > 0 && !rs->cfg.tap_input) {
+            audio_element_multi_output(self, (char *)rs->out, ret, 0);
+        }
+    }
+    return r_size;
+}
+
+static void _resample_free(pcm_resample_t *rs)
+{
+    if (rs->up == 1 && rs->cfg.fixed_point && rs->delay_s16) {
+        dsps_fird_s16_aexx_free(&rs->fir_s16);
+    }
+    heap_caps_free(rs->delay_s16);
+    audio_free(rs->delay_f32);
+    audio_free(rs->bank_s16);
+    audio_free(rs->bank_f32);
+    audio_free(rs->in);
+    audio_free(rs->out);
+    audio_free(rs->in_f32);
+    audio_free(rs->out_f32);
+    audio_free(rs);
+}
+
+static esp_err_t _resample_destroy(audio_element_handle_t self)
+{
+    _resample_free((pcm_resample_t *)audio_element_getdata(self));
+    return ESP_OK;
+}
+
+audio_element_handle_t pcm_resample_init(pcm_resample_cfg_t *config)
+{
+    int gcd = _resample_gcd(config->src_rate, config->dest_rate);
+    int up = config->dest_rate / gcd;
+    int down = config->src_rate / gcd;
+    if (up == down || up > PCM_RESAMPLE_PHASES_MAX) {
+        ESP_LOGE(TAG, "No resampler for %d -> %d Hz", config->src_rate, config->dest_rate);
+        return NULL;
+    }
+    pcm_resample_t *rs = audio_calloc(1, sizeof(pcm_resample_t));
+    AUDIO_MEM_CHECK(TAG, rs, return NULL);
+    rs->cfg = *config;
+    rs->up = up;
+    rs->down = down;
+    rs->taps = PCM_RESAMPLE_TAPS * ((down + up - 1) / up);
+    rs->in_max = PCM_RESAMPLE_BUFFER_LEN / sizeof(int16_t);
+    rs->out_max = rs->in_max * up / down + 2;
+    if (_resample_setup(rs) != ESP_OK) {
+        goto _resample_init_exit;
+    }
+    int in_size = rs->carry > down ? rs->carry + rs->in_max : down + rs->in_max;
+    rs->in = audio_calloc(in_size, sizeof(int16_t));
+    rs->out = audio_calloc(rs->out_max, sizeof(int16_t));
+    AUDIO_MEM_CHECK(TAG, rs->in && rs->out, goto _resample_init_exit);
+    if (!config->fixed_point) {
+        rs->in_f32 = audio_calloc(in_size, sizeof(float));
+        rs->out_f32 = audio_calloc(rs->out_max, sizeof(float));
+        AUDIO_MEM_CHECK(TAG, rs->in_f32 && rs->out_f32, goto _resample_init_exit);
+    }
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.close = _resample_close;
+    cfg.process = _resample_process;
+    cfg.destroy = _resample_destroy;
+    cfg.buffer_len = PCM_RESAMPLE_BUFFER_LEN;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.multi_out_rb_num = config->multi_out_num;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.tag = "resample";
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto _resample_init_exit);
+    audio_element_setdata(el, rs);
+    ESP_LOGI(TAG, "%d -> %d Hz, %d/%d, %d phases of %d taps, %s", config->src_rate, config->dest_rate, up, down,
+             up, rs->taps, config->fixed_point ? "Q15" : "float");
+    return el;
+_resample_init_exit:
+    _resample_free(rs);
+    return NULL;
+}
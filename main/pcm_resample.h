@@ -0,0 +1,66 @@
+#ifndef _PCM_RESAMPLE_H_
+#define _PCM_RESAMPLE_H_
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PCM_RESAMPLE_TASK_STACK     (3 * 1024)
+#define PCM_RESAMPLE_TASK_CORE      (1)
+#define PCM_RESAMPLE_TASK_PRIO      (5)
+#define PCM_RESAMPLE_BUFFER_LEN     (1024)
+#define PCM_RESAMPLE_RINGBUFFER_SIZE (4 * 1024)
+// Input samples under every output sample per decimation step, the stopband grows with it
+#define PCM_RESAMPLE_TAPS           (16)
+// The rate ratio reduced, at most this many phases, 441 for 16 kHz <-> 44.1 kHz
+#define PCM_RESAMPLE_PHASES_MAX     (512)
+
+/**
+ * Resampler element configurations, 16 bit mono PCM
+ */
+typedef struct {
+    int src_rate;               /*!< Input sample rate */
+    int dest_rate;              /*!< Output sample rate */
+    bool fixed_point;           /*!< Q15 coefficients, else float for a lower noise floor at more CPU */
+    int multi_out_num;          /*!< Number of multi output ringbuffers */
+    bool tap_input;             /*!< Multi output ringbuffers get the input instead of the output */
+    int out_rb_size;            /*!< Size of output ringbuffer */
+    int task_stack;             /*!< Task stack size */
+    int task_core;              /*!< Task running in core (0 or 1) */
+    int task_prio;              /*!< Task priority (based on freeRTOS priority) */
+} pcm_resample_cfg_t;
+
+#define DEFAULT_PCM_RESAMPLE_CONFIG() {                 \
+    .src_rate           = 48000,                        \
+    .dest_rate          = 16000,                        \
+    .fixed_point        = true,                         \
+    .multi_out_num      = 0,                            \
+    .tap_input          = false,                        \
+    .out_rb_size        = PCM_RESAMPLE_RINGBUFFER_SIZE, \
+    .task_stack         = PCM_RESAMPLE_TASK_STACK,      \
+    .task_core          = PCM_RESAMPLE_TASK_CORE,       \
+    .task_prio          = PCM_RESAMPLE_TASK_PRIO,       \
+}
+
+/**
+ * @brief      Create the resampler element, a polyphase FIR for any rational ratio
+ *
+ *             An integer decimation such as 48 kHz -> 16 kHz runs on the esp-dsp decimating FIR,
+ *             any other ratio such as 44.1 kHz -> 16 kHz or 16 kHz -> 48 kHz computes only the
+ *             phase of the lowpass every output sample needs. The coefficients are computed once here.
+ *
+ * @param      config  The configuration
+ *
+ * @return     The audio element handle, NULL if the rates are the same or their ratio has too many phases
+ */
+audio_element_handle_t pcm_resample_init(pcm_resample_cfg_t *config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,220 @@
+#include <string.h>
+#include <math.h>
+#include "esp_log.h"
+#include "audio_element.h"
+#include "audio_common.h"
+#include "audio_mem.h"
+#include "esp_dsp.h"
+#include "sr_aec.h"
+
+static const char *TAG = "SR_AEC";
+
+#define SR_AEC_FRAMES_PER_SEC   (100)
+// Reference samples below this are treated as silence
+#define SR_AEC_SILENCE_LEVEL    (8.0f / 32768.0f)
+#define SR_AEC_EPS              (1e-6f)
+
+typedef struct {
+    sr_aec_cfg_t    cfg;
+    int             frame_samples;
+    int             taps;
+    int16_t         *mic;
+    int16_t         *ref;
+    float           *near;
+    float           *err;
+    /* reference history, the last `taps - 1` samples followed by the current frame */
+    float           *history;
+    /* weights[c] multiplies history[c + i] for output sample i, the newest sample comes last */
+    float           *weights;
+    /* reference delay line, `delay_samples` old samples in front of the current frame */
+    int16_t         *delay;
+    int             delay_samples;
+    int             silent_samples;
+    /* ERLE over the last second with a reference, logged at debug level */
+    float           near_energy;
+    float           err_energy;
+    int             erle_samples;
+} sr_aec_t;
+
+static void _aec_read_reference(sr_aec_t *aec, int samples)
+{
+    int bytes = samples * sizeof(int16_t);
+    int16_t *frame = aec->delay + aec->delay_samples;
+    int filled = aec->cfg.reference ? rb_bytes_filled(aec->cfg.reference) : 0;
+    int read = 0;
+    if (filled > 0) {
+        read = rb_read(aec->cfg.reference, (char *)frame, filled < bytes ? filled : bytes, 0);
+        if (read < 0) {
+            read = 0;
+        }
+    }
+    memset((char *)frame + read, 0, bytes - read);
+    memcpy(aec->ref, aec->delay, bytes);
+    memmove(aec->delay, aec->delay + samples, aec->delay_samples * sizeof(int16_t));
+}
+
+static float _aec_peak(const float *x, int len)
+{
+    float peak = 0;
+    for (int i = 0; i < len; i++) {
+        float a = fabsf(x[i]);
+        if (a > peak) {
+            peak = a;
+        }
+    }
+    return peak;
+}
+
+static void _aec_update_erle(sr_aec_t *aec, int samples)
+{
+    float near_energy = 0, err_energy = 0;
+    dsps_dotprod_f32(aec->near, aec->near, &near_energy, samples);
+    dsps_dotprod_f32(aec->err, aec->err, &err_energy, samples);
+    aec->near_energy += near_energy;
+    aec->err_energy += err_energy;
+    aec->erle_samples += samples;
+    if (aec->erle_samples >= aec->cfg.sample_rate) {
+        ESP_LOGD(TAG, "ERLE %.1f dB", 10.0f * log10f((aec->near_energy + SR_AEC_EPS) / (aec->err_energy + SR_AEC_EPS)));
+        aec->near_energy = 0;
+        aec->err_energy = 0;
+        aec->erle_samples = 0;
+    }
+}
+
+static void _aec_cancel(sr_aec_t *aec, int samples)
+{
+    float *frame = aec->history + aec->taps - 1;
+    for (int i = 0; i < samples; i++) {
+        aec->near[i] = aec->mic[i] * (1.0f / 32768.0f);
+        frame[i] = aec->ref[i] * (1.0f / 32768.0f);
+    }
+    float ref_peak = _aec_peak(frame, samples);
+    aec->silent_samples = ref_peak < SR_AEC_SILENCE_LEVEL ? aec->silent_samples + samples : 0;
+    //* the whole history is silent, there is no echo left to remove
+    if (aec->silent_samples >= aec->taps + samples) {
+        memmove(aec->history, aec->history + samples, (aec->taps - 1) * sizeof(float));
+        return;
+    }
+
+    //* Geigel double talk detection, the near end speaker would pull the filter away from the echo path
+    float history_peak = _aec_peak(aec->history, aec->taps - 1 + samples);
+    bool adapt = _aec_peak(aec->near, samples) < aec->cfg.double_talk_ratio * history_peak;
+    float power = 0;
+    dsps_dotprod_f32(aec->history, aec->history, &power, aec->taps);
+    //* sample by sample NLMS, a block update lags behind on coloured input such as speech and diverges
+    for (int i = 0; i < samples; i++) {
+        const float *window = aec->history + i;
+        float echo = 0;
+        dsps_dotprod_f32(aec->weights, window, &echo, aec->taps);
+        aec->err[i] = aec->near[i] - echo;
+        if (adapt) {
+            float step = aec->cfg.step_size * aec->err[i] / (power + SR_AEC_EPS * aec->taps);
+            for (int c = 0; c < aec->taps; c++) {
+                aec->weights[c] += step * window[c];
+            }
+        }
+        if (i + 1 < samples) {
+            power += window[aec->taps] * window[aec->taps] - window[0] * window[0];
+            power = power > 0 ? power : 0;
+        }
+    }
+    _aec_update_erle(aec, samples);
+    memmove(aec->history, aec->history + samples, (aec->taps - 1) * sizeof(float));
+
+    for (int i = 0; i < samples; i++) {
+        float s = aec->err[i] * 32768.0f;
+        aec->mic[i] = s > 32767.0f ? 32767 : (s < -32768.0f ? -32768 : (int16_t)s);
+    }
+}
+
+static esp_err_t _aec_open(audio_element_handle_t self)
+{
+    sr_aec_t *aec = (sr_aec_t *)audio_element_getdata(self);
+    //* playback written while nobody was listening is stale
+    if (aec->cfg.reference) {
+        rb_reset(aec->cfg.reference);
+    }
+    memset(aec->delay, 0, (aec->delay_samples + aec->frame_samples) * sizeof(int16_t));
+    memset(aec->history, 0, (aec->taps - 1 + aec->frame_samples) * sizeof(float));
+    aec->silent_samples = aec->taps + aec->frame_samples;
+    aec->near_energy = 0;
+    aec->err_energy = 0;
+    aec->erle_samples = 0;
+    //* the echo path of the device hardly changes, the weights are kept between recordings
+    return ESP_OK;
+}
+
+static audio_element_err_t _aec_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    sr_aec_t *aec = (sr_aec_t *)audio_element_getdata(self);
+    int r_size = audio_element_input(self, (char *)aec->mic, aec->frame_samples * sizeof(int16_t));
+    if (r_size <= 0) {
+        return r_size;
+    }
+    int samples = r_size / sizeof(int16_t);
+    _aec_read_reference(aec, samples);
+    _aec_cancel(aec, samples);
+    int ret = audio_element_output(self, (char *)aec->mic, samples * sizeof(int16_t));
+    return ret < 0 ? ret : r_size;
+}
+
+static void _aec_free(sr_aec_t *aec)
+{
+    audio_free(aec->mic);
+    audio_free(aec->ref);
+    audio_free(aec->near);
+    audio_free(aec->err);
+    audio_free(aec->history);
+    audio_free(aec->weights);
+    audio_free(aec->delay);
+    audio_free(aec);
+}
+
+static esp_err_t _aec_destroy(audio_element_handle_t self)
+{
+    _aec_free((sr_aec_t *)audio_element_getdata(self));
+    return ESP_OK;
+}
+
+audio_element_handle_t sr_aec_init(sr_aec_cfg_t *config)
+{
+    sr_aec_t *aec = audio_calloc(1, sizeof(sr_aec_t));
+    AUDIO_MEM_CHECK(TAG, aec, return NULL);
+    aec->cfg = *config;
+    aec->frame_samples = config->sample_rate / SR_AEC_FRAMES_PER_SEC;
+    //* a multiple of 4 taps suits the optimized dot product of every target
+    aec->taps = (config->filter_ms * config->sample_rate / 1000 + 3) & ~3;
+    if (aec->taps < 4) {
+        aec->taps = 4;
+    }
+    aec->delay_samples = config->reference_delay_ms * config->sample_rate / 1000;
+
+    aec->mic = audio_calloc(aec->frame_samples, sizeof(int16_t));
+    aec->ref = audio_calloc(aec->frame_samples, sizeof(int16_t));
+    aec->near = audio_calloc(aec->frame_samples, sizeof(float));
+    aec->err = audio_calloc(aec->frame_samples, sizeof(float));
+    aec->history = audio_calloc(aec->taps - 1 + aec->frame_samples, sizeof(float));
+    aec->weights = audio_calloc(aec->taps, sizeof(float));
+    aec->delay = audio_calloc(aec->delay_samples + aec->frame_samples, sizeof(int16_t));
+    AUDIO_MEM_CHECK(TAG, aec->mic && aec->ref && aec->near && aec->err
+                    && aec->history && aec->weights && aec->delay, goto _aec_init_exit);
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _aec_open;
+    cfg.process = _aec_process;
+    cfg.destroy = _aec_destroy;
+    cfg.buffer_len = aec->frame_samples * sizeof(int16_t);
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.tag = "aec";
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto _aec_init_exit);
+    audio_element_setdata(el, aec);
+    ESP_LOGI(TAG, "AEC %d taps, reference delay %d samples", aec->taps, aec->delay_samples);
+    return el;
+_aec_init_exit:
+    _aec_free(aec);
+    return NULL;
+}
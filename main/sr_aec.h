@@ -0,0 +1,63 @@
+#ifndef _SR_AEC_H_
+#define _SR_AEC_H_
+
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_AEC_TASK_STACK           (4 * 1024)
+#define SR_AEC_TASK_CORE            (1)
+#define SR_AEC_TASK_PRIO            (5)
+#define SR_AEC_RINGBUFFER_SIZE      (8 * 1024)
+
+/**
+ * Acoustic echo canceller element configurations, the microphone input, the reference and the output
+ * are 16 bit mono PCM at the same sample rate
+ */
+typedef struct {
+    int sample_rate;            /*!< Sample rate of the microphone and the reference */
+    ringbuf_handle_t reference; /*!< Playback PCM, e.g. a multi output ringbuffer of the playback I2S writer */
+    int filter_ms;              /*!< Echo tail covered by the adaptive filter */
+    int reference_delay_ms;     /*!< Delay added to the reference before the filter, covers a fixed path latency */
+    float step_size;            /*!< NLMS step size, 0 < step_size < 2 */
+    float double_talk_ratio;    /*!< Adaptation stops while the microphone peak is above this share of the reference peak */
+    int out_rb_size;            /*!< Size of output ringbuffer */
+    int task_stack;             /*!< Task stack size */
+    int task_core;              /*!< Task running in core (0 or 1) */
+    int task_prio;              /*!< Task priority (based on freeRTOS priority) */
+} sr_aec_cfg_t;
+
+#define DEFAULT_SR_AEC_CONFIG() {                   \
+    .sample_rate        = 16000,                    \
+    .reference          = NULL,                     \
+    .filter_ms          = 32,                       \
+    .reference_delay_ms = 0,                        \
+    .step_size          = 0.5f,                     \
+    .double_talk_ratio  = 0.6f,                     \
+    .out_rb_size        = SR_AEC_RINGBUFFER_SIZE,   \
+    .task_stack         = SR_AEC_TASK_STACK,        \
+    .task_core          = SR_AEC_TASK_CORE,         \
+    .task_prio          = SR_AEC_TASK_PRIO,         \
+}
+
+/**
+ * @brief      Create the echo canceller element, the estimate of the playback echo is subtracted from the
+ *             microphone signal by an NLMS adaptive filter, so recording can go on while an answer is played
+ *
+ *             The reference is read without waiting, missing reference samples count as silence.
+ *             While the reference is silent the input is passed through untouched.
+ *
+ * @param      config  The configuration
+ *
+ * @return     The audio element handle
+ */
+audio_element_handle_t sr_aec_init(sr_aec_cfg_t *config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
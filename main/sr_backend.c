@@ -0,0 +1,301 @@
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "json_utils.h"
+#include "sr_backend.h"
+
+static const char *TAG = "SR_BACKEND";
+
+#if CONFIG_MOCK_SERVER
+#define BAIDU_SR_ENDPOINT CONFIG_MOCK_SERVER_URI "/pro_api"
+//* Baidu has no streaming HTTP API, server.py stands in for a streaming recognizer
+#define BAIDU_SR_STREAM_ENDPOINT CONFIG_MOCK_SERVER_URI "/stream_api?sn=%08x"
+#define RAW_SR_ENDPOINT CONFIG_MOCK_SERVER_URI "/upload"
+#else
+#define BAIDU_SR_ENDPOINT "https://vop.baidu.com/pro_api"
+#define BAIDU_SR_STREAM_ENDPOINT NULL
+#define RAW_SR_ENDPOINT CONFIG_TEST_SERVER_URI
+#endif
+
+#define BAIDU_SR_BEGIN "{"                        \
+                        "\"format\": \"%s\","      \
+                        "\"rate\": %d,"            \
+                        "\"channel\": 1,"          \
+                        "\"cuid\": \"esp32-toy\"," \
+                        "\"token\": \"%s\","       \
+                        "\"dev_pid\": 80001,"      \
+                        "\"speech\":"              \
+                        "\""
+/*  base64 audio bytes  */
+#define BAIDU_SR_END "\","        \
+                      "\"len\":%d" \
+                      "}"
+
+//* room kept in front of every chunk payload for the "%x\r\n" size line
+#define SR_CHUNK_HEADER_MAX (8)
+
+/*
+ * Send one HTTP chunk with a single write, `payload` must have SR_CHUNK_HEADER_MAX bytes
+ * reserved in front of it and 2 bytes after it
+ */
+static int _sr_write_chunk(sr_backend_ctx_t *ctx, char *payload, int len)
+{
+    char header_chunk_buffer[SR_CHUNK_HEADER_MAX + 1];
+    int header_chunk_len = snprintf(header_chunk_buffer, sizeof(header_chunk_buffer), "%x\r\n", len);
+    char *frame = payload - header_chunk_len;
+    memcpy(frame, header_chunk_buffer, header_chunk_len);
+    memcpy(payload + len, "\r\n", 2);
+    int frame_len = header_chunk_len + len + 2;
+    int64_t start = esp_timer_get_time();
+    int write_len = esp_http_client_write(ctx->http, frame, frame_len);
+    ctx->write_us += esp_timer_get_time() - start;
+    if (write_len != frame_len) {
+        ESP_LOGE(TAG, "Error write chunked content");
+        return ESP_FAIL;
+    }
+    ctx->wire_bytes += frame_len;
+    return len;
+}
+
+static esp_err_t _sr_write_last_chunk(sr_backend_ctx_t *ctx)
+{
+    int64_t start = esp_timer_get_time();
+    int write_len = esp_http_client_write(ctx->http, "0\r\n\r\n", 5);
+    ctx->write_us += esp_timer_get_time() - start;
+    if (write_len != 5) {
+        return ESP_FAIL;
+    }
+    ctx->wire_bytes += 5;
+    return ESP_OK;
+}
+
+/*
+ * Both servers answer like Baidu, `result` is an array with the best hypothesis first
+ */
+static char *_sr_read_result(sr_backend_ctx_t *ctx)
+{
+    //* the answer may come in several reads, the JSON is only parsed whole
+    int read_len = 0;
+    while (read_len < ctx->buffer_size - 1) {
+        int n = esp_http_client_read(ctx->http, ctx->buffer + read_len, ctx->buffer_size - 1 - read_len);
+        if (n <= 0) {
+            break;
+        }
+        read_len += n;
+        if (esp_http_client_is_complete_data_received(ctx->http)) {
+            break;
+        }
+    }
+    if (read_len <= 0) {
+        return NULL;
+    }
+    ctx->buffer[read_len] = 0;
+    ESP_LOGI(TAG, "Got HTTP Response = %s", ctx->buffer);
+    if (!esp_http_client_is_complete_data_received(ctx->http)) {
+        ESP_LOGE(TAG, "Response incomplete after %d bytes", read_len);
+        return NULL;
+    }
+    char *result = json_get_token_value(ctx->buffer, "result");
+    if (result == NULL) {
+        return NULL;
+    }
+    //* ["text"] -> text
+    int len = strlen(result);
+    char *text = NULL;
+    if (len >= 4 && strncmp(result, "[\"", 2) == 0 && strcmp(result + len - 2, "\"]") == 0) {
+        text = strndup(result + 2, len - 4);
+    } else {
+        ESP_LOGE(TAG, "Unexpected result %s", result);
+    }
+    free(result);
+    return text;
+}
+
+/*
+ * Baidu pro_api
+ */
+static esp_err_t _baidu_begin(sr_backend_ctx_t *ctx)
+{
+    base64_stream_reset(&ctx->b64);
+    esp_http_client_set_method(ctx->http, HTTP_METHOD_POST);
+    esp_http_client_set_post_field(ctx->http, NULL, -1);
+    esp_http_client_set_header(ctx->http, "Content-Type", "application/json");
+    esp_http_client_set_header(ctx->http, "Connection", "keep-alive");
+    esp_http_client_delete_header(ctx->http, "Content-Length");
+    return ESP_OK;
+}
+
+static esp_err_t _baidu_write_head(sr_backend_ctx_t *ctx)
+{
+    char *payload = ctx->buffer + SR_CHUNK_HEADER_MAX;
+    int payload_size = ctx->buffer_size - SR_CHUNK_HEADER_MAX - 2;
+    int head_len = snprintf(payload, payload_size, BAIDU_SR_BEGIN, ctx->format, ctx->sample_rate, ctx->token);
+    return _sr_write_chunk(ctx, payload, head_len) > 0 ? ESP_OK : ESP_FAIL;
+}
+
+static int _baidu_write(sr_backend_ctx_t *ctx, const uint8_t *audio, int len)
+{
+    char *payload = ctx->buffer + SR_CHUNK_HEADER_MAX;
+    int payload_size = ctx->buffer_size - SR_CHUNK_HEADER_MAX - 2;
+    //* the JSON head goes with the first audio, the upload starts at the speech onset
+    if (ctx->is_begin && _baidu_write_head(ctx) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    //* base64 straight from the ring buffer block into the chunk payload,
+    //* the 0-2 bytes which do not complete a group are kept by the encoder
+    int remain = len;
+    int max_block = payload_size / 4 * 3 - 2;
+    while (remain > 0) {
+        int block = remain > max_block ? max_block : remain;
+        int64_t start = esp_timer_get_time();
+        int b64_len = base64_stream_encode(&ctx->b64, payload, audio, block);
+        ctx->cpu_us += esp_timer_get_time() - start;
+        audio += block;
+        remain -= block;
+        //* a zero sized chunk would end the request
+        if (b64_len == 0) {
+            continue;
+        }
+        int write_len = _sr_write_chunk(ctx, payload, b64_len);
+        if (write_len <= 0) {
+            ESP_LOGE(TAG, "_sr_write_chunk error, write_len=%d", write_len);
+            return write_len;
+        }
+    }
+    return len;
+}
+
+static esp_err_t _baidu_finish(sr_backend_ctx_t *ctx)
+{
+    char *payload = ctx->buffer + SR_CHUNK_HEADER_MAX;
+    int payload_size = ctx->buffer_size - SR_CHUNK_HEADER_MAX - 2;
+    //* no audio came, the head still has to go before the end for the JSON to be whole
+    if (ctx->is_begin && _baidu_write_head(ctx) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    //* write remained bytes
+    int b64_len = base64_stream_finish(&ctx->b64, payload);
+    if (b64_len > 0 && _sr_write_chunk(ctx, payload, b64_len) <= 0) {
+        return ESP_FAIL;
+    }
+    //* Write End chunk: BAIDU_SR_END
+    int end_len = snprintf(payload, payload_size, BAIDU_SR_END, ctx->audio_bytes);
+    if (_sr_write_chunk(ctx, payload, end_len) <= 0) {
+        return ESP_FAIL;
+    }
+    return _sr_write_last_chunk(ctx);
+}
+
+const sr_backend_t sr_backend_baidu = {
+    .name = "baidu",
+    .uri = BAIDU_SR_ENDPOINT,
+    .stream_uri = BAIDU_SR_STREAM_ENDPOINT,
+    .begin = _baidu_begin,
+    .write = _baidu_write,
+    .finish = _baidu_finish,
+    .result = _sr_read_result,
+};
+
+/*
+ * Raw chunked audio, the format goes in headers
+ */
+static esp_err_t _raw_begin(sr_backend_ctx_t *ctx)
+{
+    char value[12];
+    esp_http_client_set_method(ctx->http, HTTP_METHOD_POST);
+    esp_http_client_set_post_field(ctx->http, NULL, -1);
+    snprintf(value, sizeof(value), "%d", ctx->sample_rate);
+    esp_http_client_set_header(ctx->http, "x-audio-sample-rates", value);
+    esp_http_client_set_header(ctx->http, "x-audio-bits", "16");
+    esp_http_client_set_header(ctx->http, "x-audio-channel", "1");
+    esp_http_client_set_header(ctx->http, "x-audio-format", ctx->format);
+    esp_http_client_delete_header(ctx->http, "Content-Length");
+    return ESP_OK;
+}
+
+static int _raw_write(sr_backend_ctx_t *ctx, const uint8_t *audio, int len)
+{
+    char *payload = ctx->buffer + SR_CHUNK_HEADER_MAX;
+    int payload_size = ctx->buffer_size - SR_CHUNK_HEADER_MAX - 2;
+    int remain = len;
+    while (remain > 0) {
+        int block = remain > payload_size ? payload_size : remain;
+        memcpy(payload, audio, block);
+        if (_sr_write_chunk(ctx, payload, block) <= 0) {
+            return ESP_FAIL;
+        }
+        audio += block;
+        remain -= block;
+    }
+    return len;
+}
+
+static esp_err_t _raw_finish(sr_backend_ctx_t *ctx)
+{
+    return _sr_write_last_chunk(ctx);
+}
+
+const sr_backend_t sr_backend_raw_pcm = {
+    .name = "raw",
+    .uri = RAW_SR_ENDPOINT,
+    .begin = _raw_begin,
+    .write = _raw_write,
+    .finish = _raw_finish,
+    .result = _sr_read_result,
+};
+
+/*
+ * Offline stub, an on-device engine would consume the audio in `write`
+ */
+static esp_err_t _offline_begin(sr_backend_ctx_t *ctx)
+{
+    return ESP_OK;
+}
+
+static int _offline_write(sr_backend_ctx_t *ctx, const uint8_t *audio, int len)
+{
+    return len;
+}
+
+static esp_err_t _offline_finish(sr_backend_ctx_t *ctx)
+{
+    return ESP_OK;
+}
+
+static char *_offline_result(sr_backend_ctx_t *ctx)
+{
+    ESP_LOGW(TAG, "Offline recognizer stub, %d bytes of audio not recognized", ctx->audio_bytes);
+    return strdup("");
+}
+
+const sr_backend_t sr_backend_offline = {
+    .name = "offline",
+    .begin = _offline_begin,
+    .write = _offline_write,
+    .finish = _offline_finish,
+    .result = _offline_result,
+};
+
+int sr_backend_probe(const sr_backend_t *backend, int timeout_ms)
+{
+    if (backend->uri == NULL) {
+        return 0;
+    }
+    esp_http_client_config_t config = {
+        .url = backend->uri,
+        .timeout_ms = timeout_ms,
+    };
+    esp_http_client_handle_t http = esp_http_client_init(&config);
+    if (http == NULL) {
+        return -1;
+    }
+    //* connection and TLS handshake plus one round trip, what every utterance costs on a cold connection
+    int64_t start = esp_timer_get_time();
+    bool reachable = esp_http_client_open(http, 0) == ESP_OK && esp_http_client_fetch_headers(http) >= 0;
+    int ms = (esp_timer_get_time() - start) / 1000;
+    esp_http_client_cleanup(http);
+    ESP_LOGI(TAG, "Backend %s %s, %d ms", backend->name, reachable ? "reachable" : "not reachable", ms);
+    return reachable ? ms : -1;
+}
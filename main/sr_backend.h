@@ -0,0 +1,77 @@
+#ifndef _SR_BACKEND_H_
+#define _SR_BACKEND_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_client.h"
+#include "base64_stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_BACKEND_PROBE_TIMEOUT_MS (1000)
+
+/**
+ * State of one utterance, filled by the ASR context and shared with its backend
+ */
+typedef struct {
+    esp_http_client_handle_t http;  /*!< Connection of the upload, NULL for a recognizer on the device */
+    char *buffer;                   /*!< Scratch buffer for chunks and the response */
+    int buffer_size;
+    const char *format;             /*!< Format name of the audio, "pcm" or the codec's */
+    int sample_rate;
+    const char *token;              /*!< Access token of the service */
+    base64_stream_t b64;
+    bool is_begin;                  /*!< Nothing written yet */
+    int audio_bytes;                /*!< Audio of the utterance */
+    int wire_bytes;                 /*!< Bytes sent for it, framing included */
+    int64_t cpu_us;                 /*!< Time spent in `write` and `finish` */
+    int64_t write_us;               /*!< Time spent in `esp_http_client_write` */
+} sr_backend_ctx_t;
+
+/**
+ * Recognition backend, an utterance is `begin`, `write` for every block of audio,
+ * `finish` after the last block and `result` once the answer is there
+ */
+typedef struct {
+    const char *name;
+    const char *uri;            /*!< Upload URL, NULL for a recognizer on the device */
+    const char *stream_uri;     /*!< printf format of the upload URL of a session with partial results, NULL if not supported */
+    esp_err_t (*begin)(sr_backend_ctx_t *ctx);
+    int (*write)(sr_backend_ctx_t *ctx, const uint8_t *audio, int len);
+    esp_err_t (*finish)(sr_backend_ctx_t *ctx);
+    char *(*result)(sr_backend_ctx_t *ctx);     /*!< Recognized text to be freed by the caller, NULL on failure */
+} sr_backend_t;
+
+/**
+ * Baidu pro_api, JSON with the audio in base64, 4/3 of the audio on the wire
+ */
+extern const sr_backend_t sr_backend_baidu;
+
+/**
+ * Audio as it is in a chunked POST with its format in headers, the `/upload` of server.py
+ */
+extern const sr_backend_t sr_backend_raw_pcm;
+
+/**
+ * Recognizer on the device, a stub for an offline engine that recognizes nothing, never unreachable
+ */
+extern const sr_backend_t sr_backend_offline;
+
+/**
+ * @brief      Measure the time to connect to a backend and get the headers of a GET of its URL
+ *
+ * @param      backend     The backend
+ * @param[in]  timeout_ms  Give up after this long
+ *
+ * @return     The time in ms, 0 for a recognizer on the device, -1 if it is not reachable
+ */
+int sr_backend_probe(const sr_backend_t *backend, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,204 @@
+#include <string.h>
+#include "esp_log.h"
+#include "audio_element.h"
+#include "audio_common.h"
+#include "audio_mem.h"
+#include "sr_encoder.h"
+
+static const char *TAG = "SR_ENCODER";
+
+#define IMA_ADPCM_BLOCK_BYTES       (256)
+#define IMA_ADPCM_BLOCK_SAMPLES     ((IMA_ADPCM_BLOCK_BYTES - 4) * 2 + 1)
+
+typedef struct {
+    const sr_codec_t    *codec;
+    void                *codec_ctx;
+    int                 sample_rate;
+    int16_t             *pcm;
+    uint8_t             *out;
+} sr_encoder_t;
+
+/*
+ * IMA-ADPCM
+ */
+static const int16_t ima_step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t ima_index_table[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+typedef struct {
+    int predictor;
+    int index;
+} ima_adpcm_t;
+
+static uint8_t _ima_encode_sample(ima_adpcm_t *ima, int sample)
+{
+    int step = ima_step_table[ima->index];
+    int diff = sample - ima->predictor;
+    uint8_t nibble = 0;
+    if (diff < 0) {
+        nibble = 8;
+        diff = -diff;
+    }
+    int vpdiff = step >> 3;
+    if (diff >= step) {
+        nibble |= 4;
+        diff -= step;
+        vpdiff += step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+        nibble |= 2;
+        diff -= step;
+        vpdiff += step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+        nibble |= 1;
+        vpdiff += step;
+    }
+    ima->predictor += (nibble & 8) ? -vpdiff : vpdiff;
+    if (ima->predictor > 32767) {
+        ima->predictor = 32767;
+    } else if (ima->predictor < -32768) {
+        ima->predictor = -32768;
+    }
+    ima->index += ima_index_table[nibble & 7];
+    if (ima->index < 0) {
+        ima->index = 0;
+    } else if (ima->index > 88) {
+        ima->index = 88;
+    }
+    return nibble;
+}
+
+static void *_ima_open(int sample_rate)
+{
+    return audio_calloc(1, sizeof(ima_adpcm_t));
+}
+
+static int _ima_encode(void *ctx, const int16_t *pcm, int samples, uint8_t *out)
+{
+    ima_adpcm_t *ima = (ima_adpcm_t *)ctx;
+    //* block header: first sample as predictor and the step index carried from the previous block
+    ima->predictor = pcm[0];
+    out[0] = pcm[0] & 0xFF;
+    out[1] = (pcm[0] >> 8) & 0xFF;
+    out[2] = ima->index;
+    out[3] = 0;
+    uint8_t *p = out + 4;
+    for (int i = 1; i < IMA_ADPCM_BLOCK_SAMPLES; i += 2) {
+        int s0 = i < samples ? pcm[i] : ima->predictor;
+        int s1 = i + 1 < samples ? pcm[i + 1] : ima->predictor;
+        uint8_t lo = _ima_encode_sample(ima, s0);
+        uint8_t hi = _ima_encode_sample(ima, s1);
+        *p++ = lo | (hi << 4);
+    }
+    return IMA_ADPCM_BLOCK_BYTES;
+}
+
+static void _ima_close(void *ctx)
+{
+    audio_free(ctx);
+}
+
+const sr_codec_t sr_codec_ima_adpcm = {
+    .format = "ima-adpcm",
+    .frame_samples = IMA_ADPCM_BLOCK_SAMPLES,
+    .max_frame_bytes = IMA_ADPCM_BLOCK_BYTES,
+    .open = _ima_open,
+    .encode = _ima_encode,
+    .close = _ima_close,
+};
+
+/*
+ * Encoder element
+ */
+static esp_err_t _encoder_open(audio_element_handle_t self)
+{
+    sr_encoder_t *enc = (sr_encoder_t *)audio_element_getdata(self);
+    enc->codec_ctx = enc->codec->open(enc->sample_rate);
+    AUDIO_MEM_CHECK(TAG, enc->codec_ctx, return ESP_FAIL);
+    return ESP_OK;
+}
+
+static esp_err_t _encoder_close(audio_element_handle_t self)
+{
+    sr_encoder_t *enc = (sr_encoder_t *)audio_element_getdata(self);
+    if (enc->codec_ctx) {
+        enc->codec->close(enc->codec_ctx);
+        enc->codec_ctx = NULL;
+    }
+    return ESP_OK;
+}
+
+static audio_element_err_t _encoder_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    sr_encoder_t *enc = (sr_encoder_t *)audio_element_getdata(self);
+    int frame_bytes = enc->codec->frame_samples * sizeof(int16_t);
+    int r_size = audio_element_input(self, (char *)enc->pcm, frame_bytes);
+    if (r_size <= 0) {
+        return r_size;
+    }
+    int out_len = enc->codec->encode(enc->codec_ctx, enc->pcm, r_size / sizeof(int16_t), enc->out);
+    if (out_len < 0) {
+        ESP_LOGE(TAG, "Error encode %s", enc->codec->format);
+        return AEL_PROCESS_FAIL;
+    }
+    if (out_len > 0) {
+        int ret = audio_element_output(self, (char *)enc->out, out_len);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return r_size;
+}
+
+static esp_err_t _encoder_destroy(audio_element_handle_t self)
+{
+    sr_encoder_t *enc = (sr_encoder_t *)audio_element_getdata(self);
+    audio_free(enc->pcm);
+    audio_free(enc->out);
+    audio_free(enc);
+    return ESP_OK;
+}
+
+audio_element_handle_t sr_encoder_init(sr_encoder_cfg_t *config)
+{
+    AUDIO_NULL_CHECK(TAG, config->codec, return NULL);
+    sr_encoder_t *enc = audio_calloc(1, sizeof(sr_encoder_t));
+    AUDIO_MEM_CHECK(TAG, enc, return NULL);
+    enc->codec = config->codec;
+    enc->sample_rate = config->sample_rate;
+    enc->pcm = audio_calloc(config->codec->frame_samples, sizeof(int16_t));
+    enc->out = audio_calloc(1, config->codec->max_frame_bytes);
+    AUDIO_MEM_CHECK(TAG, enc->pcm && enc->out, goto _encoder_init_exit);
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _encoder_open;
+    cfg.close = _encoder_close;
+    cfg.process = _encoder_process;
+    cfg.destroy = _encoder_destroy;
+    cfg.buffer_len = config->codec->frame_samples * sizeof(int16_t);
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.tag = "encoder";
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto _encoder_init_exit);
+    audio_element_setdata(el, enc);
+    ESP_LOGI(TAG, "Encoder %s, %d samples/frame", enc->codec->format, enc->codec->frame_samples);
+    return el;
+_encoder_init_exit:
+    audio_free(enc->pcm);
+    audio_free(enc->out);
+    audio_free(enc);
+    return NULL;
+}
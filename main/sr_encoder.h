@@ -0,0 +1,69 @@
+#ifndef _SR_ENCODER_H_
+#define _SR_ENCODER_H_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_ENCODER_TASK_STACK       (3 * 1024)
+#define SR_ENCODER_TASK_CORE        (0)
+#define SR_ENCODER_TASK_PRIO        (5)
+#define SR_ENCODER_RINGBUFFER_SIZE  (4 * 1024)
+
+/**
+ * Codec plugged into the encoder element, every call of `encode` turns `frame_samples`
+ * 16 bit mono samples into at most `max_frame_bytes` bytes
+ */
+typedef struct {
+    const char *format;         /*!< Format name reported to the server */
+    int frame_samples;          /*!< Samples consumed per frame */
+    int max_frame_bytes;        /*!< Largest encoded frame */
+    void *(*open)(int sample_rate);
+    int (*encode)(void *ctx, const int16_t *pcm, int samples, uint8_t *out);
+    void (*close)(void *ctx);
+} sr_codec_t;
+
+/**
+ * IMA-ADPCM, 4 bits per sample in WAV compatible 256 byte blocks of 505 samples
+ */
+extern const sr_codec_t sr_codec_ima_adpcm;
+
+/**
+ * Encoder element configurations
+ */
+typedef struct {
+    const sr_codec_t *codec;    /*!< The codec */
+    int sample_rate;            /*!< Input sample rate */
+    int out_rb_size;            /*!< Size of output ringbuffer */
+    int task_stack;             /*!< Task stack size */
+    int task_core;              /*!< Task running in core (0 or 1) */
+    int task_prio;              /*!< Task priority (based on freeRTOS priority) */
+} sr_encoder_cfg_t;
+
+#define DEFAULT_SR_ENCODER_CONFIG() {                   \
+    .codec              = &sr_codec_ima_adpcm,          \
+    .sample_rate        = 16000,                        \
+    .out_rb_size        = SR_ENCODER_RINGBUFFER_SIZE,   \
+    .task_stack         = SR_ENCODER_TASK_STACK,        \
+    .task_core          = SR_ENCODER_TASK_CORE,         \
+    .task_prio          = SR_ENCODER_TASK_PRIO,         \
+}
+
+/**
+ * @brief      Create the encoder element, 16 bit mono PCM in, codec frames out
+ *
+ * @param      config  The configuration
+ *
+ * @return     The audio element handle
+ */
+audio_element_handle_t sr_encoder_init(sr_encoder_cfg_t *config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
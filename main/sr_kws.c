@@ -0,0 +1,512 @@
+#include <string.h>
+#include <math.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_dsp.h"
+#include "audio_element.h"
+#include "audio_common.h"
+#include "audio_mem.h"
+#include "sr_kws.h"
+
+static const char *TAG = "SR_KWS";
+
+#define SR_KWS_RATE             (16000)
+#define SR_KWS_FRAME_SAMPLES    (480)
+#define SR_KWS_HOP_SAMPLES      (320)
+#define SR_KWS_HOP_BYTES        (SR_KWS_HOP_SAMPLES * sizeof(int16_t))
+#define SR_KWS_FFT_SAMPLES      (512)
+#define SR_KWS_FFT_BINS         (SR_KWS_FFT_SAMPLES / 2 + 1)
+#define SR_KWS_MEL_BANDS        (40)
+#define SR_KWS_MEL_LOW_HZ       (20)
+#define SR_KWS_MEL_HIGH_HZ      (4000)
+#define SR_KWS_LAYERS_MAX       (8)
+// Block floating point, the frame is scaled to one bit below full scale before the Q15 FFT
+#define SR_KWS_Q15_HEADROOM     (16384)
+// Floor of the band energy before the log, keeps digital silence finite
+#define SR_KWS_LOG_FLOOR        (1e-6f)
+// Front end and network time is logged once per this many frames, a minute
+#define SR_KWS_REPORT_FRAMES    (3000)
+
+typedef struct {
+    sr_kws_cfg_t            cfg;
+    /* model, read in place from the mapped partition */
+    const sr_kws_model_t    *model;
+    spi_flash_mmap_handle_t mmap;
+    const sr_kws_layer_t    *layers[SR_KWS_LAYERS_MAX];
+    int8_t                  *act[2];
+    audio_event_iface_handle_t evt;
+    /* front end */
+    int16_t                 *buf;
+    int16_t                 *frame;     /*!< The overlap of the last frame, then the hop being filled */
+    int                     fill;
+    int16_t                 *fft;
+    int16_t                 *window;
+    int16_t                 mel_start[SR_KWS_MEL_BANDS];
+    int16_t                 mel_len[SR_KWS_MEL_BANDS];
+    float                   *mel_weights;
+    int16_t                 log_mel[SR_KWS_MEL_BANDS];
+    int16_t                 *dct;       /*!< SR_KWS_MEL_BANDS x coeffs, Q15 */
+    int16_t                 *mfcc;
+    int8_t                  *features;  /*!< Ring of `frames` frames */
+    int                     feature_head;
+    int                     feature_count;
+    /* scheduling */
+    float                   gate_power;
+    int                     loud;       /*!< Frames until the last loud one leaves the network's window */
+    int                     infer_frames;
+    int                     since_infer;
+    float                   *posteriors;
+    int                     smooth_num;
+    int                     smooth_head;
+    int                     refractory_frames;
+    int                     refractory;
+    int64_t                 detect_us;  /*!< esp_timer time of the last detection */
+    int64_t                 front_us;
+    int64_t                 net_us;
+    int                     frames;
+    int                     runs;
+} sr_kws_t;
+
+static inline int8_t _kws_sat8(int32_t x)
+{
+    return x > 127 ? 127 : x < -128 ? -128 : (int8_t)x;
+}
+
+static float _kws_mel(float hz)
+{
+    return 2595.0f * log10f(1.0f + hz / 700.0f);
+}
+
+static float _kws_hz(float mel)
+{
+    return 700.0f * (powf(10.0f, mel / 2595.0f) - 1.0f);
+}
+
+/*
+ * Triangular mel bands over the FFT bins, each band keeps only the bins it covers
+ */
+static esp_err_t _kws_mel_init(sr_kws_t *kws)
+{
+    float edge[SR_KWS_MEL_BANDS + 2];
+    float low = _kws_mel(SR_KWS_MEL_LOW_HZ);
+    float high = _kws_mel(SR_KWS_MEL_HIGH_HZ);
+    for (int i = 0; i < SR_KWS_MEL_BANDS + 2; i++) {
+        edge[i] = _kws_hz(low + (high - low) * i / (SR_KWS_MEL_BANDS + 1));
+    }
+    const float bin_hz = (float)SR_KWS_RATE / SR_KWS_FFT_SAMPLES;
+    int total = 0;
+    for (int m = 0; m < SR_KWS_MEL_BANDS; m++) {
+        int first = (int)ceilf(edge[m] / bin_hz);
+        int last = (int)floorf(edge[m + 2] / bin_hz);
+        if (first < 0) {
+            first = 0;
+        }
+        if (last >= SR_KWS_FFT_BINS) {
+            last = SR_KWS_FFT_BINS - 1;
+        }
+        kws->mel_start[m] = first;
+        kws->mel_len[m] = last >= first ? last - first + 1 : 0;
+        total += kws->mel_len[m];
+    }
+    kws->mel_weights = audio_calloc(total > 0 ? total : 1, sizeof(float));
+    AUDIO_MEM_CHECK(TAG, kws->mel_weights, return ESP_FAIL);
+    float *w = kws->mel_weights;
+    for (int m = 0; m < SR_KWS_MEL_BANDS; m++) {
+        for (int i = 0; i < kws->mel_len[m]; i++) {
+            float hz = (kws->mel_start[m] + i) * bin_hz;
+            float v = hz < edge[m + 1] ? (hz - edge[m]) / (edge[m + 1] - edge[m])
+                                       : (edge[m + 2] - hz) / (edge[m + 2] - edge[m + 1]);
+            *w++ = v > 0 ? v : 0;
+        }
+    }
+    return ESP_OK;
+}
+
+/*
+ * Walk the layers of the mapped model, every size has to line up and stay inside the partition
+ */
+static esp_err_t _kws_model_check(sr_kws_t *kws, size_t size)
+{
+    const sr_kws_model_t *model = kws->model;
+    if (size < sizeof(sr_kws_model_t) || model->magic != SR_KWS_MODEL_MAGIC) {
+        return ESP_FAIL;
+    }
+    if (model->frames == 0 || model->coeffs == 0 || model->coeffs > SR_KWS_MEL_BANDS
+            || model->layer_num == 0 || model->layer_num > SR_KWS_LAYERS_MAX || model->keyword >= model->labels) {
+        return ESP_FAIL;
+    }
+    size_t offset = sizeof(sr_kws_model_t);
+    int dim = model->frames * model->coeffs;
+    int act_max = dim;
+    for (int l = 0; l < model->layer_num; l++) {
+        if (offset + sizeof(sr_kws_layer_t) > size) {
+            return ESP_FAIL;
+        }
+        const sr_kws_layer_t *layer = (const sr_kws_layer_t *)((const char *)model + offset);
+        if (layer->in_dim != dim || layer->out_dim == 0 || layer->out_shift < 1) {
+            return ESP_FAIL;
+        }
+        offset += sizeof(sr_kws_layer_t) + layer->out_dim + (size_t)layer->out_dim * layer->in_dim;
+        offset = (offset + 3) & ~(size_t)3;
+        if (offset > size) {
+            return ESP_FAIL;
+        }
+        kws->layers[l] = layer;
+        dim = layer->out_dim;
+        act_max = dim > act_max ? dim : act_max;
+    }
+    if (dim != model->labels) {
+        return ESP_FAIL;
+    }
+    kws->act[0] = audio_calloc(act_max, sizeof(int8_t));
+    kws->act[1] = audio_calloc(act_max, sizeof(int8_t));
+    AUDIO_MEM_CHECK(TAG, kws->act[0] && kws->act[1], return ESP_FAIL);
+    return ESP_OK;
+}
+
+/*
+ * MFCC of the frame into the feature ring, returns true if the hop was above the gate
+ */
+static bool _kws_front_end(sr_kws_t *kws)
+{
+    const sr_kws_model_t *model = kws->model;
+    int16_t *fft = kws->fft;
+    int32_t peak = 0;
+    int64_t energy = 0;
+    for (int i = 0; i < SR_KWS_FRAME_SAMPLES; i++) {
+        int32_t v = (kws->frame[i] * kws->window[i]) >> 15;
+        fft[i * 2 + 0] = v;
+        fft[i * 2 + 1] = 0;
+        v = v < 0 ? -v : v;
+        peak = v > peak ? v : peak;
+    }
+    for (int i = SR_KWS_FRAME_SAMPLES - SR_KWS_HOP_SAMPLES; i < SR_KWS_FRAME_SAMPLES; i++) {
+        energy += (int32_t)kws->frame[i] * kws->frame[i];
+    }
+    memset(fft + SR_KWS_FRAME_SAMPLES * 2, 0, (SR_KWS_FFT_SAMPLES - SR_KWS_FRAME_SAMPLES) * 2 * sizeof(int16_t));
+    int s = 0;
+    while (s < 14 && (peak << (s + 1)) < SR_KWS_Q15_HEADROOM) {
+        s++;
+    }
+    for (int i = 0; i < SR_KWS_FRAME_SAMPLES * 2; i++) {
+        fft[i] <<= s;
+    }
+    dsps_fft2r_sc16(fft, SR_KWS_FFT_SAMPLES);
+    dsps_bit_rev_sc16(fft, SR_KWS_FFT_SAMPLES);
+
+    //* log mel in Q7, the block exponent comes off in the log domain
+    const float *w = kws->mel_weights;
+    const float unscale = -2.0f * s * logf(2.0f);
+    for (int m = 0; m < SR_KWS_MEL_BANDS; m++) {
+        float e = 0;
+        for (int i = 0; i < kws->mel_len[m]; i++) {
+            const int16_t *x = fft + (kws->mel_start[m] + i) * 2;
+            e += *w++ * ((float)x[0] * x[0] + (float)x[1] * x[1]);
+        }
+        float log_e = logf(e + SR_KWS_LOG_FLOOR) + unscale;
+        if (log_e < logf(SR_KWS_LOG_FLOOR)) {
+            log_e = logf(SR_KWS_LOG_FLOOR);
+        }
+        kws->log_mel[m] = (int16_t)lrintf(log_e * 128.0f);
+    }
+    dspm_mult_s16(kws->log_mel, kws->dct, kws->mfcc, 1, SR_KWS_MEL_BANDS, model->coeffs, 0);
+
+    int8_t *feature = kws->features + kws->feature_head * model->coeffs;
+    for (int j = 0; j < model->coeffs; j++) {
+        int32_t v = model->input_shift >= 0 ? kws->mfcc[j] >> model->input_shift : kws->mfcc[j] << -model->input_shift;
+        feature[j] = _kws_sat8(v);
+    }
+    kws->feature_head = (kws->feature_head + 1) % model->frames;
+    if (kws->feature_count < model->frames) {
+        kws->feature_count++;
+    }
+    return (float)energy / SR_KWS_HOP_SAMPLES > kws->gate_power;
+}
+
+/*
+ * Run the network over the feature window, returns the wake word posterior
+ */
+static float _kws_infer(sr_kws_t *kws)
+{
+    const sr_kws_model_t *model = kws->model;
+    int8_t *in = kws->act[0];
+    int8_t *out = kws->act[1];
+    //* oldest frame first
+    for (int f = 0; f < model->frames; f++) {
+        int slot = (kws->feature_head + f) % model->frames;
+        memcpy(in + f * model->coeffs, kws->features + slot * model->coeffs, model->coeffs);
+    }
+    for (int l = 0; l < model->layer_num; l++) {
+        const sr_kws_layer_t *layer = kws->layers[l];
+        const int8_t *bias = (const int8_t *)(layer + 1);
+        const int8_t *weights = bias + layer->out_dim;
+        image2d_t x = {
+            .data = in,
+            .step_x = 1,
+            .step_y = 1,
+            .stride_x = layer->in_dim,
+            .stride_y = 1,
+            .size_x = layer->in_dim,
+            .size_y = 1,
+        };
+        image2d_t row = x;
+        for (int o = 0; o < layer->out_dim; o++) {
+            int8_t v;
+            row.data = (void *)(weights + o * layer->in_dim);
+            dspi_dotprod_s8(&x, &row, &v, layer->in_dim, 1, layer->out_shift);
+            int32_t r = (int32_t)v + bias[o];
+            out[o] = layer->relu && r < 0 ? 0 : _kws_sat8(r);
+        }
+        int8_t *t = in;
+        in = out;
+        out = t;
+    }
+    //* softmax over the int8 logits of the last layer
+    float scale = ldexpf(1.0f, -model->output_frac);
+    int8_t top = in[0];
+    for (int k = 1; k < model->labels; k++) {
+        top = in[k] > top ? in[k] : top;
+    }
+    float sum = 0;
+    for (int k = 0; k < model->labels; k++) {
+        sum += expf((in[k] - top) * scale);
+    }
+    return expf((in[model->keyword] - top) * scale) / sum;
+}
+
+static void _kws_report(sr_kws_t *kws)
+{
+    if (kws->frames > 0) {
+        //* the network runs only while there is sound, its share of the frames is the duty cycle
+        ESP_LOGD(TAG, "Front end %d us per frame, network %d us per run, %d runs in %d frames",
+                 (int)(kws->front_us / kws->frames), kws->runs > 0 ? (int)(kws->net_us / kws->runs) : 0,
+                 kws->runs, kws->frames);
+    }
+    kws->front_us = 0;
+    kws->net_us = 0;
+    kws->frames = 0;
+    kws->runs = 0;
+}
+
+static void _kws_frame(sr_kws_t *kws)
+{
+    const sr_kws_model_t *model = kws->model;
+    int64_t start = esp_timer_get_time();
+    if (_kws_front_end(kws)) {
+        kws->loud = model->frames;
+    } else if (kws->loud > 0) {
+        kws->loud--;
+    }
+    int64_t now = esp_timer_get_time();
+    kws->front_us += now - start;
+    if (kws->refractory > 0) {
+        kws->refractory--;
+    }
+    if (++kws->frames >= SR_KWS_REPORT_FRAMES) {
+        _kws_report(kws);
+    }
+    if (++kws->since_infer < kws->infer_frames || kws->loud == 0 || kws->feature_count < model->frames) {
+        return;
+    }
+    kws->since_infer = 0;
+    float posterior = _kws_infer(kws);
+    kws->net_us += esp_timer_get_time() - now;
+    kws->runs++;
+
+    kws->posteriors[kws->smooth_head] = posterior;
+    kws->smooth_head = (kws->smooth_head + 1) % kws->smooth_num;
+    float mean = 0;
+    for (int i = 0; i < kws->smooth_num; i++) {
+        mean += kws->posteriors[i];
+    }
+    mean /= kws->smooth_num;
+    if (mean * 100.0f < kws->cfg.threshold || kws->refractory > 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "Wake word, score %d%%", (int)(mean * 100.0f));
+    kws->refractory = kws->refractory_frames;
+    memset(kws->posteriors, 0, kws->smooth_num * sizeof(float));
+    //* the time stays here, a pointer holds 32 bits on the chip and ms since boot wrap after 24.8 days
+    kws->detect_us = esp_timer_get_time();
+    audio_event_iface_msg_t msg = {
+        .cmd = SR_KWS_EVENT_DETECTED,
+        .data = (void *)(intptr_t)(int)(mean * 100.0f),
+        .source = kws,
+    };
+    audio_event_iface_sendout(kws->evt, &msg);
+}
+
+static esp_err_t _kws_open(audio_element_handle_t self)
+{
+    sr_kws_t *kws = (sr_kws_t *)audio_element_getdata(self);
+    kws->fill = 0;
+    return ESP_OK;
+}
+
+static esp_err_t _kws_close(audio_element_handle_t self)
+{
+    _kws_report((sr_kws_t *)audio_element_getdata(self));
+    return ESP_OK;
+}
+
+static audio_element_err_t _kws_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    sr_kws_t *kws = (sr_kws_t *)audio_element_getdata(self);
+    int r_size = audio_element_input(self, (char *)kws->buf, SR_KWS_HOP_BYTES);
+    if (r_size <= 0) {
+        return r_size;
+    }
+    //* the audio goes on first, the features only hold up the next read
+    int ret = audio_element_output(self, (char *)kws->buf, r_size);
+    if (ret < 0) {
+        return ret;
+    }
+    const int overlap = SR_KWS_FRAME_SAMPLES - SR_KWS_HOP_SAMPLES;
+    int n = r_size / sizeof(int16_t);
+    for (int used = 0; used < n;) {
+        int take = n - used < SR_KWS_HOP_SAMPLES - kws->fill ? n - used : SR_KWS_HOP_SAMPLES - kws->fill;
+        memcpy(kws->frame + overlap + kws->fill, kws->buf + used, take * sizeof(int16_t));
+        kws->fill += take;
+        used += take;
+        if (kws->fill == SR_KWS_HOP_SAMPLES) {
+            _kws_frame(kws);
+            memmove(kws->frame, kws->frame + SR_KWS_HOP_SAMPLES, overlap * sizeof(int16_t));
+            kws->fill = 0;
+        }
+    }
+    return r_size;
+}
+
+static void _kws_free(sr_kws_t *kws)
+{
+    if (kws->model) {
+        spi_flash_munmap(kws->mmap);
+    }
+    if (kws->evt) {
+        audio_event_iface_destroy(kws->evt);
+    }
+    audio_free(kws->act[0]);
+    audio_free(kws->act[1]);
+    audio_free(kws->buf);
+    audio_free(kws->frame);
+    audio_free(kws->fft);
+    audio_free(kws->window);
+    audio_free(kws->mel_weights);
+    audio_free(kws->dct);
+    audio_free(kws->mfcc);
+    audio_free(kws->features);
+    audio_free(kws->posteriors);
+    audio_free(kws);
+}
+
+static esp_err_t _kws_destroy(audio_element_handle_t self)
+{
+    _kws_free((sr_kws_t *)audio_element_getdata(self));
+    return ESP_OK;
+}
+
+esp_err_t sr_kws_set_listener(audio_element_handle_t self, audio_event_iface_handle_t listener)
+{
+    sr_kws_t *kws = (sr_kws_t *)audio_element_getdata(self);
+    if (listener) {
+        audio_event_iface_set_listener(kws->evt, listener);
+    }
+    return ESP_OK;
+}
+
+bool sr_kws_check_event(audio_element_handle_t self, audio_event_iface_msg_t *msg)
+{
+    return msg->source == audio_element_getdata(self) && msg->cmd == SR_KWS_EVENT_DETECTED;
+}
+
+int64_t sr_kws_get_detect_time(audio_element_handle_t self)
+{
+    sr_kws_t *kws = (sr_kws_t *)audio_element_getdata(self);
+    return kws->detect_us;
+}
+
+audio_element_handle_t sr_kws_init(sr_kws_cfg_t *config)
+{
+    if (config->sample_rate != SR_KWS_RATE) {
+        ESP_LOGE(TAG, "The wake word model is for %d Hz, not %d Hz", SR_KWS_RATE, config->sample_rate);
+        return NULL;
+    }
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                                config->model_partition);
+    if (partition == NULL) {
+        ESP_LOGW(TAG, "No partition %s, wake word disabled", config->model_partition);
+        return NULL;
+    }
+    sr_kws_t *kws = audio_calloc(1, sizeof(sr_kws_t));
+    AUDIO_MEM_CHECK(TAG, kws, return NULL);
+    kws->cfg = *config;
+    const void *model = NULL;
+    if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &model, &kws->mmap) != ESP_OK) {
+        ESP_LOGE(TAG, "Error map partition %s", config->model_partition);
+        audio_free(kws);
+        return NULL;
+    }
+    kws->model = (const sr_kws_model_t *)model;
+    if (_kws_model_check(kws, partition->size) != ESP_OK) {
+        ESP_LOGW(TAG, "No valid model in partition %s, wake word disabled", config->model_partition);
+        goto _kws_init_exit;
+    }
+    if (dsps_fft2r_init_sc16(NULL, SR_KWS_FFT_SAMPLES) != ESP_OK) {
+        ESP_LOGE(TAG, "Error init FFT");
+        goto _kws_init_exit;
+    }
+
+    const int coeffs = kws->model->coeffs;
+    kws->buf = audio_calloc(1, SR_KWS_HOP_BYTES);
+    kws->frame = audio_calloc(SR_KWS_FRAME_SAMPLES, sizeof(int16_t));
+    kws->fft = audio_calloc(SR_KWS_FFT_SAMPLES * 2, sizeof(int16_t));
+    kws->window = audio_calloc(SR_KWS_FRAME_SAMPLES, sizeof(int16_t));
+    kws->dct = audio_calloc(SR_KWS_MEL_BANDS * coeffs, sizeof(int16_t));
+    kws->mfcc = audio_calloc(coeffs, sizeof(int16_t));
+    kws->features = audio_calloc(kws->model->frames, coeffs);
+    kws->smooth_num = config->smooth_ms / config->infer_ms > 0 ? config->smooth_ms / config->infer_ms : 1;
+    kws->posteriors = audio_calloc(kws->smooth_num, sizeof(float));
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    kws->evt = audio_event_iface_init(&evt_cfg);
+    AUDIO_MEM_CHECK(TAG, kws->buf && kws->frame && kws->fft && kws->window && kws->dct && kws->mfcc
+                    && kws->features && kws->posteriors && kws->evt, goto _kws_init_exit);
+    if (_kws_mel_init(kws) != ESP_OK) {
+        goto _kws_init_exit;
+    }
+    //* Hann over the frame, orthonormal DCT-II
+    for (int i = 0; i < SR_KWS_FRAME_SAMPLES; i++) {
+        kws->window[i] = (int16_t)(32767.0f * 0.5f * (1.0f - cosf(2.0f * M_PI * i / SR_KWS_FRAME_SAMPLES)));
+    }
+    for (int m = 0; m < SR_KWS_MEL_BANDS; m++) {
+        for (int j = 0; j < coeffs; j++) {
+            float norm = sqrtf((j == 0 ? 1.0f : 2.0f) / SR_KWS_MEL_BANDS);
+            kws->dct[m * coeffs + j] = (int16_t)lrintf(32767.0f * norm * cosf(M_PI * j * (m + 0.5f) / SR_KWS_MEL_BANDS));
+        }
+    }
+    const int frame_ms = SR_KWS_HOP_SAMPLES * 1000 / SR_KWS_RATE;
+    kws->infer_frames = config->infer_ms / frame_ms > 0 ? config->infer_ms / frame_ms : 1;
+    kws->refractory_frames = config->refractory_ms / frame_ms;
+    kws->gate_power = 32768.0f * 32768.0f * powf(10.0f, config->gate_db / 10.0f);
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _kws_open;
+    cfg.close = _kws_close;
+    cfg.process = _kws_process;
+    cfg.destroy = _kws_destroy;
+    cfg.buffer_len = SR_KWS_HOP_BYTES;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.tag = "kws";
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto _kws_init_exit);
+    audio_element_setdata(el, kws);
+    ESP_LOGI(TAG, "Wake word model: %d frames of %d coefficients, %d layers, %d labels", kws->model->frames,
+             coeffs, kws->model->layer_num, kws->model->labels);
+    return el;
+_kws_init_exit:
+    _kws_free(kws);
+    return NULL;
+}
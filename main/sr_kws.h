@@ -0,0 +1,124 @@
+#ifndef _SR_KWS_H_
+#define _SR_KWS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "audio_element.h"
+#include "audio_event_iface.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_KWS_TASK_STACK           (4 * 1024)
+#define SR_KWS_TASK_CORE            (1)
+#define SR_KWS_TASK_PRIO            (5)
+#define SR_KWS_RINGBUFFER_SIZE      (4 * 1024)
+
+// "KWS1" little endian
+#define SR_KWS_MODEL_MAGIC          (0x3153574b)
+
+/**
+ * Event of the keyword spotter
+ */
+typedef enum {
+    SR_KWS_EVENT_DETECTED = 1,  /*!< The wake word was heard, `data` is the score in percent */
+} sr_kws_event_t;
+
+/**
+ * Model at the start of the data partition, little endian
+ *
+ * The features are computed at 16 kHz, 30 ms Hann windowed frames 20 ms apart, a 512 point FFT divided by 512
+ * of the 16 bit samples, 40 mel bands from 20 Hz to 4 kHz, the natural log of the band energy and an
+ * orthonormal DCT-II of it. Coefficients are in Q7, shifted right by `input_shift` and saturated to int8.
+ * The network sees the last `frames` frames, oldest first, `coeffs` each.
+ */
+typedef struct {
+    uint32_t magic;             /*!< SR_KWS_MODEL_MAGIC */
+    uint16_t frames;            /*!< Feature frames the network sees, 49 for a second */
+    uint16_t coeffs;            /*!< Cepstral coefficients per frame, at most 40 */
+    uint16_t labels;            /*!< Outputs of the last layer */
+    uint16_t keyword;           /*!< Output of the wake word */
+    uint16_t layer_num;         /*!< Fully connected layers that follow */
+    int8_t input_shift;         /*!< Q7 coefficients to int8 input */
+    int8_t output_frac;         /*!< Fractional bits of the last layer's int8 outputs, for the softmax */
+} sr_kws_model_t;
+
+/**
+ * Fully connected layer, `out = relu(sat8((W * in) >> out_shift) + bias)`
+ *
+ * Followed by int8 bias[out_dim] at the output scale and int8 weights[out_dim][in_dim], padded to 4 bytes.
+ * The int8 dot product does not saturate, `out_shift` must bring every accumulator into int8.
+ */
+typedef struct {
+    uint16_t in_dim;
+    uint16_t out_dim;
+    uint8_t out_shift;          /*!< At least 1 */
+    uint8_t relu;               /*!< 0 for the last layer */
+    uint16_t reserved;
+} sr_kws_layer_t;
+
+/**
+ * Keyword spotter element configurations, input and output are 16 bit mono PCM at 16 kHz
+ */
+typedef struct {
+    int sample_rate;            /*!< Input sample rate, the model is for 16000 */
+    const char *model_partition; /*!< Label of the data partition holding the model */
+    int threshold;              /*!< Averaged wake word posterior that triggers (percent) */
+    int smooth_ms;              /*!< Posteriors averaged over this long */
+    int infer_ms;               /*!< The network runs this often while there is sound */
+    int gate_db;                /*!< Frames below this level do not wake the network (dBFS RMS) */
+    int refractory_ms;          /*!< No second trigger for this long */
+    int out_rb_size;            /*!< Size of output ringbuffer */
+    int task_stack;             /*!< Task stack size */
+    int task_core;              /*!< Task running in core (0 or 1) */
+    int task_prio;              /*!< Task priority (based on freeRTOS priority) */
+} sr_kws_cfg_t;
+
+#define DEFAULT_SR_KWS_CONFIG() {                   \
+    .sample_rate        = 16000,                    \
+    .model_partition    = "kws_model",              \
+    .threshold          = 80,                       \
+    .smooth_ms          = 300,                      \
+    .infer_ms           = 60,                       \
+    .gate_db            = -55,                      \
+    .refractory_ms      = 1500,                     \
+    .out_rb_size        = SR_KWS_RINGBUFFER_SIZE,   \
+    .task_stack         = SR_KWS_TASK_STACK,        \
+    .task_core          = SR_KWS_TASK_CORE,         \
+    .task_prio          = SR_KWS_TASK_PRIO,         \
+}
+
+/**
+ * @brief      Create the keyword spotter element, it passes its input through unchanged
+ *
+ *             MFCC features are computed for every frame on the Q15 FFT, the int8 network runs every
+ *             `infer_ms` while the level of the last second is above `gate_db`.
+ *
+ * @param      config  The configuration
+ *
+ * @return     The audio element handle, NULL if there is no valid model in the partition
+ */
+audio_element_handle_t sr_kws_init(sr_kws_cfg_t *config);
+
+/**
+ * @brief      Register listener for SR_KWS_EVENT_DETECTED
+ */
+esp_err_t sr_kws_set_listener(audio_element_handle_t self, audio_event_iface_handle_t listener);
+
+/**
+ * @brief      Check if the message is the SR_KWS_EVENT_DETECTED of this element
+ */
+bool sr_kws_check_event(audio_element_handle_t self, audio_event_iface_msg_t *msg);
+
+/**
+ * @brief      Get the esp_timer time in microseconds of the last SR_KWS_EVENT_DETECTED, 0 before the first one
+ */
+int64_t sr_kws_get_detect_time(audio_element_handle_t self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
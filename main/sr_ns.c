@@ -0,0 +1,433 @@
+#include <string.h>
+#include <math.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_dsp.h"
+#include "audio_element.h"
+#include "audio_common.h"
+#include "audio_mem.h"
+#include "sr_ns.h"
+
+static const char *TAG = "SR_NS";
+
+#define SR_NS_HOP               (SR_NS_FRAME_SAMPLES / 2)
+#define SR_NS_BINS              (SR_NS_FRAME_SAMPLES / 2)
+// log2(SR_NS_FRAME_SAMPLES), the fixed point FFT halves the signal once per stage
+#define SR_NS_FRAME_STAGES      (8)
+// Two frames a hop apart go through one complex FFT, one as the real and one as the imaginary part
+#define SR_NS_BLOCK_SAMPLES     (2 * SR_NS_HOP)
+#define SR_NS_BLOCK_BYTES       (SR_NS_BLOCK_SAMPLES * sizeof(int16_t))
+// Share of a noise frame taken into the noise estimate, about 80 ms to follow a change of the room
+#define SR_NS_NOISE_RATE        (0.1f)
+// Creep of the noise estimate while speech holds it, about 1 dB per second, so a louder room is not speech forever
+#define SR_NS_NOISE_CREEP       (1.002f)
+// Decision-directed smoothing of the a priori SNR, keeps the gain from flickering on noise (musical noise)
+#define SR_NS_DD_ALPHA          (0.98f)
+// Block floating point, frames are scaled to one bit below full scale before the Q15 FFT
+#define SR_NS_Q15_HEADROOM      (16384)
+#define SR_NS_EPS               (1e-10f)
+// esp-dsp keeps one twiddle table per FFT type sized by the first init, the Q15 one also serves the 512 point FFT of sr_kws
+#define SR_NS_FFT_TABLE_SIZE    (512)
+// CPU time is logged once per this many blocks, about 16 s at 16 kHz
+#define SR_NS_REPORT_BLOCKS     (1000)
+
+typedef struct {
+    sr_ns_cfg_t     cfg;
+    int16_t         *in;        /*!< A hop of history in front of a block of new samples */
+    int             fill;       /*!< New samples in `in` */
+    int16_t         *out;
+    float           *window;    /*!< Periodic Hann, sums to 1 at 50% overlap */
+    float           *noise;     /*!< Noise power per bin */
+    float           *clean;     /*!< Speech power per bin of the last frame, for the decision-directed SNR */
+    float           *power;     /*!< Power per bin of both frames */
+    float           *gain;      /*!< Gain per bin of both frames */
+    float           gain_min;
+    float           margin;
+    bool            noise_init;
+    /* float path */
+    float           *fft;
+    float           *ifft;
+    float           *ola;
+    /* fixed point path */
+    int16_t         *fft_q;
+    int32_t         *acc;
+    int16_t         *window_q;
+    int32_t         *ola_q;
+    int64_t         cpu_us;
+    int             blocks;
+} sr_ns_t;
+
+/*
+ * Wiener gain of one frame, the noise estimate follows the frames the speech margin calls noise
+ */
+static void _ns_gain(sr_ns_t *ns, const float *power, float *gain)
+{
+    if (!ns->noise_init) {
+        //* the microphone runs from init on, before anyone speaks
+        memcpy(ns->noise, power, SR_NS_BINS * sizeof(float));
+        ns->noise_init = true;
+    }
+    float energy = 0, noise = 0;
+    for (int k = 0; k < SR_NS_BINS; k++) {
+        energy += power[k];
+        noise += ns->noise[k];
+    }
+    bool speech = energy > noise * ns->margin;
+    for (int k = 0; k < SR_NS_BINS; k++) {
+        float p = power[k];
+        float n = ns->noise[k];
+        if (!speech) {
+            n += SR_NS_NOISE_RATE * (p - n);
+        } else {
+            n *= SR_NS_NOISE_CREEP;
+        }
+        if (n < SR_NS_EPS) {
+            n = SR_NS_EPS;
+        }
+        ns->noise[k] = n;
+        float post = p / n - 1.0f;
+        float prio = SR_NS_DD_ALPHA * ns->clean[k] / n + (1.0f - SR_NS_DD_ALPHA) * (post > 0 ? post : 0);
+        float g = prio / (1.0f + prio);
+        if (g < ns->gain_min) {
+            g = ns->gain_min;
+        }
+        gain[k] = g;
+        ns->clean[k] = g * g * p;
+    }
+}
+
+/*
+ * Float path, `in` holds frame 1 at 0 and frame 2 a hop later, the output block lags the input by a hop
+ */
+static void _ns_block_f32(sr_ns_t *ns)
+{
+    const int n = SR_NS_FRAME_SAMPLES;
+    float *fft = ns->fft;
+    for (int i = 0; i < n; i++) {
+        fft[i * 2 + 0] = ns->in[i] * ns->window[i];
+        fft[i * 2 + 1] = ns->in[i + SR_NS_HOP] * ns->window[i];
+    }
+    dsps_fft2r_fc32(fft, n);
+    dsps_bit_rev_fc32(fft, n);
+    //* frame 1 in the first half, frame 2 in the second, twice their spectrum but at DC, Nyquist dropped
+    dsps_cplx2reC_fc32(fft, n);
+    fft[0] *= 2.0f;
+    fft[n] *= 2.0f;
+    for (int k = 0; k < SR_NS_BINS; k++) {
+        const float *a = fft + k * 2;
+        const float *b = fft + n + k * 2;
+        ns->power[k] = 0.25f * (a[0] * a[0] + a[1] * a[1]);
+        ns->power[SR_NS_BINS + k] = 0.25f * (b[0] * b[0] + b[1] * b[1]);
+    }
+    _ns_gain(ns, ns->power, ns->gain);
+    _ns_gain(ns, ns->power + SR_NS_BINS, ns->gain + SR_NS_BINS);
+
+    //* both filtered spectra back through one FFT, Z = A + jB, inverse as conj(FFT(conj(Z))) / N
+    float *z = ns->ifft;
+    for (int k = 0; k < SR_NS_BINS; k++) {
+        float ga = 0.5f * ns->gain[k];
+        float gb = 0.5f * ns->gain[SR_NS_BINS + k];
+        float ar = fft[k * 2] * ga, ai = fft[k * 2 + 1] * ga;
+        float br = fft[n + k * 2] * gb, bi = fft[n + k * 2 + 1] * gb;
+        z[k * 2 + 0] = ar - bi;
+        z[k * 2 + 1] = -(ai + br);
+        if (k > 0) {
+            z[(n - k) * 2 + 0] = ar + bi;
+            z[(n - k) * 2 + 1] = ai - br;
+        }
+    }
+    z[n] = 0;
+    z[n + 1] = 0;
+    dsps_fft2r_fc32(z, n);
+    dsps_bit_rev_fc32(z, n);
+
+    const float scale = 1.0f / n;
+    for (int i = 0; i < SR_NS_HOP; i++) {
+        float s1 = ns->ola[i] + z[i * 2] * scale;
+        float s2 = (z[(i + SR_NS_HOP) * 2] - z[i * 2 + 1]) * scale;
+        ns->ola[i] = -z[(i + SR_NS_HOP) * 2 + 1] * scale;
+        ns->out[i] = s1 > 32767.0f ? 32767 : s1 < -32768.0f ? -32768 : (int16_t)lrintf(s1);
+        ns->out[SR_NS_HOP + i] = s2 > 32767.0f ? 32767 : s2 < -32768.0f ? -32768 : (int16_t)lrintf(s2);
+    }
+}
+
+static inline int32_t _ns_shift(int32_t x, int shift)
+{
+    return shift >= 0 ? x << shift : x >> -shift;
+}
+
+static inline int16_t _ns_sat16(int32_t x)
+{
+    return x > 32767 ? 32767 : x < -32768 ? -32768 : (int16_t)x;
+}
+
+/*
+ * Bin k of Z = A + jB with the gains on, and its mirror N - k, from twice the spectra of both frames
+ */
+static void _ns_z_q15(int32_t *acc, int k, const int32_t *a, const int32_t *b, float gain_a, float gain_b)
+{
+    const int n = SR_NS_FRAME_SAMPLES;
+    int32_t ga = (int32_t)(gain_a * 32767.0f);
+    int32_t gb = (int32_t)(gain_b * 32767.0f);
+    int32_t ar = (a[0] * ga) >> 16, ai = (a[1] * ga) >> 16;
+    int32_t br = (b[0] * gb) >> 16, bi = (b[1] * gb) >> 16;
+    //* stored conjugated for the inverse
+    acc[k * 2 + 0] = ar - bi;
+    acc[k * 2 + 1] = -(ai + br);
+    if (k > 0) {
+        acc[(n - k) * 2 + 0] = ar + bi;
+        acc[(n - k) * 2 + 1] = ai - br;
+    }
+}
+
+/*
+ * Fixed point path, same as `_ns_block_f32` on the Q15 FFT with a block exponent on either side
+ */
+static void _ns_block_sc16(sr_ns_t *ns)
+{
+    const int n = SR_NS_FRAME_SAMPLES;
+    int16_t *fft = ns->fft_q;
+    int32_t *acc = ns->acc;
+    int32_t peak = 0;
+    for (int i = 0; i < n; i++) {
+        int32_t v1 = (ns->in[i] * ns->window_q[i]) >> 15;
+        int32_t v2 = (ns->in[i + SR_NS_HOP] * ns->window_q[i]) >> 15;
+        fft[i * 2 + 0] = v1;
+        fft[i * 2 + 1] = v2;
+        v1 = v1 < 0 ? -v1 : v1;
+        v2 = v2 < 0 ? -v2 : v2;
+        peak = v1 > peak ? v1 : peak;
+        peak = v2 > peak ? v2 : peak;
+    }
+    int s = 0;
+    while (s < 14 && (peak << (s + 1)) < SR_NS_Q15_HEADROOM) {
+        s++;
+    }
+    for (int i = 0; i < n * 2; i++) {
+        fft[i] <<= s;
+    }
+    //* the FFT divides by N, so every bin is X * 2^s / N
+    dsps_fft2r_sc16(fft, n);
+    dsps_bit_rev_sc16(fft, n);
+
+    //* split the two frames in 32 bits, the sums of two bins do not fit in 16
+    for (int k = 0; k < SR_NS_BINS; k++) {
+        int32_t xr = fft[k * 2], xi = fft[k * 2 + 1];
+        int32_t yr = fft[((n - k) % n) * 2], yi = fft[((n - k) % n) * 2 + 1];
+        acc[k * 2 + 0] = xr + yr;
+        acc[k * 2 + 1] = xi - yi;
+        acc[n + k * 2 + 0] = xi + yi;
+        acc[n + k * 2 + 1] = yr - xr;
+    }
+    const float unit = ldexpf(0.25f, -2 * s);
+    for (int k = 0; k < SR_NS_BINS; k++) {
+        const int32_t *a = acc + k * 2;
+        const int32_t *b = acc + n + k * 2;
+        ns->power[k] = unit * ((float)a[0] * a[0] + (float)a[1] * a[1]);
+        ns->power[SR_NS_BINS + k] = unit * ((float)b[0] * b[0] + (float)b[1] * b[1]);
+    }
+    _ns_gain(ns, ns->power, ns->gain);
+    _ns_gain(ns, ns->power + SR_NS_BINS, ns->gain + SR_NS_BINS);
+
+    //* Z in 32 bits and in place, bins k and N/2 - k share their four slots so both are read first
+    for (int k = 0; k <= SR_NS_BINS / 2; k++) {
+        int j = SR_NS_BINS - k;
+        int32_t a1[2] = { acc[k * 2], acc[k * 2 + 1] };
+        int32_t b1[2] = { acc[n + k * 2], acc[n + k * 2 + 1] };
+        int32_t a2[2] = { 0, 0 }, b2[2] = { 0, 0 };
+        bool pair = k > 0 && j != k;
+        if (pair) {
+            a2[0] = acc[j * 2];
+            a2[1] = acc[j * 2 + 1];
+            b2[0] = acc[n + j * 2];
+            b2[1] = acc[n + j * 2 + 1];
+        }
+        _ns_z_q15(acc, k, a1, b1, ns->gain[k], ns->gain[SR_NS_BINS + k]);
+        if (pair) {
+            _ns_z_q15(acc, j, a2, b2, ns->gain[j], ns->gain[SR_NS_BINS + j]);
+        }
+    }
+    acc[n] = 0;
+    acc[n + 1] = 0;
+    //* then a second block exponent so Z fills the Q15 range again
+    int32_t zpeak = 0;
+    for (int i = 0; i < n * 2; i++) {
+        int32_t v = acc[i] < 0 ? -acc[i] : acc[i];
+        zpeak = v > zpeak ? v : zpeak;
+    }
+    int t = 0;
+    while (zpeak >= SR_NS_Q15_HEADROOM) {
+        zpeak >>= 1;
+        t--;
+    }
+    while (t < 14 && (zpeak << 1) < SR_NS_Q15_HEADROOM) {
+        zpeak <<= 1;
+        t++;
+    }
+    for (int i = 0; i < n * 2; i++) {
+        fft[i] = _ns_shift(acc[i], t);
+    }
+    dsps_fft2r_sc16(fft, n);
+    dsps_bit_rev_sc16(fft, n);
+
+    //* the inverse is the filtered frame * 2^(s + t) / N
+    int shift = SR_NS_FRAME_STAGES - s - t;
+    for (int i = 0; i < SR_NS_HOP; i++) {
+        int32_t s1 = ns->ola_q[i] + _ns_shift(fft[i * 2], shift);
+        int32_t s2 = _ns_shift(fft[(i + SR_NS_HOP) * 2], shift) - _ns_shift(fft[i * 2 + 1], shift);
+        ns->ola_q[i] = -_ns_shift(fft[(i + SR_NS_HOP) * 2 + 1], shift);
+        ns->out[i] = _ns_sat16(s1);
+        ns->out[SR_NS_HOP + i] = _ns_sat16(s2);
+    }
+}
+
+static esp_err_t _ns_open(audio_element_handle_t self)
+{
+    sr_ns_t *ns = (sr_ns_t *)audio_element_getdata(self);
+    //* the noise estimate outlives a restart, the room has not changed
+    ns->fill = 0;
+    memset(ns->in, 0, (SR_NS_HOP + SR_NS_BLOCK_SAMPLES) * sizeof(int16_t));
+    if (ns->ola) {
+        memset(ns->ola, 0, SR_NS_HOP * sizeof(float));
+    }
+    if (ns->ola_q) {
+        memset(ns->ola_q, 0, SR_NS_HOP * sizeof(int32_t));
+    }
+    return ESP_OK;
+}
+
+static void _ns_report(sr_ns_t *ns)
+{
+    if (ns->blocks > 0) {
+        //* two frames per block, a frame is due every hop
+        ESP_LOGI(TAG, "%s, %d us per frame of %d ms", ns->cfg.fixed_point ? "Q15" : "float",
+                 (int)(ns->cpu_us / (ns->blocks * 2)), SR_NS_HOP * 1000 / ns->cfg.sample_rate);
+    }
+    ns->cpu_us = 0;
+    ns->blocks = 0;
+}
+
+static esp_err_t _ns_close(audio_element_handle_t self)
+{
+    _ns_report((sr_ns_t *)audio_element_getdata(self));
+    return ESP_OK;
+}
+
+static audio_element_err_t _ns_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    sr_ns_t *ns = (sr_ns_t *)audio_element_getdata(self);
+    int r_size = audio_element_input(self, (char *)(ns->in + SR_NS_HOP + ns->fill),
+                                     (SR_NS_BLOCK_SAMPLES - ns->fill) * sizeof(int16_t));
+    if (r_size <= 0) {
+        return r_size;
+    }
+    ns->fill += r_size / sizeof(int16_t);
+    if (ns->fill < SR_NS_BLOCK_SAMPLES) {
+        return r_size;
+    }
+    ns->fill = 0;
+    int64_t start = esp_timer_get_time();
+    if (ns->cfg.fixed_point) {
+        _ns_block_sc16(ns);
+    } else {
+        _ns_block_f32(ns);
+    }
+    ns->cpu_us += esp_timer_get_time() - start;
+    //* the last hop is the history of the next block
+    memcpy(ns->in, ns->in + SR_NS_BLOCK_SAMPLES, SR_NS_HOP * sizeof(int16_t));
+    if (++ns->blocks >= SR_NS_REPORT_BLOCKS) {
+        _ns_report(ns);
+    }
+    int ret = audio_element_output(self, (char *)ns->out, SR_NS_BLOCK_BYTES);
+    return ret < 0 ? ret : r_size;
+}
+
+static void _ns_free(sr_ns_t *ns)
+{
+    audio_free(ns->in);
+    audio_free(ns->out);
+    audio_free(ns->window);
+    audio_free(ns->noise);
+    audio_free(ns->clean);
+    audio_free(ns->power);
+    audio_free(ns->gain);
+    audio_free(ns->fft);
+    audio_free(ns->ifft);
+    audio_free(ns->ola);
+    audio_free(ns->fft_q);
+    audio_free(ns->acc);
+    audio_free(ns->window_q);
+    audio_free(ns->ola_q);
+    audio_free(ns);
+}
+
+static esp_err_t _ns_destroy(audio_element_handle_t self)
+{
+    _ns_free((sr_ns_t *)audio_element_getdata(self));
+    return ESP_OK;
+}
+
+audio_element_handle_t sr_ns_init(sr_ns_cfg_t *config)
+{
+    sr_ns_t *ns = audio_calloc(1, sizeof(sr_ns_t));
+    AUDIO_MEM_CHECK(TAG, ns, return NULL);
+    ns->cfg = *config;
+
+    esp_err_t err = config->fixed_point ? dsps_fft2r_init_sc16(NULL, SR_NS_FFT_TABLE_SIZE)
+                                        : dsps_fft2r_init_fc32(NULL, SR_NS_FFT_TABLE_SIZE);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error init FFT");
+        audio_free(ns);
+        return NULL;
+    }
+
+    ns->in = audio_calloc(SR_NS_HOP + SR_NS_BLOCK_SAMPLES, sizeof(int16_t));
+    ns->out = audio_calloc(1, SR_NS_BLOCK_BYTES);
+    //* one point longer and cut, the symmetric window of N + 1 points is the periodic one of N
+    ns->window = audio_calloc(SR_NS_FRAME_SAMPLES + 1, sizeof(float));
+    ns->noise = audio_calloc(SR_NS_BINS, sizeof(float));
+    ns->clean = audio_calloc(SR_NS_BINS, sizeof(float));
+    ns->power = audio_calloc(2 * SR_NS_BINS, sizeof(float));
+    ns->gain = audio_calloc(2 * SR_NS_BINS, sizeof(float));
+    AUDIO_MEM_CHECK(TAG, ns->in && ns->out && ns->window && ns->noise && ns->clean && ns->power && ns->gain,
+                    goto _ns_init_exit);
+    dsps_wind_hann_f32(ns->window, SR_NS_FRAME_SAMPLES + 1);
+    if (config->fixed_point) {
+        ns->fft_q = audio_calloc(SR_NS_FRAME_SAMPLES * 2, sizeof(int16_t));
+        ns->acc = audio_calloc(SR_NS_FRAME_SAMPLES * 2, sizeof(int32_t));
+        ns->window_q = audio_calloc(SR_NS_FRAME_SAMPLES, sizeof(int16_t));
+        ns->ola_q = audio_calloc(SR_NS_HOP, sizeof(int32_t));
+        AUDIO_MEM_CHECK(TAG, ns->fft_q && ns->acc && ns->window_q && ns->ola_q, goto _ns_init_exit);
+        for (int i = 0; i < SR_NS_FRAME_SAMPLES; i++) {
+            ns->window_q[i] = (int16_t)(ns->window[i] * 32767.0f);
+        }
+    } else {
+        ns->fft = audio_calloc(SR_NS_FRAME_SAMPLES * 2, sizeof(float));
+        ns->ifft = audio_calloc(SR_NS_FRAME_SAMPLES * 2, sizeof(float));
+        ns->ola = audio_calloc(SR_NS_HOP, sizeof(float));
+        AUDIO_MEM_CHECK(TAG, ns->fft && ns->ifft && ns->ola, goto _ns_init_exit);
+    }
+    ns->gain_min = powf(10.0f, -config->max_attenuation_db / 20.0f);
+    ns->margin = powf(10.0f, config->speech_margin_db / 10.0f);
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _ns_open;
+    cfg.close = _ns_close;
+    cfg.process = _ns_process;
+    cfg.destroy = _ns_destroy;
+    cfg.buffer_len = SR_NS_BLOCK_BYTES;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.tag = "ns";
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto _ns_init_exit);
+    audio_element_setdata(el, ns);
+    ESP_LOGI(TAG, "%d point frames, up to %d dB off the noise, %s", SR_NS_FRAME_SAMPLES,
+             config->max_attenuation_db, config->fixed_point ? "Q15" : "float");
+    return el;
+_ns_init_exit:
+    _ns_free(ns);
+    return NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef _SR_NS_H_
+#define _SR_NS_H_
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_NS_TASK_STACK            (4 * 1024)
+#define SR_NS_TASK_CORE             (1)
+#define SR_NS_TASK_PRIO             (5)
+#define SR_NS_RINGBUFFER_SIZE       (8 * 1024)
+// STFT frame, 16 ms at 16 kHz, frames overlap by half
+#define SR_NS_FRAME_SAMPLES         (256)
+
+/**
+ * Noise suppressor element configurations, input and output are 16 bit mono PCM
+ */
+typedef struct {
+    int sample_rate;            /*!< Input sample rate */
+    int max_attenuation_db;     /*!< Most that is taken off a noise-only bin, less keeps fewer artifacts */
+    int speech_margin_db;       /*!< Frame energy above the noise estimate at which it stops being updated */
+    bool fixed_point;           /*!< Q15 FFT, for chips without an FPU, else float */
+    int out_rb_size;            /*!< Size of output ringbuffer */
+    int task_stack;             /*!< Task stack size */
+    int task_core;              /*!< Task running in core (0 or 1) */
+    int task_prio;              /*!< Task priority (based on freeRTOS priority) */
+} sr_ns_cfg_t;
+
+#define DEFAULT_SR_NS_CONFIG() {                    \
+    .sample_rate        = 16000,                    \
+    .max_attenuation_db = 12,                       \
+    .speech_margin_db   = 6,                        \
+    .fixed_point        = false,                    \
+    .out_rb_size        = SR_NS_RINGBUFFER_SIZE,    \
+    .task_stack         = SR_NS_TASK_STACK,         \
+    .task_core          = SR_NS_TASK_CORE,          \
+    .task_prio          = SR_NS_TASK_PRIO,          \
+}
+
+/**
+ * @brief      Create the noise suppressor element, a Wiener filter on the short-time spectrum
+ *
+ *             Hann windowed frames overlap by half and are added back after the gain, which delays the
+ *             audio by half a frame. The noise spectrum is tracked on frames without speech, so the element
+ *             belongs in front of the VAD and runs best when it hears the room all the time.
+ *
+ * @param      config  The configuration
+ *
+ * @return     The audio element handle
+ */
+audio_element_handle_t sr_ns_init(sr_ns_cfg_t *config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,207 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "audio_element.h"
+#include "audio_common.h"
+#include "audio_mem.h"
+#include "sr_preroll.h"
+#include "latency_trace.h"
+
+static const char *TAG = "SR_PREROLL";
+
+#define SR_PREROLL_BUFFER_LEN   (512)
+
+typedef struct {
+    sr_preroll_cfg_t    cfg;
+    char                *ring;
+    int                 ring_size;
+    int                 pre_roll_bytes;
+    int                 next_size;  /*!< Ring size taken at the next mark */
+    int                 overrun_bytes;
+    /* stream positions since the start, the ring holds [written - ring_size, written) */
+    int64_t             written;
+    int64_t             read;
+    SemaphoreHandle_t   lock;
+    SemaphoreHandle_t   data;       /*!< Given after every write */
+} sr_preroll_t;
+
+static audio_element_err_t _preroll_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    sr_preroll_t *preroll = (sr_preroll_t *)audio_element_getdata(self);
+    int r_size = audio_element_input(self, in_buffer, in_len);
+    if (r_size <= 0) {
+        return r_size;
+    }
+    xSemaphoreTake(preroll->lock, portMAX_DELAY);
+    int pos = preroll->written % preroll->ring_size;
+    int first = r_size < preroll->ring_size - pos ? r_size : preroll->ring_size - pos;
+    memcpy(preroll->ring + pos, in_buffer, first);
+    memcpy(preroll->ring, in_buffer + first, r_size - first);
+    preroll->written += r_size;
+    xSemaphoreGive(preroll->lock);
+    xSemaphoreGive(preroll->data);
+    return r_size;
+}
+
+audio_element_err_t sr_preroll_read(audio_element_handle_t self, char *buffer, int len,
+                                    TickType_t ticks_to_wait, void *context)
+{
+    sr_preroll_t *preroll = (sr_preroll_t *)audio_element_getdata((audio_element_handle_t)context);
+    TickType_t wait = pdMS_TO_TICKS(SR_PREROLL_READ_WAIT_MS);
+    for (int tries = 0; tries < 2; tries++) {
+        xSemaphoreTake(preroll->lock, portMAX_DELAY);
+        //* the reader fell a whole ring behind, skip to the oldest audio still there
+        if (preroll->written - preroll->read > preroll->ring_size) {
+            int lost = preroll->written - preroll->read - preroll->ring_size;
+            ESP_LOGW(TAG, "Overrun, %d bytes lost", lost);
+            latency_trace_record(TRACE_SR_OVERRUN, lost);
+            preroll->overrun_bytes += lost;
+            preroll->read = preroll->written - preroll->ring_size;
+        }
+        int available = preroll->written - preroll->read;
+        if (available > 0) {
+            //* straight from the ring into the reader's buffer, the pre-roll is never copied elsewhere
+            int size = available < len ? available : len;
+            int pos = preroll->read % preroll->ring_size;
+            int first = size < preroll->ring_size - pos ? size : preroll->ring_size - pos;
+            memcpy(buffer, preroll->ring + pos, first);
+            memcpy(buffer + first, preroll->ring, size - first);
+            preroll->read += size;
+            xSemaphoreGive(preroll->lock);
+            return size;
+        }
+        xSemaphoreGive(preroll->lock);
+        xSemaphoreTake(preroll->data, ticks_to_wait < wait ? ticks_to_wait : wait);
+    }
+    return AEL_IO_TIMEOUT;
+}
+
+/*
+ * Copy stream positions [pos, pos + len) out of the ring
+ */
+static void _preroll_copy(sr_preroll_t *preroll, int64_t pos, char *dst, int len)
+{
+    int offset = pos % preroll->ring_size;
+    int first = len < preroll->ring_size - offset ? len : preroll->ring_size - offset;
+    memcpy(dst, preroll->ring + offset, first);
+    memcpy(dst + first, preroll->ring, len - first);
+}
+
+/*
+ * Move the audio not read yet into a ring of `size`, every byte keeps its stream position
+ */
+static esp_err_t _preroll_resize(sr_preroll_t *preroll, int size)
+{
+    char *ring = audio_calloc(1, size);
+    AUDIO_MEM_CHECK(TAG, ring, return ESP_FAIL);
+    int64_t start = preroll->written - size;
+    if (start < preroll->read) {
+        start = preroll->read;
+    }
+    for (int64_t pos = start; pos < preroll->written;) {
+        int offset = pos % size;
+        int len = preroll->written - pos < size - offset ? preroll->written - pos : size - offset;
+        _preroll_copy(preroll, pos, ring + offset, len);
+        pos += len;
+    }
+    audio_free(preroll->ring);
+    preroll->ring = ring;
+    preroll->ring_size = size;
+    return ESP_OK;
+}
+
+esp_err_t sr_preroll_mark(audio_element_handle_t self)
+{
+    sr_preroll_t *preroll = (sr_preroll_t *)audio_element_getdata(self);
+    return sr_preroll_mark_back(self, preroll->cfg.pre_roll_ms);
+}
+
+esp_err_t sr_preroll_mark_back(audio_element_handle_t self, int back_ms)
+{
+    sr_preroll_t *preroll = (sr_preroll_t *)audio_element_getdata(self);
+    int back_bytes = back_ms * (preroll->cfg.sample_rate * (int)sizeof(int16_t) / 1000);
+    if (back_bytes < 0 || back_bytes > preroll->pre_roll_bytes) {
+        back_bytes = preroll->pre_roll_bytes;
+    }
+    xSemaphoreTake(preroll->lock, portMAX_DELAY);
+    if (preroll->next_size != preroll->ring_size && _preroll_resize(preroll, preroll->next_size) == ESP_OK) {
+        ESP_LOGI(TAG, "Ring resized to %d bytes", preroll->ring_size);
+    }
+    preroll->overrun_bytes = 0;
+    int64_t start = preroll->written - back_bytes;
+    if (start > preroll->read) {
+        preroll->read = start;
+    }
+    ESP_LOGI(TAG, "Recording starts %d ms back", (int)((preroll->written - preroll->read) * 1000
+             / (preroll->cfg.sample_rate * (int)sizeof(int16_t))));
+    xSemaphoreGive(preroll->lock);
+    return ESP_OK;
+}
+
+void sr_preroll_set_margin(audio_element_handle_t self, int margin_ms)
+{
+    sr_preroll_t *preroll = (sr_preroll_t *)audio_element_getdata(self);
+    int size = preroll->pre_roll_bytes + margin_ms * (preroll->cfg.sample_rate * (int)sizeof(int16_t) / 1000);
+    preroll->next_size = size < SR_PREROLL_BUFFER_LEN ? SR_PREROLL_BUFFER_LEN : size;
+}
+
+int sr_preroll_get_overrun(audio_element_handle_t self)
+{
+    sr_preroll_t *preroll = (sr_preroll_t *)audio_element_getdata(self);
+    return preroll->overrun_bytes;
+}
+
+static void _preroll_free(sr_preroll_t *preroll)
+{
+    if (preroll->lock) {
+        vSemaphoreDelete(preroll->lock);
+    }
+    if (preroll->data) {
+        vSemaphoreDelete(preroll->data);
+    }
+    audio_free(preroll->ring);
+    audio_free(preroll);
+}
+
+static esp_err_t _preroll_destroy(audio_element_handle_t self)
+{
+    _preroll_free((sr_preroll_t *)audio_element_getdata(self));
+    return ESP_OK;
+}
+
+audio_element_handle_t sr_preroll_init(sr_preroll_cfg_t *config)
+{
+    sr_preroll_t *preroll = audio_calloc(1, sizeof(sr_preroll_t));
+    AUDIO_MEM_CHECK(TAG, preroll, return NULL);
+    preroll->cfg = *config;
+    int bytes_per_ms = config->sample_rate * sizeof(int16_t) / 1000;
+    preroll->pre_roll_bytes = config->pre_roll_ms * bytes_per_ms;
+    preroll->ring_size = (config->pre_roll_ms + config->margin_ms) * bytes_per_ms;
+    if (preroll->ring_size < SR_PREROLL_BUFFER_LEN) {
+        preroll->ring_size = SR_PREROLL_BUFFER_LEN;
+    }
+    preroll->next_size = preroll->ring_size;
+    preroll->ring = audio_calloc(1, preroll->ring_size);
+    preroll->lock = xSemaphoreCreateMutex();
+    preroll->data = xSemaphoreCreateBinary();
+    AUDIO_MEM_CHECK(TAG, preroll->ring && preroll->lock && preroll->data, goto _preroll_init_exit);
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.process = _preroll_process;
+    cfg.destroy = _preroll_destroy;
+    cfg.buffer_len = SR_PREROLL_BUFFER_LEN;
+    cfg.out_rb_size = 0;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.tag = "preroll";
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto _preroll_init_exit);
+    audio_element_setdata(el, preroll);
+    ESP_LOGI(TAG, "Pre-roll %d ms, ring %d bytes", config->pre_roll_ms, preroll->ring_size);
+    return el;
+_preroll_init_exit:
+    _preroll_free(preroll);
+    return NULL;
+}
@@ -0,0 +1,103 @@
+#ifndef _SR_PREROLL_H_
+#define _SR_PREROLL_H_
+
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_PREROLL_TASK_STACK       (3 * 1024)
+#define SR_PREROLL_TASK_CORE        (1)
+#define SR_PREROLL_TASK_PRIO        (5)
+#define SR_PREROLL_MS               (1000)
+// Room behind the pre-roll for a recording that falls behind, e.g. while the upload stalls
+#define SR_PREROLL_MARGIN_MS        (500)
+// A read gives up after this long, so the reading element can be stopped
+#define SR_PREROLL_READ_WAIT_MS     (100)
+
+/**
+ * Pre-roll capture element configurations, 16 bit mono PCM
+ */
+typedef struct {
+    int sample_rate;            /*!< Input sample rate */
+    int pre_roll_ms;            /*!< Audio kept in front of `sr_preroll_mark` */
+    int margin_ms;              /*!< Room behind it for a slow reader */
+    int task_stack;             /*!< Task stack size */
+    int task_core;              /*!< Task running in core (0 or 1) */
+    int task_prio;              /*!< Task priority (based on freeRTOS priority) */
+} sr_preroll_cfg_t;
+
+#define DEFAULT_SR_PREROLL_CONFIG() {               \
+    .sample_rate        = 16000,                    \
+    .pre_roll_ms        = SR_PREROLL_MS,            \
+    .margin_ms          = SR_PREROLL_MARGIN_MS,     \
+    .task_stack         = SR_PREROLL_TASK_STACK,    \
+    .task_core          = SR_PREROLL_TASK_CORE,     \
+    .task_prio          = SR_PREROLL_TASK_PRIO,     \
+}
+
+/**
+ * @brief      Create the pre-roll element, the last element of an always running capture pipeline
+ *
+ *             It keeps the latest `pre_roll_ms + margin_ms` of its input in a ring. The first element of
+ *             the recording pipeline reads straight out of the ring with `sr_preroll_read`.
+ *
+ * @param      config  The configuration
+ *
+ * @return     The audio element handle
+ */
+audio_element_handle_t sr_preroll_init(sr_preroll_cfg_t *config);
+
+/**
+ * @brief      Start a new recording `pre_roll_ms` back in time, or where the last one stopped reading
+ *             if that is later, so no audio is sent twice
+ *
+ * @param[in]  self  The pre-roll element
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t sr_preroll_mark(audio_element_handle_t self);
+
+/**
+ * @brief      Like `sr_preroll_mark`, but `back_ms` back in time, at most `pre_roll_ms`
+ *
+ * @param[in]  self     The pre-roll element
+ * @param[in]  back_ms  How far back the recording starts
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t sr_preroll_mark_back(audio_element_handle_t self, int back_ms);
+
+/**
+ * @brief      Resize the room behind the pre-roll, taken at the next `sr_preroll_mark`
+ *
+ * @param[in]  self       The pre-roll element
+ * @param[in]  margin_ms  The new margin
+ */
+void sr_preroll_set_margin(audio_element_handle_t self, int margin_ms);
+
+/**
+ * @brief      Bytes the reader lost since the last `sr_preroll_mark` because it fell a whole ring behind
+ */
+int sr_preroll_get_overrun(audio_element_handle_t self);
+
+/**
+ * @brief      Read callback for `audio_element_set_read_cb` of the first recording element,
+ *             `context` is the pre-roll element
+ *
+ * @return     Bytes read, AEL_IO_TIMEOUT if nothing came within SR_PREROLL_READ_WAIT_MS
+ */
+audio_element_err_t sr_preroll_read(audio_element_handle_t self, char *buffer, int len,
+                                    TickType_t ticks_to_wait, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
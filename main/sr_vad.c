@@ -0,0 +1,272 @@
+#include <string.h>
+#include <math.h>
+#include "esp_log.h"
+#include "audio_element.h"
+#include "audio_common.h"
+#include "audio_mem.h"
+#include "esp_dsp.h"
+#include "sr_vad.h"
+#include "latency_trace.h"
+
+static const char *TAG = "SR_VAD";
+
+#define SR_VAD_FRAME_SAMPLES    (256)
+#define SR_VAD_FRAME_BYTES      (SR_VAD_FRAME_SAMPLES * sizeof(int16_t))
+#define SR_VAD_BAND_LOW_HZ      (300)
+#define SR_VAD_BAND_HIGH_HZ     (3400)
+#define SR_VAD_BPF_CENTER_HZ    (1000)
+#define SR_VAD_BPF_Q            (0.6f)
+// Frames below this level are never voiced, keeps the noise floor from following digital silence
+#define SR_VAD_MIN_ENERGY_DB    (-65.0f)
+#define SR_VAD_EPS              (1e-10f)
+
+typedef struct {
+    sr_vad_cfg_t    cfg;
+    int16_t         *frame;
+    float           *x;
+    float           *fft;
+    float           *window;
+    float           bpf_coeffs[5];
+    float           bpf_w[2];
+    int             band_low;
+    int             band_high;
+    float           noise_floor_db;
+    bool            noise_init;
+    /* pre-roll ring of silent frames, flushed at speech onset */
+    int16_t         *ring;
+    int             ring_frames;
+    int             ring_head;
+    int             ring_count;
+    int             hangover_frames;
+    int             max_pause_frames;
+    int             end_frames;
+    int             hang;
+    int             pause;
+    int             silence;
+    bool            in_speech;
+    bool            has_spoken;
+} sr_vad_t;
+
+static int _ms_to_frames(int ms, int sample_rate)
+{
+    return ms * sample_rate / 1000 / SR_VAD_FRAME_SAMPLES;
+}
+
+static bool _vad_is_voiced(sr_vad_t *vad, int samples)
+{
+    for (int i = 0; i < samples; i++) {
+        vad->x[i] = vad->frame[i] * (1.0f / 32768.0f);
+    }
+    for (int i = samples; i < SR_VAD_FRAME_SAMPLES; i++) {
+        vad->x[i] = 0;
+    }
+
+    //* band energy, 300-3400 Hz where speech lives
+    dsps_biquad_f32(vad->x, vad->x, SR_VAD_FRAME_SAMPLES, vad->bpf_coeffs, vad->bpf_w);
+    float energy = 0;
+    dsps_dotprod_f32(vad->x, vad->x, &energy, SR_VAD_FRAME_SAMPLES);
+    float energy_db = 10.0f * log10f(energy / SR_VAD_FRAME_SAMPLES + SR_VAD_EPS);
+
+    //* spectral flatness, close to 1 for stationary noise, low for voiced speech
+    for (int i = 0; i < SR_VAD_FRAME_SAMPLES; i++) {
+        vad->fft[i * 2 + 0] = vad->x[i] * vad->window[i];
+        vad->fft[i * 2 + 1] = 0;
+    }
+    dsps_fft2r_fc32(vad->fft, SR_VAD_FRAME_SAMPLES);
+    dsps_bit_rev_fc32(vad->fft, SR_VAD_FRAME_SAMPLES);
+    float log_sum = 0, sum = 0;
+    for (int k = vad->band_low; k <= vad->band_high; k++) {
+        float p = vad->fft[k * 2] * vad->fft[k * 2] + vad->fft[k * 2 + 1] * vad->fft[k * 2 + 1] + SR_VAD_EPS;
+        log_sum += logf(p);
+        sum += p;
+    }
+    int bins = vad->band_high - vad->band_low + 1;
+    float flatness = expf(log_sum / bins) / (sum / bins);
+
+    if (!vad->noise_init) {
+        vad->noise_floor_db = energy_db;
+        vad->noise_init = true;
+    }
+    bool voiced = energy_db > SR_VAD_MIN_ENERGY_DB
+                  && energy_db > vad->noise_floor_db + vad->cfg.energy_margin_db
+                  && flatness < vad->cfg.flatness_max;
+    //* track the noise floor on non-voiced frames, fast down and slow up
+    if (!voiced) {
+        float rate = energy_db < vad->noise_floor_db ? 0.2f : 0.02f;
+        vad->noise_floor_db += rate * (energy_db - vad->noise_floor_db);
+    }
+    ESP_LOGV(TAG, "energy=%.1f dB, floor=%.1f dB, flatness=%.2f, voiced=%d", energy_db, vad->noise_floor_db, flatness, voiced);
+    return voiced;
+}
+
+static void _vad_ring_push(sr_vad_t *vad, int bytes)
+{
+    if (vad->ring_frames == 0) {
+        return;
+    }
+    int16_t *slot = vad->ring + vad->ring_head * SR_VAD_FRAME_SAMPLES;
+    memcpy(slot, vad->frame, bytes);
+    if (bytes < SR_VAD_FRAME_BYTES) {
+        memset((char *)slot + bytes, 0, SR_VAD_FRAME_BYTES - bytes);
+    }
+    vad->ring_head = (vad->ring_head + 1) % vad->ring_frames;
+    if (vad->ring_count < vad->ring_frames) {
+        vad->ring_count++;
+    }
+}
+
+static int _vad_ring_flush(audio_element_handle_t self, sr_vad_t *vad)
+{
+    int tail = (vad->ring_head - vad->ring_count + vad->ring_frames) % vad->ring_frames;
+    while (vad->ring_count > 0) {
+        int ret = audio_element_output(self, (char *)(vad->ring + tail * SR_VAD_FRAME_SAMPLES), SR_VAD_FRAME_BYTES);
+        if (ret < 0) {
+            return ret;
+        }
+        tail = (tail + 1) % vad->ring_frames;
+        vad->ring_count--;
+    }
+    return 0;
+}
+
+static esp_err_t _vad_open(audio_element_handle_t self)
+{
+    sr_vad_t *vad = (sr_vad_t *)audio_element_getdata(self);
+    //* the microphone runs between recordings, the noise floor of the last one still holds
+    vad->in_speech = false;
+    vad->has_spoken = false;
+    vad->hang = 0;
+    vad->pause = 0;
+    vad->silence = 0;
+    vad->ring_head = 0;
+    vad->ring_count = 0;
+    memset(vad->bpf_w, 0, sizeof(vad->bpf_w));
+    return ESP_OK;
+}
+
+static esp_err_t _vad_close(audio_element_handle_t self)
+{
+    sr_vad_t *vad = (sr_vad_t *)audio_element_getdata(self);
+    ESP_LOGI(TAG, "VAD closed, speech detected=%d", vad->has_spoken);
+    return ESP_OK;
+}
+
+static audio_element_err_t _vad_process(audio_element_handle_t self, char *in_buffer, int in_len)
+{
+    sr_vad_t *vad = (sr_vad_t *)audio_element_getdata(self);
+    int r_size = audio_element_input(self, (char *)vad->frame, SR_VAD_FRAME_BYTES);
+    if (r_size <= 0) {
+        return r_size;
+    }
+    latency_trace_first(TRACE_SR_FIRST_FRAME, r_size);
+    int ret = 0;
+    if (_vad_is_voiced(vad, r_size / sizeof(int16_t))) {
+        if (!vad->in_speech) {
+            ESP_LOGD(TAG, "Speech onset");
+            ret = _vad_ring_flush(self, vad);
+        }
+        vad->in_speech = true;
+        vad->has_spoken = true;
+        vad->hang = vad->hangover_frames;
+        vad->pause = 0;
+        vad->silence = 0;
+    } else if (vad->in_speech && vad->hang > 0) {
+        vad->hang--;
+        vad->silence++;
+    } else {
+        vad->in_speech = false;
+        vad->silence++;
+        if (vad->has_spoken && vad->end_frames > 0 && vad->silence >= vad->end_frames) {
+            ESP_LOGI(TAG, "End of speech");
+            return AEL_IO_DONE;
+        }
+        //* keep a short natural pause, park the rest in the pre-roll ring
+        if (!vad->has_spoken || vad->pause >= vad->max_pause_frames) {
+            _vad_ring_push(vad, r_size);
+            return r_size;
+        }
+        vad->pause++;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    ret = audio_element_output(self, (char *)vad->frame, r_size);
+    return ret < 0 ? ret : r_size;
+}
+
+static esp_err_t _vad_destroy(audio_element_handle_t self)
+{
+    sr_vad_t *vad = (sr_vad_t *)audio_element_getdata(self);
+    audio_free(vad->frame);
+    audio_free(vad->x);
+    audio_free(vad->fft);
+    audio_free(vad->window);
+    audio_free(vad->ring);
+    audio_free(vad);
+    return ESP_OK;
+}
+
+bool sr_vad_speech_detected(audio_element_handle_t self)
+{
+    sr_vad_t *vad = (sr_vad_t *)audio_element_getdata(self);
+    return vad->has_spoken;
+}
+
+audio_element_handle_t sr_vad_init(sr_vad_cfg_t *config)
+{
+    sr_vad_t *vad = audio_calloc(1, sizeof(sr_vad_t));
+    AUDIO_MEM_CHECK(TAG, vad, return NULL);
+    vad->cfg = *config;
+
+    if (dsps_fft2r_init_fc32(NULL, SR_VAD_FRAME_SAMPLES) != ESP_OK) {
+        ESP_LOGE(TAG, "Error init FFT");
+        audio_free(vad);
+        return NULL;
+    }
+
+    vad->frame = audio_calloc(1, SR_VAD_FRAME_BYTES);
+    vad->x = audio_calloc(SR_VAD_FRAME_SAMPLES, sizeof(float));
+    vad->fft = audio_calloc(SR_VAD_FRAME_SAMPLES * 2, sizeof(float));
+    vad->window = audio_calloc(SR_VAD_FRAME_SAMPLES, sizeof(float));
+    vad->ring_frames = _ms_to_frames(config->pre_roll_ms, config->sample_rate);
+    if (vad->ring_frames > 0) {
+        vad->ring = audio_calloc(vad->ring_frames, SR_VAD_FRAME_BYTES);
+        AUDIO_MEM_CHECK(TAG, vad->ring, goto _vad_init_exit);
+    }
+    AUDIO_MEM_CHECK(TAG, vad->frame && vad->x && vad->fft && vad->window, goto _vad_init_exit);
+
+    dsps_wind_hann_f32(vad->window, SR_VAD_FRAME_SAMPLES);
+    dsps_biquad_gen_bpf_f32(vad->bpf_coeffs, (float)SR_VAD_BPF_CENTER_HZ / config->sample_rate, SR_VAD_BPF_Q);
+    vad->band_low = SR_VAD_BAND_LOW_HZ * SR_VAD_FRAME_SAMPLES / config->sample_rate;
+    vad->band_high = SR_VAD_BAND_HIGH_HZ * SR_VAD_FRAME_SAMPLES / config->sample_rate;
+    if (vad->band_high >= SR_VAD_FRAME_SAMPLES / 2) {
+        vad->band_high = SR_VAD_FRAME_SAMPLES / 2 - 1;
+    }
+    vad->hangover_frames = _ms_to_frames(config->hangover_ms, config->sample_rate);
+    vad->max_pause_frames = _ms_to_frames(config->max_pause_ms, config->sample_rate);
+    vad->end_frames = _ms_to_frames(config->end_silence_ms, config->sample_rate);
+
+    audio_element_cfg_t cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    cfg.open = _vad_open;
+    cfg.close = _vad_close;
+    cfg.process = _vad_process;
+    cfg.destroy = _vad_destroy;
+    cfg.buffer_len = SR_VAD_FRAME_BYTES;
+    cfg.out_rb_size = config->out_rb_size;
+    cfg.task_stack = config->task_stack;
+    cfg.task_core = config->task_core;
+    cfg.task_prio = config->task_prio;
+    cfg.tag = "vad";
+    audio_element_handle_t el = audio_element_init(&cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto _vad_init_exit);
+    audio_element_setdata(el, vad);
+    return el;
+_vad_init_exit:
+    audio_free(vad->frame);
+    audio_free(vad->x);
+    audio_free(vad->fft);
+    audio_free(vad->window);
+    audio_free(vad->ring);
+    audio_free(vad);
+    return NULL;
+}
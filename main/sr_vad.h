@@ -0,0 +1,72 @@
+#ifndef _SR_VAD_H_
+#define _SR_VAD_H_
+
+#include "esp_err.h"
+#include "audio_element.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_VAD_TASK_STACK           (4 * 1024)
+#define SR_VAD_TASK_CORE            (0)
+#define SR_VAD_TASK_PRIO            (5)
+#define SR_VAD_RINGBUFFER_SIZE      (8 * 1024)
+
+/**
+ * Voice activity detection element configurations, input and output are 16 bit mono PCM
+ */
+typedef struct {
+    int sample_rate;            /*!< Input sample rate */
+    int pre_roll_ms;            /*!< Audio kept in front of the speech onset */
+    int hangover_ms;            /*!< Time the speech state is held after the last voiced frame */
+    int max_pause_ms;           /*!< Pauses inside speech are cut down to this length */
+    int end_silence_ms;         /*!< Silence after speech that finishes the element, 0 to never finish by itself */
+    int energy_margin_db;       /*!< Band energy above the noise floor for a frame to be voiced */
+    float flatness_max;         /*!< Spectral flatness above this is treated as noise */
+    int out_rb_size;            /*!< Size of output ringbuffer */
+    int task_stack;             /*!< Task stack size */
+    int task_core;              /*!< Task running in core (0 or 1) */
+    int task_prio;              /*!< Task priority (based on freeRTOS priority) */
+} sr_vad_cfg_t;
+
+#define DEFAULT_SR_VAD_CONFIG() {                   \
+    .sample_rate        = 16000,                    \
+    .pre_roll_ms        = 240,                      \
+    .hangover_ms        = 200,                      \
+    .max_pause_ms       = 400,                      \
+    .end_silence_ms     = 1000,                     \
+    .energy_margin_db   = 9,                        \
+    .flatness_max       = 0.45f,                    \
+    .out_rb_size        = SR_VAD_RINGBUFFER_SIZE,   \
+    .task_stack         = SR_VAD_TASK_STACK,        \
+    .task_core          = SR_VAD_TASK_CORE,         \
+    .task_prio          = SR_VAD_TASK_PRIO,         \
+}
+
+/**
+ * @brief      Create the VAD element, it drops leading and trailing silence, shortens long pauses
+ *             and finishes (AEL_STATUS_STATE_FINISHED) when the speaker stops talking
+ *
+ * @param      config  The configuration
+ *
+ * @return     The audio element handle
+ */
+audio_element_handle_t sr_vad_init(sr_vad_cfg_t *config);
+
+/**
+ * @brief      Check if the speaker has started talking in the current recording
+ *
+ * @param[in]  self  The VAD element
+ *
+ * @return
+ *  - true
+ *  - false
+ */
+bool sr_vad_speech_detected(audio_element_handle_t self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
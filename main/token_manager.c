@@ -0,0 +1,262 @@
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+#include "audio_error.h"
+#include "llm_access_token.h"
+#include "token_manager.h"
+
+static const char *TAG = "TOKEN_MANAGER";
+
+#define TOKEN_MANAGER_NVS_NAMESPACE "token"
+// The task wakes up this often to check the expiries, a failed fetch is retried at the same pace
+#define TOKEN_MANAGER_CHECK_MS      (60 * 1000)
+// Before SNTP has set the clock time() counts from 1970
+#define TOKEN_CLOCK_VALID_AFTER     (1704067200)    // 2024-01-01
+#if CONFIG_MOCK_SERVER
+#define TOKEN_MANAGER_SERVER        CONFIG_MOCK_SERVER_URI
+#else
+#define TOKEN_MANAGER_SERVER        ""
+#endif
+
+typedef struct {
+    token_manager_listener_t    listener;
+    void                        *user_data;
+} token_listener_t;
+
+typedef struct {
+    const char          *name;          /*!< NVS key prefix */
+    char                *token;
+    int64_t             expires_at;     /*!< Wall clock in seconds, 0 until the clock is set */
+    int                 expires_in;     /*!< Lifetime given by the server */
+    int64_t             fetched_us;     /*!< Uptime of the fetch, dates it once the clock is set */
+    uint32_t            credential;     /*!< Hash of the credentials and server the token belongs to */
+    bool                invalid;
+    int                 listener_num;
+    token_listener_t    listeners[TOKEN_MANAGER_MAX_LISTENERS];
+} token_entry_t;
+
+static token_manager_config_t s_config;
+static token_entry_t s_tokens[TOKEN_MAX] = {
+    [TOKEN_ASR] = { .name = "asr" },
+    [TOKEN_LLM] = { .name = "llm" },
+};
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_task;
+
+static uint32_t _token_credential(token_id_t id)
+{
+    //* FNV-1a, a token stored for other credentials or for the mock server is not used
+    const char *parts[] = { s_config.access_key[id], s_config.access_secret[id], TOKEN_MANAGER_SERVER };
+    uint32_t hash = 0x811c9dc5;
+    for (int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        for (const char *p = parts[i]; p && *p; p++) {
+            hash = (hash ^ (uint8_t)*p) * 0x01000193;
+        }
+        hash = (hash ^ 0xff) * 0x01000193;
+    }
+    return hash;
+}
+
+static bool _token_clock(int64_t *now)
+{
+    *now = time(NULL);
+    return *now > TOKEN_CLOCK_VALID_AFTER;
+}
+
+static void _token_key(token_entry_t *entry, const char *suffix, char *key)
+{
+    snprintf(key, NVS_KEY_NAME_MAX_SIZE, "%s_%s", entry->name, suffix);
+}
+
+static void _token_save(token_entry_t *entry)
+{
+    nvs_handle_t nvs;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    if (nvs_open(TOKEN_MANAGER_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    _token_key(entry, "tok", key);
+    esp_err_t err = nvs_set_str(nvs, key, entry->token);
+    _token_key(entry, "exp", key);
+    err = err == ESP_OK ? nvs_set_i64(nvs, key, entry->expires_at) : err;
+    _token_key(entry, "id", key);
+    err = err == ESP_OK ? nvs_set_u32(nvs, key, entry->credential) : err;
+    err = err == ESP_OK ? nvs_commit(nvs) : err;
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save %s token, err=0x%x", entry->name, err);
+    }
+}
+
+static void _token_load(token_entry_t *entry)
+{
+    nvs_handle_t nvs;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint32_t credential = 0;
+    size_t len = 0;
+    if (nvs_open(TOKEN_MANAGER_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    _token_key(entry, "id", key);
+    if (nvs_get_u32(nvs, key, &credential) != ESP_OK || credential != entry->credential) {
+        goto _exit;
+    }
+    _token_key(entry, "tok", key);
+    if (nvs_get_str(nvs, key, NULL, &len) != ESP_OK || len <= 1) {
+        goto _exit;
+    }
+    char *token = malloc(len);
+    AUDIO_MEM_CHECK(TAG, token, goto _exit);
+    if (nvs_get_str(nvs, key, token, &len) != ESP_OK) {
+        free(token);
+        goto _exit;
+    }
+    entry->token = token;
+    _token_key(entry, "exp", key);
+    nvs_get_i64(nvs, key, &entry->expires_at);
+_exit:
+    nvs_close(nvs);
+}
+
+/*
+ * A token fetched before SNTP set the clock gets its expiry now
+ */
+static void _token_date(token_entry_t *entry)
+{
+    int64_t now;
+    if (entry->expires_at || entry->expires_in <= 0 || !_token_clock(&now)) {
+        return;
+    }
+    int64_t age = (esp_timer_get_time() - entry->fetched_us) / 1000000;
+    entry->expires_at = now - age + entry->expires_in;
+    _token_save(entry);
+}
+
+static esp_err_t _token_fetch(token_id_t id)
+{
+    token_entry_t *entry = &s_tokens[id];
+    char *token = NULL;
+    int expires_in = 0;
+    if (llm_fetch_access_token(s_config.access_key[id], s_config.access_secret[id], &token, &expires_in) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to fetch %s token", entry->name);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "New %s token, valid for %d s", entry->name, expires_in);
+    //* the listeners are called under the lock, so one added meanwhile never misses the new token
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    char *old = entry->token;
+    entry->token = token;
+    entry->fetched_us = esp_timer_get_time();
+    entry->expires_in = expires_in;
+    entry->expires_at = 0;
+    entry->invalid = false;
+    for (int i = 0; i < entry->listener_num; i++) {
+        entry->listeners[i].listener(entry->token, entry->listeners[i].user_data);
+    }
+    xSemaphoreGive(s_lock);
+    free(old);
+    _token_date(entry);
+    if (entry->expires_at == 0) {
+        _token_save(entry);
+    }
+    return ESP_OK;
+}
+
+static bool _token_due(token_entry_t *entry)
+{
+    int64_t now;
+    if (entry->token == NULL || entry->invalid) {
+        return true;
+    }
+    //* an expiry from before the clock was set stays unknown until then
+    return entry->expires_at && _token_clock(&now) && now >= entry->expires_at - s_config.refresh_margin_s;
+}
+
+static void _token_task(void *pv)
+{
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TOKEN_MANAGER_CHECK_MS));
+        for (int i = 0; i < TOKEN_MAX; i++) {
+            _token_date(&s_tokens[i]);
+            if (_token_due(&s_tokens[i])) {
+                _token_fetch(i);
+            }
+        }
+    }
+}
+
+esp_err_t token_manager_init(token_manager_config_t *config)
+{
+    if (s_lock) {
+        return ESP_OK;
+    }
+    s_config = *config;
+    if (s_config.refresh_margin_s <= 0) {
+        s_config.refresh_margin_s = TOKEN_MANAGER_REFRESH_MARGIN_S;
+    }
+    s_lock = xSemaphoreCreateMutex();
+    AUDIO_MEM_CHECK(TAG, s_lock, return ESP_FAIL);
+
+    esp_err_t err = ESP_OK;
+    for (int i = 0; i < TOKEN_MAX; i++) {
+        token_entry_t *entry = &s_tokens[i];
+        entry->credential = _token_credential(i);
+        _token_load(entry);
+        if (entry->token) {
+            ESP_LOGI(TAG, "%s token from NVS, expires at %lld", entry->name, (long long)entry->expires_at);
+            continue;
+        }
+        if (_token_fetch(i) != ESP_OK) {
+            err = ESP_FAIL;
+        }
+    }
+    if (xTaskCreate(_token_task, "token_task", s_config.task_stack, NULL, s_config.task_prio, &s_task) != pdPASS) {
+        ESP_LOGE(TAG, "Error create token task");
+        return ESP_FAIL;
+    }
+    return err;
+}
+
+char *token_manager_get(token_id_t id)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    char *token = s_tokens[id].token ? strdup(s_tokens[id].token) : NULL;
+    xSemaphoreGive(s_lock);
+    return token;
+}
+
+esp_err_t token_manager_add_listener(token_id_t id, token_manager_listener_t listener, void *user_data)
+{
+    token_entry_t *entry = &s_tokens[id];
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (entry->listener_num == TOKEN_MANAGER_MAX_LISTENERS) {
+        xSemaphoreGive(s_lock);
+        return ESP_FAIL;
+    }
+    entry->listeners[entry->listener_num] = (token_listener_t) {
+        .listener = listener,
+        .user_data = user_data,
+    };
+    entry->listener_num++;
+    if (entry->token) {
+        listener(entry->token, user_data);
+    }
+    xSemaphoreGive(s_lock);
+    return ESP_OK;
+}
+
+void token_manager_invalidate(token_id_t id)
+{
+    ESP_LOGW(TAG, "%s token rejected, refresh now", s_tokens[id].name);
+    s_tokens[id].invalid = true;
+    if (s_task) {
+        xTaskNotifyGive(s_task);
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef _TOKEN_MANAGER_H_
+#define _TOKEN_MANAGER_H_
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TOKEN_MANAGER_TASK_STACK        (6 * 1024)
+#define TOKEN_MANAGER_TASK_PRIO         (2)
+// Baidu tokens live 30 days, refresh one day early so a slow network never meets an expired token
+#define TOKEN_MANAGER_REFRESH_MARGIN_S  (24 * 3600)
+#define TOKEN_MANAGER_MAX_LISTENERS     (4)
+
+typedef enum {
+    TOKEN_ASR = 0,          /*!< Baidu speech, ASR and TTS */
+    TOKEN_LLM,              /*!< Baidu Qianfan, the LLM */
+    TOKEN_MAX,
+} token_id_t;
+
+/**
+ * @brief      Called with a new token, the string is only valid during the call and the token manager
+ *             is locked meanwhile, so the listener must not call it
+ */
+typedef void (*token_manager_listener_t)(const char *token, void *user_data);
+
+typedef struct {
+    const char *access_key[TOKEN_MAX];
+    const char *access_secret[TOKEN_MAX];
+    int refresh_margin_s;   /*!< Refresh this long before the expiry, TOKEN_MANAGER_REFRESH_MARGIN_S if 0 */
+    int task_stack;         /*!< Task stack size */
+    int task_prio;          /*!< Task priority (based on freeRTOS priority) */
+} token_manager_config_t;
+
+#define TOKEN_MANAGER_DEFAULT_CONFIG() {                    \
+    .refresh_margin_s   = TOKEN_MANAGER_REFRESH_MARGIN_S,   \
+    .task_stack         = TOKEN_MANAGER_TASK_STACK,         \
+    .task_prio          = TOKEN_MANAGER_TASK_PRIO,          \
+}
+
+/**
+ * @brief      Load the tokens from NVS and start the refresh task
+ *
+ *             Only tokens missing in NVS, or stored for other credentials, are fetched before returning.
+ *             A stored token is used right away, its expiry is checked once SNTP has set the clock.
+ *
+ * @param      config  The configuration
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL  A token could not be fetched, it is retried in the background
+ */
+esp_err_t token_manager_init(token_manager_config_t *config);
+
+/**
+ * @brief      Get a copy of the current token
+ *
+ * @param[in]  id    The token
+ *
+ * @return     The token, to be freed by the caller, NULL if there is none yet
+ */
+char *token_manager_get(token_id_t id);
+
+/**
+ * @brief      Register a listener for new tokens of `id`, it is called right away with the current token
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t token_manager_add_listener(token_id_t id, token_manager_listener_t listener, void *user_data);
+
+/**
+ * @brief      Refresh a token now, e.g. after the server rejected it
+ *
+ * @param[in]  id    The token
+ */
+void token_manager_invalidate(token_id_t id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
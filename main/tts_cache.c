@@ -0,0 +1,256 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "nvs.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "tts_cache.h"
+
+static const char *TAG = "TTS_CACHE";
+
+#define TTS_CACHE_NVS_NAMESPACE "tts_cache"
+#define TTS_CACHE_NVS_INDEX     "index"
+#define TTS_CACHE_MAGIC         (0x54545343)    // "TTSC"
+#define TTS_CACHE_SECTOR_SIZE   (4096)
+#define TTS_CACHE_FNV_OFFSET    (0xcbf29ce484222325ULL)
+#define TTS_CACHE_FNV_PRIME     (0x100000001b3ULL)
+
+/*
+ * Written in front of the audio of a slot after the audio, a slot cut by a power loss has none
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t len;
+    uint64_t key;
+} tts_cache_header_t;
+
+/*
+ * Index entry, kept in NVS so no slot has to be scanned at boot, `len == 0` marks a free slot
+ */
+typedef struct {
+    uint64_t key;
+    uint32_t len;
+    uint32_t stamp;             /*!< Use order, the smallest is evicted first */
+} tts_cache_entry_t;
+
+typedef struct tts_cache {
+    const esp_partition_t   *partition;
+    int                     slots;
+    tts_cache_entry_t       index[TTS_CACHE_MAX_SLOTS];
+    uint32_t                clock;
+    bool                    dirty;
+    tts_cache_stats_t       stats;
+} tts_cache_t;
+
+static esp_err_t _cache_save_index(tts_cache_t *cache)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(TTS_CACHE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(nvs, TTS_CACHE_NVS_INDEX, cache->index, cache->slots * sizeof(tts_cache_entry_t));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save index, err=0x%x", err);
+        return err;
+    }
+    cache->dirty = false;
+    return ESP_OK;
+}
+
+static void _cache_load_index(tts_cache_t *cache)
+{
+    nvs_handle_t nvs;
+    size_t size = cache->slots * sizeof(tts_cache_entry_t);
+    if (nvs_open(TTS_CACHE_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    //* an index of another partition layout does not fit, the cache starts empty
+    if (nvs_get_blob(nvs, TTS_CACHE_NVS_INDEX, cache->index, &size) != ESP_OK
+            || size != cache->slots * sizeof(tts_cache_entry_t)) {
+        memset(cache->index, 0, sizeof(cache->index));
+    }
+    nvs_close(nvs);
+    for (int i = 0; i < cache->slots; i++) {
+        if (cache->index[i].len > TTS_CACHE_SLOT_SIZE - sizeof(tts_cache_header_t)) {
+            cache->index[i].len = 0;
+        }
+        if (cache->index[i].len && cache->index[i].stamp >= cache->clock) {
+            cache->clock = cache->index[i].stamp + 1;
+        }
+    }
+}
+
+static int _cache_find(tts_cache_t *cache, uint64_t key)
+{
+    for (int i = 0; i < cache->slots; i++) {
+        if (cache->index[i].len && cache->index[i].key == key) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+tts_cache_handle_t tts_cache_init(const char *partition_label)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if (partition == NULL) {
+        ESP_LOGW(TAG, "No partition %s, TTS cache disabled", partition_label);
+        return NULL;
+    }
+    tts_cache_t *cache = audio_calloc(1, sizeof(tts_cache_t));
+    AUDIO_MEM_CHECK(TAG, cache, return NULL);
+    cache->partition = partition;
+    cache->slots = partition->size / TTS_CACHE_SLOT_SIZE;
+    if (cache->slots > TTS_CACHE_MAX_SLOTS) {
+        cache->slots = TTS_CACHE_MAX_SLOTS;
+    }
+    _cache_load_index(cache);
+    int used = 0;
+    for (int i = 0; i < cache->slots; i++) {
+        used += cache->index[i].len ? 1 : 0;
+    }
+    ESP_LOGI(TAG, "TTS cache %s, %d of %d slots used", partition_label, used, cache->slots);
+    return cache;
+}
+
+void tts_cache_deinit(tts_cache_handle_t cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    tts_cache_flush(cache);
+    audio_free(cache);
+}
+
+uint64_t tts_cache_key(const char *params, const char *text)
+{
+    //* FNV-1a, with a separator so ("ab", "c") and ("a", "bc") differ
+    uint64_t hash = TTS_CACHE_FNV_OFFSET;
+    for (const char *p = params; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * TTS_CACHE_FNV_PRIME;
+    }
+    hash = (hash ^ 0xff) * TTS_CACHE_FNV_PRIME;
+    for (const char *p = text; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * TTS_CACHE_FNV_PRIME;
+    }
+    return hash;
+}
+
+int tts_cache_lookup(tts_cache_handle_t cache, uint64_t key, int *len)
+{
+    int slot = _cache_find(cache, key);
+    if (slot < 0) {
+        return -1;
+    }
+    tts_cache_header_t header;
+    if (esp_partition_read(cache->partition, slot * TTS_CACHE_SLOT_SIZE, &header, sizeof(header)) != ESP_OK
+            || header.magic != TTS_CACHE_MAGIC || header.key != key || header.len != cache->index[slot].len) {
+        ESP_LOGW(TAG, "Slot %d does not match the index, dropped", slot);
+        cache->index[slot].len = 0;
+        cache->dirty = true;
+        return -1;
+    }
+    //* only RAM is touched here, the new order is written back by `tts_cache_flush`
+    cache->index[slot].stamp = cache->clock++;
+    cache->dirty = true;
+    *len = header.len;
+    return slot;
+}
+
+esp_err_t tts_cache_read(tts_cache_handle_t cache, int slot, int offset, char *buffer, int len)
+{
+    if (slot < 0 || slot >= cache->slots || offset < 0 || offset + len > cache->index[slot].len) {
+        return ESP_FAIL;
+    }
+    return esp_partition_read(cache->partition, slot * TTS_CACHE_SLOT_SIZE + sizeof(tts_cache_header_t) + offset,
+                              buffer, len);
+}
+
+esp_err_t tts_cache_store(tts_cache_handle_t cache, uint64_t key, const char *data, int len)
+{
+    if (len <= 0 || len > TTS_CACHE_SLOT_SIZE - sizeof(tts_cache_header_t)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (_cache_find(cache, key) >= 0) {
+        return ESP_OK;
+    }
+    int slot = 0;
+    for (int i = 0; i < cache->slots; i++) {
+        if (cache->index[i].len == 0) {
+            slot = i;
+            break;
+        }
+        if (cache->index[i].stamp < cache->index[slot].stamp) {
+            slot = i;
+        }
+    }
+    if (cache->index[slot].len) {
+        cache->stats.evictions++;
+    }
+    //* the index forgets the slot before it is erased, a power loss in between only loses that slot
+    cache->index[slot].len = 0;
+    if (_cache_save_index(cache) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    size_t address = slot * TTS_CACHE_SLOT_SIZE;
+    size_t erase_size = (sizeof(tts_cache_header_t) + len + TTS_CACHE_SECTOR_SIZE - 1) & ~(TTS_CACHE_SECTOR_SIZE - 1);
+    tts_cache_header_t header = {
+        .magic = TTS_CACHE_MAGIC,
+        .len = len,
+        .key = key,
+    };
+    if (esp_partition_erase_range(cache->partition, address, erase_size) != ESP_OK
+            || esp_partition_write(cache->partition, address + sizeof(header), data, len) != ESP_OK
+            || esp_partition_write(cache->partition, address, &header, sizeof(header)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write slot %d", slot);
+        return ESP_FAIL;
+    }
+    cache->index[slot].key = key;
+    cache->index[slot].len = len;
+    cache->index[slot].stamp = cache->clock++;
+    cache->stats.stores++;
+    ESP_LOGI(TAG, "Stored %d bytes in slot %d", len, slot);
+    return _cache_save_index(cache);
+}
+
+void tts_cache_flush(tts_cache_handle_t cache)
+{
+    if (cache->dirty) {
+        _cache_save_index(cache);
+    }
+}
+
+void tts_cache_record(tts_cache_handle_t cache, bool hit, int64_t first_byte_us)
+{
+    if (hit) {
+        cache->stats.hits++;
+        cache->stats.hit_us += first_byte_us;
+    } else {
+        cache->stats.misses++;
+        cache->stats.miss_us += first_byte_us;
+    }
+}
+
+void tts_cache_get_stats(tts_cache_handle_t cache, tts_cache_stats_t *stats)
+{
+    *stats = cache->stats;
+}
+
+void tts_cache_log_stats(tts_cache_handle_t cache)
+{
+    tts_cache_stats_t *s = &cache->stats;
+    int lookups = s->hits + s->misses;
+    if (lookups == 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "hits %d/%d (%d%%), first byte hit %lld ms, miss %lld ms, stores %d, evictions %d",
+             s->hits, lookups, s->hits * 100 / lookups,
+             (long long)(s->hits ? s->hit_us / s->hits / 1000 : 0), (long long)(s->misses ? s->miss_us / s->misses / 1000 : 0),
+             s->stores, s->evictions);
+}
@@ -0,0 +1,112 @@
+#ifndef _TTS_CACHE_H_
+#define _TTS_CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TTS_CACHE_SLOT_SIZE     (32 * 1024)
+#define TTS_CACHE_MAX_SLOTS     (64)
+
+typedef struct tts_cache *tts_cache_handle_t;
+
+/**
+ * Hit rate and time to the first audio byte, since boot
+ */
+typedef struct {
+    int     hits;
+    int     misses;
+    int     stores;
+    int     evictions;
+    int64_t hit_us;             /*!< Sum of the time to the first byte of every hit */
+    int64_t miss_us;            /*!< Same for the misses, the server round trip */
+} tts_cache_stats_t;
+
+/**
+ * @brief      Open the cache in a data partition, the index is loaded from NVS
+ *
+ *             The partition is split into slots of TTS_CACHE_SLOT_SIZE, each holds the audio of one text.
+ *
+ * @param[in]  partition_label  The label of the partition
+ *
+ * @return     The cache, NULL if the partition is missing
+ */
+tts_cache_handle_t tts_cache_init(const char *partition_label);
+
+/**
+ * @brief      Write back the index and release the cache
+ */
+void tts_cache_deinit(tts_cache_handle_t cache);
+
+/**
+ * @brief      Hash the request parameters that change the audio, such as voice and speed, and the text
+ *
+ * @param[in]  params  The request parameters without the access token
+ * @param[in]  text    The text
+ *
+ * @return     The key
+ */
+uint64_t tts_cache_key(const char *params, const char *text);
+
+/**
+ * @brief      Find the audio of a key and mark it as the most recently used
+ *
+ * @param[in]  cache  The cache
+ * @param[in]  key    The key
+ * @param[out] len    The audio size
+ *
+ * @return     The slot holding the audio, -1 on a miss
+ */
+int tts_cache_lookup(tts_cache_handle_t cache, uint64_t key, int *len);
+
+/**
+ * @brief      Read audio of a slot returned by `tts_cache_lookup`
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_FAIL
+ */
+esp_err_t tts_cache_read(tts_cache_handle_t cache, int slot, int offset, char *buffer, int len);
+
+/**
+ * @brief      Store the audio of a key, the least recently used slot is evicted
+ *
+ *             Erasing flash stalls the caller for tens of milliseconds per 4K sector,
+ *             do not call it while audio is being played.
+ *
+ * @return
+ *  - ESP_OK
+ *  - ESP_ERR_INVALID_SIZE  Larger than a slot
+ *  - ESP_FAIL
+ */
+esp_err_t tts_cache_store(tts_cache_handle_t cache, uint64_t key, const char *data, int len);
+
+/**
+ * @brief      Write back the use order if it changed since the last write
+ */
+void tts_cache_flush(tts_cache_handle_t cache);
+
+/**
+ * @brief      Count a lookup with the time from the request to the first audio byte
+ */
+void tts_cache_record(tts_cache_handle_t cache, bool hit, int64_t first_byte_us);
+
+/**
+ * @brief      Get the counters
+ */
+void tts_cache_get_stats(tts_cache_handle_t cache, tts_cache_stats_t *stats);
+
+/**
+ * @brief      Log the hit rate and the average time to the first byte of hits and misses
+ */
+void tts_cache_log_stats(tts_cache_handle_t cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
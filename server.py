@@ -2,26 +2,131 @@ import os, datetime, sys
 import wave
 import argparse
 import socket
+import json
+import base64
+import time
+import threading
 
 if sys.version_info.major == 3:
     # Python3
     from urllib import parse
     from http.server import HTTPServer
     from http.server import BaseHTTPRequestHandler
+    from socketserver import ThreadingMixIn
 else:
     # Python2
     import urlparse
     from BaseHTTPServer import HTTPServer
     from BaseHTTPServer import BaseHTTPRequestHandler
+    from SocketServer import ThreadingMixIn
 
 PORT = 8000
 
+# Silent MPEG-2 layer III frame, 16 kHz mono 32 kbps, 576 samples in 144 bytes
+MP3_SILENT_FRAME = b'\xff\xf3\x48\xc4' + b'\x00' * 140
+MP3_FRAME_SAMPLES = 576
+
+IMA_STEP_TABLE = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+]
+IMA_INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8]
+IMA_BLOCK_BYTES = 256
+
+def ima_adpcm_decode(data):
+    """Decode 256 byte IMA-ADPCM mono blocks (WAV layout) into 16-bit PCM bytes"""
+    pcm = bytearray()
+    for offset in range(0, len(data) - 3, IMA_BLOCK_BYTES):
+        block = data[offset:offset + IMA_BLOCK_BYTES]
+        predictor = int.from_bytes(bytes(block[0:2]), 'little', signed=True)
+        index = min(max(block[2], 0), 88)
+        pcm += predictor.to_bytes(2, 'little', signed=True)
+        for byte in block[4:]:
+            for nibble in (byte & 0x0F, byte >> 4):
+                step = IMA_STEP_TABLE[index]
+                diff = step >> 3
+                if nibble & 4:
+                    diff += step
+                if nibble & 2:
+                    diff += step >> 1
+                if nibble & 1:
+                    diff += step >> 2
+                predictor += -diff if nibble & 8 else diff
+                predictor = min(max(predictor, -32768), 32767)
+                index = min(max(index + IMA_INDEX_TABLE[nibble & 7], 0), 88)
+                pcm += predictor.to_bytes(2, 'little', signed=True)
+    return pcm
+
+class AsrSession(object):
+    """Partial hypotheses of one streaming upload, long-polled by the device"""
+    def __init__(self):
+        self.seq = 0
+        self.text = u''
+        self.final = False
+        self.created = time.time()
+
+# Streaming sessions by the `sn` of the upload, guarded by the condition
+asr_sessions = {}
+asr_sessions_cond = threading.Condition()
+ASR_SESSION_MAX_AGE = 60
+
+def asr_session(sn):
+    """Get or create a session, the device may poll before its upload arrives; call with the condition held"""
+    now = time.time()
+    for key in [k for k, v in asr_sessions.items() if now - v.created > ASR_SESSION_MAX_AGE]:
+        del asr_sessions[key]
+    return asr_sessions.setdefault(sn, AsrSession())
+
+def asr_update(sn, text, final=False):
+    with asr_sessions_cond:
+        session = asr_session(sn)
+        if text != session.text or final != session.final:
+            session.seq += 1
+            session.text = text
+            session.final = final
+            asr_sessions_cond.notify_all()
+
 class Handler(BaseHTTPRequestHandler):
-    def _set_headers(self, length):
-        self.send_response(200)
-        if length > 0:
-            self.send_header('Content-length', str(length))
+    # HTTP/1.1 keeps the connection open between requests, like the Baidu servers
+    protocol_version = 'HTTP/1.1'
+
+    def _delay(self, ms):
+        if ms > 0:
+            time.sleep(ms / 1000.0)
+
+    def _throttle(self, length):
+        if args.bandwidth_kbps > 0:
+            time.sleep(length * 8.0 / (args.bandwidth_kbps * 1000.0))
+
+    def _write(self, data):
+        """Write the response body, paced to --bandwidth-kbps"""
+        for offset in range(0, len(data), 512):
+            block = data[offset:offset + 512]
+            self._throttle(len(block))
+            self.wfile.write(block)
+        self.wfile.flush()
+
+    def _send_body(self, body, content_type, status=200):
+        if not isinstance(body, bytes):
+            body = body.encode('utf-8')
+        self._delay(args.rtt_ms)
+        self.send_response(status)
+        self.send_header('Content-Type', content_type)
+        self.send_header('Content-Length', str(len(body)))
         self.end_headers()
+        self._write(body)
+
+    def _send_json(self, obj, status=200):
+        self._send_body(json.dumps(obj, ensure_ascii=False), 'application/json;charset=utf-8', status)
+
+    def _write_chunk(self, data):
+        if not isinstance(data, bytes):
+            data = data.encode('utf-8')
+        self._write('{:x}\r\n'.format(len(data)).encode('ascii') + data + b'\r\n')
 
     def _get_chunk_size(self):
         data = self.rfile.read(2)
@@ -32,6 +137,24 @@ class Handler(BaseHTTPRequestHandler):
     def _get_chunk_data(self, chunk_size):
         data = self.rfile.read(chunk_size)
         self.rfile.read(2)
+        self._throttle(chunk_size)
+        return data
+
+    def _read_body(self):
+        """Read a chunked or Content-Length request body"""
+        if self.headers.get('Transfer-Encoding', '').lower() == 'chunked':
+            data = b''
+            while True:
+                chunk_size = self._get_chunk_size()
+                if chunk_size == 0:
+                    # trailer, end with an empty line
+                    while self.rfile.readline() not in (b'\r\n', b'\n', b''):
+                        pass
+                    return data
+                data += self._get_chunk_data(chunk_size)
+        length = int(self.headers.get('Content-Length', 0))
+        data = self.rfile.read(length)
+        self._throttle(length)
         return data
 
     def _write_wav(self, data, rates, bits, ch):
@@ -45,51 +168,251 @@ class Handler(BaseHTTPRequestHandler):
         wavfile.close()
         return filename
 
+    def _decode_audio(self, data, audio_format):
+        if audio_format == 'ima-adpcm':
+            print("\nDecode {} bytes of IMA-ADPCM".format(len(data)))
+            return ima_adpcm_decode(bytes(data))
+        return data
+
+    def _mock_token(self):
+        self._send_json({
+            'access_token': 'mock-token',
+            'expires_in': 2592000,
+            'scope': 'audio_voice_assistant_get audio_tts_post',
+        })
+
+    def _mock_asr(self):
+        """Baidu ASR: chunked JSON with base64 speech, answers the fixed --asr-text"""
+        body = self._read_body()
+        received = time.time()
+        try:
+            request = json.loads(body.decode('utf-8'))
+            speech = base64.b64decode(request.get('speech', ''))
+        except ValueError as e:
+            self._send_json({'err_no': 3300, 'err_msg': 'bad request: {}'.format(e)})
+            return
+        pcm = self._decode_audio(speech, request.get('format', 'pcm').lower())
+        filename = self._write_wav(pcm, int(request.get('rate', 16000)), 16, int(request.get('channel', 1)))
+        print("ASR: {} bytes of {} audio, saved to {}".format(request.get('len'), request.get('format'), filename))
+        self._delay(args.asr_ms - (time.time() - received) * 1000)
+        self._send_json({
+            'corpus_no': '0',
+            'err_msg': 'success.',
+            'err_no': 0,
+            'result': [args.asr_text],
+            'sn': 'mock',
+        })
+
+    def _query(self):
+        path = self.path.split('?', 1)
+        query = path[1] if len(path) > 1 else ''
+        fields = parse.parse_qs(query) if sys.version_info.major == 3 else urlparse.parse_qs(query)
+        return dict((k, v[0]) for k, v in fields.items())
+
+    def _mock_asr_stream(self):
+        """Streaming ASR: the Baidu upload of session `sn`, one more character of --asr-partial-text
+        is recognized every --asr-partial-char-ms of audio received, the final text is --asr-text"""
+        sn = self._query().get('sn', '')
+        if self.headers.get('Transfer-Encoding', '').lower() != 'chunked':
+            self._read_body()
+            self._send_json({'err_no': 3300, 'err_msg': 'bad request: streaming needs a chunked upload'})
+            return
+        partial_text = args.asr_partial_text if args.asr_partial_text is not None else args.asr_text
+        body = b''
+        while True:
+            chunk_size = self._get_chunk_size()
+            if chunk_size == 0:
+                while self.rfile.readline() not in (b'\r\n', b'\n', b''):
+                    pass
+                break
+            body += self._get_chunk_data(chunk_size)
+            # the base64 speech grows between `"speech":"` and the closing quote
+            start = body.find(b'"speech":"')
+            if start < 0:
+                continue
+            rate_start = body.find(b'"rate":')
+            rate = int(body[rate_start + 7:].split(b',')[0]) if rate_start >= 0 else 16000
+            speech = body[start + 10:].split(b'"')[0]
+            audio_bytes = len(speech) * 3 // 4
+            if b'"format":"ima-adpcm"' in body.replace(b' ', b''):
+                audio_bytes *= 4
+            audio_ms = audio_bytes * 1000 // (rate * 2)
+            chars = min(audio_ms // args.asr_partial_char_ms, len(partial_text))
+            if chars > 0:
+                asr_update(sn, partial_text[:chars])
+        received = time.time()
+        try:
+            request = json.loads(body.decode('utf-8'))
+        except ValueError as e:
+            asr_update(sn, u'', True)
+            self._send_json({'err_no': 3300, 'err_msg': 'bad request: {}'.format(e)})
+            return
+        print("ASR stream {}: {} bytes of {} audio".format(sn, request.get('len'), request.get('format')))
+        self._delay(args.asr_ms - (time.time() - received) * 1000)
+        asr_update(sn, args.asr_text, True)
+        self._send_json({
+            'corpus_no': '0',
+            'err_msg': 'success.',
+            'err_no': 0,
+            'result': [args.asr_text],
+            'sn': sn,
+        })
+
+    def _mock_asr_partial(self):
+        """Long poll: answer when the hypothesis of session `sn` is newer than `seq`, or after `wait` ms"""
+        query = self._query()
+        sn = query.get('sn', '')
+        seq = int(query.get('seq', 0))
+        deadline = time.time() + int(query.get('wait', 300)) / 1000.0
+        with asr_sessions_cond:
+            session = asr_session(sn)
+            while session.seq <= seq and not session.final:
+                remaining = deadline - time.time()
+                if remaining <= 0:
+                    break
+                asr_sessions_cond.wait(remaining)
+            answer = {'err_no': 0, 'seq': session.seq, 'result': session.text, 'final': session.final}
+        self._send_json(answer)
+
+    def _mock_llm(self):
+        """ERNIE style chat, the answer is streamed as server-sent events in chunks of --llm-piece characters"""
+        body = self._read_body()
+        try:
+            question = json.loads(body.decode('utf-8'))['messages'][-1]['content']
+        except (ValueError, KeyError, IndexError) as e:
+            self._send_json({'error_code': 336003, 'error_msg': 'bad request: {}'.format(e)})
+            return
+        print("LLM: {}".format(question))
+        answer = args.llm_answer
+        pieces = [answer[i:i + args.llm_piece] for i in range(0, len(answer), args.llm_piece)] or ['']
+        self._delay(args.rtt_ms)
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/event-stream')
+        self.send_header('Transfer-Encoding', 'chunked')
+        self.end_headers()
+        self._delay(args.llm_first_ms)
+        prompt_tokens = len(question)
+        for i, piece in enumerate(pieces):
+            if i > 0:
+                self._delay(args.llm_token_ms * len(piece))
+            is_end = i == len(pieces) - 1
+            completion_tokens = sum(len(p) for p in pieces[:i + 1])
+            event = {
+                'id': 'as-mock',
+                'object': 'chat.completion',
+                'created': int(time.time()),
+                'sentence_id': i,
+                'is_end': is_end,
+                'is_truncated': False,
+                'result': piece,
+                'need_clear_history': False,
+                'usage': {
+                    'prompt_tokens': prompt_tokens,
+                    'completion_tokens': completion_tokens,
+                    'total_tokens': prompt_tokens + completion_tokens,
+                },
+            }
+            self._write_chunk('data: {}\n\n'.format(json.dumps(event, ensure_ascii=False)))
+        self._write(b'0\r\n\r\n')
+
+    def _mock_tts(self):
+        """Baidu TTS: form encoded `tex`, answers --tts-mp3 or silence as long as the text would be spoken,
+        as MP3 or as the raw PCM of aue=4 (16 kHz) and aue=5 (8 kHz)"""
+        body = self._read_body().decode('utf-8')
+        fields = parse.parse_qs(body) if sys.version_info.major == 3 else urlparse.parse_qs(body)
+        text = fields.get('tex', [''])[0]
+        aue = fields.get('aue', ['3'])[0]
+        print("TTS aue={}: {}".format(aue, text))
+        self._delay(args.tts_ms)
+        if aue in ('4', '5'):
+            rate = 16000 if aue == '4' else 8000
+            audio = b'\x00\x00' * int(len(text) * args.tts_char_ms / 1000.0 * rate)
+            self._send_body(audio, 'audio/basic;codec=pcm;rate={}'.format(rate))
+            return
+        if args.tts_mp3:
+            with open(args.tts_mp3, 'rb') as f:
+                audio = f.read()
+        else:
+            frames = int(len(text) * args.tts_char_ms / 1000.0 * 16000 / MP3_FRAME_SAMPLES) + 1
+            audio = MP3_SILENT_FRAME * frames
+        self._send_body(audio, 'audio/mp3')
+
+    def _upload(self):
+        """Raw chunked audio with its format in headers, answers --asr-text like Baidu"""
+        total_bytes = 0
+        data = []
+        sample_rates = self.headers.get('x-audio-sample-rates', '').lower()
+        bits = self.headers.get('x-audio-bits', '').lower()
+        channel = self.headers.get('x-audio-channel', '').lower()
+        audio_format = self.headers.get('x-audio-format', 'pcm').lower()
+
+        print("Audio information, sample rates: {}, bits: {}, channel(s): {}, format: {}".format(sample_rates, bits, channel, audio_format))
+        # https://stackoverflow.com/questions/24500752/how-can-i-read-exactly-one-response-chunk-with-pythons-http-client
+        while True:
+            chunk_size = self._get_chunk_size()
+            total_bytes += chunk_size
+            print("Total bytes received: {}".format(total_bytes))
+            sys.stdout.write("\033[F")
+            if (chunk_size == 0):
+                self.rfile.readline()
+                break
+            else:
+                chunk_data = self._get_chunk_data(chunk_size)
+                data += chunk_data
+        received = time.time()
+
+        data = self._decode_audio(data, audio_format)
+        filename = self._write_wav(data, int(sample_rates), int(bits), int(channel))
+        print("ASR: {} bytes of {} audio, saved to {}".format(total_bytes, audio_format, filename))
+        self._delay(args.asr_ms - (time.time() - received) * 1000)
+        self._send_json({
+            'corpus_no': '0',
+            'err_msg': 'success.',
+            'err_no': 0,
+            'result': [args.asr_text],
+            'sn': 'mock',
+        })
+
     def do_POST(self):
         if sys.version_info.major == 3:
             urlparts = parse.urlparse(self.path)
         else:
             urlparts = urlparse.urlparse(self.path)
         request_file_path = urlparts.path.strip('/')
-        total_bytes = 0
-        sample_rates = 0
-        bits = 0
-        channel = 0
         print("Do Post......")
         if (request_file_path == 'upload'
             and self.headers.get('Transfer-Encoding', '').lower() == 'chunked'):
-            data = []
-            sample_rates = self.headers.get('x-audio-sample-rates', '').lower()
-            bits = self.headers.get('x-audio-bits', '').lower()
-            channel = self.headers.get('x-audio-channel', '').lower()
-            sample_rates = self.headers.get('x-audio-sample-rates', '').lower()
-
-            print("Audio information, sample rates: {}, bits: {}, channel(s): {}".format(sample_rates, bits, channel))
-            # https://stackoverflow.com/questions/24500752/how-can-i-read-exactly-one-response-chunk-with-pythons-http-client
-            while True:
-                chunk_size = self._get_chunk_size()
-                total_bytes += chunk_size
-                print("Total bytes received: {}".format(total_bytes))
-                sys.stdout.write("\033[F")
-                if (chunk_size == 0):
-                    break
-                else:
-                    chunk_data = self._get_chunk_data(chunk_size)
-                    data += chunk_data
-
-            filename = self._write_wav(data, int(sample_rates), int(bits), int(channel))
-            self.send_response(200)
-            self.send_header("Content-type", "text/html;charset=utf-8")
-            self.send_header("Content-Length", str(total_bytes))
-            self.end_headers()
-            body = 'File {} was written, size {}'.format(filename, total_bytes)
-            self.wfile.write(body.encode('utf-8'))
+            self._upload()
+        elif request_file_path == 'pro_api' or request_file_path == 'server_api':
+            self._mock_asr()
+        elif request_file_path == 'stream_api':
+            self._mock_asr_stream()
+        elif request_file_path.startswith('rpc/2.0/ai_custom/v1/wenxinworkshop/chat/'):
+            self._mock_llm()
+        elif request_file_path == 'text2audio':
+            self._mock_tts()
+        elif request_file_path == 'oauth/2.0/token':
+            self._mock_token()
+        else:
+            self._read_body()
+            self._send_json({'error_code': 404, 'error_msg': 'unknown path {}'.format(urlparts.path)}, 404)
 
     def do_GET(self):
         print("Do GET")
-        self.send_response(200)
-        self.send_header('Content-type', "text/html;charset=utf-8")
-        self.end_headers()
+        if sys.version_info.major == 3:
+            urlparts = parse.urlparse(self.path)
+        else:
+            urlparts = urlparse.urlparse(self.path)
+        if urlparts.path.strip('/') == 'oauth/2.0/token':
+            self._mock_token()
+            return
+        if urlparts.path.strip('/') == 'stream_partial':
+            self._mock_asr_partial()
+            return
+        self._send_body(b'', "text/html;charset=utf-8")
+
+class ThreadingHTTPServer(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
 
 def get_host_ip():
     # https://www.cnblogs.com/z-x-y/p/9529930.html
@@ -101,17 +424,34 @@ def get_host_ip():
         s.close()
     return ip
 
-parser = argparse.ArgumentParser(description='HTTP Server save pipeline_raw_http example voice data to wav file')
+parser = argparse.ArgumentParser(description='HTTP Server save pipeline_raw_http example voice data to wav file, '
+                                             'and mock of the Baidu token, ASR, LLM and TTS endpoints')
 parser.add_argument('--ip', '-i', nargs='?', type = str)
 parser.add_argument('--port', '-p', nargs='?', type = int)
+parser.add_argument('--rtt-ms', type=int, default=0, help='delay added in front of every response')
+parser.add_argument('--bandwidth-kbps', type=int, default=0, help='pace request and response bodies, 0 for no limit')
+parser.add_argument('--asr-ms', type=int, default=300, help='ASR time counted from the end of the upload')
+parser.add_argument('--asr-text', type=str, default=u'\u4ecb\u7ecd\u4e00\u4e0b\u4f60\u81ea\u5df1')
+parser.add_argument('--asr-partial-char-ms', type=int, default=250,
+                    help='streaming ASR: audio per character of the partial hypothesis')
+parser.add_argument('--asr-partial-text', type=str,
+                    help='streaming ASR: partial hypotheses are prefixes of this text, --asr-text if not given')
+parser.add_argument('--llm-first-ms', type=int, default=600, help='delay before the first LLM result')
+parser.add_argument('--llm-token-ms', type=int, default=40, help='delay per character of the following results')
+parser.add_argument('--llm-piece', type=int, default=12, help='characters per LLM result')
+parser.add_argument('--llm-answer', type=str,
+                    default=u'\u4f60\u597d\uff0c\u6211\u662f\u4e00\u4e2a\u8bed\u97f3\u52a9\u624b\u3002'
+                            u'\u6709\u4ec0\u4e48\u53ef\u4ee5\u5e2e\u4f60\u7684\u5417\uff1f')
+parser.add_argument('--tts-ms', type=int, default=150, help='delay before the TTS audio')
+parser.add_argument('--tts-char-ms', type=int, default=200, help='length of the silent answer per character')
+parser.add_argument('--tts-mp3', type=str, help='answer every TTS request with this MP3 file')
 args = parser.parse_args()
 if not args.ip:
     args.ip = get_host_ip()
 if not args.port:
     args.port = PORT
 
-httpd = HTTPServer((args.ip, args.port), Handler)
+httpd = ThreadingHTTPServer((args.ip, args.port), Handler)
 
 print("Serving HTTP on {} port {}".format(args.ip, args.port));
 httpd.serve_forever()
-
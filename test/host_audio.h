@@ -0,0 +1,137 @@
+/*
+ * Signals and WAV files for the audio element tests. The synthetic signals
+ * stand in for recordings; a test that takes a WAV path as its argument runs
+ * on that file instead, e.g. one that server.py saved from the device.
+ */
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static uint32_t host_audio_seed = 1;
+
+/*
+ * Roughly Gaussian noise, the sum of four uniform draws
+ */
+static float host_audio_noise(void)
+{
+    float sum = 0;
+    for (int i = 0; i < 4; i++) {
+        host_audio_seed = host_audio_seed * 1664525u + 1013904223u;
+        sum += (float)(host_audio_seed >> 8) / (float)(1 << 24) - 0.5f;
+    }
+    return sum * 1.732f;
+}
+
+static int16_t host_audio_clip(float v)
+{
+    return v > 32767.0f ? 32767 : v < -32768.0f ? -32768 : (int16_t)lrintf(v);
+}
+
+/*
+ * Adds white noise of `rms` to `n` samples
+ */
+static void host_audio_add_noise(int16_t *pcm, int n, float rms)
+{
+    for (int i = 0; i < n; i++) {
+        pcm[i] = host_audio_clip(pcm[i] + rms * host_audio_noise());
+    }
+}
+
+/*
+ * Adds a vowel-like sound: a gliding pitch with harmonics up to 4 kHz, falling 6 dB per octave
+ * and modulated at a syllable rate of 4 Hz. `peak` is the amplitude of the fundamental.
+ */
+static void host_audio_add_voice(int16_t *pcm, int n, int rate, float peak)
+{
+    double phase = 0;
+    for (int i = 0; i < n; i++) {
+        double t = (double)i / rate;
+        double f0 = 140.0 + 30.0 * sin(2 * M_PI * 0.7 * t);
+        phase += 2 * M_PI * f0 / rate;
+        double v = 0;
+        for (int h = 1; h * f0 < 4000.0; h++) {
+            v += sin(h * phase) / h;
+        }
+        double envelope = 0.55 + 0.45 * sin(2 * M_PI * 4.0 * t);
+        pcm[i] = host_audio_clip(pcm[i] + peak * envelope * v);
+    }
+}
+
+static void host_audio_add_tone(int16_t *pcm, int n, int rate, double hz, float amplitude)
+{
+    for (int i = 0; i < n; i++) {
+        pcm[i] = host_audio_clip(pcm[i] + amplitude * sin(2 * M_PI * hz * i / rate));
+    }
+}
+
+static double host_audio_rms(const int16_t *pcm, int n)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += (double)pcm[i] * pcm[i];
+    }
+    return n > 0 ? sqrt(sum / n) : 0;
+}
+
+/*
+ * 16-bit PCM WAV, the first channel of a multi-channel file. Returns NULL if it is not one.
+ */
+static int16_t *host_wav_read(const char *path, int *rate, int *samples)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    uint8_t hdr[12];
+    int16_t *pcm = NULL;
+    int channels = 0, bits = 0;
+    if (fread(hdr, 1, 12, f) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4)) {
+        goto done;
+    }
+    uint8_t chunk[8];
+    while (fread(chunk, 1, 8, f) == 8) {
+        uint32_t size = chunk[4] | chunk[5] << 8 | chunk[6] << 16 | (uint32_t)chunk[7] << 24;
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            uint8_t fmt[16];
+            if (size < 16 || fread(fmt, 1, 16, f) != 16) {
+                goto done;
+            }
+            channels = fmt[2] | fmt[3] << 8;
+            *rate = fmt[4] | fmt[5] << 8 | fmt[6] << 16 | fmt[7] << 24;
+            bits = fmt[14] | fmt[15] << 8;
+            fseek(f, size - 16 + (size & 1), SEEK_CUR);
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (bits != 16 || channels < 1) {
+                goto done;
+            }
+            int frames = size / (2 * channels);
+            int16_t *raw = malloc(size);
+            pcm = malloc(frames * sizeof(int16_t) + 1);
+            if (raw == NULL || pcm == NULL || fread(raw, 1, size, f) != size) {
+                free(raw);
+                free(pcm);
+                pcm = NULL;
+                goto done;
+            }
+            for (int i = 0; i < frames; i++) {
+                pcm[i] = raw[i * channels];
+            }
+            free(raw);
+            *samples = frames;
+            goto done;
+        } else {
+            fseek(f, size + (size & 1), SEEK_CUR);
+        }
+    }
+done:
+    fclose(f);
+    return pcm;
+}
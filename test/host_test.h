@@ -0,0 +1,58 @@
+/*
+ * Minimal Unity-style asserts for the host tests, a failed assert ends the
+ * current test and the process exits non-zero once all tests ran.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+static int host_test_failures;
+static int host_test_failed;
+
+#define TEST_FAIL_MESSAGE(msg) do {                                         \
+        fprintf(stderr, "%s:%d: FAIL: %s\n", __FILE__, __LINE__, msg);     \
+        host_test_failed = 1;                                               \
+        return;                                                             \
+    } while (0)
+
+#define TEST_ASSERT(cond) do {                                              \
+        if (!(cond)) {                                                      \
+            TEST_FAIL_MESSAGE(#cond);                                       \
+        }                                                                   \
+    } while (0)
+
+#define TEST_ASSERT_EQUAL_INT(expected, actual) do {                        \
+        long long __e = (long long)(expected), __a = (long long)(actual);   \
+        if (__e != __a) {                                                   \
+            fprintf(stderr, "%s:%d: FAIL: %s expected %lld, got %lld\n",    \
+                    __FILE__, __LINE__, #actual, __e, __a);                 \
+            host_test_failed = 1;                                           \
+            return;                                                         \
+        }                                                                   \
+    } while (0)
+
+#define TEST_ASSERT_EQUAL_MEMORY(expected, actual, len) do {                \
+        if (memcmp((expected), (actual), (len)) != 0) {                     \
+            TEST_FAIL_MESSAGE(#actual " differs from " #expected);          \
+        }                                                                   \
+    } while (0)
+
+#define TEST_ASSERT_EQUAL_STRING(expected, actual) do {                     \
+        const char *__e = (expected), *__a = (actual);                      \
+        if (__a == NULL || strcmp(__e, __a) != 0) {                         \
+            fprintf(stderr, "%s:%d: FAIL: %s expected \"%s\", got \"%s\"\n",\
+                    __FILE__, __LINE__, #actual, __e, __a ? __a : "(null)");\
+            host_test_failed = 1;                                           \
+            return;                                                         \
+        }                                                                   \
+    } while (0)
+
+#define RUN_TEST(fn) do {                                                   \
+        host_test_failed = 0;                                               \
+        fn();                                                               \
+        printf("%s %s\n", host_test_failed ? "FAIL" : "PASS", #fn);        \
+        host_test_failures += host_test_failed;                             \
+    } while (0)
+
+#define TEST_EXIT() (host_test_failures ? 1 : 0)
@@ -0,0 +1,591 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "audio_mem.h"
+#include "audio_element.h"
+#include "audio_event_iface.h"
+#include "ringbuf.h"
+#include "json_utils.h"
+#include "host_shim.h"
+
+#define HOST_ELEMENT_MULTI_MAX  (4)
+#define HOST_ELEMENT_LOOP_MAX   (10 * 1000 * 1000)
+
+void *audio_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+void *audio_calloc(size_t nmemb, size_t size)
+{
+    return calloc(nmemb, size);
+}
+
+void *audio_calloc_inner(size_t nmemb, size_t size)
+{
+    return calloc(nmemb, size);
+}
+
+void *audio_realloc(void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+char *audio_strdup(const char *str)
+{
+    return strdup(str);
+}
+
+void audio_free(void *ptr)
+{
+    free(ptr);
+}
+
+bool audio_mem_spiram_is_enabled(void)
+{
+    return false;
+}
+
+/*
+ * Ring buffer
+ */
+struct ringbuf {
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    char            *data;
+    int             size;
+    int             head;
+    int             fill;
+    bool            done;
+    bool            aborted;
+};
+
+ringbuf_handle_t rb_create(int block_size, int n_blocks)
+{
+    ringbuf_handle_t rb = calloc(1, sizeof(struct ringbuf));
+    if (rb == NULL) {
+        return NULL;
+    }
+    rb->size = block_size * n_blocks;
+    rb->data = calloc(1, rb->size);
+    if (rb->data == NULL) {
+        free(rb);
+        return NULL;
+    }
+    pthread_mutex_init(&rb->lock, NULL);
+    pthread_cond_init(&rb->changed, NULL);
+    return rb;
+}
+
+esp_err_t rb_destroy(ringbuf_handle_t rb)
+{
+    if (rb == NULL) {
+        return ESP_FAIL;
+    }
+    pthread_cond_destroy(&rb->changed);
+    pthread_mutex_destroy(&rb->lock);
+    free(rb->data);
+    free(rb);
+    return ESP_OK;
+}
+
+esp_err_t rb_abort(ringbuf_handle_t rb)
+{
+    pthread_mutex_lock(&rb->lock);
+    rb->aborted = true;
+    pthread_cond_broadcast(&rb->changed);
+    pthread_mutex_unlock(&rb->lock);
+    return ESP_OK;
+}
+
+esp_err_t rb_reset(ringbuf_handle_t rb)
+{
+    pthread_mutex_lock(&rb->lock);
+    rb->head = 0;
+    rb->fill = 0;
+    rb->done = false;
+    rb->aborted = false;
+    pthread_cond_broadcast(&rb->changed);
+    pthread_mutex_unlock(&rb->lock);
+    return ESP_OK;
+}
+
+int rb_bytes_available(ringbuf_handle_t rb)
+{
+    pthread_mutex_lock(&rb->lock);
+    int available = rb->size - rb->fill;
+    pthread_mutex_unlock(&rb->lock);
+    return available;
+}
+
+int rb_bytes_filled(ringbuf_handle_t rb)
+{
+    pthread_mutex_lock(&rb->lock);
+    int fill = rb->fill;
+    pthread_mutex_unlock(&rb->lock);
+    return fill;
+}
+
+int rb_get_size(ringbuf_handle_t rb)
+{
+    return rb->size;
+}
+
+/*
+ * Reads and writes move what fits without blocking, the host tests run both ends
+ * from one thread so a partial transfer is returned instead of waiting.
+ */
+int rb_read(ringbuf_handle_t rb, char *buf, int len, TickType_t ticks_to_wait)
+{
+    pthread_mutex_lock(&rb->lock);
+    if (rb->aborted) {
+        pthread_mutex_unlock(&rb->lock);
+        return RB_ABORT;
+    }
+    if (rb->fill == 0) {
+        pthread_mutex_unlock(&rb->lock);
+        return rb->done ? RB_DONE : RB_TIMEOUT;
+    }
+    int n = len < rb->fill ? len : rb->fill;
+    for (int i = 0; i < n; i++) {
+        buf[i] = rb->data[(rb->head + i) % rb->size];
+    }
+    rb->head = (rb->head + n) % rb->size;
+    rb->fill -= n;
+    pthread_cond_broadcast(&rb->changed);
+    pthread_mutex_unlock(&rb->lock);
+    return n;
+}
+
+int rb_write(ringbuf_handle_t rb, char *buf, int len, TickType_t ticks_to_wait)
+{
+    pthread_mutex_lock(&rb->lock);
+    if (rb->aborted) {
+        pthread_mutex_unlock(&rb->lock);
+        return RB_ABORT;
+    }
+    int space = rb->size - rb->fill;
+    int n = len < space ? len : space;
+    for (int i = 0; i < n; i++) {
+        rb->data[(rb->head + rb->fill + i) % rb->size] = buf[i];
+    }
+    rb->fill += n;
+    pthread_cond_broadcast(&rb->changed);
+    pthread_mutex_unlock(&rb->lock);
+    return n > 0 ? n : RB_TIMEOUT;
+}
+
+esp_err_t rb_done_write(ringbuf_handle_t rb)
+{
+    pthread_mutex_lock(&rb->lock);
+    rb->done = true;
+    pthread_cond_broadcast(&rb->changed);
+    pthread_mutex_unlock(&rb->lock);
+    return ESP_OK;
+}
+
+/*
+ * Event interface
+ */
+struct audio_event_iface {
+    QueueHandle_t               queue;
+    audio_event_iface_handle_t  listener;
+};
+
+audio_event_iface_handle_t audio_event_iface_init(audio_event_iface_cfg_t *config)
+{
+    audio_event_iface_handle_t evt = calloc(1, sizeof(struct audio_event_iface));
+    if (evt == NULL) {
+        return NULL;
+    }
+    int size = config->internal_queue_size + config->external_queue_size + config->queue_set_size;
+    evt->queue = xQueueCreate(size > 0 ? size : DEFAULT_AUDIO_EVENT_IFACE_SIZE, sizeof(audio_event_iface_msg_t));
+    if (evt->queue == NULL) {
+        free(evt);
+        return NULL;
+    }
+    return evt;
+}
+
+esp_err_t audio_event_iface_destroy(audio_event_iface_handle_t evt)
+{
+    if (evt == NULL) {
+        return ESP_FAIL;
+    }
+    vQueueDelete(evt->queue);
+    free(evt);
+    return ESP_OK;
+}
+
+esp_err_t audio_event_iface_set_listener(audio_event_iface_handle_t evt, audio_event_iface_handle_t listener)
+{
+    evt->listener = listener;
+    return ESP_OK;
+}
+
+esp_err_t audio_event_iface_remove_listener(audio_event_iface_handle_t listen, audio_event_iface_handle_t evt)
+{
+    if (evt->listener == listen) {
+        evt->listener = NULL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t audio_event_iface_sendout(audio_event_iface_handle_t evt, audio_event_iface_msg_t *msg)
+{
+    if (evt->listener == NULL) {
+        return ESP_OK;
+    }
+    return xQueueSend(evt->listener->queue, msg, 0) == pdTRUE ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t audio_event_iface_listen(audio_event_iface_handle_t evt, audio_event_iface_msg_t *msg, TickType_t wait_time)
+{
+    return xQueueReceive(evt->queue, msg, wait_time) == pdTRUE ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t audio_event_iface_discard(audio_event_iface_handle_t evt)
+{
+    xQueueReset(evt->queue);
+    return ESP_OK;
+}
+
+/*
+ * Element
+ */
+struct audio_element {
+    audio_element_cfg_t     cfg;
+    char                    *tag;
+    void                    *data;
+    audio_element_info_t    info;
+    audio_element_state_t   state;
+    char                    *buf;
+    stream_func             read_cb;
+    void                    *read_ctx;
+    stream_func             write_cb;
+    void                    *write_ctx;
+    ringbuf_handle_t        in_rb;
+    ringbuf_handle_t        out_rb;
+    ringbuf_handle_t        multi_out[HOST_ELEMENT_MULTI_MAX];
+};
+
+audio_element_handle_t audio_element_init(audio_element_cfg_t *config)
+{
+    audio_element_handle_t el = calloc(1, sizeof(struct audio_element));
+    if (el == NULL) {
+        return NULL;
+    }
+    el->cfg = *config;
+    el->data = config->data;
+    el->tag = strdup(config->tag ? config->tag : "element");
+    el->buf = calloc(1, config->buffer_len > 0 ? config->buffer_len : DEFAULT_ELEMENT_BUFFER_LENGTH);
+    el->read_cb = config->read;
+    el->write_cb = config->write;
+    el->info.sample_rates = 44100;
+    el->info.channels = 2;
+    el->info.bits = 16;
+    el->state = AEL_STATE_INIT;
+    if (el->tag == NULL || el->buf == NULL) {
+        free(el->tag);
+        free(el->buf);
+        free(el);
+        return NULL;
+    }
+    return el;
+}
+
+esp_err_t audio_element_deinit(audio_element_handle_t el)
+{
+    if (el->cfg.destroy) {
+        el->cfg.destroy(el);
+    }
+    free(el->tag);
+    free(el->buf);
+    free(el);
+    return ESP_OK;
+}
+
+esp_err_t audio_element_setdata(audio_element_handle_t el, void *data)
+{
+    el->data = data;
+    return ESP_OK;
+}
+
+void *audio_element_getdata(audio_element_handle_t el)
+{
+    return el->data;
+}
+
+esp_err_t audio_element_set_tag(audio_element_handle_t el, const char *tag)
+{
+    free(el->tag);
+    el->tag = strdup(tag);
+    return el->tag ? ESP_OK : ESP_FAIL;
+}
+
+char *audio_element_get_tag(audio_element_handle_t el)
+{
+    return el->tag;
+}
+
+esp_err_t audio_element_setinfo(audio_element_handle_t el, audio_element_info_t *info)
+{
+    el->info = *info;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_getinfo(audio_element_handle_t el, audio_element_info_t *info)
+{
+    *info = el->info;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_set_music_info(audio_element_handle_t el, int sample_rates, int ch, int bits)
+{
+    el->info.sample_rates = sample_rates;
+    el->info.channels = ch;
+    el->info.bits = bits;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_report_info(audio_element_handle_t el)
+{
+    return ESP_OK;
+}
+
+esp_err_t audio_element_set_read_cb(audio_element_handle_t el, stream_func fn, void *context)
+{
+    el->read_cb = fn;
+    el->read_ctx = context;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_set_write_cb(audio_element_handle_t el, stream_func fn, void *context)
+{
+    el->write_cb = fn;
+    el->write_ctx = context;
+    return ESP_OK;
+}
+
+esp_err_t audio_element_set_input_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb)
+{
+    el->in_rb = rb;
+    return ESP_OK;
+}
+
+ringbuf_handle_t audio_element_get_input_ringbuf(audio_element_handle_t el)
+{
+    return el->in_rb;
+}
+
+esp_err_t audio_element_set_output_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb)
+{
+    el->out_rb = rb;
+    return ESP_OK;
+}
+
+ringbuf_handle_t audio_element_get_output_ringbuf(audio_element_handle_t el)
+{
+    return el->out_rb;
+}
+
+esp_err_t audio_element_set_multi_output_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb, int index)
+{
+    if (index < 0 || index >= el->cfg.multi_out_rb_num || index >= HOST_ELEMENT_MULTI_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    el->multi_out[index] = rb;
+    return ESP_OK;
+}
+
+audio_element_err_t audio_element_input(audio_element_handle_t el, char *buffer, int wanted_size)
+{
+    if (el->read_cb) {
+        return el->read_cb(el, buffer, wanted_size, portMAX_DELAY, el->read_ctx);
+    }
+    if (el->in_rb) {
+        int ret = rb_read(el->in_rb, buffer, wanted_size, portMAX_DELAY);
+        return ret == RB_DONE ? AEL_IO_DONE : ret;
+    }
+    return AEL_IO_FAIL;
+}
+
+audio_element_err_t audio_element_output(audio_element_handle_t el, char *buffer, int write_size)
+{
+    if (el->write_cb) {
+        return el->write_cb(el, buffer, write_size, portMAX_DELAY, el->write_ctx);
+    }
+    if (el->out_rb) {
+        return rb_write(el->out_rb, buffer, write_size, portMAX_DELAY);
+    }
+    return AEL_IO_FAIL;
+}
+
+audio_element_err_t audio_element_multi_output(audio_element_handle_t el, char *buffer, int wanted_size,
+                                               TickType_t ticks_to_wait)
+{
+    audio_element_err_t ret = AEL_IO_OK;
+    for (int i = 0; i < el->cfg.multi_out_rb_num && i < HOST_ELEMENT_MULTI_MAX; i++) {
+        if (el->multi_out[i]) {
+            ret = rb_write(el->multi_out[i], buffer, wanted_size, ticks_to_wait);
+        }
+    }
+    return ret;
+}
+
+audio_element_state_t audio_element_get_state(audio_element_handle_t el)
+{
+    return el->state;
+}
+
+/*
+ * host_element_run() sources and sinks
+ */
+typedef struct {
+    const char      *data;
+    int             len;
+    int             pos;
+    int             chunk;
+    host_buffer_t   *out;
+} host_stream_t;
+
+static host_read_hook_t host_read_hook;
+static void *host_read_hook_ctx;
+
+void host_element_set_read_hook(host_read_hook_t hook, void *ctx)
+{
+    host_read_hook = hook;
+    host_read_hook_ctx = ctx;
+}
+
+static audio_element_err_t _host_read(audio_element_handle_t el, char *buffer, int len, TickType_t ticks, void *ctx)
+{
+    host_stream_t *s = (host_stream_t *)ctx;
+    if (s->pos >= s->len) {
+        return AEL_IO_DONE;
+    }
+    int n = s->len - s->pos;
+    if (n > len) {
+        n = len;
+    }
+    if (s->chunk > 0 && n > s->chunk) {
+        n = s->chunk;
+    }
+    if (host_read_hook) {
+        host_read_hook(s->pos, n, host_read_hook_ctx);
+    }
+    memcpy(buffer, s->data + s->pos, n);
+    s->pos += n;
+    return n;
+}
+
+static audio_element_err_t _host_write(audio_element_handle_t el, char *buffer, int len, TickType_t ticks, void *ctx)
+{
+    host_stream_t *s = (host_stream_t *)ctx;
+    if (s->out == NULL) {
+        return len;
+    }
+    host_buffer_t *out = s->out;
+    if (out->len + len > out->size) {
+        int size = out->size ? out->size : 4096;
+        while (size < out->len + len) {
+            size *= 2;
+        }
+        char *data = realloc(out->data, size);
+        if (data == NULL) {
+            return AEL_IO_FAIL;
+        }
+        out->data = data;
+        out->size = size;
+    }
+    memcpy(out->data + out->len, buffer, len);
+    out->len += len;
+    return len;
+}
+
+int host_element_run(audio_element_handle_t el, const void *in, int in_len, int chunk, host_buffer_t *out)
+{
+    host_stream_t stream = {
+        .data = (const char *)in,
+        .len = in_len,
+        .chunk = chunk,
+        .out = out,
+    };
+    audio_element_set_read_cb(el, _host_read, &stream);
+    audio_element_set_write_cb(el, _host_write, &stream);
+    if (el->cfg.open && el->cfg.open(el) != ESP_OK) {
+        return AEL_IO_FAIL;
+    }
+    el->state = AEL_STATE_RUNNING;
+    int ret = AEL_IO_OK;
+    for (int loops = 0; loops < HOST_ELEMENT_LOOP_MAX; loops++) {
+        ret = el->cfg.process(el, el->buf, el->cfg.buffer_len);
+        if (ret < 0 && ret != AEL_IO_TIMEOUT) {
+            break;
+        }
+    }
+    el->state = ret == AEL_IO_DONE ? AEL_STATE_FINISHED : AEL_STATE_ERROR;
+    if (el->cfg.close) {
+        el->cfg.close(el);
+    }
+    audio_element_set_read_cb(el, NULL, NULL);
+    audio_element_set_write_cb(el, NULL, NULL);
+    return ret;
+}
+
+void host_buffer_free(host_buffer_t *buf)
+{
+    free(buf->data);
+    memset(buf, 0, sizeof(host_buffer_t));
+}
+
+/*
+ * JSON, enough for the flat answers of the services
+ */
+char *json_get_token_value(const char *buffer, const char *token)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\"", token);
+    const char *p = strstr(buffer, key);
+    if (p == NULL) {
+        return NULL;
+    }
+    p += strlen(key);
+    p += strspn(p, " \t\r\n");
+    if (*p++ != ':') {
+        return NULL;
+    }
+    p += strspn(p, " \t\r\n");
+    const char *end = p;
+    if (*p == '"') {
+        for (end = ++p; *end && *end != '"'; end++) {
+            end += *end == '\\' && end[1];
+        }
+        if (*end != '"') {
+            return NULL;
+        }
+    } else if (*p == '[' || *p == '{') {
+        int depth = 0;
+        bool in_string = false;
+        for (; *end; end++) {
+            if (in_string) {
+                end += *end == '\\' && end[1];
+                in_string = *end != '"';
+            } else if (*end == '"') {
+                in_string = true;
+            } else if (*end == '[' || *end == '{') {
+                depth++;
+            } else if ((*end == ']' || *end == '}') && --depth == 0) {
+                end++;
+                break;
+            }
+        }
+        if (depth != 0) {
+            return NULL;
+        }
+    } else {
+        end += strcspn(p, ",}] \t\r\n");
+    }
+    return strndup(p, end - p);
+}
@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/portable.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+/*
+ * A queue with item_size 0 is a counting semaphore, `count` is then the only state.
+ */
+struct host_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    UBaseType_t     length;
+    UBaseType_t     item_size;
+    UBaseType_t     count;
+    UBaseType_t     head;
+    uint8_t         *items;
+};
+
+/*
+ * Kept after the task ends, a late xTaskNotifyGive must not touch freed memory. `notify` is the
+ * counting semaphore behind ulTaskNotifyTake.
+ */
+struct host_task {
+    TaskFunction_t  fn;
+    void            *arg;
+    pthread_t       thread;
+    QueueHandle_t   notify;
+};
+
+static __thread struct host_task *host_current_task;
+
+static pthread_mutex_t critical_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+void host_critical_enter(void)
+{
+    pthread_mutex_lock(&critical_lock);
+}
+
+void host_critical_exit(void)
+{
+    pthread_mutex_unlock(&critical_lock);
+}
+
+static void _host_deadline(struct timespec *ts, TickType_t ticks)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ticks / 1000;
+    ts->tv_nsec += (long)(ticks % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * Waits on `changed` until `ready` holds or the ticks run out, called with the lock held.
+ */
+static bool _host_wait(struct host_queue *q, bool (*ready)(struct host_queue *), TickType_t ticks)
+{
+    struct timespec deadline;
+    if (ticks != portMAX_DELAY) {
+        _host_deadline(&deadline, ticks);
+    }
+    while (!ready(q)) {
+        if (ticks == 0) {
+            return false;
+        }
+        //* a task deleted while it waits leaves the lock to the others
+        int err;
+        pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, &q->lock);
+        if (ticks == portMAX_DELAY) {
+            err = pthread_cond_wait(&q->changed, &q->lock);
+        } else {
+            err = pthread_cond_timedwait(&q->changed, &q->lock, &deadline);
+        }
+        pthread_cleanup_pop(0);
+        if (err == ETIMEDOUT) {
+            return ready(q);
+        }
+    }
+    return true;
+}
+
+static bool _host_has_space(struct host_queue *q)
+{
+    return q->count < q->length;
+}
+
+static bool _host_has_item(struct host_queue *q)
+{
+    return q->count > 0;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct host_queue *q = calloc(1, sizeof(struct host_queue));
+    if (q == NULL) {
+        return NULL;
+    }
+    q->length = length;
+    q->item_size = item_size;
+    if (item_size > 0 && (q->items = calloc(length, item_size)) == NULL) {
+        free(q);
+        return NULL;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&q->lock, NULL);
+    return q;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+    if (q == NULL) {
+        return;
+    }
+    pthread_cond_destroy(&q->changed);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+    free(q);
+}
+
+static BaseType_t _host_queue_put(QueueHandle_t q, const void *item, TickType_t ticks, bool front)
+{
+    pthread_mutex_lock(&q->lock);
+    if (!_host_wait(q, _host_has_space, ticks)) {
+        pthread_mutex_unlock(&q->lock);
+        return pdFALSE;
+    }
+    if (q->item_size > 0) {
+        UBaseType_t slot;
+        if (front) {
+            q->head = (q->head + q->length - 1) % q->length;
+            slot = q->head;
+        } else {
+            slot = (q->head + q->count) % q->length;
+        }
+        memcpy(q->items + slot * q->item_size, item, q->item_size);
+    }
+    q->count++;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks_to_wait)
+{
+    return _host_queue_put(q, item, ticks_to_wait, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item, TickType_t ticks_to_wait)
+{
+    return _host_queue_put(q, item, ticks_to_wait, true);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks_to_wait)
+{
+    pthread_mutex_lock(&q->lock);
+    if (!_host_wait(q, _host_has_item, ticks_to_wait)) {
+        pthread_mutex_unlock(&q->lock);
+        return pdFALSE;
+    }
+    if (q->item_size > 0) {
+        memcpy(item, q->items + q->head * q->item_size, q->item_size);
+        q->head = (q->head + 1) % q->length;
+    }
+    q->count--;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->count = 0;
+    q->head = 0;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    pthread_mutex_lock(&q->lock);
+    UBaseType_t count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q)
+{
+    return q->length - uxQueueMessagesWaiting(q);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    SemaphoreHandle_t sem = xQueueCreate(max_count, 0);
+    if (sem) {
+        sem->count = initial_count;
+    }
+    return sem;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks_to_wait)
+{
+    return xQueueReceive(sem, NULL, ticks_to_wait);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    return xQueueSend(sem, NULL, 0);
+}
+
+static void *_host_task_entry(void *pv)
+{
+    struct host_task *task = (struct host_task *)pv;
+    host_current_task = task;
+    task->fn(task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *handle, BaseType_t core)
+{
+    struct host_task *task = calloc(1, sizeof(struct host_task));
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->notify = xSemaphoreCreateCounting(0xffffffff, 0);
+    if (task->notify == NULL) {
+        free(task);
+        return pdFAIL;
+    }
+    if (pthread_create(&task->thread, NULL, _host_task_entry, task) != 0) {
+        vQueueDelete(task->notify);
+        free(task);
+        return pdFAIL;
+    }
+    if (handle) {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t prio, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(fn, name, stack_depth, arg, prio, handle, tskNO_AFFINITY);
+}
+
+/*
+ * Another task is gone when this returns, its queues and semaphores can be deleted then
+ */
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL) {
+        pthread_detach(pthread_self());
+        pthread_exit(NULL);
+    }
+    pthread_cancel(task->thread);
+    pthread_join(task->thread, NULL);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    return xSemaphoreGive(task->notify);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    struct host_task *task = host_current_task;
+    if (task == NULL || xSemaphoreTake(task->notify, ticks_to_wait) != pdTRUE) {
+        return 0;
+    }
+    uint32_t count = 1;
+    while (xSemaphoreTake(task->notify, 0) == pdTRUE) {
+        count++;
+    }
+    //* not cleared, all but the one taken stay pending
+    for (uint32_t i = 1; !clear_on_exit && i < count; i++) {
+        xSemaphoreGive(task->notify);
+    }
+    return clear_on_exit ? count : 1;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    usleep((useconds_t)ticks * 1000);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (TickType_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+    return 0;
+}
@@ -0,0 +1,304 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_http_client.h"
+#include "host_shim.h"
+
+/*
+ * One scripted server shared by all clients. A client is connected between a
+ * successful open and close. A connection the server dropped while idle takes
+ * the request like a real socket does and fails with an EOF at the header fetch,
+ * the server never sees that request.
+ */
+struct esp_http_client {
+    char                        *url;
+    esp_http_client_method_t    method;
+    int                         timeout_ms;
+    bool                        connected;
+    int                         drop_epoch;
+    int                         write_left;
+    int                         status;
+    int                         read_pos;
+};
+
+static struct {
+    pthread_mutex_t     lock;
+    int                 status;
+    char                *body;
+    int                 body_len;
+    host_http_fail_t    fail;
+    int                 drop_epoch;
+    host_http_stats_t   stats;
+    int                 read_max;
+    int                 rtt_ms;
+    int                 kbps;
+    char                *request;
+    int                 request_len;
+    int                 request_size;
+} host_http = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .status = 200,
+};
+
+void host_http_reset(int status, const char *body)
+{
+    pthread_mutex_lock(&host_http.lock);
+    free(host_http.body);
+    host_http.body = strdup(body ? body : "");
+    host_http.body_len = strlen(host_http.body);
+    host_http.status = status;
+    host_http.fail = HOST_HTTP_FAIL_NONE;
+    host_http.read_max = 0;
+    memset(&host_http.stats, 0, sizeof(host_http_stats_t));
+    pthread_mutex_unlock(&host_http.lock);
+}
+
+void host_http_fail_next(host_http_fail_t step)
+{
+    pthread_mutex_lock(&host_http.lock);
+    host_http.fail = step;
+    pthread_mutex_unlock(&host_http.lock);
+}
+
+void host_http_drop_idle(void)
+{
+    pthread_mutex_lock(&host_http.lock);
+    host_http.drop_epoch++;
+    pthread_mutex_unlock(&host_http.lock);
+}
+
+void host_http_set_read_max(int len)
+{
+    pthread_mutex_lock(&host_http.lock);
+    host_http.read_max = len;
+    pthread_mutex_unlock(&host_http.lock);
+}
+
+void host_http_set_link(int rtt_ms, int kbps)
+{
+    pthread_mutex_lock(&host_http.lock);
+    host_http.rtt_ms = rtt_ms;
+    host_http.kbps = kbps;
+    pthread_mutex_unlock(&host_http.lock);
+}
+
+const char *host_http_request(int *len)
+{
+    *len = host_http.request_len;
+    return host_http.request;
+}
+
+/*
+ * The time `bytes` take on the simulated link plus `rtts` round trips, slept outside the lock
+ */
+static void _host_http_link_delay(int bytes, int rtts)
+{
+    pthread_mutex_lock(&host_http.lock);
+    int64_t us = (int64_t)rtts * host_http.rtt_ms * 1000;
+    if (host_http.kbps > 0) {
+        us += (int64_t)bytes * 8 * 1000 / host_http.kbps;
+    }
+    pthread_mutex_unlock(&host_http.lock);
+    if (us > 0) {
+        usleep(us);
+    }
+}
+
+host_http_stats_t host_http_stats(void)
+{
+    pthread_mutex_lock(&host_http.lock);
+    host_http_stats_t stats = host_http.stats;
+    pthread_mutex_unlock(&host_http.lock);
+    return stats;
+}
+
+/*
+ * Consumes the injected failure when it is for `step`, called with the lock held.
+ */
+static bool _host_http_fail(host_http_fail_t step)
+{
+    if (host_http.fail != step) {
+        return false;
+    }
+    host_http.fail = HOST_HTTP_FAIL_NONE;
+    return true;
+}
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config)
+{
+    esp_http_client_handle_t client = calloc(1, sizeof(struct esp_http_client));
+    if (client == NULL) {
+        return NULL;
+    }
+    client->url = strdup(config->url ? config->url : "");
+    client->method = config->method;
+    client->timeout_ms = config->timeout_ms;
+    return client;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client)
+{
+    free(client->url);
+    free(client);
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char *url)
+{
+    free(client->url);
+    client->url = strdup(url);
+    return client->url ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t client, esp_http_client_method_t method)
+{
+    client->method = method;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_timeout_ms(esp_http_client_handle_t client, int timeout_ms)
+{
+    client->timeout_ms = timeout_ms;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_post_field(esp_http_client_handle_t client, const char *data, int len)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_delete_header(esp_http_client_handle_t client, const char *key)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len)
+{
+    //* TCP and TLS 1.2, three round trips on a new connection
+    _host_http_link_delay(0, client->connected ? 0 : 3);
+    pthread_mutex_lock(&host_http.lock);
+    esp_err_t err = ESP_OK;
+    host_http.request_len = 0;
+    if (!client->connected) {
+        if (_host_http_fail(HOST_HTTP_FAIL_OPEN)) {
+            err = ESP_FAIL;
+        } else {
+            host_http.stats.handshakes++;
+            client->connected = true;
+            client->drop_epoch = host_http.drop_epoch;
+        }
+    }
+    client->write_left = write_len;
+    client->status = 0;
+    client->read_pos = 0;
+    pthread_mutex_unlock(&host_http.lock);
+    return err;
+}
+
+int esp_http_client_write(esp_http_client_handle_t client, const char *buffer, int len)
+{
+    _host_http_link_delay(len, 0);
+    pthread_mutex_lock(&host_http.lock);
+    int ret = len;
+    if (!client->connected || _host_http_fail(HOST_HTTP_FAIL_WRITE)) {
+        client->connected = false;
+        ret = -1;
+    } else {
+        client->write_left -= len;
+        if (host_http.request_len + len > host_http.request_size) {
+            int size = (host_http.request_len + len) * 2;
+            char *request = realloc(host_http.request, size);
+            if (request) {
+                host_http.request = request;
+                host_http.request_size = size;
+            }
+        }
+        if (host_http.request_len + len <= host_http.request_size) {
+            memcpy(host_http.request + host_http.request_len, buffer, len);
+            host_http.request_len += len;
+        }
+    }
+    pthread_mutex_unlock(&host_http.lock);
+    return ret;
+}
+
+int esp_http_client_fetch_headers(esp_http_client_handle_t client)
+{
+    //* the answer of a server that takes no time
+    _host_http_link_delay(0, 1);
+    pthread_mutex_lock(&host_http.lock);
+    int ret = -1;
+    if (client->connected && client->drop_epoch != host_http.drop_epoch) {
+        host_http.stats.stale++;
+        client->connected = false;
+    } else if (client->connected && client->write_left <= 0) {
+        host_http.stats.requests++;
+        client->status = host_http.status;
+        if (_host_http_fail(HOST_HTTP_FAIL_FETCH)) {
+            client->connected = false;
+        } else {
+            ret = host_http.body_len;
+        }
+    } else {
+        client->connected = false;
+    }
+    pthread_mutex_unlock(&host_http.lock);
+    return ret;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client)
+{
+    return client->status;
+}
+
+int esp_http_client_get_content_length(esp_http_client_handle_t client)
+{
+    return host_http.body_len;
+}
+
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t client)
+{
+    return false;
+}
+
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer, int len)
+{
+    pthread_mutex_lock(&host_http.lock);
+    int n = 0;
+    if (client->status > 0) {
+        n = host_http.body_len - client->read_pos;
+        if (n > len) {
+            n = len;
+        }
+        if (host_http.read_max > 0 && n > host_http.read_max) {
+            n = host_http.read_max;
+        }
+        memcpy(buffer, host_http.body + client->read_pos, n);
+        client->read_pos += n;
+    }
+    pthread_mutex_unlock(&host_http.lock);
+    _host_http_link_delay(n, 0);
+    return n;
+}
+
+int esp_http_client_read_response(esp_http_client_handle_t client, char *buffer, int len)
+{
+    return esp_http_client_read(client, buffer, len);
+}
+
+bool esp_http_client_is_complete_data_received(esp_http_client_handle_t client)
+{
+    return client->status > 0 && client->read_pos >= host_http.body_len;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client)
+{
+    client->connected = false;
+    return ESP_OK;
+}
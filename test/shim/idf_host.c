@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_partition.h"
+#include "nvs.h"
+#include "host_shim.h"
+
+#define HOST_PARTITION_MAX  (8)
+#define HOST_NVS_MAX        (16)
+
+static esp_log_level_t _host_log_level(void)
+{
+    const char *level = getenv("HOST_LOG_LEVEL");
+    return level ? (esp_log_level_t)atoi(level) : ESP_LOG_WARN;
+}
+
+esp_log_level_t host_log_level = ESP_LOG_WARN;
+
+__attribute__((constructor)) static void _host_log_init(void)
+{
+    host_log_level = _host_log_level();
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    //* one level for every tag on the host
+    if (strcmp(tag, "*") == 0) {
+        host_log_level = level;
+    }
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+        case ESP_OK:
+            return "ESP_OK";
+        case ESP_FAIL:
+            return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:
+            return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:
+            return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE:
+            return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE:
+            return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND:
+            return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED:
+            return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT:
+            return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_INVALID_RESPONSE:
+            return "ESP_ERR_INVALID_RESPONSE";
+        default:
+            return "UNKNOWN ERROR";
+    }
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    return malloc(size);
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps)
+{
+    return calloc(n, size);
+}
+
+void *heap_caps_aligned_alloc(size_t alignment, size_t size, uint32_t caps)
+{
+    //* aligned_alloc wants the size to be a multiple of the alignment
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void *heap_caps_aligned_calloc(size_t alignment, size_t n, size_t size, uint32_t caps)
+{
+    void *ptr = heap_caps_aligned_alloc(alignment, n * size, caps);
+    if (ptr) {
+        memset(ptr, 0, n * size);
+    }
+    return ptr;
+}
+
+void heap_caps_free(void *ptr)
+{
+    free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+    return 4 * 1024 * 1024;
+}
+
+/*
+ * RAM partitions
+ */
+typedef struct {
+    esp_partition_t partition;
+    uint8_t         *data;
+} host_partition_t;
+
+static host_partition_t host_partitions[HOST_PARTITION_MAX];
+
+static host_partition_t *_host_partition(const esp_partition_t *partition)
+{
+    for (int i = 0; i < HOST_PARTITION_MAX; i++) {
+        if (&host_partitions[i].partition == partition) {
+            return &host_partitions[i];
+        }
+    }
+    return NULL;
+}
+
+const esp_partition_t *host_partition_add(const char *label, uint32_t size)
+{
+    for (int i = 0; i < HOST_PARTITION_MAX; i++) {
+        host_partition_t *p = &host_partitions[i];
+        if (p->data && strcmp(p->partition.label, label) != 0) {
+            continue;
+        }
+        free(p->data);
+        p->data = malloc(size);
+        if (p->data == NULL) {
+            return NULL;
+        }
+        memset(p->data, 0xff, size);
+        memset(&p->partition, 0, sizeof(esp_partition_t));
+        p->partition.type = ESP_PARTITION_TYPE_DATA;
+        p->partition.subtype = ESP_PARTITION_SUBTYPE_ANY;
+        p->partition.address = 0x400000 + i * 0x100000;
+        p->partition.size = size;
+        strncpy(p->partition.label, label, sizeof(p->partition.label) - 1);
+        return &p->partition;
+    }
+    return NULL;
+}
+
+uint8_t *host_partition_data(const esp_partition_t *partition)
+{
+    host_partition_t *p = _host_partition(partition);
+    return p ? p->data : NULL;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+    for (int i = 0; i < HOST_PARTITION_MAX; i++) {
+        host_partition_t *p = &host_partitions[i];
+        if (p->data && p->partition.type == type && (label == NULL || strcmp(p->partition.label, label) == 0)) {
+            return &p->partition;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    host_partition_t *p = _host_partition(partition);
+    if (p == NULL || src_offset + size > partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, p->data + src_offset, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    host_partition_t *p = _host_partition(partition);
+    if (p == NULL || dst_offset + size > partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t *in = (const uint8_t *)src;
+    for (size_t i = 0; i < size; i++) {
+        p->data[dst_offset + i] &= in[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    host_partition_t *p = _host_partition(partition);
+    if (p == NULL || offset + size > partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(p->data + offset, 0xff, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                             spi_flash_mmap_memory_t memory, const void **out_ptr, spi_flash_mmap_handle_t *out_handle)
+{
+    host_partition_t *p = _host_partition(partition);
+    if (p == NULL || offset + size > partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *out_ptr = p->data + offset;
+    *out_handle = (spi_flash_mmap_handle_t)(p - host_partitions + 1);
+    return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle)
+{
+}
+
+/*
+ * RAM NVS, a handle is the index of its namespace plus one
+ */
+typedef struct {
+    char    name[16];
+    char    key[16];
+    void    *value;
+    size_t  len;
+} host_nvs_blob_t;
+
+static host_nvs_blob_t host_nvs[HOST_NVS_MAX];
+static char host_nvs_names[HOST_NVS_MAX][16];
+
+void host_nvs_erase(void)
+{
+    for (int i = 0; i < HOST_NVS_MAX; i++) {
+        free(host_nvs[i].value);
+    }
+    memset(host_nvs, 0, sizeof(host_nvs));
+    memset(host_nvs_names, 0, sizeof(host_nvs_names));
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    int free_ns = -1;
+    for (int i = 0; i < HOST_NVS_MAX; i++) {
+        if (strncmp(host_nvs_names[i], name, sizeof(host_nvs_names[i])) == 0) {
+            *out_handle = i + 1;
+            return ESP_OK;
+        }
+        if (free_ns < 0 && host_nvs_names[i][0] == 0) {
+            free_ns = i;
+        }
+    }
+    //* like the chip, a namespace that was never written cannot be opened read-only
+    if (open_mode == NVS_READONLY) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (free_ns < 0) {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+    strncpy(host_nvs_names[free_ns], name, sizeof(host_nvs_names[free_ns]) - 1);
+    *out_handle = free_ns + 1;
+    return ESP_OK;
+}
+
+static host_nvs_blob_t *_host_nvs_find(nvs_handle_t handle, const char *key)
+{
+    for (int i = 0; i < HOST_NVS_MAX; i++) {
+        host_nvs_blob_t *blob = &host_nvs[i];
+        if (blob->value && strcmp(blob->name, host_nvs_names[handle - 1]) == 0 && strcmp(blob->key, key) == 0) {
+            return blob;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    host_nvs_blob_t *blob = _host_nvs_find(handle, key);
+    for (int i = 0; blob == NULL && i < HOST_NVS_MAX; i++) {
+        if (host_nvs[i].value == NULL) {
+            blob = &host_nvs[i];
+            strncpy(blob->name, host_nvs_names[handle - 1], sizeof(blob->name) - 1);
+            strncpy(blob->key, key, sizeof(blob->key) - 1);
+        }
+    }
+    if (blob == NULL) {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+    void *copy = malloc(length ? length : 1);
+    if (copy == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(copy, value, length);
+    free(blob->value);
+    blob->value = copy;
+    blob->len = length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    host_nvs_blob_t *blob = _host_nvs_find(handle, key);
+    if (blob == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (out_value == NULL) {
+        *length = blob->len;
+        return ESP_OK;
+    }
+    if (*length < blob->len) {
+        *length = blob->len;
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out_value, blob->value, blob->len);
+    *length = blob->len;
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
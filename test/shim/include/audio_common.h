@@ -0,0 +1,25 @@
+#pragma once
+
+#include "audio_error.h"
+
+#define AUDIO_TASK_STACK_SIZE   (3 * 1024)
+
+typedef enum {
+    AUDIO_ELEMENT_TYPE_UNKNOW = 0x01 << 24,
+    AUDIO_ELEMENT_TYPE_ELEMENT = 0x01 << 25,
+    AUDIO_ELEMENT_TYPE_PLAYER = 0x01 << 26,
+    AUDIO_ELEMENT_TYPE_SERVICE = 0x01 << 27,
+    AUDIO_ELEMENT_TYPE_PERIPH = 0x01 << 28,
+} audio_element_type_t;
+
+typedef enum {
+    AUDIO_STREAM_NONE = 0,
+    AUDIO_STREAM_READER,
+    AUDIO_STREAM_WRITER,
+} audio_stream_type_t;
+
+typedef enum {
+    AUDIO_CODEC_TYPE_NONE = 0,
+    AUDIO_CODEC_TYPE_DECODER,
+    AUDIO_CODEC_TYPE_ENCODER,
+} audio_codec_type_t;
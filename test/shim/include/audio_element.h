@@ -0,0 +1,117 @@
+/*
+ * The part of the ADF element API the host-built modules use. There is no
+ * element task on the host: host_element_run() in host_shim.h opens the
+ * element, calls its process callback until the input is done and closes it.
+ */
+#pragma once
+
+#include "esp_err.h"
+#include "audio_common.h"
+#include "audio_event_iface.h"
+#include "ringbuf.h"
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct audio_element *audio_element_handle_t;
+
+typedef enum {
+    AEL_IO_OK           = ESP_OK,
+    AEL_IO_FAIL         = ESP_FAIL,
+    AEL_IO_DONE         = -2,
+    AEL_IO_ABORT        = -3,
+    AEL_IO_TIMEOUT      = -4,
+    AEL_PROCESS_FAIL    = -5,
+} audio_element_err_t;
+
+typedef enum {
+    AEL_STATE_NONE          = 0,
+    AEL_STATE_INIT          = 1,
+    AEL_STATE_INITIALIZING  = 2,
+    AEL_STATE_RUNNING       = 3,
+    AEL_STATE_PAUSED        = 4,
+    AEL_STATE_STOPPED       = 5,
+    AEL_STATE_FINISHED      = 6,
+    AEL_STATE_ERROR         = 7,
+} audio_element_state_t;
+
+typedef struct {
+    int         sample_rates;
+    int         channels;
+    int         bits;
+    int         bps;
+    int64_t     byte_pos;
+    int64_t     total_bytes;
+    int         duration;
+    char        *uri;
+    int         codec_fmt;
+} audio_element_info_t;
+
+typedef esp_err_t (*el_io_func)(audio_element_handle_t self);
+typedef audio_element_err_t (*process_func)(audio_element_handle_t self, char *el_buffer, int el_buf_len);
+typedef audio_element_err_t (*stream_func)(audio_element_handle_t self, char *buffer, int len,
+                                           TickType_t ticks_to_wait, void *context);
+typedef esp_err_t (*ctrl_func)(audio_element_handle_t self, void *in_data, int in_size, void *out_data, int *out_size);
+
+typedef struct {
+    el_io_func      open;
+    ctrl_func       seek;
+    process_func    process;
+    el_io_func      close;
+    el_io_func      destroy;
+    stream_func     read;
+    stream_func     write;
+    int             buffer_len;
+    int             task_stack;
+    int             task_prio;
+    int             task_core;
+    int             out_rb_size;
+    void            *data;
+    const char      *tag;
+    bool            stack_in_ext;
+    int             multi_in_rb_num;
+    int             multi_out_rb_num;
+} audio_element_cfg_t;
+
+#define DEFAULT_ELEMENT_RINGBUF_SIZE    (8 * 1024)
+#define DEFAULT_ELEMENT_BUFFER_LENGTH   (1024)
+#define DEFAULT_ELEMENT_STACK_SIZE      (2 * 1024)
+#define DEFAULT_ELEMENT_TASK_PRIO       (5)
+#define DEFAULT_ELEMENT_TASK_CORE       (0)
+
+#define DEFAULT_AUDIO_ELEMENT_CONFIG() {                \
+    .buffer_len         = DEFAULT_ELEMENT_BUFFER_LENGTH,\
+    .task_stack         = DEFAULT_ELEMENT_STACK_SIZE,   \
+    .task_prio          = DEFAULT_ELEMENT_TASK_PRIO,    \
+    .task_core          = DEFAULT_ELEMENT_TASK_CORE,    \
+    .out_rb_size        = DEFAULT_ELEMENT_RINGBUF_SIZE, \
+}
+
+audio_element_handle_t audio_element_init(audio_element_cfg_t *config);
+esp_err_t audio_element_deinit(audio_element_handle_t el);
+esp_err_t audio_element_setdata(audio_element_handle_t el, void *data);
+void *audio_element_getdata(audio_element_handle_t el);
+esp_err_t audio_element_set_tag(audio_element_handle_t el, const char *tag);
+char *audio_element_get_tag(audio_element_handle_t el);
+esp_err_t audio_element_setinfo(audio_element_handle_t el, audio_element_info_t *info);
+esp_err_t audio_element_getinfo(audio_element_handle_t el, audio_element_info_t *info);
+esp_err_t audio_element_set_music_info(audio_element_handle_t el, int sample_rates, int ch, int bits);
+esp_err_t audio_element_report_info(audio_element_handle_t el);
+esp_err_t audio_element_set_read_cb(audio_element_handle_t el, stream_func fn, void *context);
+esp_err_t audio_element_set_write_cb(audio_element_handle_t el, stream_func fn, void *context);
+esp_err_t audio_element_set_input_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb);
+ringbuf_handle_t audio_element_get_input_ringbuf(audio_element_handle_t el);
+esp_err_t audio_element_set_output_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb);
+ringbuf_handle_t audio_element_get_output_ringbuf(audio_element_handle_t el);
+esp_err_t audio_element_set_multi_output_ringbuf(audio_element_handle_t el, ringbuf_handle_t rb, int index);
+audio_element_err_t audio_element_input(audio_element_handle_t el, char *buffer, int wanted_size);
+audio_element_err_t audio_element_output(audio_element_handle_t el, char *buffer, int write_size);
+audio_element_err_t audio_element_multi_output(audio_element_handle_t el, char *buffer, int wanted_size,
+                                               TickType_t ticks_to_wait);
+audio_element_state_t audio_element_get_state(audio_element_handle_t el);
+
+#ifdef __cplusplus
+}
+#endif
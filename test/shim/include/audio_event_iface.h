@@ -0,0 +1,57 @@
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct audio_event_iface *audio_event_iface_handle_t;
+
+typedef struct {
+    int                 cmd;
+    void                *data;
+    int                 data_len;
+    void                *source;
+    int                 source_type;
+    bool                need_free_data;
+} audio_event_iface_msg_t;
+
+typedef esp_err_t (*on_event_iface_func)(audio_event_iface_msg_t *, void *);
+
+typedef struct {
+    int                 internal_queue_size;
+    int                 external_queue_size;
+    int                 queue_set_size;
+    on_event_iface_func on_cmd;
+    void                *context;
+    TickType_t          wait_time;
+    int                 type;
+} audio_event_iface_cfg_t;
+
+#define DEFAULT_AUDIO_EVENT_IFACE_SIZE  (5)
+
+#define AUDIO_EVENT_IFACE_DEFAULT_CFG() {                   \
+    .internal_queue_size = DEFAULT_AUDIO_EVENT_IFACE_SIZE,  \
+    .external_queue_size = DEFAULT_AUDIO_EVENT_IFACE_SIZE,  \
+    .queue_set_size = DEFAULT_AUDIO_EVENT_IFACE_SIZE,       \
+    .on_cmd = NULL,                                         \
+    .context = NULL,                                        \
+    .wait_time = portMAX_DELAY,                             \
+    .type = 0,                                              \
+}
+
+/* One queue per interface, sendout posts to the listener's queue and listen reads our own */
+audio_event_iface_handle_t audio_event_iface_init(audio_event_iface_cfg_t *config);
+esp_err_t audio_event_iface_destroy(audio_event_iface_handle_t evt);
+esp_err_t audio_event_iface_set_listener(audio_event_iface_handle_t evt, audio_event_iface_handle_t listener);
+esp_err_t audio_event_iface_remove_listener(audio_event_iface_handle_t listen, audio_event_iface_handle_t evt);
+esp_err_t audio_event_iface_sendout(audio_event_iface_handle_t evt, audio_event_iface_msg_t *msg);
+esp_err_t audio_event_iface_listen(audio_event_iface_handle_t evt, audio_event_iface_msg_t *msg, TickType_t wait_time);
+esp_err_t audio_event_iface_discard(audio_event_iface_handle_t evt);
+
+#ifdef __cplusplus
+}
+#endif
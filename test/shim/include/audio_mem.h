@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *audio_malloc(size_t size);
+void *audio_calloc(size_t nmemb, size_t size);
+void *audio_calloc_inner(size_t nmemb, size_t size);
+void *audio_realloc(void *ptr, size_t size);
+char *audio_strdup(const char *str);
+void audio_free(void *ptr);
+bool audio_mem_spiram_is_enabled(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+static inline uint32_t esp_cpu_get_ccount(void)
+{
+    return 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Monotonic host clock in microseconds */
+int64_t esp_timer_get_time(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Test-side controls for the host shims: driving an audio element without a
+ * pipeline, RAM partitions and NVS, and the scripted HTTP server.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "audio_element.h"
+#include "esp_partition.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    char    *data;
+    int     len;
+    int     size;
+} host_buffer_t;
+
+/**
+ * @brief      Run an element over a buffer the way its task would: open, process until
+ *             the input is done, close. The input is offered in `chunk` byte reads
+ *             (0 reads as much as the element asks for) and the output is appended to `out`.
+ *
+ * @return     The last process result, AEL_IO_DONE when the input ran out
+ */
+int host_element_run(audio_element_handle_t el, const void *in, int in_len, int chunk, host_buffer_t *out);
+
+void host_buffer_free(host_buffer_t *buf);
+
+typedef void (*host_read_hook_t)(int pos, int len, void *ctx);
+
+/**
+ * @brief      Called by host_element_run before each input read of `len` bytes at offset `pos`,
+ *             e.g. to write the playback of the same moment into an echo reference. NULL removes it.
+ */
+void host_element_set_read_hook(host_read_hook_t hook, void *ctx);
+
+/**
+ * @brief      Add an erased RAM partition, the label is what esp_partition_find_first looks up
+ */
+const esp_partition_t *host_partition_add(const char *label, uint32_t size);
+
+/**
+ * @brief      The RAM behind a partition, for filling a model or checking what was written
+ */
+uint8_t *host_partition_data(const esp_partition_t *partition);
+
+/**
+ * @brief      Forget every NVS namespace, the NVS of a new chip
+ */
+void host_nvs_erase(void);
+
+typedef enum {
+    HOST_HTTP_FAIL_NONE = 0,
+    HOST_HTTP_FAIL_OPEN,        /*!< The next connect is refused */
+    HOST_HTTP_FAIL_WRITE,       /*!< The next body write breaks the connection */
+    HOST_HTTP_FAIL_FETCH,       /*!< The server gets the next request, the connection drops after the status line */
+} host_http_fail_t;
+
+typedef struct {
+    int     handshakes;         /*!< Connections the server accepted, a TLS handshake each on the device */
+    int     requests;           /*!< Requests the server received in full */
+    int     stale;              /*!< Requests sent on a connection the server had dropped, never received */
+} host_http_stats_t;
+
+void host_http_reset(int status, const char *body);
+void host_http_fail_next(host_http_fail_t step);
+
+/**
+ * @brief      The server closes every idle kept-alive connection, clients notice at the next header fetch
+ */
+void host_http_drop_idle(void);
+
+host_http_stats_t host_http_stats(void);
+
+/**
+ * @brief      Reads return at most `len` bytes, the answer comes in pieces. 0 for no limit, host_http_reset clears it.
+ */
+void host_http_set_read_max(int len);
+
+/**
+ * @brief      Simulate a link: a new connection costs three round trips, every answer one, and the
+ *             request and answer bytes go at `kbps`. 0 for both is a link that takes no time.
+ */
+void host_http_set_link(int rtt_ms, int kbps);
+
+/**
+ * @brief      The bytes written for the last request, chunk framing included
+ */
+const char *host_http_request(int *len);
+
+#ifdef __cplusplus
+}
+#endif
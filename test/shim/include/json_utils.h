@@ -0,0 +1,15 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief      The value of the first `"token":` in `buffer` as ADF's jsmn based one returns it: a string
+ *             without its quotes, an array or object as its raw text. To be freed, NULL if not found.
+ */
+char *json_get_token_value(const char *buffer, const char *token);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,4 @@
+#pragma once
+
+/* Included by llm_ask.h, nothing in it is used on the host */
+#include "esp_err.h"
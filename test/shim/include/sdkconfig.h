@@ -0,0 +1,16 @@
+/*
+ * Host build configuration, the subset of the project sdkconfig that the
+ * host-built modules and esp-dsp read.
+ */
+#pragma once
+
+#define CONFIG_IDF_TARGET               "linux"
+#define CONFIG_DSP_ANSI                 1
+#define CONFIG_DSP_MAX_FFT_SIZE         4096
+#define CONFIG_AUDIO_TASK_CORE          1
+#define CONFIG_NET_TASK_CORE            0
+// Short, the tests wait it out
+#define CONFIG_HTTP_CONN_IDLE_MS        300
+#define CONFIG_LLM_TASK_PRIO            4
+#define CONFIG_CODEC_SAMPLE_RATE        48000
+#define CONFIG_TEST_SERVER_URI          "http://192.168.1.75:8000/upload"
@@ -0,0 +1,174 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "base64_stream.h"
+#include "esp_timer.h"
+#include "host_test.h"
+
+#if HOST_HAVE_MBEDTLS
+// mbedtls/base64.h, the headers may not be installed
+int mbedtls_base64_encode(unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen);
+#endif
+
+// One ring buffer block of the ASR upload
+#define BLOCK_SIZE  (3 * 1024)
+
+static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int _decode(const char *src, int len, uint8_t *dst)
+{
+    int out = 0;
+    uint32_t acc = 0;
+    int bits = 0;
+    for (int i = 0; i < len && src[i] != '='; i++) {
+        acc = (acc << 6) | (uint32_t)(strchr(alphabet, src[i]) - alphabet);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            dst[out++] = (uint8_t)(acc >> bits);
+        }
+    }
+    return out;
+}
+
+/*
+ * Encodes `src` in pieces of 0 to `max_piece` bytes, checking the length bound of every piece
+ */
+static int _encode_pieces(const uint8_t *src, int len, int max_piece, char *dst)
+{
+    base64_stream_t b64;
+    base64_stream_reset(&b64);
+    int out = 0;
+    for (int i = 0; i < len;) {
+        int n = rand() % (max_piece + 1);
+        if (n > len - i) {
+            n = len - i;
+        }
+        int bound = base64_stream_encoded_len(&b64, n);
+        int written = base64_stream_encode(&b64, dst + out, src + i, n);
+        if (written > bound || written % 4 != 0) {
+            return -1;
+        }
+        out += written;
+        i += n;
+    }
+    out += base64_stream_finish(&b64, dst + out);
+    dst[out] = 0;
+    return out;
+}
+
+static void test_rfc4648_vectors(void)
+{
+    static const char *plain[] = { "", "f", "fo", "foo", "foob", "fooba", "foobar" };
+    static const char *encoded[] = { "", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy" };
+    for (int i = 0; i < 7; i++) {
+        char out[16];
+        TEST_ASSERT_EQUAL_INT(strlen(encoded[i]), _encode_pieces((const uint8_t *)plain[i], strlen(plain[i]), 1, out));
+        TEST_ASSERT_EQUAL_STRING(encoded[i], out);
+    }
+}
+
+static void test_tail_carry_round_trip(void)
+{
+    srand(1);
+    uint8_t in[300], back[300];
+    char whole[512], pieces[512];
+    for (int t = 0; t < 2000; t++) {
+        int len = rand() % (int)sizeof(in);
+        for (int i = 0; i < len; i++) {
+            in[i] = rand();
+        }
+        //* one piece is the reference, any split must give the same text
+        base64_stream_t b64;
+        base64_stream_reset(&b64);
+        int whole_len = base64_stream_encode(&b64, whole, in, len);
+        whole_len += base64_stream_finish(&b64, whole + whole_len);
+        whole[whole_len] = 0;
+        TEST_ASSERT_EQUAL_INT((len + 2) / 3 * 4, whole_len);
+
+        int pieces_len = _encode_pieces(in, len, 1 + t % 7, pieces);
+        TEST_ASSERT_EQUAL_INT(whole_len, pieces_len);
+        TEST_ASSERT_EQUAL_STRING(whole, pieces);
+
+        TEST_ASSERT_EQUAL_INT(len, _decode(pieces, pieces_len, back));
+        TEST_ASSERT_EQUAL_MEMORY(in, back, len);
+    }
+}
+
+static void test_reset_drops_tail(void)
+{
+    base64_stream_t b64;
+    base64_stream_reset(&b64);
+    char out[8];
+    TEST_ASSERT_EQUAL_INT(0, base64_stream_encode(&b64, out, (const uint8_t *)"ab", 2));
+    base64_stream_reset(&b64);
+    TEST_ASSERT_EQUAL_INT(0, base64_stream_finish(&b64, out));
+}
+
+/*
+ * MB/s of input encoded block by block, the way the ASR upload does it
+ */
+static double _encode_mbps(const uint8_t *src, int len, int rounds, bool mbedtls, char *dst)
+{
+    int64_t start = esp_timer_get_time();
+    for (int r = 0; r < rounds; r++) {
+        base64_stream_t b64;
+        base64_stream_reset(&b64);
+        for (int pos = 0; pos < len; pos += BLOCK_SIZE) {
+            int n = len - pos < BLOCK_SIZE ? len - pos : BLOCK_SIZE;
+#if HOST_HAVE_MBEDTLS
+            if (mbedtls) {
+                size_t olen;
+                mbedtls_base64_encode((unsigned char *)dst, BLOCK_SIZE * 2, &olen, src + pos, n);
+                continue;
+            }
+#endif
+            base64_stream_encode(&b64, dst, src + pos, n);
+        }
+        base64_stream_finish(&b64, dst);
+    }
+    return (double)len * rounds / (esp_timer_get_time() - start + 1);
+}
+
+static void test_throughput(void)
+{
+    //* 10 s of 16 kHz audio
+    int len = 320 * 1024;
+    uint8_t *src = malloc(len);
+    char *dst = malloc(BLOCK_SIZE * 2);
+    for (int i = 0; i < len; i++) {
+        src[i] = rand();
+    }
+    //* the output of a whole block is the same, the blocks are multiples of 3
+    base64_stream_t b64;
+    base64_stream_reset(&b64);
+    int n = base64_stream_encode(&b64, dst, src, BLOCK_SIZE);
+#if HOST_HAVE_MBEDTLS
+    char *ref = malloc(BLOCK_SIZE * 2);
+    size_t olen;
+    mbedtls_base64_encode((unsigned char *)ref, BLOCK_SIZE * 2, &olen, src, BLOCK_SIZE);
+    TEST_ASSERT_EQUAL_INT(olen, n);
+    TEST_ASSERT_EQUAL_MEMORY(ref, dst, n);
+    free(ref);
+    double mbedtls_mbps = _encode_mbps(src, len, 50, true, dst);
+#endif
+    double mbps = _encode_mbps(src, len, 50, false, dst);
+#if HOST_HAVE_MBEDTLS
+    printf("%d kB in %d byte blocks: base64_stream %.1f MB/s, mbedtls_base64_encode %.1f MB/s on this host\n",
+           len / 1024, BLOCK_SIZE, mbps, mbedtls_mbps);
+#else
+    printf("%d kB in %d byte blocks: base64_stream %.1f MB/s on this host, no mbedTLS to compare with\n",
+           len / 1024, BLOCK_SIZE, mbps);
+#endif
+    free(src);
+    free(dst);
+}
+
+int main(void)
+{
+    RUN_TEST(test_rfc4648_vectors);
+    RUN_TEST(test_tail_carry_round_trip);
+    RUN_TEST(test_reset_drops_tail);
+    RUN_TEST(test_throughput);
+    return TEST_EXIT();
+}
@@ -0,0 +1,176 @@
+#include <string.h>
+#include "sdkconfig.h"
+#include "http_conn.h"
+#include "freertos/task.h"
+#include "host_shim.h"
+#include "host_test.h"
+
+#define URL_A   "https://a.example.com/chat?x=1"
+#define URL_A2  "https://a.example.com/token"
+#define URL_B   "https://b.example.com:8443/tts"
+
+static const char body[] = "{\"text\":\"hello\"}";
+
+/*
+ * One POST the way the modules do it, reads the whole answer so the connection is kept
+ */
+static esp_err_t _post(const char *url)
+{
+    esp_http_client_handle_t client = http_conn_acquire(url, portMAX_DELAY);
+    if (client == NULL) {
+        return ESP_ERR_TIMEOUT;
+    }
+    esp_http_client_set_method(client, HTTP_METHOD_POST);
+    esp_err_t err = http_conn_request(client, body, strlen(body));
+    bool keep_alive = false;
+    if (err == ESP_OK) {
+        char answer[32];
+        while (esp_http_client_read(client, answer, sizeof(answer)) > 0);
+        keep_alive = esp_http_client_is_complete_data_received(client);
+    }
+    http_conn_release(client, keep_alive);
+    return err;
+}
+
+/*
+ * Starts every test without open connections
+ */
+static void _reset(void)
+{
+    const char *urls[] = { URL_A, URL_B };
+    for (int i = 0; i < 2; i++) {
+        http_conn_release(http_conn_acquire(urls[i], portMAX_DELAY), false);
+    }
+    host_http_reset(200, "ok");
+}
+
+static void test_kept_connection_skips_handshake(void)
+{
+    _reset();
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A2));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    //* another host gets its own connection
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_B));
+    host_http_stats_t stats = host_http_stats();
+    TEST_ASSERT_EQUAL_INT(2, stats.handshakes);
+    TEST_ASSERT_EQUAL_INT(4, stats.requests);
+}
+
+static void test_dropped_idle_connection_retried(void)
+{
+    _reset();
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    //* the body goes out on the dead socket, the EOF at the header fetch is what shows it
+    host_http_drop_idle();
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    host_http_stats_t stats = host_http_stats();
+    TEST_ASSERT_EQUAL_INT(2, stats.handshakes);
+    TEST_ASSERT_EQUAL_INT(2, stats.requests);
+    TEST_ASSERT_EQUAL_INT(1, stats.stale);
+}
+
+static void test_idle_connection_reopened(void)
+{
+    _reset();
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    //* past the idle limit the connection is not trusted, whether the server dropped it or not
+    host_http_drop_idle();
+    vTaskDelay(pdMS_TO_TICKS(CONFIG_HTTP_CONN_IDLE_MS + 50));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    host_http_stats_t stats = host_http_stats();
+    TEST_ASSERT_EQUAL_INT(2, stats.handshakes);
+    TEST_ASSERT_EQUAL_INT(2, stats.requests);
+    TEST_ASSERT_EQUAL_INT(0, stats.stale);
+}
+
+static void test_write_failure_retried(void)
+{
+    _reset();
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    host_http_fail_next(HOST_HTTP_FAIL_WRITE);
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    host_http_stats_t stats = host_http_stats();
+    TEST_ASSERT_EQUAL_INT(2, stats.handshakes);
+    TEST_ASSERT_EQUAL_INT(2, stats.requests);
+}
+
+static void test_no_second_post_after_body_sent(void)
+{
+    _reset();
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    //* the server got the request and started to answer, the connection broke
+    host_http_fail_next(HOST_HTTP_FAIL_FETCH);
+    TEST_ASSERT_EQUAL_INT(ESP_FAIL, _post(URL_A));
+    host_http_stats_t stats = host_http_stats();
+    TEST_ASSERT_EQUAL_INT(1, stats.handshakes);
+    TEST_ASSERT_EQUAL_INT(2, stats.requests);
+    //* the next request opens a fresh connection
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    TEST_ASSERT_EQUAL_INT(2, host_http_stats().handshakes);
+}
+
+static void test_fresh_connection_not_retried(void)
+{
+    _reset();
+    host_http_fail_next(HOST_HTTP_FAIL_OPEN);
+    TEST_ASSERT_EQUAL_INT(ESP_FAIL, _post(URL_A));
+    host_http_fail_next(HOST_HTTP_FAIL_WRITE);
+    TEST_ASSERT_EQUAL_INT(ESP_FAIL, _post(URL_A));
+    host_http_stats_t stats = host_http_stats();
+    TEST_ASSERT_EQUAL_INT(1, stats.handshakes);
+    TEST_ASSERT_EQUAL_INT(0, stats.requests);
+}
+
+static void test_prewarm_takes_the_handshake(void)
+{
+    _reset();
+    TEST_ASSERT_EQUAL_INT(ESP_OK, http_conn_prewarm(URL_A2));
+    for (int i = 0; i < 100 && host_http_stats().requests == 0; i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    //* the prewarm task gives the client back right after its request
+    esp_http_client_handle_t client = http_conn_acquire(URL_A, portMAX_DELAY);
+    http_conn_release(client, true);
+    host_http_stats_t stats = host_http_stats();
+    TEST_ASSERT_EQUAL_INT(1, stats.handshakes);
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    TEST_ASSERT_EQUAL_INT(1, host_http_stats().handshakes);
+    //* nothing to do on a connected host
+    TEST_ASSERT_EQUAL_INT(ESP_OK, http_conn_prewarm(URL_A2));
+}
+
+static void test_prewarm_refreshes_idle_connection(void)
+{
+    _reset();
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    host_http_drop_idle();
+    vTaskDelay(pdMS_TO_TICKS(CONFIG_HTTP_CONN_IDLE_MS + 50));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, http_conn_prewarm(URL_A2));
+    for (int i = 0; i < 100 && host_http_stats().requests < 2; i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    http_conn_release(http_conn_acquire(URL_A, portMAX_DELAY), true);
+    TEST_ASSERT_EQUAL_INT(2, host_http_stats().handshakes);
+    //* the request goes out on the connection the prewarm opened
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _post(URL_A));
+    host_http_stats_t stats = host_http_stats();
+    TEST_ASSERT_EQUAL_INT(2, stats.handshakes);
+    TEST_ASSERT_EQUAL_INT(0, stats.stale);
+}
+
+int main(void)
+{
+    if (http_conn_init() != ESP_OK) {
+        return 1;
+    }
+    RUN_TEST(test_kept_connection_skips_handshake);
+    RUN_TEST(test_dropped_idle_connection_retried);
+    RUN_TEST(test_idle_connection_reopened);
+    RUN_TEST(test_write_failure_retried);
+    RUN_TEST(test_no_second_post_after_body_sent);
+    RUN_TEST(test_fresh_connection_not_retried);
+    RUN_TEST(test_prewarm_takes_the_handshake);
+    RUN_TEST(test_prewarm_refreshes_idle_connection);
+    return TEST_EXIT();
+}
@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <string.h>
+#include "jitter_buffer.h"
+#include "esp_http_client.h"
+#include "esp_timer.h"
+#include "host_shim.h"
+#include "host_test.h"
+
+// 32 kbit/s MP3 of the TTS answers
+#define AUDIO_RATE      (4000)
+#define ROUND_MS        (JITTER_BUFFER_HORIZON_MS)
+#define TICK_MS         (10)
+#define CHUNK_BYTES     (512)
+
+// What google_tts reads at a time, raw PCM at 16 kHz (aue=4)
+#define TTS_READ_SIZE   (2048)
+#define PCM_RATE        (16000 * 2)
+// Input the MP3 decoder takes in before its first frame, the Helix main buffer
+#define MP3_PRIME_BYTES (1940)
+
+static jitter_buffer_t _init(void)
+{
+    jitter_buffer_cfg_t cfg = DEFAULT_JITTER_BUFFER_CONFIG();
+    jitter_buffer_t jb;
+    jitter_buffer_init(&jb, "test", &cfg);
+    return jb;
+}
+
+static void test_grows_on_underrun(void)
+{
+    jitter_buffer_t jb = _init();
+    TEST_ASSERT_EQUAL_INT(JITTER_BUFFER_MIN_MS, jb.target_ms);
+    jitter_buffer_underrun(&jb);
+    TEST_ASSERT_EQUAL_INT(JITTER_BUFFER_MIN_MS + JITTER_BUFFER_STEP_MS, jitter_buffer_round_end(&jb, AUDIO_RATE));
+    //* one step per round however many glitches it had
+    jitter_buffer_underrun(&jb);
+    jitter_buffer_overrun(&jb);
+    TEST_ASSERT_EQUAL_INT(JITTER_BUFFER_MIN_MS + 2 * JITTER_BUFFER_STEP_MS, jitter_buffer_round_end(&jb, AUDIO_RATE));
+    for (int i = 0; i < 20; i++) {
+        jitter_buffer_underrun(&jb);
+        jitter_buffer_round_end(&jb, AUDIO_RATE);
+    }
+    TEST_ASSERT_EQUAL_INT(JITTER_BUFFER_MAX_MS, jb.target_ms);
+    TEST_ASSERT_EQUAL_INT(22, jb.underruns);
+    TEST_ASSERT_EQUAL_INT(1, jb.overruns);
+    TEST_ASSERT_EQUAL_INT(JITTER_BUFFER_MAX_MS * AUDIO_RATE / 1000, jitter_buffer_target_bytes(&jb, AUDIO_RATE));
+}
+
+static void test_shrinks_after_clean_rounds(void)
+{
+    jitter_buffer_t jb = _init();
+    jitter_buffer_underrun(&jb);
+    jitter_buffer_round_end(&jb, AUDIO_RATE);
+    jitter_buffer_underrun(&jb);
+    jitter_buffer_round_end(&jb, AUDIO_RATE);
+    int grown = jb.target_ms;
+    for (int i = 1; i < JITTER_BUFFER_SHRINK_AFTER; i++) {
+        TEST_ASSERT_EQUAL_INT(grown, jitter_buffer_round_end(&jb, AUDIO_RATE));
+    }
+    TEST_ASSERT_EQUAL_INT(grown - JITTER_BUFFER_STEP_MS / 2, jitter_buffer_round_end(&jb, AUDIO_RATE));
+    //* a glitch starts the count again
+    jitter_buffer_round_end(&jb, AUDIO_RATE);
+    jitter_buffer_underrun(&jb);
+    TEST_ASSERT_EQUAL_INT(grown + JITTER_BUFFER_STEP_MS / 2, jitter_buffer_round_end(&jb, AUDIO_RATE));
+    for (int i = 0; i < 100; i++) {
+        jitter_buffer_round_end(&jb, AUDIO_RATE);
+    }
+    TEST_ASSERT_EQUAL_INT(JITTER_BUFFER_MIN_MS, jb.target_ms);
+}
+
+static void test_follows_throughput_deficit(void)
+{
+    jitter_buffer_t jb = _init();
+    //* a network at 75% of the audio rate is a quarter of the round behind
+    jitter_buffer_measure(&jb, AUDIO_RATE * 3 / 4, 1000000);
+    TEST_ASSERT_EQUAL_INT(AUDIO_RATE * 3 / 4, jb.throughput);
+    TEST_ASSERT_EQUAL_INT(JITTER_BUFFER_HORIZON_MS / 4, jitter_buffer_round_end(&jb, AUDIO_RATE));
+    //* the moving average takes a few transfers to follow a drop to half
+    for (int i = 0; i < 40; i++) {
+        jitter_buffer_measure(&jb, AUDIO_RATE / 2, 1000000);
+    }
+    //* the integer average settles a byte per second off
+    TEST_ASSERT(abs(jitter_buffer_round_end(&jb, AUDIO_RATE) - JITTER_BUFFER_HORIZON_MS / 2) <= 2);
+    //* faster than the audio, nothing to cover
+    for (int i = 0; i < 40; i++) {
+        jitter_buffer_measure(&jb, AUDIO_RATE * 4, 1000000);
+    }
+    for (int i = 0; i < 100; i++) {
+        jitter_buffer_round_end(&jb, AUDIO_RATE);
+    }
+    TEST_ASSERT_EQUAL_INT(JITTER_BUFFER_MIN_MS, jb.target_ms);
+    //* transfers too short to time say nothing
+    int throughput = jb.throughput;
+    jitter_buffer_measure(&jb, 100, 10);
+    jitter_buffer_measure(&jb, 0, 100000);
+    TEST_ASSERT_EQUAL_INT(throughput, jb.throughput);
+}
+
+/*
+ * A network throttled to `bytes_per_s`, stalling `stall_ms` at random about every `stall_every_ms`
+ */
+typedef struct {
+    int         bytes_per_s;
+    int         stall_ms;
+    int         stall_every_ms;
+    uint32_t    seed;
+} link_t;
+
+static int _rand(link_t *link, int n)
+{
+    link->seed = link->seed * 1664525u + 1013904223u;
+    return (link->seed >> 8) % n;
+}
+
+/*
+ * One answer of ROUND_MS streamed over the link and played once `target` bytes are buffered, playback
+ * that runs dry waits for the target again. Returns the times it ran dry.
+ */
+static int _play_round(jitter_buffer_t *jb, link_t *link, int target_bytes)
+{
+    int total = AUDIO_RATE * ROUND_MS / 1000;
+    int received = 0, played = 0, buffered = 0, underruns = 0;
+    bool playing = false;
+    //* time left in the transfer of the current chunk, and of a stall
+    int chunk_left_us = CHUNK_BYTES * 1000000LL / link->bytes_per_s;
+    int chunk_us = 0;
+    int stall_left_ms = 0;
+    for (int t = 0; played < total; t += TICK_MS) {
+        if (received < total) {
+            if (stall_left_ms > 0) {
+                stall_left_ms -= TICK_MS;
+                chunk_us += TICK_MS * 1000;
+            } else if (_rand(link, link->stall_every_ms / TICK_MS) == 0) {
+                stall_left_ms = link->stall_ms;
+            } else {
+                chunk_left_us -= TICK_MS * 1000;
+                chunk_us += TICK_MS * 1000;
+                if (chunk_left_us <= 0) {
+                    int n = total - received < CHUNK_BYTES ? total - received : CHUNK_BYTES;
+                    received += n;
+                    buffered += n;
+                    jitter_buffer_measure(jb, n, chunk_us);
+                    chunk_left_us += CHUNK_BYTES * 1000000LL / link->bytes_per_s;
+                    chunk_us = 0;
+                }
+            }
+        }
+        if (!playing && (buffered >= target_bytes || received == total)) {
+            playing = true;
+        }
+        if (playing) {
+            int n = AUDIO_RATE * TICK_MS / 1000;
+            n = n < buffered ? n : buffered;
+            buffered -= n;
+            played += n;
+            if (buffered == 0 && played < total) {
+                playing = false;
+                underruns++;
+                jitter_buffer_underrun(jb);
+            }
+        }
+    }
+    return underruns;
+}
+
+/*
+ * Underruns of `rounds` answers with the adaptive buffer, and with a fixed one of the minimum size
+ */
+static void _simulate(link_t link, int rounds, int *adaptive, int *fixed, int *target_ms)
+{
+    jitter_buffer_t jb = _init();
+    jitter_buffer_t ref = _init();
+    link_t ref_link = link;
+    *adaptive = 0;
+    *fixed = 0;
+    for (int r = 0; r < rounds; r++) {
+        *adaptive += _play_round(&jb, &link, jitter_buffer_target_bytes(&jb, AUDIO_RATE));
+        jitter_buffer_round_end(&jb, AUDIO_RATE);
+        *fixed += _play_round(&ref, &ref_link, jitter_buffer_target_bytes(&ref, AUDIO_RATE));
+        ref.glitched = false;
+    }
+    *target_ms = jb.target_ms;
+}
+
+static void test_throttled_network(void)
+{
+    static const struct {
+        const char  *name;
+        link_t      link;
+    } links[] = {
+        { "80% of the audio rate", { AUDIO_RATE * 8 / 10, 0, 1000000, 1 } },
+        { "1.5x, 800 ms stalls", { AUDIO_RATE * 3 / 2, 800, 1500, 2 } },
+        { "1.2x, 400 ms stalls", { AUDIO_RATE * 12 / 10, 400, 1000, 3 } },
+    };
+    for (int i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+        int adaptive, fixed, target_ms;
+        _simulate(links[i].link, 20, &adaptive, &fixed, &target_ms);
+        int first_adaptive, first_fixed, unused;
+        _simulate(links[i].link, 2, &first_adaptive, &first_fixed, &unused);
+        printf("%s: %d underruns in 20 answers, %d in the last 18, target %d ms; %d and %d with a fixed %d ms buffer\n",
+               links[i].name, adaptive, adaptive - first_adaptive, target_ms, fixed, fixed - first_fixed,
+               JITTER_BUFFER_MIN_MS);
+        //* the first answers teach it, after that it glitches at most half as often
+        TEST_ASSERT((adaptive - first_adaptive) * 2 <= fixed - first_fixed);
+    }
+    //* a network that recovers gives the delay back
+    jitter_buffer_t jb = _init();
+    link_t slow = { AUDIO_RATE * 7 / 10, 0, 1000000, 4 };
+    link_t fast = { AUDIO_RATE * 4, 0, 1000000, 5 };
+    for (int r = 0; r < 5; r++) {
+        _play_round(&jb, &slow, jitter_buffer_target_bytes(&jb, AUDIO_RATE));
+        jitter_buffer_round_end(&jb, AUDIO_RATE);
+    }
+    int slow_target = jb.target_ms;
+    for (int r = 0; r < 60; r++) {
+        _play_round(&jb, &fast, jitter_buffer_target_bytes(&jb, AUDIO_RATE));
+        jitter_buffer_round_end(&jb, AUDIO_RATE);
+    }
+    printf("recovery: %d ms on the slow link, %d ms after 60 answers on a fast one\n", slow_target, jb.target_ms);
+    TEST_ASSERT(slow_target >= JITTER_BUFFER_HORIZON_MS * 3 / 10);
+    TEST_ASSERT_EQUAL_INT(JITTER_BUFFER_MIN_MS, jb.target_ms);
+}
+
+/*
+ * Time from the request of an answer at `bytes_per_s` on a kept connection to its first sample going to
+ * I2S: the playback holds back the jitter buffer target, a decoder that needs `prime_bytes` waits longer
+ */
+static int _first_sample_ms(jitter_buffer_t *jb, esp_http_client_handle_t client, int bytes_per_s, int prime_bytes)
+{
+    static char buffer[TTS_READ_SIZE];
+    int hold = jitter_buffer_target_bytes(jb, bytes_per_s);
+    hold = hold > prime_bytes ? hold : prime_bytes;
+    int64_t start = esp_timer_get_time();
+    const char *request = "lan=zh&cuid=ESP32&ctp=1&tok=token&tex=text";
+    if (esp_http_client_open(client, strlen(request)) != ESP_OK
+            || esp_http_client_write(client, request, strlen(request)) < 0
+            || esp_http_client_fetch_headers(client) < 0) {
+        return -1;
+    }
+    int got = 0;
+    while (got < hold) {
+        int64_t read_start = esp_timer_get_time();
+        int n = esp_http_client_read(client, buffer, sizeof(buffer));
+        if (n <= 0) {
+            return -1;
+        }
+        jitter_buffer_measure(jb, n, esp_timer_get_time() - read_start);
+        got += n;
+    }
+    int ms = (esp_timer_get_time() - start) / 1000;
+    jitter_buffer_round_end(jb, bytes_per_s);
+    return ms;
+}
+
+/*
+ * Time to the first sample of MP3 and of raw PCM answers on a link of `rtt_ms` and `kbps`, once the
+ * jitter buffer has measured it. Returns the PCM time less the MP3 one, the decoding itself left out.
+ */
+static int _first_sample(int rtt_ms, int kbps)
+{
+    static const struct {
+        const char  *name;
+        int         bytes_per_s;
+        int         prime_bytes;
+    } formats[] = {
+        { "MP3", AUDIO_RATE, MP3_PRIME_BYTES },
+        { "PCM", PCM_RATE, 0 },
+    };
+    int ms[2] = { 0 };
+    printf("link of %d ms RTT and %d kbit/s:", rtt_ms, kbps);
+    for (int f = 0; f < 2; f++) {
+        //* a few seconds of answer, more than is ever held back
+        int len = formats[f].bytes_per_s * 3;
+        char *body = malloc(len + 1);
+        memset(body, 'U', len);
+        body[len] = 0;
+        host_http_set_link(0, 0);
+        host_http_reset(200, body);
+        free(body);
+        esp_http_client_config_t config = {
+            .url = "http://tsn.baidu.com/text2audio",
+        };
+        esp_http_client_handle_t client = esp_http_client_init(&config);
+        jitter_buffer_t jb = _init();
+        //* the connection is kept, and the first answers teach the buffer the link
+        esp_http_client_open(client, 0);
+        host_http_set_link(rtt_ms, kbps);
+        for (int answer = 0; answer < 3 && ms[f] >= 0; answer++) {
+            ms[f] = _first_sample_ms(&jb, client, formats[f].bytes_per_s, formats[f].prime_bytes);
+        }
+        esp_http_client_cleanup(client);
+        printf(" %s %d ms (target %d ms)%s", formats[f].name, ms[f], jb.target_ms, f == 0 ? "," : "\n");
+    }
+    host_http_set_link(0, 0);
+    return ms[0] < 0 || ms[1] < 0 ? INT32_MIN : ms[1] - ms[0];
+}
+
+static void test_time_to_first_sample(void)
+{
+    //* at the automatic PCM threshold, twice its byte rate, and on a fast WLAN
+    int at_threshold = _first_sample(30, PCM_RATE * 2 * 8 / 1000);
+    int fast = _first_sample(30, 8000);
+    TEST_ASSERT(at_threshold != INT32_MIN && fast != INT32_MIN);
+    //* PCM holds back the same time of audio in more bytes, the gap closes with the link speed
+    TEST_ASSERT(fast < at_threshold);
+}
+
+/*
+ * test_jitter_buffer <rtt_ms> <kbps>...: time to the first sample of MP3 and of PCM answers on each link
+ */
+static int _bench(int argc, char **argv)
+{
+    int rtt_ms = atoi(argv[1]);
+    for (int i = 2; i < argc; i++) {
+        _first_sample(rtt_ms, atoi(argv[i]));
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2) {
+        return _bench(argc, argv);
+    }
+    RUN_TEST(test_grows_on_underrun);
+    RUN_TEST(test_shrinks_after_clean_rounds);
+    RUN_TEST(test_follows_throughput_deficit);
+    RUN_TEST(test_throttled_network);
+    RUN_TEST(test_time_to_first_sample);
+    return TEST_EXIT();
+}
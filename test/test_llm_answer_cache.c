@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <string.h>
+#include "llm_answer_cache.h"
+#include "host_shim.h"
+#include "host_test.h"
+
+#define CACHE_SLOTS     (16)
+#define CACHE_TTL_S     (3600)
+
+static llm_answer_cache_handle_t _open(void)
+{
+    return llm_answer_cache_init("llm_cache", CACHE_TTL_S);
+}
+
+/*
+ * One question the way llm_ask asks it: normalize, look up, and store the server's answer on a miss
+ */
+static bool _ask(llm_answer_cache_handle_t cache, const char *text)
+{
+    char key[LLM_ANSWER_CACHE_QUESTION_MAX];
+    if (llm_answer_cache_normalize(text, key, sizeof(key)) <= 0) {
+        return false;
+    }
+    int len;
+    int slot = llm_answer_cache_lookup(cache, key, &len);
+    if (slot >= 0) {
+        char answer[256];
+        return len < sizeof(answer) && llm_answer_cache_read(cache, slot, answer) == ESP_OK;
+    }
+    char answer[160];
+    snprintf(answer, sizeof(answer), "answer to %s", key);
+    llm_answer_cache_record_miss(cache, 1500 * 1000);
+    llm_answer_cache_store(cache, key, answer, strlen(answer));
+    return false;
+}
+
+static void test_normalize(void)
+{
+    char a[LLM_ANSWER_CACHE_QUESTION_MAX], b[LLM_ANSWER_CACHE_QUESTION_MAX];
+    llm_answer_cache_normalize("今天天气？", a, sizeof(a));
+    llm_answer_cache_normalize(" 今天 天气", b, sizeof(b));
+    TEST_ASSERT_EQUAL_STRING(a, b);
+    llm_answer_cache_normalize("What's  the WEATHER?", a, sizeof(a));
+    TEST_ASSERT_EQUAL_STRING("whats the weather", a);
+    //* full-width letters and digits
+    llm_answer_cache_normalize("\xef\xbc\xa1\xef\xbc\xa9 \xef\xbc\x91\xef\xbc\x92", a, sizeof(a));
+    TEST_ASSERT_EQUAL_STRING("ai 12", a);
+    TEST_ASSERT(llm_answer_cache_normalize("？！。", a, sizeof(a)) <= 0);
+}
+
+static void test_store_survives_reopen(void)
+{
+    llm_answer_cache_handle_t cache = _open();
+    TEST_ASSERT(cache != NULL);
+    int len;
+    TEST_ASSERT_EQUAL_INT(-1, llm_answer_cache_lookup(cache, "你好", &len));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, llm_answer_cache_store(cache, "你好", "你好呀", strlen("你好呀")));
+    llm_answer_cache_deinit(cache);
+
+    //* the index is rebuilt from the slot headers in flash
+    cache = _open();
+    int slot = llm_answer_cache_lookup(cache, "你好", &len);
+    TEST_ASSERT(slot >= 0);
+    char answer[32] = { 0 };
+    TEST_ASSERT_EQUAL_INT(ESP_OK, llm_answer_cache_read(cache, slot, answer));
+    TEST_ASSERT_EQUAL_STRING("你好呀", answer);
+    //* a stored answer is replaced in place
+    TEST_ASSERT_EQUAL_INT(ESP_OK, llm_answer_cache_store(cache, "你好", "hi", 2));
+    TEST_ASSERT_EQUAL_INT(slot, llm_answer_cache_lookup(cache, "你好", &len));
+    TEST_ASSERT_EQUAL_INT(2, len);
+    TEST_ASSERT_EQUAL_INT(ESP_ERR_INVALID_SIZE, llm_answer_cache_store(cache, "", "x", 1));
+    llm_answer_cache_deinit(cache);
+}
+
+/*
+ * What a toy hears over a day, the same few questions in slightly different words
+ */
+static const char *query_log[] = {
+    "今天天气怎么样？", "讲个故事", "今天天气怎么样", "1加1等于几", "讲个故事。",
+    "你叫什么名字", "今天 天气怎么样？", "What is the moon?", "what is the moon", "讲个笑话",
+    "1加1等于几？", "你叫什么名字？", "讲个故事！", "WHAT IS THE MOON", "唱首歌",
+};
+
+static void test_replayed_query_log(void)
+{
+    //* a freshly erased partition
+    host_partition_add("llm_cache", CACHE_SLOTS * LLM_ANSWER_CACHE_SLOT_SIZE);
+    llm_answer_cache_handle_t cache = _open();
+    int n = sizeof(query_log) / sizeof(query_log[0]);
+    int hits = 0;
+    for (int i = 0; i < n; i++) {
+        hits += _ask(cache, query_log[i]) ? 1 : 0;
+    }
+    llm_answer_cache_stats_t stats;
+    llm_answer_cache_get_stats(cache, &stats);
+    printf("query log: %d of %d answered from the cache\n", hits, n);
+    //* 7 different questions, every repeat is a hit
+    TEST_ASSERT_EQUAL_INT(8, hits);
+    TEST_ASSERT_EQUAL_INT(n, stats.lookups);
+    TEST_ASSERT_EQUAL_INT(hits, stats.hits);
+    TEST_ASSERT_EQUAL_INT(n - hits, stats.stores);
+    llm_answer_cache_deinit(cache);
+}
+
+/*
+ * test_llm_answer_cache <log.txt>: replays a log of recognized questions, one per line,
+ * with an empty cache and reports the hit rate and the round trips it saves
+ */
+static int _bench(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 1;
+    }
+    llm_answer_cache_handle_t cache = _open();
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        _ask(cache, line);
+    }
+    fclose(f);
+    llm_answer_cache_stats_t s;
+    llm_answer_cache_get_stats(cache, &s);
+    printf("%s: %d of %d questions from the cache (%d%%), %d stored, %d round trips saved\n", path,
+           s.hits, s.lookups, s.lookups ? s.hits * 100 / s.lookups : 0, s.stores, s.hits);
+    llm_answer_cache_deinit(cache);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    host_partition_add("llm_cache", CACHE_SLOTS * LLM_ANSWER_CACHE_SLOT_SIZE);
+    if (argc > 1) {
+        return _bench(argv[1]);
+    }
+    RUN_TEST(test_normalize);
+    RUN_TEST(test_store_survives_reopen);
+    RUN_TEST(test_replayed_query_log);
+    return TEST_EXIT();
+}
@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+#include "llm_ask.h"
+#include "esp_timer.h"
+#include "host_shim.h"
+#include "host_test.h"
+
+#define ANSWERS_SIZE    (4096)
+#define WAIT_MS         (5000)
+
+static char answers[ANSWERS_SIZE];
+static int answer_num;
+
+static void _on_result(llm_ask_handle_t ask)
+{
+    host_critical_enter();
+    int len = strlen(answers);
+    snprintf(answers + len, sizeof(answers) - len, "%s%.*s", len ? "|" : "", ask->answer_len, ask->answer);
+    answer_num++;
+    host_critical_exit();
+}
+
+/*
+ * An answer of `n` results "s0." to "s<n-1>.", the server's SSE stream
+ */
+static void _answer(int n)
+{
+    char *body = malloc(n * 80 + 1);
+    int len = 0;
+    for (int i = 0; i < n; i++) {
+        len += sprintf(body + len, "data: {\"sentence_id\":%d,\"is_end\":%s,\"result\":\"s%d.\"}\n\n", i,
+                       i == n - 1 ? "true" : "false", i);
+    }
+    host_http_reset(200, body);
+    free(body);
+    host_critical_enter();
+    answers[0] = 0;
+    answer_num = 0;
+    host_critical_exit();
+}
+
+static const char *_expected(int n)
+{
+    static char text[ANSWERS_SIZE];
+    int len = 0;
+    for (int i = 0; i < n; i++) {
+        len += sprintf(text + len, "%ss%d.", i ? "|" : "", i);
+    }
+    return text;
+}
+
+/*
+ * A link slow enough to act while a speculation runs, a result about every 50 ms
+ */
+static void _slow_link(void)
+{
+    host_http_set_link(0, 8);
+    host_http_set_read_max(50);
+}
+
+static llm_ask_handle_t _init(void)
+{
+    llm_ask_config_t config = {
+        .api_token = "token",
+        .on_respone = _on_result,
+        .speculate = true,
+    };
+    host_http_set_link(0, 0);
+    return llm_ask_init(&config);
+}
+
+/*
+ * Waits until the speculation is in `state` with at least `held` results kept back
+ */
+static bool _wait(llm_ask_handle_t ask, llm_speculation_state_t state, int held)
+{
+    for (int ms = 0; ms < WAIT_MS; ms += 5) {
+        xSemaphoreTake(ask->spec_lock, portMAX_DELAY);
+        bool done = ask->spec_state == state && ask->held_num >= held;
+        xSemaphoreGive(ask->spec_lock);
+        if (done) {
+            return true;
+        }
+        vTaskDelay(5);
+    }
+    return false;
+}
+
+/*
+ * The final question, the way the request task asks it
+ */
+static esp_err_t _ask(llm_ask_handle_t ask, const char *question)
+{
+    if (llm_ask_set_question(ask, question) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    return llm_post_response(ask);
+}
+
+static int _write_history(void *user_data, const char *data, int len)
+{
+    strncat((char *)user_data, data, len);
+    return 0;
+}
+
+static const char *_history(llm_ask_handle_t ask)
+{
+    static char text[ANSWERS_SIZE];
+    text[0] = 0;
+    llm_context_write_messages(&ask->context, _write_history, text);
+    return text;
+}
+
+static void test_done_speculation_adopted(void)
+{
+    llm_ask_handle_t ask = _init();
+    _answer(4);
+    llm_ask_speculate(ask, "What time is it");
+    TEST_ASSERT(_wait(ask, LLM_SPECULATION_DONE, 4));
+    //* kept back until the final text agrees
+    TEST_ASSERT_EQUAL_INT(0, answer_num);
+    //* the same question once normalized
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _ask(ask, "what time is it?"));
+    TEST_ASSERT_EQUAL_STRING(_expected(4), answers);
+    TEST_ASSERT_EQUAL_INT(1, host_http_stats().requests);
+    TEST_ASSERT(strstr(_history(ask), "s3.") != NULL);
+    llm_ask_uninit(ask);
+}
+
+static void test_running_speculation_adopted(void)
+{
+    llm_ask_handle_t ask = _init();
+    _answer(8);
+    _slow_link();
+    llm_ask_speculate(ask, "What time is it");
+    TEST_ASSERT(_wait(ask, LLM_SPECULATION_RUNNING, 2));
+    //* the held results come first, the rest as they arrive
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _ask(ask, "What time is it"));
+    TEST_ASSERT_EQUAL_STRING(_expected(8), answers);
+    TEST_ASSERT_EQUAL_INT(1, host_http_stats().requests);
+    llm_ask_uninit(ask);
+}
+
+static void test_changed_text_cancels(void)
+{
+    llm_ask_handle_t ask = _init();
+    _answer(8);
+    _slow_link();
+    //* a newer partial replaces the running speculation
+    llm_ask_speculate(ask, "What time is it");
+    TEST_ASSERT(_wait(ask, LLM_SPECULATION_RUNNING, 1));
+    llm_ask_speculate(ask, "What day is it");
+    TEST_ASSERT(_wait(ask, LLM_SPECULATION_DONE, 8));
+    TEST_ASSERT_EQUAL_INT(2, host_http_stats().requests);
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _ask(ask, "What day is it"));
+    TEST_ASSERT_EQUAL_INT(2, host_http_stats().requests);
+    TEST_ASSERT_EQUAL_STRING(_expected(8), answers);
+    TEST_ASSERT(strstr(_history(ask), "What day is it") != NULL);
+    TEST_ASSERT(strstr(_history(ask), "What time is it") == NULL);
+
+    //* a final text other than the speculated one
+    _answer(8);
+    _slow_link();
+    llm_ask_speculate(ask, "Tell me a joke");
+    TEST_ASSERT(_wait(ask, LLM_SPECULATION_RUNNING, 1));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _ask(ask, "Tell me a story"));
+    TEST_ASSERT_EQUAL_INT(2, host_http_stats().requests);
+    TEST_ASSERT_EQUAL_STRING(_expected(8), answers);
+    TEST_ASSERT(strstr(_history(ask), "Tell me a story") != NULL);
+    TEST_ASSERT(strstr(_history(ask), "joke") == NULL);
+    llm_ask_uninit(ask);
+}
+
+static void test_held_overflow_asks_again(void)
+{
+    llm_ask_handle_t ask = _init();
+    int n = LLM_ASK_SPECULATE_HELD_MAX + 4;
+    _answer(n);
+    llm_ask_speculate(ask, "Count to forty");
+    TEST_ASSERT(_wait(ask, LLM_SPECULATION_DONE, LLM_ASK_SPECULATE_HELD_MAX));
+    TEST_ASSERT(ask->spec_lost);
+    //* the results past the last one kept are gone, the question is asked again
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _ask(ask, "Count to forty"));
+    TEST_ASSERT_EQUAL_INT(2, host_http_stats().requests);
+    TEST_ASSERT_EQUAL_STRING(_expected(n), answers);
+    //* one turn in the history, the dropped speculation left none
+    const char *history = _history(ask);
+    TEST_ASSERT(strstr(history, "Count to forty") == strrchr(history, 'C'));
+    llm_ask_uninit(ask);
+}
+
+static void test_abort_drops_speculation(void)
+{
+    llm_ask_handle_t ask = _init();
+    _answer(8);
+    _slow_link();
+    llm_ask_speculate(ask, "What time is it");
+    TEST_ASSERT(_wait(ask, LLM_SPECULATION_RUNNING, 1));
+    //* a new round, the speculation of the last one stops with half an answer
+    llm_ask_abort(ask);
+    TEST_ASSERT(_wait(ask, LLM_SPECULATION_IDLE, 0));
+    TEST_ASSERT_EQUAL_INT(0, answer_num);
+    //* the same text is speculated on again in the new round
+    llm_ask_speculate(ask, "What time is it");
+    TEST_ASSERT(_wait(ask, LLM_SPECULATION_DONE, 8));
+    TEST_ASSERT_EQUAL_INT(2, host_http_stats().requests);
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _ask(ask, "What time is it"));
+    TEST_ASSERT_EQUAL_INT(2, host_http_stats().requests);
+    TEST_ASSERT_EQUAL_STRING(_expected(8), answers);
+
+    //* an abort after the final text, the adopted speculation stops handing results over
+    _answer(8);
+    _slow_link();
+    llm_ask_speculate(ask, "What day is it");
+    TEST_ASSERT(_wait(ask, LLM_SPECULATION_RUNNING, 1));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, llm_ask_set_question(ask, "What day is it"));
+    llm_ask_abort(ask);
+    llm_post_response(ask);
+    TEST_ASSERT(answer_num < 8);
+    TEST_ASSERT(strstr(_history(ask), "What day is it") == NULL);
+    llm_ask_uninit(ask);
+}
+
+int main(void)
+{
+    RUN_TEST(test_done_speculation_adopted);
+    RUN_TEST(test_running_speculation_adopted);
+    RUN_TEST(test_changed_text_cancels);
+    RUN_TEST(test_held_overflow_asks_again);
+    RUN_TEST(test_abort_drops_speculation);
+    return TEST_EXIT();
+}
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+#include "llm_context.h"
+#include "host_test.h"
+
+typedef struct {
+    char    text[1024];
+    int     len;
+} messages_t;
+
+static int _collect(void *user_data, const char *data, int len)
+{
+    messages_t *m = (messages_t *)user_data;
+    if (m->len + len >= (int)sizeof(m->text)) {
+        return -1;
+    }
+    memcpy(m->text + m->len, data, len);
+    m->len += len;
+    m->text[m->len] = 0;
+    return len;
+}
+
+static void _turn(llm_context_t *ctx, const char *question, const char *answer)
+{
+    llm_context_begin_turn(ctx, question, strlen(question));
+    llm_context_append_answer(ctx, answer, strlen(answer));
+    llm_context_end_turn(ctx, true);
+}
+
+static void test_messages_escaped(void)
+{
+    llm_context_t ctx;
+    TEST_ASSERT_EQUAL_INT(ESP_OK, llm_context_init(&ctx, 512, 1000));
+    _turn(&ctx, "say \"hi\"", "hi\n");
+    llm_context_begin_turn(&ctx, "again", 5);
+    messages_t m = { 0 };
+    int len = llm_context_write_messages(&ctx, _collect, &m);
+    TEST_ASSERT_EQUAL_STRING("[{\"role\":\"user\",\"content\":\"say \\\"hi\\\"\"},"
+                             "{\"role\":\"assistant\",\"content\":\"hi\\n\"},"
+                             "{\"role\":\"user\",\"content\":\"again\"}]", m.text);
+    TEST_ASSERT_EQUAL_INT(m.len, len);
+    //* counting only gives the same length
+    TEST_ASSERT_EQUAL_INT(len, llm_context_write_messages(&ctx, NULL, NULL));
+    llm_context_deinit(&ctx);
+}
+
+static void test_oldest_turn_dropped(void)
+{
+    llm_context_t ctx;
+    //* room for two short turns and a question
+    TEST_ASSERT_EQUAL_INT(ESP_OK, llm_context_init(&ctx, 48, 1000));
+    _turn(&ctx, "q1", "a1-long-answer");
+    _turn(&ctx, "q2", "a2");
+    _turn(&ctx, "q3", "a3");
+    llm_context_begin_turn(&ctx, "q4", 2);
+    messages_t m = { 0 };
+    llm_context_write_messages(&ctx, _collect, &m);
+    TEST_ASSERT(strstr(m.text, "q1") == NULL);
+    TEST_ASSERT(strstr(m.text, "a1") == NULL);
+    //* whole pairs go, the array still starts with a question
+    TEST_ASSERT(strncmp(m.text, "[{\"role\":\"user\"", 15) == 0);
+    TEST_ASSERT(strstr(m.text, "\"q4\"}]") != NULL);
+    llm_context_deinit(&ctx);
+}
+
+static void test_failed_turn_forgotten(void)
+{
+    llm_context_t ctx;
+    TEST_ASSERT_EQUAL_INT(ESP_OK, llm_context_init(&ctx, 256, 1000));
+    _turn(&ctx, "q1", "a1");
+    llm_context_begin_turn(&ctx, "q2", 2);
+    llm_context_append_answer(&ctx, "half", 4);
+    llm_context_end_turn(&ctx, false);
+    llm_context_begin_turn(&ctx, "q3", 2);
+    messages_t m = { 0 };
+    llm_context_write_messages(&ctx, _collect, &m);
+    TEST_ASSERT(strstr(m.text, "q2") == NULL);
+    TEST_ASSERT(strstr(m.text, "half") == NULL);
+    TEST_ASSERT(strstr(m.text, "q1") != NULL);
+    llm_context_deinit(&ctx);
+}
+
+int main(void)
+{
+    RUN_TEST(test_messages_escaped);
+    RUN_TEST(test_oldest_turn_dropped);
+    RUN_TEST(test_failed_turn_forgotten);
+    return TEST_EXIT();
+}
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "llm_sse_parser.h"
+#include "esp_timer.h"
+#include "host_test.h"
+
+#define EVENTS_MAX  (8)
+// The read size of llm_ask
+#define READ_SIZE   (2048)
+
+typedef struct {
+    int             count;
+    llm_sse_event_t event[EVENTS_MAX];
+    char            result[EVENTS_MAX][128];
+    char            error_msg[EVENTS_MAX][64];
+} events_t;
+
+static void _on_event(const llm_sse_event_t *event, void *user_data)
+{
+    events_t *e = (events_t *)user_data;
+    if (e->count == EVENTS_MAX) {
+        return;
+    }
+    //* the strings live in the parser buffer only during the callback
+    e->event[e->count] = *event;
+    if (event->result) {
+        memcpy(e->result[e->count], event->result, event->result_len + 1);
+    }
+    if (event->error_msg) {
+        strcpy(e->error_msg[e->count], event->error_msg);
+    }
+    e->count++;
+}
+
+/*
+ * Feeds `stream` in pieces of `step` bytes, as the socket reads would deliver it
+ */
+static void _parse(const char *stream, int step, events_t *events)
+{
+    char buffer[256];
+    llm_sse_parser_t parser;
+    memset(events, 0, sizeof(events_t));
+    llm_sse_parser_init(&parser, buffer, sizeof(buffer), _on_event, events);
+    int remain = strlen(stream);
+    while (remain > 0) {
+        int available;
+        char *w = llm_sse_parser_get_write_ptr(&parser, &available);
+        int n = step < available ? step : available;
+        if (n > remain) {
+            n = remain;
+        }
+        memcpy(w, stream, n);
+        stream += n;
+        remain -= n;
+        llm_sse_parser_feed(&parser, n);
+    }
+    llm_sse_parser_finish(&parser);
+}
+
+static const char *stream =
+    "data: {\"id\":\"as-1\",\"sentence_id\":0,\"is_end\":false,\"result\":\"\\u4f60\\u597d \\\"q\\\"\\n\","
+    "\"skip\":[1,{\"a\":\"}\"}],\"usage\":{\"prompt_tokens\":2,\"completion_tokens\":3,\"total_tokens\":5}}\r\n"
+    "\r\n"
+    ": keep-alive comment\n"
+    "data: {\"sentence_id\":1,\"is_end\":true,\"result\":\"\xe5\x86\x8d\xe8\xa7\x81\xe3\x80\x82\"}\n"
+    "\n"
+    "{\"error_code\":110,\"error_msg\":\"Access token invalid\"}";
+
+static void _check_stream(events_t *e)
+{
+    TEST_ASSERT_EQUAL_INT(3, e->count);
+    TEST_ASSERT_EQUAL_INT(0, e->event[0].sentence_id);
+    TEST_ASSERT(!e->event[0].is_end);
+    TEST_ASSERT_EQUAL_STRING("\xe4\xbd\xa0\xe5\xa5\xbd \"q\"\n", e->result[0]);
+    TEST_ASSERT_EQUAL_INT(strlen(e->result[0]), e->event[0].result_len);
+    TEST_ASSERT_EQUAL_INT(2, e->event[0].usage.prompt_tokens);
+    TEST_ASSERT_EQUAL_INT(3, e->event[0].usage.completion_tokens);
+    TEST_ASSERT_EQUAL_INT(5, e->event[0].usage.total_tokens);
+    TEST_ASSERT_EQUAL_INT(1, e->event[1].sentence_id);
+    TEST_ASSERT(e->event[1].is_end);
+    TEST_ASSERT_EQUAL_STRING("\xe5\x86\x8d\xe8\xa7\x81\xe3\x80\x82", e->result[1]);
+    TEST_ASSERT_EQUAL_INT(110, e->event[2].error_code);
+    TEST_ASSERT_EQUAL_STRING("Access token invalid", e->error_msg[2]);
+}
+
+static void test_whole_stream(void)
+{
+    events_t e;
+    _parse(stream, 1024, &e);
+    _check_stream(&e);
+}
+
+static void test_split_at_every_byte(void)
+{
+    //* every split point, including inside escapes, UTF-8 characters and "\r\n"
+    for (int step = 1; step < 16; step++) {
+        events_t e;
+        _parse(stream, step, &e);
+        _check_stream(&e);
+    }
+}
+
+static void test_surrogate_pair(void)
+{
+    events_t e;
+    _parse("data: {\"result\":\"a\\ud83d\\ude00b\"}\n", 3, &e);
+    TEST_ASSERT_EQUAL_INT(1, e.count);
+    TEST_ASSERT_EQUAL_STRING("a\xf0\x9f\x98\x80" "b", e.result[0]);
+}
+
+static void test_lone_surrogates(void)
+{
+    events_t e;
+    //* a high half without its low half, then a low half on its own
+    _parse("data: {\"result\":\"a\\ud83db\\ude00c\\ud83d\"}\n", 5, &e);
+    TEST_ASSERT_EQUAL_INT(1, e.count);
+    TEST_ASSERT_EQUAL_STRING("a\xef\xbf\xbd" "b\xef\xbf\xbd" "c\xef\xbf\xbd", e.result[0]);
+    //* a high half followed by another escape that is not a low half
+    _parse("data: {\"result\":\"\\ud83d\\u0041\"}\n", 7, &e);
+    TEST_ASSERT_EQUAL_STRING("\xef\xbf\xbd" "A", e.result[0]);
+}
+
+static void test_malformed_escape_dropped(void)
+{
+    events_t e;
+    _parse("data: {\"result\":\"\\u12G4\"}\ndata: {\"result\":\"ok\"}\n", 4, &e);
+    TEST_ASSERT_EQUAL_INT(1, e.count);
+    TEST_ASSERT_EQUAL_STRING("ok", e.result[0]);
+}
+
+/*
+ * The per-byte state machine llm_ask used before the parser, kept as the reference of the benchmark:
+ * it looks for "result":" and copies up to the next quote, only \n is unescaped
+ */
+typedef enum {
+    LEGACY_START,
+    LEGACY_KEY,         /*!< inside "result, `matched` characters of it so far */
+    LEGACY_KEY_END,     /*!< "result" */
+    LEGACY_COLON,       /*!< "result": */
+    LEGACY_ACCEPT,      /*!< "result":" and the answer */
+} legacy_state_t;
+
+typedef struct {
+    legacy_state_t  state;
+    int             matched;
+    int             ans_len;
+    char            ans[1024 + 5];
+    int             results;
+} legacy_parser_t;
+
+static void _legacy_feed(legacy_parser_t *p, const char *data, int len)
+{
+    static const char key[] = "result";
+    for (int i = 0; i < len; i++) {
+        char c = data[i];
+        legacy_state_t last = p->state;
+        switch (p->state) {
+        case LEGACY_START:
+            p->state = c == '"' ? LEGACY_KEY : LEGACY_START;
+            p->matched = 0;
+            break;
+        case LEGACY_KEY:
+            if (p->matched < 6 && c == key[p->matched]) {
+                p->matched++;
+            } else if (p->matched == 6 && c == '"') {
+                p->state = LEGACY_KEY_END;
+            } else {
+                p->state = c == '"' ? LEGACY_KEY : LEGACY_START;
+                p->matched = 0;
+            }
+            break;
+        case LEGACY_KEY_END:
+            p->state = c == ':' ? LEGACY_COLON : c == '"' ? LEGACY_KEY : LEGACY_START;
+            p->matched = 0;
+            break;
+        case LEGACY_COLON:
+            p->state = c == '"' ? LEGACY_ACCEPT : LEGACY_START;
+            p->ans_len = 0;
+            break;
+        case LEGACY_ACCEPT:
+            p->state = c == '"' ? LEGACY_START : LEGACY_ACCEPT;
+            break;
+        }
+        if (p->state == LEGACY_START && last == LEGACY_ACCEPT) {
+            p->ans[p->ans_len] = 0;
+            p->results++;
+        } else if (p->state == LEGACY_ACCEPT && last == LEGACY_ACCEPT) {
+            if (c == 'n' && p->ans_len > 0 && p->ans[p->ans_len - 1] == '\\') {
+                p->ans_len--;
+            } else if (p->ans_len < 1024) {
+                p->ans[p->ans_len++] = c;
+            }
+        }
+    }
+}
+
+static void _count_event(const llm_sse_event_t *event, void *user_data)
+{
+    *(int *)user_data += event->result ? 1 : 0;
+}
+
+/*
+ * MB/s of the parser and of the old state machine over `data`, read in READ_SIZE pieces, `rounds` times
+ */
+static void _throughput(const char *data, int len, int rounds, double *mbps, double *legacy_mbps, int *results)
+{
+    static char buffer[READ_SIZE + 512];
+    int64_t start = esp_timer_get_time();
+    for (int r = 0; r < rounds; r++) {
+        llm_sse_parser_t parser;
+        *results = 0;
+        llm_sse_parser_init(&parser, buffer, sizeof(buffer), _count_event, results);
+        for (int pos = 0; pos < len;) {
+            int available;
+            char *w = llm_sse_parser_get_write_ptr(&parser, &available);
+            int n = available < READ_SIZE ? available : READ_SIZE;
+            n = n < len - pos ? n : len - pos;
+            memcpy(w, data + pos, n);
+            pos += n;
+            llm_sse_parser_feed(&parser, n);
+        }
+        llm_sse_parser_finish(&parser);
+    }
+    int64_t us = esp_timer_get_time() - start;
+    *mbps = (double)len * rounds / (us + 1);
+    static legacy_parser_t legacy;
+    start = esp_timer_get_time();
+    for (int r = 0; r < rounds; r++) {
+        memset(&legacy, 0, sizeof(legacy));
+        for (int pos = 0; pos < len; pos += READ_SIZE) {
+            //* the old loop read into its own buffer, the copy is part of the cost
+            memcpy(buffer, data + pos, len - pos < READ_SIZE ? len - pos : READ_SIZE);
+            _legacy_feed(&legacy, buffer, len - pos < READ_SIZE ? len - pos : READ_SIZE);
+        }
+    }
+    us = esp_timer_get_time() - start;
+    *legacy_mbps = (double)len * rounds / (us + 1);
+    if (legacy.results != *results) {
+        *results = -1;
+    }
+}
+
+static void test_throughput(void)
+{
+    //* a long answer the way the server streams it, a sentence of Chinese per event, escaped
+    const char *event = "data: {\"id\":\"as-fmwvd1gdgc\",\"object\":\"chat.completion\",\"created\":1700000000,"
+                        "\"sentence_id\":%d,\"is_end\":false,\"is_truncated\":false,\"result\":\"\u4f60\u597d\uff0c"
+                        "\u6211\u662f\u4e00\u4e2a\u5c0f\u73a9\u5177\u3002\u4eca\u5929\u5929\u6c14\u5f88\u597d\uff0c"
+                        "\u6211\u4eec\u53bb\u516c\u56ed\u5427\uff01\\n\",\"need_clear_history\":false,"
+                        "\"usage\":{\"prompt_tokens\":12,\"completion_tokens\":%d,\"total_tokens\":%d}}\n\n";
+    int events = 400;
+    char *data = malloc(events * 512);
+    int len = 0;
+    for (int i = 0; i < events; i++) {
+        len += sprintf(data + len, event, i, i * 20, 12 + i * 20);
+    }
+    double mbps, legacy_mbps;
+    int results;
+    _throughput(data, len, 50, &mbps, &legacy_mbps, &results);
+    printf("%d kB stream: parser %.1f MB/s, old state machine %.1f MB/s on this host\n", len / 1024, mbps, legacy_mbps);
+    TEST_ASSERT_EQUAL_INT(events, results);
+    free(data);
+}
+
+/*
+ * test_llm_sse_parser <stream.txt>: throughput of both over a captured response body
+ */
+static int _bench(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    int len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(len + 1);
+    if (data == NULL || fread(data, 1, len, f) != len) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        fclose(f);
+        free(data);
+        return 1;
+    }
+    fclose(f);
+    double mbps, legacy_mbps;
+    int results;
+    _throughput(data, len, 1 + (16 << 20) / (len + 1), &mbps, &legacy_mbps, &results);
+    printf("%s: %d results, parser %.1f MB/s, old state machine %.1f MB/s on this host%s\n", path, results, mbps,
+           legacy_mbps, results < 0 ? " (they found a different number of results)" : "");
+    free(data);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        return _bench(argv[1]);
+    }
+    RUN_TEST(test_whole_stream);
+    RUN_TEST(test_split_at_every_byte);
+    RUN_TEST(test_surrogate_pair);
+    RUN_TEST(test_lone_surrogates);
+    RUN_TEST(test_malformed_escape_dropped);
+    RUN_TEST(test_throughput);
+    return TEST_EXIT();
+}
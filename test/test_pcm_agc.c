@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include "pcm_agc.h"
+#include "esp_timer.h"
+#include "host_shim.h"
+#include "host_audio.h"
+#include "host_test.h"
+
+#define RATE        (16000)
+#define MS(ms)      ((ms) * RATE / 1000)
+// The output is delayed by the look-ahead of the default configuration
+#define DELAY       (MS(4))
+
+static double _db(double rms)
+{
+    return 20.0 * log10(rms / 32768.0 + 1e-9);
+}
+
+/*
+ * Runs the AGC over `pcm`, returns the output lined up with the input
+ */
+static int16_t *_agc(const int16_t *pcm, int n, bool fixed_point, int64_t *us)
+{
+    pcm_agc_cfg_t cfg = DEFAULT_PCM_AGC_CONFIG();
+    cfg.fixed_point = fixed_point;
+    audio_element_handle_t agc = pcm_agc_init(&cfg);
+    host_buffer_t out = { 0 };
+    int64_t start = esp_timer_get_time();
+    host_element_run(agc, pcm, n * 2, 0, &out);
+    if (us) {
+        *us = esp_timer_get_time() - start;
+    }
+    audio_element_deinit(agc);
+    int16_t *aligned = calloc(n, sizeof(int16_t));
+    int len = out.len / 2 - DELAY;
+    memcpy(aligned, (int16_t *)out.data + DELAY, (len < n ? len : n) * sizeof(int16_t));
+    host_buffer_free(&out);
+    return aligned;
+}
+
+static void test_gain_converges(void)
+{
+    pcm_agc_cfg_t cfg = DEFAULT_PCM_AGC_CONFIG();
+    //* a quiet and a loud talker, both within the gain range of the target
+    static const double levels_db[] = { -32, -10 };
+    int n = MS(5000);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    for (int l = 0; l < sizeof(levels_db) / sizeof(levels_db[0]); l++) {
+        memset(pcm, 0, n * sizeof(int16_t));
+        host_audio_add_noise(pcm, n, 32768.0 * pow(10.0, levels_db[l] / 20.0));
+        for (int fixed = 0; fixed < 2; fixed++) {
+            int16_t *out = _agc(pcm, n, fixed, NULL);
+            double in_db = _db(host_audio_rms(pcm + n - MS(1000), MS(1000)));
+            double out_db = _db(host_audio_rms(out + n - MS(1000), MS(1000)));
+            printf("%s: %.1f dBFS in, %.1f dBFS out after 4 s\n", fixed ? "Q15" : "float", in_db, out_db);
+            free(out);
+            TEST_ASSERT(fabs(out_db - cfg.target_db) < 1.5);
+        }
+    }
+    free(pcm);
+}
+
+static void test_gate_holds_gain(void)
+{
+    //* 3 s of a quiet talker, then 2 s of room noise below the gate
+    int n = MS(5000);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_noise(pcm, MS(3000), 32768.0 * pow(10.0, -32 / 20.0));
+    host_audio_add_noise(pcm + MS(3000), MS(2000), 32768.0 * pow(10.0, -60 / 20.0));
+    for (int fixed = 0; fixed < 2; fixed++) {
+        int16_t *out = _agc(pcm, n, fixed, NULL);
+        double speech_gain = _db(host_audio_rms(out + MS(2500), MS(500))) - _db(host_audio_rms(pcm + MS(2500), MS(500)));
+        double noise_gain = _db(host_audio_rms(out + MS(4000), MS(1000))) - _db(host_audio_rms(pcm + MS(4000), MS(1000)));
+        printf("%s: gain %.1f dB on speech, %.1f dB on the noise after it\n", fixed ? "Q15" : "float",
+               speech_gain, noise_gain);
+        free(out);
+        //* not raised towards the maximum, not dropped either
+        TEST_ASSERT(fabs(noise_gain - speech_gain) < 1.0);
+    }
+    free(pcm);
+}
+
+/*
+ * A quiet talker drives the gain up, then a shout and clicks at full scale arrive with no warning
+ * but the look-ahead
+ */
+static int16_t *_shout(int n)
+{
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_noise(pcm, MS(3000), 32768.0 * pow(10.0, -40 / 20.0));
+    host_audio_add_voice(pcm + MS(3000), MS(1000), RATE, 32000);
+    for (int i = MS(4200); i < n; i += MS(100)) {
+        pcm[i] = i & 1 ? 32767 : -32768;
+        pcm[i + 1] = i & 1 ? -32768 : 32767;
+    }
+    return pcm;
+}
+
+static void test_peak_ceiling(void)
+{
+    pcm_agc_cfg_t cfg = DEFAULT_PCM_AGC_CONFIG();
+    int ceiling = (int)ceilf(32767.0f * powf(10.0f, cfg.limit_db / 20.0f));
+    int n = MS(5000);
+    int16_t *pcm = _shout(n);
+    for (int fixed = 0; fixed < 2; fixed++) {
+        int16_t *out = _agc(pcm, n, fixed, NULL);
+        int peak = 0;
+        for (int i = 0; i < n; i++) {
+            int v = abs(out[i]);
+            peak = v > peak ? v : peak;
+        }
+        printf("%s: peak %.2f dBFS after %.1f dB of gain on the quiet talker\n", fixed ? "Q15" : "float",
+               _db(peak), _db(host_audio_rms(out + MS(2000), MS(1000))) - _db(host_audio_rms(pcm + MS(2000), MS(1000))));
+        free(out);
+        TEST_ASSERT(peak <= ceiling);
+    }
+    free(pcm);
+}
+
+static void test_fixed_ramp_never_wraps(void)
+{
+    //* dsps_mul_s16 keeps the low 16 bits, a product out of range would flip the sign of the sample
+    int n = MS(5000);
+    int16_t *pcm = _shout(n);
+    //* and the gain going back up at the release rate after the shout
+    host_audio_add_noise(pcm + MS(4500), MS(500), 32768.0 * pow(10.0, -40 / 20.0));
+    int16_t *out = _agc(pcm, n, true, NULL);
+    int flips = 0;
+    for (int i = 0; i < n; i++) {
+        //* a sample of one LSB may round to the other side
+        if ((pcm[i] > 1 && out[i] < 0) || (pcm[i] < -1 && out[i] > 0)) {
+            flips++;
+        }
+    }
+    free(out);
+    free(pcm);
+    TEST_ASSERT_EQUAL_INT(0, flips);
+}
+
+static void test_cpu_per_sample(void)
+{
+    int n = MS(10000);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_voice(pcm, n, RATE, 8000);
+    host_audio_add_noise(pcm, n, 100);
+    for (int fixed = 0; fixed < 2; fixed++) {
+        int64_t us;
+        free(_agc(pcm, n, fixed, &us));
+        printf("%s: %.1f ns per sample on this host\n", fixed ? "Q15" : "float", us * 1000.0 / n);
+        //* far below the 62.5 us a sample lasts at 16 kHz
+        TEST_ASSERT(us * 1000 / n < 5000);
+    }
+    free(pcm);
+}
+
+/*
+ * test_pcm_agc <file.wav>: runs the AGC over the file, reports the level before and after and the time
+ * per sample
+ */
+static int _bench(const char *path)
+{
+    int rate, n;
+    int16_t *pcm = host_wav_read(path, &rate, &n);
+    if (pcm == NULL || rate != RATE) {
+        fprintf(stderr, "Need a 16 kHz 16-bit PCM WAV: %s\n", path);
+        free(pcm);
+        return 1;
+    }
+    for (int fixed = 0; fixed < 2; fixed++) {
+        int64_t us;
+        int16_t *out = _agc(pcm, n, fixed, &us);
+        printf("%s %s: %.1f dBFS in, %.1f dBFS out, %.1f ns per sample on this host\n", path,
+               fixed ? "Q15" : "float", _db(host_audio_rms(pcm, n)), _db(host_audio_rms(out, n)), us * 1000.0 / n);
+        free(out);
+    }
+    free(pcm);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        return _bench(argv[1]);
+    }
+    RUN_TEST(test_gain_converges);
+    RUN_TEST(test_gate_holds_gain);
+    RUN_TEST(test_peak_ceiling);
+    RUN_TEST(test_fixed_ramp_never_wraps);
+    RUN_TEST(test_cpu_per_sample);
+    return TEST_EXIT();
+}
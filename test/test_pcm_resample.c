@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include "pcm_resample.h"
+#include "esp_timer.h"
+#include "host_shim.h"
+#include "host_audio.h"
+#include "host_test.h"
+
+#define AMPLITUDE   (10000.0f)
+// The filter start-up left out of the measurement
+#define SETTLE_MS   (20)
+
+/*
+ * Amplitude of the `hz` component, a Hann windowed single bin DFT
+ */
+static double _tone_level(const int16_t *pcm, int n, int rate, double hz)
+{
+    double re = 0, im = 0, wsum = 0;
+    for (int i = 0; i < n; i++) {
+        double w = 0.5 - 0.5 * cos(2 * M_PI * i / (n - 1));
+        re += w * pcm[i] * cos(2 * M_PI * hz * i / rate);
+        im -= w * pcm[i] * sin(2 * M_PI * hz * i / rate);
+        wsum += w;
+    }
+    return 2.0 * sqrt(re * re + im * im) / wsum;
+}
+
+/*
+ * Resamples 200 ms of a tone, returns the output samples in `out`
+ */
+static int _resample_tone(int src, int dest, bool fixed_point, double hz, host_buffer_t *out)
+{
+    pcm_resample_cfg_t cfg = DEFAULT_PCM_RESAMPLE_CONFIG();
+    cfg.src_rate = src;
+    cfg.dest_rate = dest;
+    cfg.fixed_point = fixed_point;
+    audio_element_handle_t rs = pcm_resample_init(&cfg);
+    if (rs == NULL) {
+        return -1;
+    }
+    int n = src / 5;
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_tone(pcm, n, src, hz, AMPLITUDE);
+    host_element_run(rs, pcm, n * 2, 0, out);
+    audio_element_deinit(rs);
+    free(pcm);
+    return out->len / 2;
+}
+
+/*
+ * Level of `hz` after resampling a tone of `in_hz`, in dB relative to the input tone
+ */
+static double _gain_db(int src, int dest, bool fixed_point, double in_hz, double hz)
+{
+    host_buffer_t out = { 0 };
+    int n = _resample_tone(src, dest, fixed_point, in_hz, &out);
+    int skip = dest * SETTLE_MS / 1000;
+    double level = n > skip ? _tone_level((int16_t *)out.data + skip, n - 2 * skip, dest, hz) : 0;
+    host_buffer_free(&out);
+    return 20.0 * log10(level / AMPLITUDE + 1e-9);
+}
+
+static const struct {
+    int src;
+    int dest;
+} ratios[] = { { 48000, 16000 }, { 44100, 16000 }, { 16000, 48000 }, { 16000, 44100 }, { 48000, 44100 } };
+
+static void test_output_length(void)
+{
+    for (int r = 0; r < sizeof(ratios) / sizeof(ratios[0]); r++) {
+        host_buffer_t out = { 0 };
+        int n = _resample_tone(ratios[r].src, ratios[r].dest, true, 1000, &out);
+        host_buffer_free(&out);
+        //* 200 ms in, 200 ms out but for the filter delay
+        int expected = ratios[r].dest / 5;
+        TEST_ASSERT(n > 0 && abs(n - expected) <= PCM_RESAMPLE_TAPS * 3);
+    }
+}
+
+static void test_passband_flat(void)
+{
+    static const double tones[] = { 300, 1000, 3000, 6000 };
+    for (int r = 0; r < sizeof(ratios) / sizeof(ratios[0]); r++) {
+        for (int fixed = 0; fixed < 2; fixed++) {
+            for (int t = 0; t < sizeof(tones) / sizeof(tones[0]); t++) {
+                double db = _gain_db(ratios[r].src, ratios[r].dest, fixed, tones[t], tones[t]);
+                if (db < -1.0 || db > 0.5) {
+                    printf("%d -> %d %s: %.0f Hz at %.2f dB\n", ratios[r].src, ratios[r].dest,
+                           fixed ? "Q15" : "float", tones[t], db);
+                    TEST_FAIL_MESSAGE("passband not flat");
+                }
+            }
+        }
+    }
+}
+
+static void test_alias_rejected(void)
+{
+    //* above the 8 kHz output Nyquist: 12 kHz folds to 4 kHz, 10 kHz to 6 kHz
+    static const struct {
+        int src;
+        double in_hz;
+        double alias_hz;
+    } cases[] = { { 48000, 12000, 4000 }, { 48000, 10000, 6000 }, { 44100, 12000, 4000 }, { 44100, 18000, 2000 } };
+    for (int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        for (int fixed = 0; fixed < 2; fixed++) {
+            double db = _gain_db(cases[c].src, 16000, fixed, cases[c].in_hz, cases[c].alias_hz);
+            printf("%d -> 16000 %s: %.0f Hz aliases to %.0f Hz at %.1f dB\n", cases[c].src, fixed ? "Q15" : "float",
+                   cases[c].in_hz, cases[c].alias_hz, db);
+            TEST_ASSERT(db < -40.0);
+        }
+    }
+}
+
+static void test_image_rejected(void)
+{
+    //* a 3 kHz tone at 16 kHz has images at 13 and 19 kHz after upsampling
+    for (int fixed = 0; fixed < 2; fixed++) {
+        double db = _gain_db(16000, 48000, fixed, 3000, 13000);
+        printf("16000 -> 48000 %s: image at 13 kHz at %.1f dB\n", fixed ? "Q15" : "float", db);
+        TEST_ASSERT(db < -40.0);
+        db = _gain_db(16000, 44100, fixed, 3000, 13000);
+        TEST_ASSERT(db < -40.0);
+    }
+}
+
+/*
+ * The textbook resampler the polyphase one replaces: the input zero stuffed to `up` times its rate, the
+ * whole lowpass of the element run over it and every `down`th sample kept. Going up, only the kept
+ * samples are computed, all of them would take minutes at 44.1 kHz.
+ */
+static int _naive_resample(const int16_t *in, int n, int src, int dest, int16_t *out)
+{
+    int g = src;
+    for (int b = dest; b; ) {
+        int t = g % b;
+        g = b;
+        b = t;
+    }
+    int up = dest / g, down = src / g;
+    int len = PCM_RESAMPLE_TAPS * up;
+    float *h = malloc(len * sizeof(float));
+    float fc = 0.9f * 0.5f / (up > down ? up : down);
+    for (int i = 0; i < len; i++) {
+        float m = i - (len - 1) / 2.0f;
+        float x = (float)M_PI * 2 * fc * m;
+        float sinc = m == 0 ? 1.0f : sinf(x) / x;
+        float w = 0.42f - 0.5f * cosf(2 * (float)M_PI * i / (len - 1)) + 0.08f * cosf(4 * (float)M_PI * i / (len - 1));
+        h[i] = 2 * fc * sinc * w * up;
+    }
+    int out_n = 0;
+    for (int64_t k = len - 1; k < (int64_t)n * up; k += up == 1 ? 1 : down) {
+        float acc = 0;
+        for (int j = 0; j < len; j++) {
+            int64_t i = k - j;
+            acc += h[j] * (i % up == 0 ? in[i / up] : 0);
+        }
+        if (up > 1 || k % down == 0) {
+            out[out_n++] = acc > 32767.0f ? 32767 : (acc < -32768.0f ? -32768 : (int16_t)lrintf(acc));
+        }
+    }
+    free(h);
+    return out_n;
+}
+
+/*
+ * Time per 10 ms of output of the element in float and Q15 and of the naive FIR, prints them after `name`.
+ * Returns how many times faster the float element is than the naive FIR.
+ */
+static double _speed(const char *name, const int16_t *pcm, int n, int src, int dest)
+{
+    double us_per_10ms[3];
+    for (int fixed = 0; fixed < 2; fixed++) {
+        pcm_resample_cfg_t cfg = DEFAULT_PCM_RESAMPLE_CONFIG();
+        cfg.src_rate = src;
+        cfg.dest_rate = dest;
+        cfg.fixed_point = fixed;
+        audio_element_handle_t rs = pcm_resample_init(&cfg);
+        if (rs == NULL) {
+            fprintf(stderr, "No resampler for %d -> %d\n", src, dest);
+            return 0;
+        }
+        host_buffer_t out = { 0 };
+        int64_t start = esp_timer_get_time();
+        host_element_run(rs, pcm, n * 2, 0, &out);
+        int64_t us = esp_timer_get_time() - start;
+        us_per_10ms[fixed] = (double)us / (out.len / 2 / (dest / 100) + 1);
+        host_buffer_free(&out);
+        audio_element_deinit(rs);
+    }
+    int16_t *out = malloc(((int64_t)n * dest / src + 1) * sizeof(int16_t));
+    int64_t start = esp_timer_get_time();
+    int out_n = _naive_resample(pcm, n, src, dest, out);
+    us_per_10ms[2] = (double)(esp_timer_get_time() - start) / (out_n / (dest / 100) + 1);
+    free(out);
+    printf("%s: %d -> %d, us per 10 ms of output on this host: float %.2f, Q15 %.2f, naive FIR %.2f (%.1fx)\n",
+           name, src, dest, us_per_10ms[0], us_per_10ms[1], us_per_10ms[2], us_per_10ms[2] / us_per_10ms[0]);
+    return us_per_10ms[2] / us_per_10ms[0];
+}
+
+static void test_faster_than_naive_fir(void)
+{
+    int n = 44100;
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_voice(pcm, n, 44100, 3000);
+    //* the polyphase banks skip the zeros, up to `up` times less work
+    TEST_ASSERT(_speed("1 s of voice", pcm, n, 44100, 16000) > 2.0);
+    TEST_ASSERT(_speed("1 s of voice", pcm, n * 16000 / 44100, 16000, 44100) > 2.0);
+    free(pcm);
+}
+
+/*
+ * test_pcm_resample <file.wav>: resamples the file to 16 kHz and reports the time per 10 ms of output,
+ * against a naive FIR
+ */
+static int _bench(const char *path)
+{
+    int rate, n;
+    int16_t *pcm = host_wav_read(path, &rate, &n);
+    if (pcm == NULL) {
+        fprintf(stderr, "Not a 16-bit PCM WAV: %s\n", path);
+        return 1;
+    }
+    int dest = rate == 16000 ? 48000 : 16000;
+    double speedup = _speed(path, pcm, n, rate, dest);
+    free(pcm);
+    return speedup > 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        return _bench(argv[1]);
+    }
+    RUN_TEST(test_output_length);
+    RUN_TEST(test_passband_flat);
+    RUN_TEST(test_alias_rejected);
+    RUN_TEST(test_image_rejected);
+    RUN_TEST(test_faster_than_naive_fir);
+    return TEST_EXIT();
+}
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include "sr_aec.h"
+#include "ringbuf.h"
+#include "esp_timer.h"
+#include "host_shim.h"
+#include "host_audio.h"
+#include "host_test.h"
+
+#define RATE            (16000)
+#define MS(ms)          ((ms) * RATE / 1000)
+#define FRAME_SAMPLES   (RATE / 100)
+#define ECHO_DELAY      (48)
+
+/*
+ * The playback the microphone hears, written into the reference as the microphone is read
+ */
+typedef struct {
+    ringbuf_handle_t    reference;
+    const int16_t       *far;
+} playback_t;
+
+static void _play(int pos, int len, void *ctx)
+{
+    playback_t *p = (playback_t *)ctx;
+    rb_write(p->reference, (char *)(p->far + pos / 2), len, 0);
+}
+
+/*
+ * A loudspeaker to microphone path: a delay, a decaying tail of a few reflections and some gain loss
+ */
+static void _add_echo(const int16_t *far, int16_t *mic, int n)
+{
+    static const struct {
+        int     delay;
+        float   gain;
+    } path[] = { { ECHO_DELAY, 0.5f }, { ECHO_DELAY + 7, -0.2f }, { ECHO_DELAY + 31, 0.1f }, { ECHO_DELAY + 90, -0.05f } };
+    for (int i = 0; i < n; i++) {
+        float v = mic[i];
+        for (int k = 0; k < sizeof(path) / sizeof(path[0]); k++) {
+            if (i >= path[k].delay) {
+                v += path[k].gain * far[i - path[k].delay];
+            }
+        }
+        mic[i] = host_audio_clip(v);
+    }
+}
+
+/*
+ * Runs the canceller over `mic` with `far` as the playback, the output is `n` samples
+ */
+static void _cancel(const int16_t *far, const int16_t *mic, int n, host_buffer_t *out)
+{
+    sr_aec_cfg_t cfg = DEFAULT_SR_AEC_CONFIG();
+    ringbuf_handle_t reference = rb_create(FRAME_SAMPLES * 2, 8);
+    cfg.reference = reference;
+    audio_element_handle_t aec = sr_aec_init(&cfg);
+    playback_t playback = {
+        .reference = reference,
+        .far = far,
+    };
+    host_element_set_read_hook(_play, &playback);
+    host_element_run(aec, mic, n * 2, FRAME_SAMPLES * 2, out);
+    host_element_set_read_hook(NULL, NULL);
+    audio_element_deinit(aec);
+    rb_destroy(reference);
+}
+
+static double _erle_db(const int16_t *mic, const int16_t *out, int n)
+{
+    return 20.0 * log10(host_audio_rms(mic, n) / (host_audio_rms(out, n) + 1e-9));
+}
+
+static void test_echo_removed(void)
+{
+    int n = MS(4000);
+    int16_t *far = calloc(n, sizeof(int16_t));
+    int16_t *mic = calloc(n, sizeof(int16_t));
+    host_audio_add_voice(far, n, RATE, 6000);
+    host_audio_add_noise(far, n, 300);
+    _add_echo(far, mic, n);
+    host_audio_add_noise(mic, n, 20);
+    host_buffer_t out = { 0 };
+    _cancel(far, mic, n, &out);
+    TEST_ASSERT_EQUAL_INT(n * 2, out.len);
+    //* the last second, after the filter converged
+    double erle = _erle_db(mic + n - MS(1000), (int16_t *)out.data + n - MS(1000), MS(1000));
+    printf("echo only: ERLE %.1f dB\n", erle);
+    TEST_ASSERT(erle > 20.0);
+    host_buffer_free(&out);
+    free(far);
+    free(mic);
+}
+
+static void test_near_speech_kept_in_double_talk(void)
+{
+    //* 2 s of echo to converge, then the user talks over the answer, closer to the microphone
+    //* than the loudspeaker is, the Geigel detector only sees near speech louder than the echo
+    int n = MS(4000);
+    int16_t *far = calloc(n, sizeof(int16_t));
+    int16_t *near = calloc(n, sizeof(int16_t));
+    int16_t *mic = calloc(n, sizeof(int16_t));
+    host_audio_add_voice(far, n, RATE, 6000);
+    host_audio_add_noise(far, n, 300);
+    host_audio_add_tone(near + MS(2000), MS(2000), RATE, 330, 8000);
+    memcpy(mic, near, n * sizeof(int16_t));
+    _add_echo(far, mic, n);
+    host_buffer_t out = { 0 };
+    _cancel(far, mic, n, &out);
+    //* what is left is the near speech, the echo over it is attenuated and the filter did not diverge
+    int16_t *residual = calloc(MS(2000), sizeof(int16_t));
+    const int16_t *tail = (const int16_t *)out.data + MS(2000);
+    for (int i = 0; i < MS(2000); i++) {
+        residual[i] = tail[i] - near[MS(2000) + i];
+    }
+    double near_to_residual = 20.0 * log10(host_audio_rms(near + MS(2000), MS(2000)) / host_audio_rms(residual, MS(2000)));
+    printf("double talk: near speech %.1f dB above what is left of the echo\n", near_to_residual);
+    TEST_ASSERT(near_to_residual > 15.0);
+    host_buffer_free(&out);
+    free(residual);
+    free(far);
+    free(near);
+    free(mic);
+}
+
+static void test_silent_reference_passes_through(void)
+{
+    int n = MS(500);
+    int16_t *far = calloc(n, sizeof(int16_t));
+    int16_t *mic = calloc(n, sizeof(int16_t));
+    host_audio_add_voice(mic, n, RATE, 3000);
+    host_buffer_t out = { 0 };
+    _cancel(far, mic, n, &out);
+    TEST_ASSERT_EQUAL_INT(n * 2, out.len);
+    TEST_ASSERT_EQUAL_MEMORY(mic, out.data, n * 2);
+    host_buffer_free(&out);
+    free(far);
+    free(mic);
+}
+
+/*
+ * test_sr_aec <far.wav> <mic.wav>: ERLE of a recording made while playing far.wav,
+ * and the time per 10 ms frame. With only far.wav the echo is simulated.
+ */
+static int _bench(const char *far_path, const char *mic_path)
+{
+    int rate, n, mic_rate = 0, mic_n = 0;
+    int16_t *far = host_wav_read(far_path, &rate, &n);
+    int16_t *mic = mic_path ? host_wav_read(mic_path, &mic_rate, &mic_n) : calloc(n, sizeof(int16_t));
+    if (far == NULL || mic == NULL || rate != RATE || (mic_path && mic_rate != rate)) {
+        fprintf(stderr, "Need 16 kHz 16-bit PCM WAV files\n");
+        return 1;
+    }
+    if (mic_path) {
+        n = n < mic_n ? n : mic_n;
+    } else {
+        _add_echo(far, mic, n);
+        host_audio_add_noise(mic, n, 20);
+    }
+    host_buffer_t out = { 0 };
+    int64_t start = esp_timer_get_time();
+    _cancel(far, mic, n, &out);
+    int64_t us = esp_timer_get_time() - start;
+    int frames = n / FRAME_SAMPLES;
+    printf("%s: ERLE %.1f dB over the whole file, %.1f dB over the last second, %.2f us per 10 ms frame on this host\n",
+           mic_path ? mic_path : far_path, _erle_db(mic, (int16_t *)out.data, n),
+           _erle_db(mic + n - MS(1000), (int16_t *)out.data + n - MS(1000), MS(1000)), (double)us / frames);
+    host_buffer_free(&out);
+    free(far);
+    free(mic);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        return _bench(argv[1], argc > 2 ? argv[2] : NULL);
+    }
+    RUN_TEST(test_echo_removed);
+    RUN_TEST(test_near_speech_kept_in_double_talk);
+    RUN_TEST(test_silent_reference_passes_through);
+    return TEST_EXIT();
+}
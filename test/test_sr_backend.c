@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sr_backend.h"
+#include "esp_timer.h"
+#include "host_shim.h"
+#include "host_audio.h"
+#include "host_test.h"
+
+#define BUFFER_SIZE     (2048)
+#define ANSWER          "{\"corpus_no\":\"6433214037620997779\",\"err_msg\":\"success.\",\"err_no\":0," \
+                        "\"result\":[\"\xe4\xbd\xa0\xe5\xa5\xbd\"],\"sn\":\"371191073711497849365\"}"
+
+// Audio blocks of 100 ms at 16 kHz, what the recording pipeline hands over
+#define AUDIO_BLOCK     (3200)
+
+static char buffer[BUFFER_SIZE];
+
+typedef struct {
+    int64_t upload_us;      /*!< From the first write to the end of `finish` */
+    int64_t result_us;      /*!< From the end of `finish` to the text */
+    int     wire_bytes;
+    int64_t cpu_us;
+} utterance_time_t;
+
+/*
+ * One utterance the way google_sr drives a backend, `len` bytes of audio in `block` byte writes
+ */
+static char *_utterance(const sr_backend_t *backend, const uint8_t *audio, int len, int block, utterance_time_t *t)
+{
+    esp_http_client_config_t config = {
+        .url = backend->uri,
+    };
+    sr_backend_ctx_t ctx = {
+        .http = esp_http_client_init(&config),
+        .buffer = buffer,
+        .buffer_size = sizeof(buffer),
+        .format = "pcm",
+        .sample_rate = 16000,
+        .token = "token",
+        .is_begin = true,
+    };
+    char *text = NULL;
+    //* a recognizer on the device has no connection
+    if (backend->begin(&ctx) != ESP_OK || (backend->uri && esp_http_client_open(ctx.http, -1) != ESP_OK)) {
+        goto done;
+    }
+    int64_t start = esp_timer_get_time();
+    for (int pos = 0; pos < len; pos += block) {
+        int n = len - pos < block ? len - pos : block;
+        ctx.audio_bytes += n;
+        if (backend->write(&ctx, audio + pos, n) != n) {
+            goto done;
+        }
+        ctx.is_begin = false;
+    }
+    if (backend->finish(&ctx) != ESP_OK) {
+        goto done;
+    }
+    int64_t finished = esp_timer_get_time();
+    if (backend->uri && esp_http_client_fetch_headers(ctx.http) < 0) {
+        goto done;
+    }
+    text = backend->result(&ctx);
+    if (t) {
+        t->upload_us = finished - start;
+        t->result_us = esp_timer_get_time() - finished;
+        t->wire_bytes = ctx.wire_bytes;
+        t->cpu_us = ctx.cpu_us;
+    }
+done:
+    esp_http_client_cleanup(ctx.http);
+    return text;
+}
+
+/*
+ * The request body without the chunk framing, NULL if the framing is broken or the last chunk is missing
+ */
+static char *_unchunk(int *body_len)
+{
+    int len;
+    const char *p = host_http_request(&len);
+    const char *end = p + len;
+    char *body = malloc(len + 1);
+    *body_len = 0;
+    while (p < end) {
+        char *line_end;
+        long size = strtol(p, &line_end, 16);
+        if (line_end == p || line_end + 2 > end || memcmp(line_end, "\r\n", 2) != 0) {
+            break;
+        }
+        p = line_end + 2;
+        if (size == 0) {
+            body[*body_len] = 0;
+            return p + 2 == end && memcmp(p, "\r\n", 2) == 0 ? body : NULL;
+        }
+        if (p + size + 2 > end) {
+            break;
+        }
+        memcpy(body + *body_len, p, size);
+        *body_len += size;
+        p += size + 2;
+    }
+    free(body);
+    return NULL;
+}
+
+static void test_baidu_request_is_whole_json(void)
+{
+    host_http_reset(200, ANSWER);
+    uint8_t audio[1000];
+    memset(audio, 0x55, sizeof(audio));
+    char *text = _utterance(&sr_backend_baidu, audio, sizeof(audio), 320, NULL);
+    TEST_ASSERT_EQUAL_STRING("\xe4\xbd\xa0\xe5\xa5\xbd", text);
+    free(text);
+    int len;
+    char *body = _unchunk(&len);
+    TEST_ASSERT(body != NULL);
+    TEST_ASSERT(strncmp(body, "{\"format\": \"pcm\"", 16) == 0);
+    //* 1000 bytes are 1336 base64 characters with the padding
+    char *speech = strstr(body, "\"speech\":\"");
+    TEST_ASSERT(speech != NULL);
+    speech += strlen("\"speech\":\"");
+    TEST_ASSERT_EQUAL_INT(1336, strcspn(speech, "\""));
+    TEST_ASSERT_EQUAL_STRING("\",\"len\":1000}", speech + 1336);
+    free(body);
+}
+
+static void test_baidu_empty_recording(void)
+{
+    host_http_reset(200, ANSWER);
+    free(_utterance(&sr_backend_baidu, NULL, 0, 320, NULL));
+    int len;
+    char *body = _unchunk(&len);
+    TEST_ASSERT(body != NULL);
+    //* the head goes out with the end, the server gets valid JSON with no speech
+    TEST_ASSERT(strncmp(body, "{\"format\": \"pcm\"", 16) == 0);
+    TEST_ASSERT(strstr(body, "\"speech\":\"\",\"len\":0}") != NULL);
+    free(body);
+}
+
+static void test_raw_request_is_the_audio(void)
+{
+    host_http_reset(200, ANSWER);
+    uint8_t audio[5000];
+    for (int i = 0; i < sizeof(audio); i++) {
+        audio[i] = i * 7;
+    }
+    free(_utterance(&sr_backend_raw_pcm, audio, sizeof(audio), 1600, NULL));
+    int len;
+    char *body = _unchunk(&len);
+    TEST_ASSERT(body != NULL);
+    TEST_ASSERT_EQUAL_INT(sizeof(audio), len);
+    TEST_ASSERT_EQUAL_MEMORY(audio, body, len);
+    free(body);
+}
+
+static void test_result_split_across_reads(void)
+{
+    for (int piece = 1; piece < 40; piece += 3) {
+        host_http_reset(200, ANSWER);
+        host_http_set_read_max(piece);
+        char *text = _utterance(&sr_backend_raw_pcm, (const uint8_t *)"ab", 2, 2, NULL);
+        TEST_ASSERT_EQUAL_STRING("\xe4\xbd\xa0\xe5\xa5\xbd", text);
+        free(text);
+    }
+}
+
+static void test_result_framing_checked(void)
+{
+    static const char *bad[] = {
+        "{\"err_no\":3301,\"err_msg\":\"speech quality error.\"}",
+        "{\"result\":\"plain string\"}",
+        "{\"result\":[]}",
+        "{\"result\":[1]}",
+    };
+    for (int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        host_http_reset(200, bad[i]);
+        char *text = _utterance(&sr_backend_raw_pcm, (const uint8_t *)"ab", 2, 2, NULL);
+        TEST_ASSERT(text == NULL);
+        free(text);
+    }
+    //* an answer bigger than the buffer is not parsed cut off
+    char *big = malloc(BUFFER_SIZE + 64);
+    int len = sprintf(big, "{\"result\":[\"");
+    memset(big + len, 'a', BUFFER_SIZE);
+    strcpy(big + len + BUFFER_SIZE, "\"]}");
+    host_http_reset(200, big);
+    free(big);
+    char *text = _utterance(&sr_backend_raw_pcm, (const uint8_t *)"ab", 2, 2, NULL);
+    TEST_ASSERT(text == NULL);
+    free(text);
+}
+
+/*
+ * Per backend on a link of `rtt_ms` and `kbps`: the cold connection, the upload and the wait for the text
+ * after the end of speech. The audio comes in real time, an upload slower than that falls behind.
+ */
+static void _backend_latency(const int16_t *pcm, int samples, int rtt_ms, int kbps)
+{
+    static const sr_backend_t *backends[] = { &sr_backend_baidu, &sr_backend_raw_pcm, &sr_backend_offline };
+    int audio_ms = samples * 1000 / 16000;
+    printf("%d ms of audio, link of %d ms RTT and %d kbit/s:\n", audio_ms, rtt_ms, kbps);
+    host_http_set_link(rtt_ms, kbps);
+    for (int b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        host_http_reset(200, ANSWER);
+        int probe_ms = sr_backend_probe(backends[b], SR_BACKEND_PROBE_TIMEOUT_MS);
+        utterance_time_t t = { 0 };
+        char *text = _utterance(backends[b], (const uint8_t *)pcm, samples * 2, AUDIO_BLOCK, &t);
+        int upload_ms = t.upload_us / 1000;
+        int behind_ms = upload_ms > audio_ms ? upload_ms - audio_ms : 0;
+        printf("  %-8s connect %4d ms, %6d bytes up in %5d ms, text %4d ms after the end of speech, %d us CPU per second%s\n",
+               backends[b]->name, probe_ms, t.wire_bytes, upload_ms, behind_ms + (int)(t.result_us / 1000),
+               (int)(t.cpu_us * 1000 / (audio_ms > 0 ? audio_ms : 1)), text ? "" : ", no text");
+        free(text);
+    }
+    host_http_set_link(0, 0);
+}
+
+static void test_backend_latency(void)
+{
+    int n = 16000;
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_voice(pcm, n, 16000, 3000);
+    //* a toy on a busy 2.4 GHz network
+    _backend_latency(pcm, n, 30, 1000);
+    free(pcm);
+}
+
+/*
+ * test_sr_backend <rtt_ms> <kbps> [file.wav]: the latency of every backend on that link,
+ * for 3 s of synthetic voice or the 16 kHz file
+ */
+static int _bench(int argc, char **argv)
+{
+    int rtt_ms = atoi(argv[1]);
+    int kbps = argc > 2 ? atoi(argv[2]) : 0;
+    int rate = 16000, n = 3 * 16000;
+    int16_t *pcm = NULL;
+    if (argc > 3) {
+        pcm = host_wav_read(argv[3], &rate, &n);
+        if (pcm == NULL || rate != 16000) {
+            fprintf(stderr, "Need a 16 kHz 16-bit PCM WAV: %s\n", argv[3]);
+            return 1;
+        }
+    } else {
+        pcm = calloc(n, sizeof(int16_t));
+        host_audio_add_voice(pcm, n, 16000, 3000);
+    }
+    _backend_latency(pcm, n, rtt_ms, kbps);
+    free(pcm);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        return _bench(argc, argv);
+    }
+    RUN_TEST(test_baidu_request_is_whole_json);
+    RUN_TEST(test_baidu_empty_recording);
+    RUN_TEST(test_raw_request_is_the_audio);
+    RUN_TEST(test_result_split_across_reads);
+    RUN_TEST(test_result_framing_checked);
+    RUN_TEST(test_backend_latency);
+    return TEST_EXIT();
+}
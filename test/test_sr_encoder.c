@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include "sr_encoder.h"
+#include "esp_timer.h"
+#include "host_shim.h"
+#include "host_audio.h"
+#include "host_test.h"
+
+#define RATE            (16000)
+#define BLOCK_BYTES     (256)
+#define BLOCK_SAMPLES   (505)
+
+static const int16_t step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t index_table[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+/*
+ * Reference decoder of mono WAV IMA-ADPCM blocks, what the server does with the upload
+ */
+static int _decode(const uint8_t *in, int len, int16_t *out)
+{
+    int n = 0;
+    for (int b = 0; b + BLOCK_BYTES <= len; b += BLOCK_BYTES) {
+        const uint8_t *block = in + b;
+        int predictor = (int16_t)(block[0] | block[1] << 8);
+        int index = block[2];
+        if (index > 88 || block[3] != 0) {
+            return -1;
+        }
+        out[n++] = predictor;
+        for (int i = 4; i < BLOCK_BYTES; i++) {
+            for (int shift = 0; shift < 8; shift += 4) {
+                int nibble = (block[i] >> shift) & 0xF;
+                int step = step_table[index];
+                int diff = step >> 3;
+                if (nibble & 4) {
+                    diff += step;
+                }
+                if (nibble & 2) {
+                    diff += step >> 1;
+                }
+                if (nibble & 1) {
+                    diff += step >> 2;
+                }
+                predictor += (nibble & 8) ? -diff : diff;
+                predictor = predictor > 32767 ? 32767 : predictor < -32768 ? -32768 : predictor;
+                index += index_table[nibble];
+                index = index < 0 ? 0 : index > 88 ? 88 : index;
+                out[n++] = predictor;
+            }
+        }
+    }
+    return n;
+}
+
+static double _snr_db(const int16_t *ref, const int16_t *test, int n)
+{
+    double signal = 0, noise = 0;
+    for (int i = 0; i < n; i++) {
+        double e = (double)ref[i] - test[i];
+        signal += (double)ref[i] * ref[i];
+        noise += e * e;
+    }
+    return 10.0 * log10(signal / (noise + 1e-9));
+}
+
+/*
+ * Encodes `pcm` through the element and decodes it back into `back`, returns the decoded samples
+ */
+static int _round_trip(const int16_t *pcm, int n, int16_t *back, int *wire_bytes)
+{
+    sr_encoder_cfg_t cfg = DEFAULT_SR_ENCODER_CONFIG();
+    audio_element_handle_t enc = sr_encoder_init(&cfg);
+    host_buffer_t out = { 0 };
+    host_element_run(enc, pcm, n * 2, 0, &out);
+    *wire_bytes = out.len;
+    int decoded = _decode((const uint8_t *)out.data, out.len, back);
+    host_buffer_free(&out);
+    audio_element_deinit(enc);
+    return decoded;
+}
+
+static void test_voice_snr(void)
+{
+    int n = 2 * RATE;
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    int16_t *back = calloc(n + BLOCK_SAMPLES, sizeof(int16_t));
+    host_audio_add_voice(pcm, n, RATE, 3000);
+    host_audio_add_noise(pcm, n, 60);
+    int wire;
+    int decoded = _round_trip(pcm, n, back, &wire);
+    //* whole blocks, the last one padded
+    TEST_ASSERT_EQUAL_INT((n + BLOCK_SAMPLES - 1) / BLOCK_SAMPLES * BLOCK_BYTES, wire);
+    TEST_ASSERT(decoded >= n);
+    double snr = _snr_db(pcm, back, n);
+    printf("voice: SNR %.1f dB, %d bytes/s on the wire for %d bytes/s of PCM\n", snr, wire * RATE / n, RATE * 2);
+    //* a bright synthetic voice, IMA-ADPCM keeps about 20 dB on it
+    TEST_ASSERT(snr > 18.0);
+    free(pcm);
+    free(back);
+}
+
+static void test_loud_and_quiet_snr(void)
+{
+    //* a loud tone then a quiet one, the step index must follow both ways across blocks
+    int n = RATE;
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    int16_t *back = calloc(n + BLOCK_SAMPLES, sizeof(int16_t));
+    host_audio_add_tone(pcm, n / 2, RATE, 440, 20000);
+    host_audio_add_tone(pcm + n / 2, n / 2, RATE, 440, 300);
+    int wire;
+    _round_trip(pcm, n, back, &wire);
+    //* skip the first blocks after the level drop while the step size comes down
+    TEST_ASSERT(_snr_db(pcm, back, n / 2) > 25.0);
+    TEST_ASSERT(_snr_db(pcm + n / 2 + 2 * BLOCK_SAMPLES, back + n / 2 + 2 * BLOCK_SAMPLES,
+                        n / 2 - 2 * BLOCK_SAMPLES) > 20.0);
+    free(pcm);
+    free(back);
+}
+
+static void test_block_starts_exact(void)
+{
+    //* every block header carries its first sample verbatim
+    int n = 3 * BLOCK_SAMPLES;
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    int16_t *back = calloc(n, sizeof(int16_t));
+    host_audio_add_noise(pcm, n, 8000);
+    int wire;
+    TEST_ASSERT_EQUAL_INT(n, _round_trip(pcm, n, back, &wire));
+    for (int b = 0; b < n; b += BLOCK_SAMPLES) {
+        TEST_ASSERT_EQUAL_INT(pcm[b], back[b]);
+    }
+    free(pcm);
+    free(back);
+}
+
+/*
+ * test_sr_encoder <file.wav>: SNR, bytes on the wire per second of audio and encode time per block
+ */
+static int _bench(const char *path)
+{
+    int rate, n;
+    int16_t *pcm = host_wav_read(path, &rate, &n);
+    if (pcm == NULL) {
+        fprintf(stderr, "Not a 16-bit PCM WAV: %s\n", path);
+        return 1;
+    }
+    int16_t *back = calloc(n + BLOCK_SAMPLES, sizeof(int16_t));
+    int64_t start = esp_timer_get_time();
+    int wire;
+    _round_trip(pcm, n, back, &wire);
+    int64_t us = esp_timer_get_time() - start;
+    printf("%s: SNR %.1f dB, %d bytes/s on the wire, %.2f us per block on this host (including the decode)\n",
+           path, _snr_db(pcm, back, n), (int)((int64_t)wire * rate / n), (double)us / (wire / BLOCK_BYTES));
+    free(pcm);
+    free(back);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        return _bench(argv[1]);
+    }
+    RUN_TEST(test_voice_snr);
+    RUN_TEST(test_loud_and_quiet_snr);
+    RUN_TEST(test_block_starts_exact);
+    return TEST_EXIT();
+}
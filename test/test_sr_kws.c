@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include "sr_kws.h"
+#include "esp_timer.h"
+#include "host_shim.h"
+#include "host_audio.h"
+#include "host_test.h"
+
+#define RATE            (16000)
+#define MS(ms)          ((ms) * RATE / 1000)
+#define HOP_SAMPLES     (320)
+#define FRAMES          (49)
+#define COEFFS          (13)
+#define MODEL_PART_SIZE (64 * 1024)
+// The summed log energy of a second of quiet voice is about 7 at the logit scale, of loud voice up to 42
+#define LOUD_BIAS       (-20)
+
+/*
+ * A one layer model that says "wake word" for a loud second: the keyword logit is the sum of c0,
+ * the log energy, over the window plus `bias`, the other logit is 0. The spotter's front end and
+ * scheduling are what is tested, not a trained network.
+ */
+static void _loudness_model(int8_t bias, int8_t c0_weight)
+{
+    const esp_partition_t *part = host_partition_add("kws_model", MODEL_PART_SIZE);
+    uint8_t *p = host_partition_data(part);
+    sr_kws_model_t model = {
+        .magic = SR_KWS_MODEL_MAGIC,
+        .frames = FRAMES,
+        .coeffs = COEFFS,
+        .labels = 2,
+        .keyword = 1,
+        .layer_num = 1,
+        //* c0 in natural log units
+        .input_shift = 7,
+        .output_frac = 2,
+    };
+    memcpy(p, &model, sizeof(model));
+    p += sizeof(model);
+    sr_kws_layer_t layer = {
+        .in_dim = FRAMES * COEFFS,
+        .out_dim = 2,
+        .out_shift = 6,
+        .relu = 0,
+    };
+    memcpy(p, &layer, sizeof(layer));
+    int8_t *bias_out = (int8_t *)(p + sizeof(layer));
+    bias_out[0] = 0;
+    bias_out[1] = bias;
+    int8_t *weights = bias_out + 2;
+    memset(weights, 0, 2 * FRAMES * COEFFS);
+    for (int f = 0; f < FRAMES; f++) {
+        weights[FRAMES * COEFFS + f * COEFFS] = c0_weight;
+    }
+}
+
+/*
+ * Runs the spotter over `pcm`, returns the detections and checks the audio went through unchanged
+ */
+static int _spot(const int16_t *pcm, int n, int64_t *us)
+{
+    sr_kws_cfg_t cfg = DEFAULT_SR_KWS_CONFIG();
+    audio_element_handle_t kws = sr_kws_init(&cfg);
+    if (kws == NULL) {
+        return -1;
+    }
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    audio_event_iface_handle_t evt = audio_event_iface_init(&evt_cfg);
+    sr_kws_set_listener(kws, evt);
+    host_buffer_t out = { 0 };
+    int64_t start = esp_timer_get_time();
+    host_element_run(kws, pcm, n * 2, 0, &out);
+    if (us) {
+        *us = esp_timer_get_time() - start;
+    }
+    int detections = 0;
+    audio_event_iface_msg_t msg;
+    while (audio_event_iface_listen(evt, &msg, 0) == ESP_OK) {
+        detections += sr_kws_check_event(kws, &msg) ? 1 : 0;
+    }
+    //* heard during the run
+    int64_t detect_us = sr_kws_get_detect_time(kws);
+    if (detections > 0 && (detect_us < start || detect_us > esp_timer_get_time())) {
+        detections = -3;
+    }
+    if (out.len != n * 2 || memcmp(out.data, pcm, n * 2) != 0) {
+        detections = -2;
+    }
+    host_buffer_free(&out);
+    audio_element_deinit(kws);
+    audio_event_iface_destroy(evt);
+    return detections;
+}
+
+static void test_invalid_model_rejected(void)
+{
+    sr_kws_cfg_t cfg = DEFAULT_SR_KWS_CONFIG();
+    //* an erased partition
+    host_partition_add("kws_model", MODEL_PART_SIZE);
+    TEST_ASSERT(sr_kws_init(&cfg) == NULL);
+    //* the last layer does not end in the labels
+    _loudness_model(0, 1);
+    sr_kws_model_t *model = (sr_kws_model_t *)host_partition_data(esp_partition_find_first(
+                                ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "kws_model"));
+    model->labels = 3;
+    TEST_ASSERT(sr_kws_init(&cfg) == NULL);
+    model->labels = 2;
+    //* the first layer does not take the feature window
+    model->frames = FRAMES + 1;
+    TEST_ASSERT(sr_kws_init(&cfg) == NULL);
+    model->frames = FRAMES;
+    cfg.sample_rate = 8000;
+    TEST_ASSERT(sr_kws_init(&cfg) == NULL);
+    cfg.sample_rate = RATE;
+    audio_element_handle_t kws = sr_kws_init(&cfg);
+    TEST_ASSERT(kws != NULL);
+    audio_element_deinit(kws);
+}
+
+static void test_loud_word_triggers_once(void)
+{
+    _loudness_model(LOUD_BIAS, 1);
+    //* quiet room, a second of loud voice, quiet room
+    int n = MS(3000);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_voice(pcm + MS(1000), MS(1000), RATE, 6000);
+    host_audio_add_noise(pcm, n, 30);
+    int64_t us;
+    int detections = _spot(pcm, n, &us);
+    printf("loud word: %d detections, %.1f us per 20 ms frame on this host\n", detections,
+           (double)us / (n / HOP_SAMPLES));
+    TEST_ASSERT_EQUAL_INT(1, detections);
+    free(pcm);
+}
+
+static void test_quiet_sound_ignored(void)
+{
+    _loudness_model(LOUD_BIAS, 1);
+    int n = MS(3000);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    //* above the gate, the network runs and says no
+    host_audio_add_voice(pcm, n, RATE, 100);
+    host_audio_add_noise(pcm, n, 30);
+    TEST_ASSERT_EQUAL_INT(0, _spot(pcm, n, NULL));
+    //* digital silence never wakes the network, even if it would say yes
+    _loudness_model(127, 0);
+    memset(pcm, 0, n * sizeof(int16_t));
+    TEST_ASSERT_EQUAL_INT(0, _spot(pcm, n, NULL));
+    free(pcm);
+}
+
+static void test_refractory_period(void)
+{
+    //* a model that always says yes: one detection per refractory period while there is sound
+    _loudness_model(127, 0);
+    int n = MS(4000);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_voice(pcm, n, RATE, 3000);
+    int detections = _spot(pcm, n, NULL);
+    printf("always yes: %d detections in 4 s\n", detections);
+    //* the first once the window is full, the next 1.5 s later and the smoothing refilled
+    TEST_ASSERT_EQUAL_INT(2, detections);
+    //* equal logits, a posterior of 50% is below the threshold
+    _loudness_model(0, 0);
+    TEST_ASSERT_EQUAL_INT(0, _spot(pcm, n, NULL));
+    free(pcm);
+}
+
+/*
+ * test_sr_kws <model.bin> <file.wav>...: loads a trained model and counts the detections in each
+ * file, a file whose name starts with "wake" should have one and any other none. Reports the
+ * accuracy over the files and the time per 20 ms frame.
+ */
+static int _bench(int argc, char **argv)
+{
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+        return 1;
+    }
+    const esp_partition_t *part = host_partition_add("kws_model", MODEL_PART_SIZE * 4);
+    fread(host_partition_data(part), 1, part->size, f);
+    fclose(f);
+    int correct = 0, files = 0;
+    int64_t total_us = 0, total_frames = 0;
+    for (int i = 2; i < argc; i++) {
+        int rate, n;
+        int16_t *pcm = host_wav_read(argv[i], &rate, &n);
+        if (pcm == NULL || rate != RATE) {
+            fprintf(stderr, "Need a 16 kHz 16-bit PCM WAV: %s\n", argv[i]);
+            free(pcm);
+            continue;
+        }
+        const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        bool positive = strncmp(name, "wake", 4) == 0;
+        int64_t us;
+        int detections = _spot(pcm, n, &us);
+        free(pcm);
+        if (detections < 0) {
+            fprintf(stderr, "No valid model in %s\n", argv[1]);
+            return 1;
+        }
+        bool ok = positive ? detections == 1 : detections == 0;
+        printf("%s: %d detections, %s\n", argv[i], detections, ok ? "ok" : positive ? "missed" : "false alarm");
+        correct += ok ? 1 : 0;
+        files++;
+        total_us += us;
+        total_frames += n / HOP_SAMPLES;
+    }
+    printf("%d of %d files right (%d%%), %.1f us per 20 ms frame on this host\n", correct, files,
+           files ? correct * 100 / files : 0, total_frames ? (double)total_us / total_frames : 0);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2) {
+        return _bench(argc, argv);
+    }
+    RUN_TEST(test_invalid_model_rejected);
+    RUN_TEST(test_loud_word_triggers_once);
+    RUN_TEST(test_quiet_sound_ignored);
+    RUN_TEST(test_refractory_period);
+    return TEST_EXIT();
+}
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include "sr_ns.h"
+#include "dsps_snr.h"
+#include "dsps_fft2r.h"
+#include "esp_timer.h"
+#include "host_shim.h"
+#include "host_audio.h"
+#include "host_test.h"
+
+#define RATE        (16000)
+#define MS(ms)      ((ms) * RATE / 1000)
+#define NOISE_RMS   (300.0f)
+#define SNR_LEN     (4096)
+
+static int16_t *_suppress(const int16_t *pcm, int n, bool fixed_point)
+{
+    sr_ns_cfg_t cfg = DEFAULT_SR_NS_CONFIG();
+    cfg.fixed_point = fixed_point;
+    audio_element_handle_t ns = sr_ns_init(&cfg);
+    host_buffer_t out = { 0 };
+    host_element_run(ns, pcm, n * 2, 0, &out);
+    audio_element_deinit(ns);
+    //* the output is delayed by half a frame, line it up with the input
+    int16_t *aligned = calloc(n, sizeof(int16_t));
+    int delay = SR_NS_FRAME_SAMPLES / 2;
+    int len = out.len / 2 - delay;
+    memcpy(aligned, (int16_t *)out.data + delay, (len < n ? len : n) * sizeof(int16_t));
+    host_buffer_free(&out);
+    return aligned;
+}
+
+static float _snr_db(const int16_t *pcm)
+{
+    static float x[SNR_LEN];
+    for (int i = 0; i < SNR_LEN; i++) {
+        x[i] = pcm[i] / 32768.0f;
+    }
+    return dsps_snr_f32(x, SNR_LEN, 0);
+}
+
+static void test_tone_snr_improves(void)
+{
+    //* 1 s of room noise to learn it from, then a held vowel in the same noise
+    int n = MS(1000) + MS(1000);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_tone(pcm + MS(1000), MS(1000), RATE, 500, 2000);
+    host_audio_add_noise(pcm, n, NOISE_RMS);
+    for (int fixed = 0; fixed < 2; fixed++) {
+        int16_t *out = _suppress(pcm, n, fixed);
+        float before = _snr_db(pcm + n - SNR_LEN);
+        float after = _snr_db(out + n - SNR_LEN);
+        printf("%s: tone SNR %.1f dB -> %.1f dB\n", fixed ? "Q15" : "float", before, after);
+        free(out);
+        TEST_ASSERT(after - before > 6.0f);
+    }
+    free(pcm);
+}
+
+static void test_noise_floor_lowered(void)
+{
+    int n = MS(3000);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_noise(pcm, n, NOISE_RMS);
+    for (int fixed = 0; fixed < 2; fixed++) {
+        int16_t *out = _suppress(pcm, n, fixed);
+        double db = 20.0 * log10(host_audio_rms(out + MS(1000), MS(2000)) / host_audio_rms(pcm + MS(1000), MS(2000)));
+        printf("%s: noise floor %.1f dB\n", fixed ? "Q15" : "float", db);
+        free(out);
+        //* close to the 12 dB most that is taken off
+        TEST_ASSERT(db < -9.0 && db > -13.0);
+    }
+    free(pcm);
+}
+
+static void test_voice_level_kept(void)
+{
+    int n = MS(3000);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_voice(pcm + MS(1000), MS(2000), RATE, 3000);
+    host_audio_add_noise(pcm, n, NOISE_RMS / 4);
+    int16_t *out = _suppress(pcm, n, false);
+    double db = 20.0 * log10(host_audio_rms(out + MS(1000), MS(2000)) / host_audio_rms(pcm + MS(1000), MS(2000)));
+    printf("voice level %.2f dB\n", db);
+    TEST_ASSERT(db > -1.5 && db < 0.5);
+    free(out);
+    free(pcm);
+}
+
+/*
+ * test_sr_ns <file.wav>: level change of the file and the time per 8 ms hop, float and Q15
+ */
+static int _bench(const char *path)
+{
+    int rate, n;
+    int16_t *pcm = host_wav_read(path, &rate, &n);
+    if (pcm == NULL || rate != RATE) {
+        fprintf(stderr, "Need a 16 kHz 16-bit PCM WAV: %s\n", path);
+        return 1;
+    }
+    for (int fixed = 0; fixed < 2; fixed++) {
+        int64_t start = esp_timer_get_time();
+        int16_t *out = _suppress(pcm, n, fixed);
+        int64_t us = esp_timer_get_time() - start;
+        printf("%s %s: level %.1f dB, %.2f us per %d sample hop on this host\n", path, fixed ? "Q15" : "float",
+               20.0 * log10(host_audio_rms(out, n) / (host_audio_rms(pcm, n) + 1e-9)),
+               (double)us / (n / (SR_NS_FRAME_SAMPLES / 2)), SR_NS_FRAME_SAMPLES / 2);
+        free(out);
+    }
+    free(pcm);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    //* dsps_snr_f32 runs a longer FFT than the suppressor, the first init sizes the shared table
+    dsps_fft2r_init_fc32(NULL, SNR_LEN);
+    if (argc > 1) {
+        return _bench(argv[1]);
+    }
+    RUN_TEST(test_tone_snr_improves);
+    RUN_TEST(test_noise_floor_lowered);
+    RUN_TEST(test_voice_level_kept);
+    return TEST_EXIT();
+}
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include "sr_vad.h"
+#include "esp_timer.h"
+#include "host_shim.h"
+#include "host_audio.h"
+#include "host_test.h"
+
+#define RATE        (16000)
+#define MS(ms)      ((ms) * RATE / 1000)
+#define NOISE_RMS   (60.0f)
+
+static audio_element_handle_t _vad(int end_silence_ms)
+{
+    sr_vad_cfg_t cfg = DEFAULT_SR_VAD_CONFIG();
+    cfg.end_silence_ms = end_silence_ms;
+    return sr_vad_init(&cfg);
+}
+
+static void test_silence_trimmed_and_end_detected(void)
+{
+    //* 0.5 s room noise, 1 s speech, 2 s room noise
+    int n = MS(3500);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_voice(pcm + MS(500), MS(1000), RATE, 3000);
+    host_audio_add_noise(pcm, n, NOISE_RMS);
+
+    audio_element_handle_t vad = _vad(1000);
+    host_buffer_t out = { 0 };
+    int ret = host_element_run(vad, pcm, n * 2, 1024, &out);
+    int out_ms = out.len / 2 * 1000 / RATE;
+    TEST_ASSERT(sr_vad_speech_detected(vad));
+    //* finished by itself, before the input ran out
+    TEST_ASSERT_EQUAL_INT(AEL_IO_DONE, ret);
+    //* the speech, the 240 ms pre-roll and the pauses and hangover it keeps, not the tail
+    TEST_ASSERT(out_ms >= 1000 && out_ms <= 1000 + 240 + 600 + 32);
+    //* the pre-roll starts inside the leading noise, the speech itself is untouched
+    TEST_ASSERT(host_audio_rms((int16_t *)out.data + MS(240) + MS(100), MS(500)) > 1000);
+    host_buffer_free(&out);
+    audio_element_deinit(vad);
+    free(pcm);
+}
+
+static void test_noise_only_gives_nothing(void)
+{
+    int n = MS(2000);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_noise(pcm, n, NOISE_RMS);
+    //* a hum is tonal like speech, but it is stationary and never rises above the floor
+    host_audio_add_tone(pcm, n, RATE, 1000, 100);
+    audio_element_handle_t vad = _vad(1000);
+    host_buffer_t out = { 0 };
+    host_element_run(vad, pcm, n * 2, 0, &out);
+    TEST_ASSERT(!sr_vad_speech_detected(vad));
+    TEST_ASSERT_EQUAL_INT(0, out.len);
+    audio_element_deinit(vad);
+    free(pcm);
+}
+
+static void test_long_pause_shortened(void)
+{
+    //* speech, 1.5 s pause, speech, with the end detection off
+    int n = MS(3000);
+    int16_t *pcm = calloc(n, sizeof(int16_t));
+    host_audio_add_voice(pcm, MS(700), RATE, 3000);
+    host_audio_add_voice(pcm + MS(2200), MS(800), RATE, 3000);
+    host_audio_add_noise(pcm, n, NOISE_RMS);
+    audio_element_handle_t vad = _vad(0);
+    host_buffer_t out = { 0 };
+    host_element_run(vad, pcm, n * 2, 0, &out);
+    int out_ms = out.len / 2 * 1000 / RATE;
+    //* 1.5 s of speech, the pause cut to hangover + max pause + the pre-roll before the second part
+    TEST_ASSERT(out_ms >= 1500 && out_ms <= 1500 + 200 + 400 + 240 + 32);
+    host_buffer_free(&out);
+    audio_element_deinit(vad);
+    free(pcm);
+}
+
+/*
+ * test_sr_vad <file.wav>: trims a recording and reports how much was kept and the time per frame
+ */
+static int _bench(const char *path)
+{
+    int rate, n;
+    int16_t *pcm = host_wav_read(path, &rate, &n);
+    if (pcm == NULL) {
+        fprintf(stderr, "Not a 16-bit PCM WAV: %s\n", path);
+        return 1;
+    }
+    sr_vad_cfg_t cfg = DEFAULT_SR_VAD_CONFIG();
+    cfg.sample_rate = rate;
+    audio_element_handle_t vad = sr_vad_init(&cfg);
+    host_buffer_t out = { 0 };
+    int64_t start = esp_timer_get_time();
+    host_element_run(vad, pcm, n * 2, 0, &out);
+    int64_t us = esp_timer_get_time() - start;
+    printf("%s: %d ms in, %d ms out, speech=%d, %.2f us per 256 sample frame on this host\n", path,
+           n * 1000 / rate, (int)((int64_t)out.len / 2 * 1000 / rate), sr_vad_speech_detected(vad),
+           (double)us / (n / 256 + 1));
+    host_buffer_free(&out);
+    audio_element_deinit(vad);
+    free(pcm);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        return _bench(argv[1]);
+    }
+    RUN_TEST(test_silence_trimmed_and_end_detected);
+    RUN_TEST(test_noise_only_gives_nothing);
+    RUN_TEST(test_long_pause_shortened);
+    return TEST_EXIT();
+}
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tts_cache.h"
+#include "host_shim.h"
+#include "host_test.h"
+
+#define CACHE_SLOTS     (4)
+#define CACHE_PARAMS    "voice=zh-CN-Standard-A&speed=1.0"
+#define KEY_NUM         (20000)
+
+static const esp_partition_t *partition;
+
+/*
+ * A new chip: erased partition, empty NVS
+ */
+static tts_cache_handle_t _open_new(void)
+{
+    partition = host_partition_add("tts_cache", CACHE_SLOTS * TTS_CACHE_SLOT_SIZE);
+    host_nvs_erase();
+    return tts_cache_init("tts_cache");
+}
+
+/*
+ * Audio of `key`, a pattern that tells the keys apart
+ */
+static int _audio(uint64_t key, char *buf)
+{
+    int len = 1000 + (int)(key % 3000);
+    for (int i = 0; i < len; i++) {
+        buf[i] = (char)(key + i * 7);
+    }
+    return len;
+}
+
+static esp_err_t _store(tts_cache_handle_t cache, uint64_t key)
+{
+    static char buf[TTS_CACHE_SLOT_SIZE];
+    return tts_cache_store(cache, key, buf, _audio(key, buf));
+}
+
+/*
+ * True if `key` hits and reads back its audio
+ */
+static bool _hit(tts_cache_handle_t cache, uint64_t key)
+{
+    static char want[TTS_CACHE_SLOT_SIZE], got[TTS_CACHE_SLOT_SIZE];
+    int len;
+    int slot = tts_cache_lookup(cache, key, &len);
+    if (slot < 0 || len != _audio(key, want)) {
+        return false;
+    }
+    return tts_cache_read(cache, slot, 0, got, len) == ESP_OK && memcmp(want, got, len) == 0;
+}
+
+static int _slot(tts_cache_handle_t cache, uint64_t key)
+{
+    int len;
+    return tts_cache_lookup(cache, key, &len);
+}
+
+static int _evictions(tts_cache_handle_t cache)
+{
+    tts_cache_stats_t stats;
+    tts_cache_get_stats(cache, &stats);
+    return stats.evictions;
+}
+
+static void test_lru_eviction(void)
+{
+    tts_cache_handle_t cache = _open_new();
+    TEST_ASSERT(cache != NULL);
+    for (uint64_t k = 0; k < CACHE_SLOTS; k++) {
+        TEST_ASSERT_EQUAL_INT(ESP_OK, _store(cache, 100 + k));
+    }
+    TEST_ASSERT_EQUAL_INT(0, _evictions(cache));
+    //* a hit makes 100 the most recent, 101 is the oldest now
+    TEST_ASSERT(_hit(cache, 100));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _store(cache, 104));
+    TEST_ASSERT_EQUAL_INT(1, _evictions(cache));
+    TEST_ASSERT_EQUAL_INT(-1, _slot(cache, 101));
+
+    //* the use order comes back from NVS, 102 goes next
+    tts_cache_deinit(cache);
+    cache = tts_cache_init("tts_cache");
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _store(cache, 105));
+    TEST_ASSERT_EQUAL_INT(-1, _slot(cache, 102));
+    TEST_ASSERT(_hit(cache, 100));
+    TEST_ASSERT(_hit(cache, 103));
+    TEST_ASSERT(_hit(cache, 104));
+    TEST_ASSERT(_hit(cache, 105));
+
+    //* the hits reorder the slots, 103 is the oldest now
+    TEST_ASSERT(_hit(cache, 100));
+    tts_cache_deinit(cache);
+    cache = tts_cache_init("tts_cache");
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _store(cache, 106));
+    TEST_ASSERT_EQUAL_INT(-1, _slot(cache, 103));
+    TEST_ASSERT(_hit(cache, 100));
+    TEST_ASSERT_EQUAL_INT(ESP_ERR_INVALID_SIZE, tts_cache_store(cache, 107, "", 0));
+    tts_cache_deinit(cache);
+}
+
+static void test_mismatched_slot_dropped(void)
+{
+    tts_cache_handle_t cache = _open_new();
+    for (uint64_t k = 0; k < CACHE_SLOTS; k++) {
+        TEST_ASSERT_EQUAL_INT(ESP_OK, _store(cache, 200 + k));
+    }
+    uint8_t *flash = host_partition_data(partition);
+    //* power lost after the erase, the header was never written
+    int erased = _slot(cache, 200);
+    memset(flash + erased * TTS_CACHE_SLOT_SIZE, 0xff, SPI_FLASH_SEC_SIZE);
+    //* the slot holds another key than the index says
+    int other = _slot(cache, 201);
+    flash[other * TTS_CACHE_SLOT_SIZE + 8] ^= 0x01;
+    //* the length in the header is not the one in the index
+    int cut = _slot(cache, 202);
+    flash[cut * TTS_CACHE_SLOT_SIZE + 4] ^= 0x01;
+
+    TEST_ASSERT_EQUAL_INT(-1, _slot(cache, 200));
+    TEST_ASSERT_EQUAL_INT(-1, _slot(cache, 201));
+    TEST_ASSERT_EQUAL_INT(-1, _slot(cache, 202));
+    TEST_ASSERT(_hit(cache, 203));
+
+    //* the dropped slots stay free after a reboot and are filled before anything is evicted
+    tts_cache_flush(cache);
+    tts_cache_deinit(cache);
+    cache = tts_cache_init("tts_cache");
+    TEST_ASSERT_EQUAL_INT(-1, _slot(cache, 201));
+    for (uint64_t k = 0; k < 3; k++) {
+        TEST_ASSERT_EQUAL_INT(ESP_OK, _store(cache, 210 + k));
+    }
+    TEST_ASSERT_EQUAL_INT(0, _evictions(cache));
+    TEST_ASSERT(_hit(cache, 203));
+    TEST_ASSERT(_hit(cache, 210));
+    TEST_ASSERT(_hit(cache, 212));
+    tts_cache_deinit(cache);
+}
+
+static int _key_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void test_key_collisions(void)
+{
+    //* the separator keeps the split between parameters and text
+    TEST_ASSERT(tts_cache_key("ab", "c") != tts_cache_key("a", "bc"));
+    TEST_ASSERT(tts_cache_key(CACHE_PARAMS, "你好") != tts_cache_key(CACHE_PARAMS "&pitch=1", "你好"));
+    TEST_ASSERT(tts_cache_key(CACHE_PARAMS, "你好") == tts_cache_key(CACHE_PARAMS, "你好"));
+
+    //* prompts that differ in one character or one number
+    static uint64_t keys[KEY_NUM];
+    char text[64];
+    for (int i = 0; i < KEY_NUM; i++) {
+        snprintf(text, sizeof(text), i % 2 ? "现在是%d点%d分" : "The volume is %d, step %d", i / 60, i % 60);
+        keys[i] = tts_cache_key(CACHE_PARAMS, text);
+    }
+    qsort(keys, KEY_NUM, sizeof(uint64_t), _key_cmp);
+    int same = 0;
+    for (int i = 1; i < KEY_NUM; i++) {
+        same += keys[i] == keys[i - 1];
+    }
+    TEST_ASSERT_EQUAL_INT(0, same);
+
+    //* a key stored twice takes one slot
+    tts_cache_handle_t cache = _open_new();
+    uint64_t key = tts_cache_key(CACHE_PARAMS, "你好");
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _store(cache, key));
+    TEST_ASSERT_EQUAL_INT(ESP_OK, _store(cache, key));
+    tts_cache_stats_t stats;
+    tts_cache_get_stats(cache, &stats);
+    TEST_ASSERT_EQUAL_INT(1, stats.stores);
+    TEST_ASSERT(_hit(cache, key));
+    tts_cache_deinit(cache);
+}
+
+int main(void)
+{
+    RUN_TEST(test_lru_eviction);
+    RUN_TEST(test_mismatched_slot_dropped);
+    RUN_TEST(test_key_collisions);
+    return TEST_EXIT();
+}